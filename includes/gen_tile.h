@@ -19,6 +19,7 @@
 #define GEN_TILE_H
 
 #include "protocol.h"
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,6 +43,22 @@ struct item {
 	struct item *duplicates;
 	enum queueEnum inQueue;
 	enum queueEnum originatedQueue;
+	// Time (see request_queue_clock) after which the client stops waiting, 0 for none
+	int64_t deadline;
+	// Time the request was queued at and index of its style in the request queue
+	int64_t queued;
+	int style;
+	// Estimated render time (ms), counted in the work of the list the item is on
+	int cost;
+	// Other items in the same waiter bucket of the request queue, while fd is valid
+	struct item *waiterNext;
+	struct item *waiterPrev;
+	// Next rendered item whose response is still to be sent, with the result of its render
+	struct item *completedNext;
+	enum protoCmd response;
+	int renderTime;
+	// Id of the request on connections of protocol version 5 (req.ver), returned with its response
+	uint64_t id;
 };
 
 // int render(Map &m, int x, int y, int z, const char *filename);
@@ -49,6 +66,9 @@ void *render_thread(void *);
 struct item *fetch_request(void);
 void delete_request(struct item *item);
 void render_init(const char *plugins_dir, const char *font_dir, int font_recurse);
+int render_init_encoders(int num_threads);
+// Make the render threads return once they are done with their current render
+void render_exit(void);
 
 #ifdef __cplusplus
 }
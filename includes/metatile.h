@@ -38,7 +38,7 @@ struct entry {
 
 struct meta_layout {
 	char magic[4];
-	int count;	      // METATILE ^ 2
+	int count;	      // size ^ 2, METATILE ^ 2 unless the style sets another size
 	int x, y, z;	      // lowest x,y of this metatile, plus z
 	struct entry index[]; // count entries
 	// Followed by the tile data
@@ -51,20 +51,23 @@ struct meta_layout {
 class metaTile
 {
 public:
-	metaTile(const std::string &xmlconfig, const std::string &options, int x, int y, int z);
+	metaTile(const std::string &xmlconfig, const std::string &options, int x, int y, int z, int size = METATILE);
 	void clear();
-	void set(int x, int y, const std::string &data);
+	void set(int x, int y, std::string data);
 	const std::string get(int x, int y);
 	int xyz_to_meta_offset(int x, int y, int z);
 	void save(struct storage_backend *store);
 	void expire_tiles(int sock, const char *host, const char *uri);
 
 private:
-	int x_, y_, z_;
+	int compare(struct storage_backend *store);
+
+	int x_, y_, z_, size_;
 	std::string xmlconfig_;
 	std::string options_;
-	std::string tile[METATILE][METATILE];
-	static const int header_size = sizeof(struct meta_layout) + (sizeof(struct entry) * (METATILE * METATILE));
+	std::string tile[METATILE_MAX][METATILE_MAX];
+	// Tiles which differ from the stored ones, all of them until the metatile is saved
+	bool changed[METATILE_MAX][METATILE_MAX];
 };
 
 #endif
@@ -19,6 +19,7 @@
 #define PROTOCOL_H
 
 #include "config.h"
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,9 +34,23 @@ extern "C" {
  *
  * A client may not bother waiting for a response if the render daemon is too slow
  * causing responses to get slightly out of step with requests.
+ *
+ * ver = 4 adds the number of seconds the client is going to wait for a response
+ * (0 if it has no deadline), so that requests nobody waits for any more can be
+ * moved off the interactive queues.
+ *
+ * ver = 5 sends length prefixed frames (struct protocol_frame) in both directions,
+ * each holding up to PROTO_FRAME_MAX requests or responses (struct protocol_v5).
+ * Every request carries an id chosen by the client, which is returned with its
+ * response. Responses are sent as soon as they are ready and not necessarily in the
+ * order of the requests, so a client can have any number of requests outstanding on
+ * one connection. Versions 1 to 4 can still be used on other connections.
  */
 #define TILE_PATH_MAX (256)
-#define PROTO_VER (3)
+#define PROTO_VER (4)
+#define PROTO_VER_FRAMED (5)
+// Most requests or responses in a frame of protocol version 5
+#define PROTO_FRAME_MAX (256)
 #ifndef RENDERD_SOCKET
 #define RENDERD_SOCKET "/run/renderd/renderd.sock"
 #endif
@@ -66,6 +81,7 @@ struct protocol {
 	char xmlname[XMLCONFIG_MAX];
 	char mimetype[XMLCONFIG_MAX];
 	char options[XMLCONFIG_MAX];
+	int timeout;
 };
 
 struct protocol_v1 {
@@ -85,6 +101,38 @@ struct protocol_v2 {
 	char xmlname[XMLCONFIG_MAX];
 };
 
+struct protocol_v3 {
+	int ver;
+	enum protoCmd cmd;
+	int x;
+	int y;
+	int z;
+	char xmlname[XMLCONFIG_MAX];
+	char mimetype[XMLCONFIG_MAX];
+	char options[XMLCONFIG_MAX];
+};
+
+/* Header of a frame of protocol version 5, ver is at the same offset as in the
+ * older versions so that they can be told apart
+ */
+struct protocol_frame {
+	int ver;
+	// Number of bytes of struct protocol_v5 following the header
+	uint32_t length;
+};
+
+struct protocol_v5 {
+	uint64_t id;
+	enum protoCmd cmd;
+	int x;
+	int y;
+	int z;
+	char xmlname[XMLCONFIG_MAX];
+	char mimetype[XMLCONFIG_MAX];
+	char options[XMLCONFIG_MAX];
+	int timeout;
+};
+
 #ifdef __cplusplus
 }
 
@@ -23,9 +23,15 @@ extern "C" {
 #endif
 
 #include "protocol.h"
+#include <stddef.h>
 
 int send_cmd(struct protocol *cmd, int fd);
 int recv_cmd(struct protocol *cmd, int fd, int block);
+int cmd_size(int ver);
+int parse_cmd(struct protocol *cmd, const char *buf, size_t len);
+int parse_frame(struct protocol_frame *frame, const char *buf, size_t len);
+int send_frame(const struct protocol_v5 *entries, int num, int fd);
+int recv_frame(struct protocol_v5 *entries, int max, int fd);
 
 #ifdef __cplusplus
 }
@@ -107,6 +107,9 @@
 #define METATILE (8)
 // #undef METATILE
 
+// Largest meta-tile size styles may set for some or all zoom levels instead of METATILE
+#define METATILE_MAX (16)
+
 // Fallback to standard tiles if meta tile doesn't exist
 // Legacy - not needed on new installs
 // #undef METATILEFALLBACK
@@ -121,7 +124,6 @@
 #define QUEUE_MAX (1024)
 #define REQ_LIMIT (512)
 #define DIRTY_LIMIT (10000)
-#define HASHIDX_SIZE 22123
 #endif
 
 // Penalty for client making an invalid request (in seconds)
@@ -29,6 +29,8 @@ int daemon(int nochdir, int noclose);
 #include "gen_tile.h"
 #include "protocol.h"
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #define INILINE_MAX 256
 #define MAX_SLAVES 5
@@ -39,12 +41,18 @@ typedef struct {
 	const char *mapnik_plugins_dir;
 	const char *name;
 	const char *pid_filename;
+	const char *queue_journal;
+	const char *queue_order;
+	const char *queue_spool;
+	const char *slave_routing;
 	const char *socketname;
 	const char *stats_filename;
 	const char *tile_dir;
+	int encode_threads;
 	int ipport;
 	int mapnik_font_dir_recurse;
 	int num_threads;
+	int queue_journal_sync;
 } renderd_config;
 
 typedef struct {
@@ -65,18 +73,67 @@ typedef struct {
 	double scale_factor;
 	int aspect_x;
 	int aspect_y;
+	int lazy_load;
+	int lazy_unload;
 	int max_zoom;
+	int metatile_sizes[MAX_ZOOM + 1];
 	int min_zoom;
 	int num_threads;
 	int tile_px_size;
+	int weight;
 } xmlconfigitem;
 
+/* Dispatcher of requests to a slave renderd, which keeps several of them in flight */
+struct slave_dispatcher {
+	renderd_config *config;
+	int fd;
+	// Requests in flight, indexed by the id they were sent with
+	struct item **inflight;
+	int size;
+	int num;
+	// Most requests kept in flight, adapted to the throughput of the slave
+	int window;
+	// Requests rendered per second while the slave was busy, and the current measurement
+	double rate;
+	int64_t rateStart;
+	int rateCount;
+	// Time of the last response, or of sending a request while none was in flight
+	int64_t progress;
+	// Set while connected, requests are only routed to connected slaves
+	int connected;
+	// Requests routed to this slave by the dispatchers of others, a ring buffer of size
+	// entries. idle is set while the dispatcher waits for requests and needs a wakeup.
+	pthread_mutex_t lock;
+	struct item **routed;
+	int routedHead;
+	int numRouted;
+	int idle;
+	// Set while the dispatcher waits for requests with requests in flight, the watcher
+	// thread then wakes it up once the slave responds (guarded by lock as well)
+	int watching;
+	int watchExit;
+	pthread_cond_t watchCond;
+	pthread_t watcher;
+	long noDispatched;
+	long noCompleted;
+	long noFailed;
+	long noRouted;
+};
+
 extern struct request_queue *render_request_queue;
 
 void statsRenderFinish(int z, long time);
 void request_exit(void);
+void process_loop(int listen_fd);
 void send_response(struct item *item, enum protoCmd rsp, int render_time);
 enum protoCmd rx_request(struct protocol *req, int fd);
+enum protoCmd rx_request_v5(const struct protocol_v5 *req, int fd);
+int slave_dispatcher_init(struct slave_dispatcher *slave, renderd_config *sConfig);
+int slave_routing_init(struct slave_dispatcher *slaves, int num);
+struct slave_dispatcher *slave_route(struct slave_dispatcher *self, struct item *item, int pending);
+int slave_dispatch(struct slave_dispatcher *slave);
+void *slave_thread(void *arg);
+int render_reload(const xmlconfigitem *parentxmlconfig);
 
 #ifdef __cplusplus
 }
@@ -42,6 +42,8 @@ void free_map_section(xmlconfigitem map_section);
 void free_map_sections(xmlconfigitem *map_sections);
 void free_renderd_section(renderd_config renderd_section);
 void free_renderd_sections(renderd_config *renderd_sections);
+int load_map_sections(dictionary *ini, const char *config_file_name, xmlconfigitem *maps_dest, const char *default_tile_dir, int num_threads);
+int parse_metatile_sizes(const char *metatile_size, int *sizes);
 void process_config_file(const char *config_file_name, int active_renderd_section_num, int log_level);
 void process_map_sections(dictionary *ini, const char *config_file_name, xmlconfigitem *maps_dest, const char *default_tile_dir, int num_threads);
 void process_mapnik_section(dictionary *ini, const char *config_file_name, renderd_config *config_dest);
@@ -21,12 +21,38 @@
 #include "gen_tile.h"
 #include "render_config.h"
 #include <pthread.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define HASHIDX_SIZE 2213
+// Number of independently locked partitions of the duplicate index (power of 2)
+#define HASHIDX_SHARDS 16
+// Initial number of slots of each partition, grown and shrunk with load (power of 2)
+#define HASHIDX_SIZE 64
+// Number of buckets of the items waiting per client fd (power of 2), as fds are small
+// integers this gives each connection a bucket of its own
+#define FDIDX_SIZE 2048
+// Number of preallocated items, enough for full queues and a waiting duplicate per
+// connection. Items are only malloced once they are all in use.
+#define ITEM_POOL_SIZE (4 * REQ_LIMIT + DIRTY_LIMIT + MAX_CONNECTIONS)
+// Number of render threads whose time outside of rendering is reported separately
+#define THREAD_STATS_MAX 64
+// Number of entries in enum queueEnum, used to size the per queue lists
+#define QUEUE_LISTS (queueRequestLow + 1)
+// Number of styles with their own sub-queues, style 0 is shared by unregistered styles
+#define STYLES_MAX (XMLCONFIGS_MAX + 1)
+// Render time (ms) assumed for a style until the first of its metatiles is rendered
+#define STYLE_COST_INITIAL 1000
+// Fixed point scale of the virtual time of the fair queueing between styles
+#define STYLE_WEIGHT_SCALE 1000
+
+/* Order in which the dirty and bulk queues are served, the other queues are always FIFO */
+enum queueOrder { queueOrderFifo,
+		  queueOrderMorton,
+		  queueOrderHilbert
+		};
 
 typedef struct {
 	long noDirtyRender;
@@ -35,6 +61,18 @@ typedef struct {
 	long noReqLowRender;
 	long noReqBulkRender;
 	long noReqDroped;
+	long noReqDemoted;
+	long noReqRejected;
+	long noReqSpilled;
+	long noReqRefilled;
+	// Current number of spooled dirty requests
+	long noReqSpooled;
+	// Items handed out, those that had to be malloced and those currently in use
+	long noItemAlloc;
+	long noItemMalloc;
+	long noItemInUse;
+	// Number of times a partition of the duplicate index was resized
+	long noIdxResize;
 	long noZoomRender[MAX_ZOOM + 1];
 	long timeReqRender;
 	long timeReqPrioRender;
@@ -42,27 +80,169 @@ typedef struct {
 	long timeReqBulkRender;
 	long timeReqDirty;
 	long timeZoomRender[MAX_ZOOM + 1];
+	// Render time (ms) split into rasterising metatiles and encoding their tiles
+	long timeRasterise;
+	long timeEncode;
+	long noStyleQueued[STYLES_MAX];
+	long noStyleRender[STYLES_MAX];
+	long timeStyleRender[STYLES_MAX];
+	long timeStyleWait[STYLES_MAX];
+	// Loads of styles loaded on demand and the time (ms) they took, not part of the render time
+	long noStyleLoad[STYLES_MAX];
+	long timeStyleLoad[STYLES_MAX];
+	// Renders of parameterized styles reusing a parameterized map of the render thread, or not
+	long noStyleParameterizedHit[STYLES_MAX];
+	long noStyleParameterizedMiss[STYLES_MAX];
+	// Time (us) each render thread spent on other things than rendering and saving
+	// metatiles while it had a request to work on
+	long timeThreadOutside[THREAD_STATS_MAX];
+	long noThreads;
 } stats_struct;
 
+/* Slot of the open addressing (robin hood) duplicate index, hash is 0 for empty slots */
 struct item_idx {
-	struct item_idx *next;
+	uint64_t hash;
+	struct item *item;
+};
+
+/* One partition of the duplicate index. The lock also guards the inQueue
+ * state and the duplicates chain of the items indexed in it.
+ */
+struct request_queue_idx {
+	pthread_mutex_t lock;
+	struct item_idx *slots;
+	unsigned int size;
+	unsigned int num;
+};
+
+/* Entry of a sweep heap, key is the position of the item along the space filling curve */
+struct item_order {
+	uint64_t key;
 	struct item *item;
 };
 
+/* Binary min heap of queued items, ordered by key */
+struct request_queue_heap {
+	struct item_order *entries;
+	int size;
+	int num;
+};
+
+/* The items of one style on a request_queue_list.
+ *
+ * Unless the order of the list is queueOrderFifo, items are additionally kept
+ * in two heaps and served as a circular sweep along a space filling curve:
+ * sweep[ahead] holds the items at or after the last served position, the other
+ * heap those behind it, which are picked up on the next pass.
+ */
+struct request_queue_sub {
+	struct item head;
+	int num;
+	struct request_queue_heap sweep[2];
+	int ahead;
+	uint64_t position;
+	// Render time received so far, scaled by the weight of the style
+	int64_t vtime;
+};
+
+/* A list of items, protected by its own lock so that the different
+ * priority queues (and the render list) do not contend with each other.
+ * num is updated with the lock held, but may be read without it.
+ *
+ * Every style has its own sub-queue, see list_take for how they are shared.
+ * Lists with deadlines set are served earliest deadline first within a style,
+ * see list_take_deadline.
+ */
+struct request_queue_list {
+	pthread_mutex_t lock;
+	int num;
+	int deadlines;
+	enum queueOrder order;
+	// Virtual time of the last served style
+	int64_t vtime;
+	// Sum of the estimated render times of the items on the list, read without the lock
+	int64_t work;
+	struct request_queue_sub subs[STYLES_MAX];
+};
+
+/* Items whose client waits on one of the fds that map to the bucket */
+struct request_queue_fd {
+	pthread_mutex_t lock;
+	struct item *waiters;
+};
+
+/* Preallocated items for requests, see request_queue_alloc_item */
+struct request_queue_pool {
+	pthread_mutex_t lock;
+	struct item *slab;
+	// Returned items, linked through their duplicates pointer
+	struct item *free;
+	// Number of items at the start of the slab that have been handed out before
+	int carved;
+	long noAlloc;
+	long noMalloc;
+	long noInUse;
+};
+
+struct request_queue_style {
+	char name[XMLCONFIG_MAX];
+	uint64_t hash;
+	int weight;
+	// Moving average of the render time of a metatile in ms, accessed atomically
+	int cost;
+};
+
 struct request_queue {
-	int hashidxSize;
-	struct item reqHead, reqPrioHead, reqLowHead, reqBulkHead, dirtyHead, renderHead;
-	struct item_idx *item_hashidx;
-	int reqNum, reqPrioNum, reqLowNum, reqBulkNum, dirtyNum;
+	// Indexed by enum queueEnum, lists[queueDuplicate] is unused
+	struct request_queue_list lists[QUEUE_LISTS];
+	struct request_queue_idx idx[HASHIDX_SHARDS];
+	// Taken after the index shard lock when both are needed
+	struct request_queue_fd fds[FDIDX_SIZE];
+	// Its lock is not held while taking any other lock
+	struct request_queue_pool pool;
+	// Registered styles, only appended to (see request_queue_add_style)
+	struct request_queue_style styles[STYLES_MAX];
+	int noStyles;
+	// Moving average of the render time per zoom level (ms), 0 until measured
+	int zoomCost[MAX_ZOOM + 1];
+	// Number of threads serving the queue, 0 if admission control is off
+	int admissionThreads;
+	// Total number of queued items and number of sleeping fetchers,
+	// both accessed atomically
+	int noQueued;
+	int noWaiting;
+	// Number of calls of request_queue_wakeup, protected by qLock
+	int noWakeups;
+	// Only used to put fetchers to sleep while all queues are empty
 	pthread_mutex_t qLock;
 	pthread_cond_t qCond;
+	pthread_mutex_t statsLock;
 	stats_struct stats;
+	// Log of the dirty and bulk queues, NULL if they are not journaled
+	struct request_queue_journal *journal;
+	// Overflow of the dirty queue, NULL if requests beyond DIRTY_LIMIT are dropped
+	struct request_queue_spool *spool;
+	// Set while a fetcher refills the dirty queue from the spool, accessed atomically
+	int refilling;
 };
 
 struct request_queue *request_queue_init();
 void request_queue_close(struct request_queue *queue);
+void request_queue_set_order(struct request_queue *queue, enum queueOrder order);
+int request_queue_add_style(struct request_queue *queue, const char *xmlname, int weight);
+const char *request_queue_style_name(struct request_queue *queue, int style);
+void request_queue_set_journal(struct request_queue *queue, struct request_queue_journal *journal);
+void request_queue_set_spool(struct request_queue *queue, struct request_queue_spool *spool);
+void request_queue_set_admission(struct request_queue *queue, int threads);
+
+struct item *request_queue_alloc_item(struct request_queue *queue);
+void request_queue_free_item(struct request_queue *queue, struct item *item);
 
 struct item *request_queue_fetch_request(struct request_queue *queue);
+struct item *request_queue_try_fetch_request(struct request_queue *queue);
+struct item *request_queue_fetch_request_or_wakeup(struct request_queue *queue, int wakeups);
+int request_queue_wakeups(struct request_queue *queue);
+void request_queue_wakeup(struct request_queue *queue);
 enum protoCmd request_queue_add_request(struct request_queue *queue, struct item *request);
 
 void request_queue_remove_request(struct request_queue *queue, struct item *request, int render_time);
@@ -70,6 +250,12 @@ void request_queue_clear_requests_by_fd(struct request_queue *queue, int fd);
 
 int request_queue_no_requests_queued(struct request_queue *queue, enum protoCmd);
 void request_queue_copy_stats(struct request_queue *queue, stats_struct *stats);
+int request_queue_add_thread(struct request_queue *queue);
+void request_queue_thread_time(struct request_queue *queue, int thread, long outside);
+void request_queue_style_load(struct request_queue *queue, struct item *request, long load_time);
+void request_queue_render_phases(struct request_queue *queue, long rasterise_time, long encode_time);
+void request_queue_style_parameterized(struct request_queue *queue, struct item *request, int hit);
+int64_t request_queue_clock(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2007 - 2023 by mod_tile contributors (see AUTHORS file)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef REQUEST_QUEUE_JOURNAL_H
+#define REQUEST_QUEUE_JOURNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "gen_tile.h"
+#include "request_queue.h"
+
+#define JOURNAL_MAGIC 0x6a716d74
+// Records buffered in memory before producers have to wait for the flusher
+#define JOURNAL_BUFFER_RECORDS 4096
+// The journal is compacted once it holds this many records and at least
+// JOURNAL_COMPACT_RATIO times the number of queued requests
+#define JOURNAL_COMPACT_MIN 16384
+#define JOURNAL_COMPACT_RATIO 4
+
+enum journalOp { journalAdd = 1, journalDone = 2 };
+
+/* On disk record, written in host byte order */
+struct journal_record {
+	uint32_t magic;
+	uint32_t op;
+	int32_t cmd;
+	int32_t x;
+	int32_t y;
+	int32_t z;
+	char xmlname[XMLCONFIG_MAX];
+	char mimetype[XMLCONFIG_MAX];
+	char options[XMLCONFIG_MAX];
+	// FNV-1a over all preceding bytes of the record
+	uint32_t checksum;
+};
+
+struct request_queue_journal;
+
+struct request_queue_journal *request_queue_journal_open(const char *path, int sync);
+int request_queue_journal_replay(struct request_queue_journal *journal, struct request_queue *queue);
+void request_queue_journal_append(struct request_queue_journal *journal, enum journalOp op, const struct item *item);
+void request_queue_journal_sync(struct request_queue_journal *journal);
+void request_queue_journal_close(struct request_queue_journal *journal);
+
+#ifdef __cplusplus
+}
+
+#endif
+#endif
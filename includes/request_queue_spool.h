@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2007 - 2023 by mod_tile contributors (see AUTHORS file)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef REQUEST_QUEUE_SPOOL_H
+#define REQUEST_QUEUE_SPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "gen_tile.h"
+#include "render_config.h"
+
+// Number of records per segment file
+#define SPOOL_SEGMENT_RECORDS 65536
+// The dirty queue is refilled from the spool once it is shorter than this
+#define SPOOL_REFILL_WATERMARK (DIRTY_LIMIT / 2)
+// Most items moved from the spool to the dirty queue at a time
+#define SPOOL_REFILL_BATCH 256
+// Initial number of slots of the set of spooled metatiles (power of 2)
+#define SPOOL_KEYS_SIZE 1024
+
+struct spool_record {
+	uint64_t key;
+	int32_t cmd;
+	int32_t x;
+	int32_t y;
+	int32_t z;
+	char xmlname[XMLCONFIG_MAX];
+	char mimetype[XMLCONFIG_MAX];
+	char options[XMLCONFIG_MAX];
+};
+
+struct request_queue_spool;
+
+struct request_queue_spool *request_queue_spool_open(const char *dir);
+int request_queue_spool_push(struct request_queue_spool *spool, const struct item *item, uint64_t key);
+int request_queue_spool_pop(struct request_queue_spool *spool, struct item *item);
+void request_queue_spool_remove(struct request_queue_spool *spool, const struct item *item, uint64_t key);
+int request_queue_spool_depth(struct request_queue_spool *spool);
+void request_queue_spool_close(struct request_queue_spool *spool);
+
+#ifdef __cplusplus
+}
+
+#endif
+#endif
@@ -40,6 +40,11 @@ struct storage_backend {
 	int (*metatile_write)(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z, const char *buf, int sz);
 	int (*metatile_delete)(struct storage_backend *store, const char *xmlconfig, int x, int y, int z);
 	int (*metatile_expire)(struct storage_backend *store, const char *xmlconfig, int x, int y, int z);
+	// Reads a whole meta-tile as it was passed to metatile_write, returns its size or -1. Sizes above sz
+	// are returned without filling buf. NULL where reading meta-tiles back costs as much as writing them.
+	int (*metatile_read)(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz);
+	// Marks a meta-tile rendered again without changes as fresh, NULL where it has to be written instead
+	int (*metatile_touch)(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z);
 	char *(*tile_storage_id)(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z, char *string);
 	int (*close_storage)(struct storage_backend *store);
 
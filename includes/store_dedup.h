@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2007 - 2023 by mod_tile contributors (see AUTHORS file)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef STORE_DEDUP_H
+#define STORE_DEDUP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "store.h"
+
+#define DEDUP_MAGIC "METD"
+#define DEDUP_BLOB_MAGIC "BLOB"
+#define DEDUP_BLOB_DIR ".blobs"
+
+/* Header of a blob, followed by the tile */
+struct dedup_blob {
+	char magic[4];
+	int refs; // Number of metatiles referencing the blob
+};
+
+struct storage_backend *init_storage_dedup(const char *connection_string);
+
+#ifdef __cplusplus
+}
+
+#endif
+
+#endif /* STORE_DEDUP_H */
@@ -39,6 +39,18 @@ int mkdirp(const char *path);
 int path_to_xyz(const char *tilepath, const char *path, char *xmlconfig, int *px, int *py, int *pz);
 
 #ifdef METATILE
+struct meta_layout;
+
+/* Meta-tile sizes of a style by zoom level, styles not set use METATILE. Sizes may be
+ * set while other threads look them up. All programs sharing the meta-tiles of a style
+ * have to set the same sizes.
+ */
+void metatile_size_set(const char *xmlconfig, const int *sizes);
+int metatile_size(const char *xmlconfig, int z);
+
+/* Returns the position of a tile in the index of a meta-tile of any size, or -1 if it is not in there */
+int meta_layout_offset(const struct meta_layout *m, int x, int y);
+
 /* New meta-tile storage functions */
 /* Returns the path to the meta-tile and the offset within the meta-tile */
 int xyzo_to_meta(char *path, size_t len, const char *tile_dir, const char *xmlconfig, const char *options, int x, int y, int z);
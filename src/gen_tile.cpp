@@ -15,10 +15,13 @@
  * along with this program; If not, see http://www.gnu.org/licenses/.
  */
 
+#include <boost/optional.hpp>
 #include <dirent.h>
+#include <errno.h>
 #include <exception>
 #include <glib.h>
 #include <map>
+#include <memory>
 #include <mapnik/agg_renderer.hpp>
 #include <mapnik/coord.hpp>
 #include <mapnik/datasource.hpp>
@@ -34,12 +37,15 @@
 #include <mapnik/params.hpp>
 #include <mapnik/pixel_types.hpp>
 #include <mapnik/version.hpp>
+#include <list>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <sys/time.h>
+#include <time.h>
+#include <tuple>
 #include <unistd.h>
 #include <utility>
 
@@ -59,6 +65,7 @@
 #include "renderd.h"
 #include "request_queue.h"
 #include "store.h"
+#include "store_file_utils.h"
 
 #ifndef DEG_TO_RAD
 #define DEG_TO_RAD (M_PI / 180)
@@ -87,6 +94,9 @@ struct projectionconfig {
 	int aspect_y;
 };
 
+// Parameterized maps kept by each render thread for each parameterized style
+#define PARAMETERIZED_MAPS_MAX 8
+
 struct xmlmapconfig {
 	Map map;
 	const char *host;
@@ -97,17 +107,89 @@ struct xmlmapconfig {
 	const char *xmluri;
 	double scale;
 	int htcpsock;
+	int lazy;
 	int maxzoom;
 	int minzoom;
 	int ok;
 	int tilesize;
+	// Time (ms) of the last render of a style loaded on demand
+	int64_t used;
 	parameterize_function_ptr parameterize_function;
+	// Copies of map parameterized for the most recently rendered options, most recent first
+	std::list<std::pair<std::string, Map>> parameterized;
 	struct projectionconfig *prj;
 	struct storage_backend *store;
 
 	xmlmapconfig() : map(256, 256) {}
 };
 
+/* Map of a style, loaded once and copied by every render thread. The copies share the
+ * symbolizers, expressions and pooled datasources of the template, which are not
+ * modified by rendering. The settings of the style are kept with it, so that the
+ * configuration it was loaded from can be freed.
+ */
+struct map_template {
+	Map map;
+	int ok;
+	// Styles loaded on demand are loaded by the first render thread that needs them,
+	// under the lock, and unloaded once no render thread has a copy and they were not
+	// used for unload seconds. Failed loads are not retried until the next reload.
+	pthread_mutex_t lock;
+	int lazy;
+	int failed;
+	int unload;
+	int users;
+	int64_t used;
+	std::string host;
+	std::string htcphost;
+	std::string output_format;
+	std::string parameterization;
+	std::string tile_dir;
+	std::string xmlfile;
+	std::string xmlname;
+	std::string xmluri;
+	double scale;
+	int maxzoom;
+	int minzoom;
+	int num_threads;
+	int tilesize;
+
+	map_template() : map(256, 256), ok(0), lazy(0), failed(0), unload(0), users(0), used(0), scale(1.0), maxzoom(0), minzoom(0), num_threads(0), tilesize(256)
+	{
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	~map_template()
+	{
+		pthread_mutex_destroy(&lock);
+	}
+};
+
+/* The styles of one configuration. Every reload loads a new generation, render threads
+ * move on to it between two renders and the last one to leave the old generation
+ * frees it.
+ */
+struct map_generation {
+	map_template templates[XMLCONFIGS_MAX];
+	int num;
+	int id;
+	int users;
+};
+
+// Generation render threads move on to, its id is read without the lock between renders
+static map_generation *map_generation_current;
+static int map_generation_id;
+static pthread_mutex_t map_generation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Wakes up idle render threads to unload the styles they have not used for a while,
+ * guarded by map_generation_lock
+ */
+static pthread_cond_t lazy_unload_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t lazy_unload_timer;
+static int lazy_unload_timer_started;
+// Set by render_exit, render threads return once they see it
+static int render_exiting;
+
 struct projectionconfig *get_projection(const char *srs)
 {
 	struct projectionconfig *prj;
@@ -204,6 +286,412 @@ static void parameterize_map_max_connections(Map &m, int num_threads)
 	free(tmp);
 }
 
+/**
+ * Give the copy of a map datasources of its own, unless they are of a type that draws
+ * on a pool of connections and can be queried by several render threads at once
+ **/
+static void unshare_datasources(Map &m)
+{
+	for (unsigned int i = 0; i < m.layer_count(); i++) {
+		layer &l = m.get_layer(i);
+
+		if (!l.datasource()) {
+			continue;
+		}
+
+		parameters params = l.datasource()->params();
+		boost::optional<std::string> type = params.get<std::string>("type");
+
+		if (!type || (*type != "postgis" && *type != "pgraster")) {
+			l.set_datasource(datasource_cache::instance().create(params));
+		}
+	}
+}
+
+static void *load_map_template(void *arg)
+{
+	map_template *tmpl = (map_template *)arg;
+
+	tmpl->map.resize(RENDER_SIZE, RENDER_SIZE);
+
+	try {
+		mapnik::load_map(tmpl->map, tmpl->xmlfile);
+
+		/* If we have more than 10 rendering threads configured, we need to fix
+		 * up the mapnik datasources to support larger postgres connection pools
+		 */
+		if (tmpl->num_threads > 10) {
+			g_logger(G_LOG_LEVEL_DEBUG, "Updating max_connection parameter for mapnik layers to reflect thread count");
+			parameterize_map_max_connections(tmpl->map, tmpl->num_threads);
+		}
+
+		tmpl->ok = 1;
+	} catch (std::exception const &ex) {
+		g_logger(G_LOG_LEVEL_ERROR, "An error occurred while loading the map layer '%s': %s", tmpl->xmlname.c_str(), ex.what());
+	} catch (...) {
+		g_logger(G_LOG_LEVEL_ERROR, "An unknown error occurred while loading the map layer '%s'", tmpl->xmlname.c_str());
+	}
+
+	return NULL;
+}
+
+/* Load the maps of all styles of a configuration, each in a thread of its own */
+static map_generation *load_map_generation(const xmlconfigitem *parentxmlconfig)
+{
+	map_generation *gen = new map_generation();
+	pthread_t threads[XMLCONFIGS_MAX];
+	int i, started[XMLCONFIGS_MAX];
+	timeval start, end;
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < XMLCONFIGS_MAX; ++i) {
+		const xmlconfigitem *config = &parentxmlconfig[i];
+		map_template *tmpl = &gen->templates[i];
+
+		if (config->xmlname == NULL || config->xmlfile == NULL) {
+			break;
+		}
+
+		tmpl->host = config->host;
+		tmpl->htcphost = config->htcpip;
+		tmpl->output_format = config->output_format;
+		tmpl->parameterization = config->parameterization;
+		tmpl->tile_dir = config->tile_dir;
+		tmpl->xmlfile = config->xmlfile;
+		tmpl->xmlname = config->xmlname;
+		tmpl->xmluri = config->xmluri;
+		tmpl->scale = config->scale_factor;
+		tmpl->maxzoom = config->max_zoom;
+		tmpl->minzoom = config->min_zoom;
+		tmpl->num_threads = config->num_threads;
+		tmpl->tilesize = config->tile_px_size;
+		tmpl->lazy = config->lazy_load;
+		tmpl->unload = config->lazy_unload;
+
+		// Styles loaded on demand are left to the first render thread that needs them
+		started[i] = 0;
+
+		if (!tmpl->lazy && !(started[i] = (pthread_create(&threads[i], NULL, load_map_template, tmpl) == 0))) {
+			load_map_template(tmpl);
+		}
+	}
+
+	gen->num = i;
+
+	while (i-- > 0) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	gettimeofday(&end, NULL);
+	g_logger(G_LOG_LEVEL_INFO, "Loaded map styles in %.3lf seconds", (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0);
+
+	return gen;
+}
+
+/* Shortest time (s) after which a style loaded on demand is unloaded, 0 if none is */
+static int lazy_unload_interval(map_generation *gen)
+{
+	int interval = 0;
+
+	for (int i = 0; i < gen->num; ++i) {
+		if (gen->templates[i].lazy && gen->templates[i].unload > 0 && (interval == 0 || gen->templates[i].unload < interval)) {
+			interval = gen->templates[i].unload;
+		}
+	}
+
+	return interval;
+}
+
+/* Wake up the render threads every lazy_unload_interval, so that the ones waiting for
+ * requests drop their copies of styles that are not used any more
+ */
+static void *lazy_unload_thread(void *arg)
+{
+	pthread_mutex_lock(&map_generation_lock);
+
+	while (!render_exiting) {
+		int interval = map_generation_current ? lazy_unload_interval(map_generation_current) : 0;
+		struct timespec until;
+
+		if (interval == 0) {
+			pthread_cond_wait(&lazy_unload_cond, &map_generation_lock);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += interval;
+
+		if (pthread_cond_timedwait(&lazy_unload_cond, &map_generation_lock, &until) == ETIMEDOUT) {
+			request_queue_wakeup(render_request_queue);
+		}
+	}
+
+	pthread_mutex_unlock(&map_generation_lock);
+
+	return NULL;
+}
+
+/* Join the current generation, which is loaded by the first render thread to start while
+ * the others wait for it
+ */
+static map_generation *map_generation_join(const xmlconfigitem *parentxmlconfig)
+{
+	map_generation *gen;
+
+	pthread_mutex_lock(&map_generation_lock);
+
+	if (map_generation_current == NULL) {
+		map_generation_current = load_map_generation(parentxmlconfig);
+	}
+
+	if (!lazy_unload_timer_started && pthread_create(&lazy_unload_timer, NULL, lazy_unload_thread, NULL) == 0) {
+		lazy_unload_timer_started = 1;
+	}
+
+	gen = map_generation_current;
+	gen->users++;
+	pthread_mutex_unlock(&map_generation_lock);
+
+	return gen;
+}
+
+static void map_generation_leave(map_generation *gen)
+{
+	int unused;
+
+	pthread_mutex_lock(&map_generation_lock);
+	unused = (--gen->users == 0) && (gen != map_generation_current);
+	pthread_mutex_unlock(&map_generation_lock);
+
+	if (unused) {
+		delete gen;
+	}
+}
+
+/* Copy the map of a style for a render thread, returns whether it can be rendered */
+static int map_copy(map_template *tmpl, xmlmapconfig *map)
+{
+	try {
+		map->parameterized.clear();
+		map->map = tmpl->map;
+		unshare_datasources(map->map);
+
+		// Fonts loaded into memory are not part of a copy
+		if (!map->parameterize_function) {
+			map->map.load_fonts();
+		}
+
+		map->prj = get_projection(map->map.srs().c_str());
+		return 1;
+	} catch (std::exception const &ex) {
+		g_logger(G_LOG_LEVEL_ERROR, "An error occurred while copying the map layer '%s': %s", map->xmlname, ex.what());
+	} catch (...) {
+		g_logger(G_LOG_LEVEL_ERROR, "An unknown error occurred while copying the map layer '%s'", map->xmlname);
+	}
+
+	return 0;
+}
+
+static void map_drop(xmlmapconfig *map)
+{
+	free(map->prj);
+	map->prj = NULL;
+	map->parameterized.clear();
+	map->map = Map(256, 256);
+	map->ok = 0;
+}
+
+/* Copy a style loaded on demand for a render thread, loading it first if no other
+ * render thread has done so yet. Returns the time (ms) it took.
+ */
+static long map_lazy_copy(map_template *tmpl, xmlmapconfig *map)
+{
+	timeval start, end;
+	int ok;
+
+	gettimeofday(&start, NULL);
+	pthread_mutex_lock(&tmpl->lock);
+
+	if (!tmpl->ok && !tmpl->failed) {
+		g_logger(G_LOG_LEVEL_INFO, "Loading map style '%s' on demand", tmpl->xmlname.c_str());
+		load_map_template(tmpl);
+		tmpl->failed = !tmpl->ok;
+	}
+
+	// Not unloaded while a render thread has a copy
+	if ((ok = tmpl->ok)) {
+		tmpl->users++;
+	}
+
+	pthread_mutex_unlock(&tmpl->lock);
+
+	if (ok && !(map->ok = map_copy(tmpl, map))) {
+		pthread_mutex_lock(&tmpl->lock);
+		tmpl->users--;
+		pthread_mutex_unlock(&tmpl->lock);
+	}
+
+	gettimeofday(&end, NULL);
+
+	return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+}
+
+/* Drop the copy of a render thread of a style loaded on demand, and the style itself
+ * if no render thread has a copy and it was not used for a while
+ */
+static void map_lazy_drop(map_template *tmpl, xmlmapconfig *map)
+{
+	int64_t now = request_queue_clock();
+
+	map_drop(map);
+
+	pthread_mutex_lock(&tmpl->lock);
+
+	if (--tmpl->users == 0 && now - __atomic_load_n(&tmpl->used, __ATOMIC_RELAXED) >= tmpl->unload * 1000L) {
+		g_logger(G_LOG_LEVEL_INFO, "Unloading map style '%s', it was not used for %i seconds", tmpl->xmlname.c_str(), tmpl->unload);
+		tmpl->map = Map(256, 256);
+		tmpl->ok = 0;
+	}
+
+	pthread_mutex_unlock(&tmpl->lock);
+}
+
+/* Drop the copies of styles loaded on demand which were not used for a while */
+static void map_lazy_unload(map_generation *gen, xmlmapconfig *maps, int num)
+{
+	int64_t now = request_queue_clock();
+
+	for (int i = 0; i < num; ++i) {
+		if (maps[i].lazy && maps[i].ok && gen->templates[i].unload > 0 && now - maps[i].used >= gen->templates[i].unload * 1000L) {
+			map_lazy_drop(&gen->templates[i], &maps[i]);
+		}
+	}
+}
+
+/* Copy the maps of a generation for a render thread, returns the number of styles */
+static int map_generation_copy(map_generation *gen, xmlmapconfig *maps)
+{
+	for (int i = 0; i < gen->num; ++i) {
+		map_template *tmpl = &gen->templates[i];
+
+		maps[i].maxzoom = tmpl->maxzoom;
+		maps[i].minzoom = tmpl->minzoom;
+		maps[i].output_format = strndup(tmpl->output_format.c_str(), PATH_MAX);
+		maps[i].parameterize_function = init_parameterization_function(tmpl->parameterization.c_str());
+		maps[i].prj = NULL;
+		maps[i].scale = tmpl->scale;
+		maps[i].store = init_storage_backend(tmpl->tile_dir.c_str());
+		maps[i].tilesize = tmpl->tilesize;
+		maps[i].xmlfile = strndup(tmpl->xmlfile.c_str(), PATH_MAX);
+		maps[i].xmlname = strndup(tmpl->xmlname.c_str(), PATH_MAX);
+		maps[i].lazy = tmpl->lazy;
+		maps[i].used = 0;
+
+		if (maps[i].store) {
+			// Styles loaded on demand are copied when the first of their requests is rendered
+			maps[i].ok = !tmpl->lazy && tmpl->ok && map_copy(tmpl, &maps[i]);
+
+#ifdef HTCP_EXPIRE_CACHE
+			maps[i].host = strndup(tmpl->host.c_str(), PATH_MAX);
+			maps[i].htcphost = strndup(tmpl->htcphost.c_str(), PATH_MAX);
+			maps[i].xmluri = strndup(tmpl->xmluri.c_str(), PATH_MAX);
+
+			if (strlen(maps[i].htcphost) > 0) {
+				maps[i].htcpsock = init_cache_expire(maps[i].htcphost);
+
+				if (maps[i].htcpsock > 0) {
+					g_logger(G_LOG_LEVEL_DEBUG, "Successfully opened socket for HTCP cache expiry");
+				} else {
+					g_logger(G_LOG_LEVEL_ERROR, "Failed to open socket for HTCP cache expiry");
+				}
+			} else {
+				maps[i].htcpsock = -1;
+			}
+
+#endif // HTCP_EXPIRE_CACHE
+		} else {
+			maps[i].ok = 0;
+		}
+	}
+
+	return gen->num;
+}
+
+/* Free what a render thread copied of a generation */
+static void map_generation_free_copy(map_generation *gen, xmlmapconfig *maps, int num)
+{
+	for (int i = 0; i < num; ++i) {
+		if (maps[i].lazy && maps[i].ok) {
+			map_lazy_drop(&gen->templates[i], &maps[i]);
+		}
+
+		if (maps[i].store) {
+			maps[i].store->close_storage(maps[i].store);
+			maps[i].store = NULL;
+		}
+
+#ifdef HTCP_EXPIRE_CACHE
+
+		if (maps[i].htcpsock > 0) {
+			close(maps[i].htcpsock);
+		}
+
+		free((void *)maps[i].host);
+		free((void *)maps[i].htcphost);
+		free((void *)maps[i].xmluri);
+		maps[i].host = maps[i].htcphost = maps[i].xmluri = NULL;
+		maps[i].htcpsock = -1;
+#endif // HTCP_EXPIRE_CACHE
+
+		free((void *)maps[i].output_format);
+		free((void *)maps[i].xmlfile);
+		free((void *)maps[i].xmlname);
+		maps[i].output_format = maps[i].xmlfile = maps[i].xmlname = NULL;
+		map_drop(&maps[i]);
+	}
+}
+
+int render_reload(const xmlconfigitem *parentxmlconfig)
+{
+	map_generation *gen = load_map_generation(parentxmlconfig), *old;
+	int unused;
+
+	// Rather keep rendering with the styles that work than switch to broken ones
+	for (int i = 0; i < gen->num; ++i) {
+		if (!gen->templates[i].ok && !gen->templates[i].lazy) {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to reload map style '%s', keeping the current map styles", gen->templates[i].xmlname.c_str());
+			delete gen;
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&map_generation_lock);
+	old = map_generation_current;
+	gen->id = old ? old->id + 1 : 0;
+	map_generation_current = gen;
+	__atomic_store_n(&map_generation_id, gen->id, __ATOMIC_RELEASE);
+	unused = old && (old->users == 0);
+	// The styles unloaded on demand may have changed
+	pthread_cond_signal(&lazy_unload_cond);
+	pthread_mutex_unlock(&map_generation_lock);
+
+	if (unused) {
+		delete old;
+	}
+
+	// Idle render threads let go of the old styles right away
+	if (render_request_queue) {
+		request_queue_wakeup(render_request_queue);
+	}
+
+	g_logger(G_LOG_LEVEL_INFO, "Reloaded %i map styles, render threads switch to them after their current render", gen->num);
+
+	return 0;
+}
+
 static int check_xyz(int x, int y, int z, struct xmlmapconfig *map)
 {
 	int oob, limit;
@@ -224,12 +712,220 @@ static int check_xyz(int x, int y, int z, struct xmlmapconfig *map)
 	return !oob;
 }
 
+/* Monotonic time in us, for the time render threads spend outside of rendering */
+static int64_t thread_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 #ifdef METATILE
-mapnik::box2d<double> tile2prjbounds(struct projectionconfig *prj, int x, int y, int z)
+/* Tile of a rendered metatile to be encoded, by an encoder thread or a render thread */
+struct encode_job {
+	const mapnik::image_32 *buf;
+	const char *format;
+	metaTile *tiles;
+	int tilesize;
+	int xx;
+	int yy;
+	int *left;
+	int *failed;
+	struct encode_job *next;
+};
+
+// Tiles waiting to be encoded, the counters of the metatiles are guarded by the lock as well
+static pthread_mutex_t encode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t encode_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t encode_done = PTHREAD_COND_INITIALIZER;
+static struct encode_job *encode_head, *encode_tail;
+static int encode_threads;
+
+// Encoded solid colour tiles by colour, format and tile size, shared by all render threads
+#define SOLID_TILES_MAX 4096
+static pthread_mutex_t solid_tiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::tuple<uint32_t, std::string, int>, std::string> solid_tiles;
+
+/* Returns whether all pixels of a tile of the raster have the same colour, and which one */
+bool tile_solid(const mapnik::image_32 &buf, int xx, int yy, int tilesize, uint32_t *colour)
+{
+	const uint32_t *first = buf.get_row(yy * tilesize, xx * tilesize);
+	size_t row_size = tilesize * sizeof(uint32_t);
+
+	// The first row is uniform if it equals itself shifted by a pixel, the others have to equal it
+	if (memcmp(first, first + 1, row_size - sizeof(uint32_t)) != 0) {
+		return false;
+	}
+
+	for (int row = 1; row < tilesize; row++) {
+		if (memcmp(first, buf.get_row(yy * tilesize + row, xx * tilesize), row_size) != 0) {
+			return false;
+		}
+	}
+
+	*colour = first[0];
+	return true;
+}
+
+/* Returns the encoded tile of a solid colour, encoding it only the first time it is seen */
+static std::string solid_tile(mapnik::image_view_any &vw, uint32_t colour, const char *format, int tilesize)
+{
+	std::tuple<uint32_t, std::string, int> key(colour, format, tilesize);
+
+	pthread_mutex_lock(&solid_tiles_lock);
+	auto found = solid_tiles.find(key);
+
+	if (found != solid_tiles.end()) {
+		std::string data = found->second;
+		pthread_mutex_unlock(&solid_tiles_lock);
+		return data;
+	}
+
+	pthread_mutex_unlock(&solid_tiles_lock);
+
+	std::string data = save_to_string(vw, format);
+
+	pthread_mutex_lock(&solid_tiles_lock);
+
+	if (solid_tiles.size() < SOLID_TILES_MAX) {
+		solid_tiles.emplace(key, data);
+	}
+
+	pthread_mutex_unlock(&solid_tiles_lock);
+
+	return data;
+}
+
+static int encode(struct encode_job *job)
+{
+	mapnik::image_view<mapnik::image<mapnik::rgba8_t >> vw1(job->xx * job->tilesize, job->yy * job->tilesize, job->tilesize, job->tilesize, *job->buf);
+	struct mapnik::image_view_any vw(vw1);
+	uint32_t colour;
+
+	try {
+		if (tile_solid(*job->buf, job->xx, job->yy, job->tilesize, &colour)) {
+			job->tiles->set(job->xx, job->yy, solid_tile(vw, colour, job->format, job->tilesize));
+		} else {
+			job->tiles->set(job->xx, job->yy, save_to_string(vw, job->format));
+		}
+
+		return 0;
+	} catch (std::exception const &ex) {
+		g_logger(G_LOG_LEVEL_ERROR, "failed to encode tile %d %d of metatile as %s: %s", job->xx, job->yy, job->format, ex.what());
+		return -1;
+	} catch (...) {
+		// Nothing may be thrown out of an encoder thread
+		g_logger(G_LOG_LEVEL_ERROR, "failed to encode tile %d %d of metatile as %s", job->xx, job->yy, job->format);
+		return -1;
+	}
+}
+
+/* Take the next tile off the queue and encode it (call with encode_lock held) */
+static void encode_next(void)
 {
+	struct encode_job *job = encode_head;
+	int ret;
 
-	int render_size_tx = MIN(METATILE, prj->aspect_x * (1 << z));
-	int render_size_ty = MIN(METATILE, prj->aspect_y * (1 << z));
+	encode_head = job->next;
+
+	if (encode_head == NULL) {
+		encode_tail = NULL;
+	}
+
+	pthread_mutex_unlock(&encode_lock);
+	ret = encode(job);
+	pthread_mutex_lock(&encode_lock);
+
+	if (ret != 0) {
+		*(job->failed) = 1;
+	}
+
+	if (--*(job->left) == 0) {
+		pthread_cond_broadcast(&encode_done);
+	}
+}
+
+static void *encode_thread(void *arg)
+{
+	pthread_mutex_lock(&encode_lock);
+
+	while (1) {
+		if (encode_head) {
+			encode_next();
+		} else {
+			pthread_cond_wait(&encode_work, &encode_lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* Encode the tiles of a rendered metatile with the encoder threads, and by the render
+ * thread itself while it waits for them. Returns cmdNotDone if any tile failed to encode.
+ */
+enum protoCmd encode_metatile(const mapnik::image_32 &buf, const char *format, int tilesize, unsigned int size_tx, unsigned int size_ty, metaTile &tiles)
+{
+	struct encode_job jobs[METATILE_MAX * METATILE_MAX];
+	int left = size_tx * size_ty, failed = 0, num = 0;
+
+	for (unsigned int yy = 0; yy < size_ty; yy++) {
+		for (unsigned int xx = 0; xx < size_tx; xx++) {
+			struct encode_job *job = &jobs[num++];
+
+			job->buf = &buf;
+			job->format = format;
+			job->tiles = &tiles;
+			job->tilesize = tilesize;
+			job->xx = xx;
+			job->yy = yy;
+			job->left = &left;
+			job->failed = &failed;
+			job->next = NULL;
+
+			if (encode_threads == 0) {
+				failed |= (encode(job) != 0);
+			}
+		}
+	}
+
+	if (encode_threads == 0) {
+		return failed ? cmdNotDone : cmdDone;
+	}
+
+	pthread_mutex_lock(&encode_lock);
+
+	for (int i = 0; i < num; i++) {
+		if (encode_tail) {
+			encode_tail->next = &jobs[i];
+		} else {
+			encode_head = &jobs[i];
+		}
+
+		encode_tail = &jobs[i];
+	}
+
+	pthread_cond_broadcast(&encode_work);
+
+	// Tiles of other metatiles may be encoded here as well, they are all as urgent
+	while (left > 0) {
+		if (encode_head) {
+			encode_next();
+		} else {
+			pthread_cond_wait(&encode_done, &encode_lock);
+		}
+	}
+
+	pthread_mutex_unlock(&encode_lock);
+
+	return failed ? cmdNotDone : cmdDone;
+}
+
+mapnik::box2d<double> tile2prjbounds(struct projectionconfig *prj, int x, int y, int z, int size)
+{
+
+	int render_size_tx = MIN(size, prj->aspect_x * (1 << z));
+	int render_size_ty = MIN(size, prj->aspect_y * (1 << z));
 
 	double p0x = prj->bound_x0 + (prj->bound_x1 - prj->bound_x0) * ((double)x / (double)(prj->aspect_x * 1 << z));
 	double p0y = (prj->bound_y1 - (prj->bound_y1 - prj->bound_y0) * (((double)y + render_size_ty) / (double)(prj->aspect_y * 1 << z)));
@@ -242,54 +938,94 @@ mapnik::box2d<double> tile2prjbounds(struct projectionconfig *prj, int x, int y,
 	return bbox;
 }
 
-static enum protoCmd render(struct xmlmapconfig *map, int x, int y, int z, char *options, metaTile &tiles)
+/*
+ * Returns the raster of a render thread, cleared and sized for a metatile.
+ * It is kept between renders and only reallocated when the size changes.
+ */
+static mapnik::image_32 &render_raster(std::unique_ptr<mapnik::image_32> &raster, unsigned int width, unsigned int height)
 {
-	unsigned int render_size_tx = MIN(METATILE, map->prj->aspect_x * (1 << z));
-	unsigned int render_size_ty = MIN(METATILE, map->prj->aspect_y * (1 << z));
+	if (raster && raster->width() == width && raster->height() == height) {
+		raster->set(0);
+	} else {
+		raster.reset(new mapnik::image_32(width, height));
+	}
 
-	map->map.resize(render_size_tx * map->tilesize, render_size_ty * map->tilesize);
-	map->map.zoom_to_box(tile2prjbounds(map->prj, x, y, z));
+	return *raster;
+}
 
-	if (map->map.buffer_size() == 0) { // Only set buffer size if the buffer size isn't explicitly set in the mapnik stylesheet.
-		map->map.set_buffer_size((map->tilesize >> 1) * map->scale);
+/*
+ * Returns the map of a parameterized style for options. Parameterizing a copy of the map
+ * recreates datasources and loads fonts, so the maps of the most recently rendered
+ * options are kept and reused. Sets hit to whether it was one of them.
+ */
+static Map &parameterized_map(struct xmlmapconfig *map, char *options, int *hit)
+{
+	for (auto it = map->parameterized.begin(); it != map->parameterized.end(); ++it) {
+		if (it->first == options) {
+			map->parameterized.splice(map->parameterized.begin(), map->parameterized, it);
+			*hit = 1;
+			return map->parameterized.front().second;
+		}
 	}
 
-	// m.zoom(size+1);
+	*hit = 0;
+
+	if (map->parameterized.size() >= PARAMETERIZED_MAPS_MAX) {
+		map->parameterized.pop_back();
+	}
 
-	mapnik::image_32 buf(render_size_tx * map->tilesize, render_size_ty * map->tilesize);
+	map->parameterized.emplace_front(options, map->map);
 
 	try {
-		if (map->parameterize_function) {
-			Map map_parameterized = map->map;
+		map->parameterize_function(map->parameterized.front().second, options);
+		map->parameterized.front().second.load_fonts();
+	} catch (...) {
+		map->parameterized.pop_front();
+		throw;
+	}
 
-			map->parameterize_function(map_parameterized, options);
+	return map->parameterized.front().second;
+}
 
-			map_parameterized.load_fonts();
+static enum protoCmd render(struct xmlmapconfig *map, int x, int y, int z, int size, char *options, std::unique_ptr<mapnik::image_32> &raster, metaTile &tiles, long *rasterise_time, long *encode_time, int *parameterized_hit)
+{
+	int64_t start = thread_clock(), rasterised;
+	unsigned int render_size_tx = MIN(size, map->prj->aspect_x * (1 << z));
+	unsigned int render_size_ty = MIN(size, map->prj->aspect_y * (1 << z));
 
-			mapnik::agg_renderer<mapnik::image_32> ren(map_parameterized, buf, map->scale);
-			ren.apply();
-		} else {
-			mapnik::agg_renderer<mapnik::image_32> ren(map->map, buf, map->scale);
-			ren.apply();
+	mapnik::image_32 &buf = render_raster(raster, render_size_tx * map->tilesize, render_size_ty * map->tilesize);
+
+	*parameterized_hit = -1;
+
+	try {
+		Map &m = map->parameterize_function ? parameterized_map(map, options, parameterized_hit) : map->map;
+
+		m.resize(render_size_tx * map->tilesize, render_size_ty * map->tilesize);
+		m.zoom_to_box(tile2prjbounds(map->prj, x, y, z, size));
+
+		if (m.buffer_size() == 0) { // Only set buffer size if the buffer size isn't explicitly set in the mapnik stylesheet.
+			m.set_buffer_size((map->tilesize >> 1) * map->scale);
 		}
+
+		// m.zoom(size+1);
+
+		mapnik::agg_renderer<mapnik::image_32> ren(m, buf, map->scale);
+		ren.apply();
 	} catch (std::exception const &ex) {
 		g_logger(G_LOG_LEVEL_ERROR, "failed to render TILE %s %d %d-%d %d-%d", map->xmlname, z, x, x + render_size_tx - 1, y, y + render_size_ty - 1);
 		g_logger(G_LOG_LEVEL_ERROR, "  reason: %s", ex.what());
 		return cmdNotDone;
 	}
 
+	rasterised = thread_clock();
+	*rasterise_time = (rasterised - start) / 1000;
+
 	// Split the meta tile into an NxN grid of tiles
-	unsigned int xx, yy;
+	enum protoCmd ret = encode_metatile(buf, map->output_format, map->tilesize, render_size_tx, render_size_ty, tiles);
 
-	for (yy = 0; yy < render_size_ty; yy++) {
-		for (xx = 0; xx < render_size_tx; xx++) {
-			mapnik::image_view<mapnik::image<mapnik::rgba8_t >> vw1(xx * map->tilesize, yy * map->tilesize, map->tilesize, map->tilesize, buf);
-			struct mapnik::image_view_any vw(vw1);
-			tiles.set(xx, yy, save_to_string(vw, map->output_format));
-		}
-	}
+	*encode_time = (thread_clock() - rasterised) / 1000;
 
-	return cmdDone; // OK
+	return ret;
 }
 
 #else  // METATILE
@@ -339,6 +1075,30 @@ static enum protoCmd render(Map &m, const char *tile_dir, char *xmlname, project
 
 #endif // METATILE
 
+#ifdef METATILE
+int render_init_encoders(int num_threads)
+{
+	pthread_t thread;
+
+	for (int i = 0; i < num_threads; i++) {
+		if (pthread_create(&thread, NULL, encode_thread, NULL) != 0) {
+			g_logger(G_LOG_LEVEL_ERROR, "Could not spawn encoder thread");
+			return -1;
+		}
+
+		pthread_detach(thread);
+		encode_threads++;
+	}
+
+	return 0;
+}
+#else  // METATILE
+int render_init_encoders(int num_threads)
+{
+	return 0;
+}
+#endif // METATILE
+
 void render_init(const char *plugins_dir, const char *font_dir, int font_dir_recurse)
 {
 	g_logger(G_LOG_LEVEL_INFO, "Renderd is using mapnik version %i.%i.%i", MAPNIK_MAJOR_VERSION, MAPNIK_MINOR_VERSION, MAPNIK_PATCH_VERSION);
@@ -352,115 +1112,104 @@ void *render_thread(void *arg)
 	xmlmapconfig maps[XMLCONFIGS_MAX];
 	int i, iMaxConfigs;
 	int render_time;
+	int thread = request_queue_add_thread(render_request_queue);
+#ifdef METATILE
+	// Raster of the metatiles rendered by this thread, reused between renders
+	std::unique_ptr<mapnik::image_32> raster;
+#endif
 
 	g_logger(G_LOG_LEVEL_DEBUG, "Starting rendering thread: %lu", (unsigned long)pthread_self());
 
-	for (iMaxConfigs = 0; iMaxConfigs < XMLCONFIGS_MAX; ++iMaxConfigs) {
-		if (parentxmlconfig[iMaxConfigs].xmlname == NULL || parentxmlconfig[iMaxConfigs].xmlfile == NULL) {
-			break;
-		}
-
-		maps[iMaxConfigs].maxzoom = parentxmlconfig[iMaxConfigs].max_zoom;
-		maps[iMaxConfigs].minzoom = parentxmlconfig[iMaxConfigs].min_zoom;
-		maps[iMaxConfigs].output_format = strndup(parentxmlconfig[iMaxConfigs].output_format, PATH_MAX);
-		maps[iMaxConfigs].parameterize_function = init_parameterization_function(parentxmlconfig[iMaxConfigs].parameterization);
-		maps[iMaxConfigs].scale = parentxmlconfig[iMaxConfigs].scale_factor;
-		maps[iMaxConfigs].store = init_storage_backend(parentxmlconfig[iMaxConfigs].tile_dir);
-		maps[iMaxConfigs].tilesize = parentxmlconfig[iMaxConfigs].tile_px_size;
-		maps[iMaxConfigs].xmlfile = strndup(parentxmlconfig[iMaxConfigs].xmlfile, PATH_MAX);
-		maps[iMaxConfigs].xmlname = strndup(parentxmlconfig[iMaxConfigs].xmlname, PATH_MAX);
-
-		if (maps[iMaxConfigs].store) {
-			maps[iMaxConfigs].ok = 1;
-
-			maps[iMaxConfigs].map.resize(RENDER_SIZE, RENDER_SIZE);
-
-			try {
-				mapnik::load_map(maps[iMaxConfigs].map, maps[iMaxConfigs].xmlfile);
+	map_generation *gen = map_generation_join(parentxmlconfig);
 
-				if (!maps[iMaxConfigs].parameterize_function) {
-					maps[iMaxConfigs].map.load_fonts();
-				}
-
-				/* If we have more than 10 rendering threads configured, we need to fix
-				 * up the mapnik datasources to support larger postgres connection pools
-				 */
-				if (parentxmlconfig[iMaxConfigs].num_threads > 10) {
-					g_logger(G_LOG_LEVEL_DEBUG, "Updating max_connection parameter for mapnik layers to reflect thread count");
-					parameterize_map_max_connections(maps[iMaxConfigs].map, parentxmlconfig[iMaxConfigs].num_threads);
-				}
-
-				maps[iMaxConfigs].prj = get_projection(maps[iMaxConfigs].map.srs().c_str());
-			} catch (std::exception const &ex) {
-				g_logger(G_LOG_LEVEL_ERROR, "An error occurred while loading the map layer '%s': %s", maps[iMaxConfigs].xmlname, ex.what());
-				maps[iMaxConfigs].ok = 0;
-			} catch (...) {
-				g_logger(G_LOG_LEVEL_ERROR, "An unknown error occurred while loading the map layer '%s'", maps[iMaxConfigs].xmlname);
-				maps[iMaxConfigs].ok = 0;
-			}
-
-#ifdef HTCP_EXPIRE_CACHE
-			maps[iMaxConfigs].host = strndup(parentxmlconfig[iMaxConfigs].host, PATH_MAX);
-			maps[iMaxConfigs].htcphost = strndup(parentxmlconfig[iMaxConfigs].htcpip, PATH_MAX);
-			maps[iMaxConfigs].xmluri = strndup(parentxmlconfig[iMaxConfigs].xmluri, PATH_MAX);
+	iMaxConfigs = map_generation_copy(gen, maps);
 
-			if (strlen(maps[iMaxConfigs].htcphost) > 0) {
-				maps[iMaxConfigs].htcpsock = init_cache_expire(maps[iMaxConfigs].htcphost);
+	while (1) {
+		enum protoCmd ret;
+		int wakeups = request_queue_wakeups(render_request_queue);
 
-				if (maps[iMaxConfigs].htcpsock > 0) {
-					g_logger(G_LOG_LEVEL_DEBUG, "Successfully opened socket for HTCP cache expiry");
-				} else {
-					g_logger(G_LOG_LEVEL_ERROR, "Failed to open socket for HTCP cache expiry");
-				}
-			} else {
-				maps[iMaxConfigs].htcpsock = -1;
-			}
+		if (__atomic_load_n(&render_exiting, __ATOMIC_ACQUIRE)) {
+			break;
+		}
 
-#endif // HTCP_EXPIRE_CACHE
-		} else {
-			maps[iMaxConfigs].ok = 0;
+		// Between two renders is a safe point to switch to reloaded styles
+		if (__atomic_load_n(&map_generation_id, __ATOMIC_ACQUIRE) != gen->id) {
+			map_generation_free_copy(gen, maps, iMaxConfigs);
+			map_generation_leave(gen);
+			gen = map_generation_join(parentxmlconfig);
+			iMaxConfigs = map_generation_copy(gen, maps);
 		}
-	}
 
-	while (1) {
-		enum protoCmd ret;
-		struct item *item = request_queue_fetch_request(render_request_queue);
+		map_lazy_unload(gen, maps, iMaxConfigs);
+
+		// Returns NULL once woken up by a reload, to unload styles or to exit
+		struct item *item = request_queue_fetch_request_or_wakeup(render_request_queue, wakeups);
+		int64_t fetched = thread_clock(), rendering = 0, loading = 0, render_start;
+		long rasterise_time, encode_time;
+		int parameterized_hit;
 		render_time = -1;
 
 		if (item) {
 			struct protocol *req = &item->req;
 #ifdef METATILE
-			// At very low zoom the whole world may be smaller than METATILE
-			unsigned int size = MIN(METATILE, 1 << req->z);
+			// Meta-tile size of the style at this zoom, the whole world may be smaller at very low zoom
+			int meta_size = metatile_size(req->xmlname, req->z);
+			unsigned int size = MIN(meta_size, 1 << req->z);
+			// Rounded down again, the sizes may have been reloaded since the request was queued
+			int mx = req->x & ~(meta_size - 1), my = req->y & ~(meta_size - 1);
 
 			for (i = 0; i < iMaxConfigs; ++i) {
 				if (!strcmp(maps[i].xmlname, req->xmlname)) {
+					if (maps[i].lazy && maps[i].store) {
+						if (!maps[i].ok) {
+							long load_time = map_lazy_copy(&gen->templates[i], &maps[i]);
+
+							if (maps[i].ok) {
+								request_queue_style_load(render_request_queue, item, load_time);
+							}
+
+							loading = thread_clock() - fetched;
+						}
+
+						maps[i].used = request_queue_clock();
+						__atomic_store_n(&gen->templates[i].used, maps[i].used, __ATOMIC_RELAXED);
+					}
+
 					if (maps[i].ok) {
-						if (check_xyz(item->mx, item->my, req->z, &(maps[i]))) {
+						if (check_xyz(mx, my, req->z, &(maps[i]))) {
 
-							metaTile tiles(req->xmlname, req->options, item->mx, item->my, req->z);
+							metaTile tiles(req->xmlname, req->options, mx, my, req->z, meta_size);
 
 							timeval tim;
 							gettimeofday(&tim, NULL);
 							long t1 = tim.tv_sec * 1000 + (tim.tv_usec / 1000);
 
-							struct stat_info sinfo = maps[i].store->tile_stat(maps[i].store, req->xmlname, req->options, item->mx, item->my, req->z);
+							struct stat_info sinfo = maps[i].store->tile_stat(maps[i].store, req->xmlname, req->options, mx, my, req->z);
 
 							if (sinfo.size > 0)
 								g_logger(G_LOG_LEVEL_DEBUG, "START TILE %s %d %d-%d %d-%d, age %.2f days",
-									 req->xmlname, req->z, item->mx, item->mx + size - 1, item->my, item->my + size - 1,
+									 req->xmlname, req->z, mx, mx + size - 1, my, my + size - 1,
 									 (tim.tv_sec - sinfo.mtime) / 86400.0);
 							else
 								g_logger(G_LOG_LEVEL_DEBUG, "START TILE %s %d %d-%d %d-%d, new metatile",
-									 req->xmlname, req->z, item->mx, item->mx + size - 1, item->my, item->my + size - 1);
+									 req->xmlname, req->z, mx, mx + size - 1, my, my + size - 1);
+
+							render_start = thread_clock();
+							ret = render(&(maps[i]), mx, my, req->z, meta_size, req->options, raster, tiles, &rasterise_time, &encode_time, &parameterized_hit);
+
+							if (ret == cmdDone) {
+								request_queue_render_phases(render_request_queue, rasterise_time, encode_time);
+							}
 
-							ret = render(&(maps[i]), item->mx, item->my, req->z, req->options, tiles);
+							if (parameterized_hit >= 0) {
+								request_queue_style_parameterized(render_request_queue, item, parameterized_hit);
+							}
 
 							gettimeofday(&tim, NULL);
 							long t2 = tim.tv_sec * 1000 + (tim.tv_usec / 1000);
 
 							g_logger(G_LOG_LEVEL_DEBUG, "DONE TILE %s %d %d-%d %d-%d in %.3lf seconds",
-								 req->xmlname, req->z, item->mx, item->mx + size - 1, item->my, item->my + size - 1, (t2 - t1) / 1000.0);
+								 req->xmlname, req->z, mx, mx + size - 1, my, my + size - 1, (t2 - t1) / 1000.0);
 
 							render_time = t2 - t1;
 
@@ -482,6 +1231,8 @@ void *render_thread(void *arg)
 								}
 							}
 
+							rendering = thread_clock() - render_start;
+
 #else // METATILE
 			ret = render(maps[i].map, maps[i].tile_dir, req->xmlname, maps[i].prj, req->x, req->y, req->z, maps[i].output_format);
 #ifdef HTCP_EXPIRE_CACHE
@@ -499,6 +1250,7 @@ void *render_thread(void *arg)
 					}
 
 					send_response(item, ret, render_time);
+					request_queue_thread_time(render_request_queue, thread, thread_clock() - fetched - loading - rendering);
 
 					if ((ret != cmdDone) && (ret != cmdIgnore)) {
 						sleep(10); // Something went wrong with rendering, delay next processing to allow temporary issues to fix them selves
@@ -509,12 +1261,33 @@ void *render_thread(void *arg)
 			}
 
 			if (i == iMaxConfigs) {
+				// The style may have been removed by a reload while the request was queued
 				g_logger(G_LOG_LEVEL_ERROR, "No map for: %s", req->xmlname);
+				send_response(item, cmdNotDone, -1);
 			}
-		} else {
-			sleep(1); // TODO: Use an event to indicate there are new requests
 		}
 	}
 
+	map_generation_free_copy(gen, maps, iMaxConfigs);
+	map_generation_leave(gen);
+
 	return NULL;
 }
+
+void render_exit(void)
+{
+	int started;
+
+	pthread_mutex_lock(&map_generation_lock);
+	__atomic_store_n(&render_exiting, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&lazy_unload_cond);
+	started = lazy_unload_timer_started;
+	lazy_unload_timer_started = 0;
+	pthread_mutex_unlock(&map_generation_lock);
+
+	if (started) {
+		pthread_join(lazy_unload_timer, NULL);
+	}
+
+	request_queue_wakeup(render_request_queue);
+}
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <string>
 #include <sys/types.h>
+#include <utility>
 
 #include "cache_expire.h"
 #include "g_logger.h"
@@ -28,23 +29,28 @@
 #include "render_config.h"
 #include "store.h"
 
-metaTile::metaTile(const std::string &xmlconfig, const std::string &options, int x, int y, int z):
-	x_(x), y_(y), z_(z), xmlconfig_(xmlconfig), options_(options)
+// Slots of the table of distinct payloads of a metatile, at most half of them are used
+#define PAYLOAD_SLOTS (2 * METATILE_MAX * METATILE_MAX)
+
+metaTile::metaTile(const std::string &xmlconfig, const std::string &options, int x, int y, int z, int size):
+	x_(x), y_(y), z_(z), size_(size), xmlconfig_(xmlconfig), options_(options)
 {
 	clear();
 }
 
 void metaTile::clear()
 {
-	for (int x = 0; x < METATILE; x++)
-		for (int y = 0; y < METATILE; y++) {
+	for (int x = 0; x < size_; x++)
+		for (int y = 0; y < size_; y++) {
 			tile[x][y] = "";
+			changed[x][y] = true;
 		}
 }
 
-void metaTile::set(int x, int y, const std::string &data)
+void metaTile::set(int x, int y, std::string data)
 {
-	tile[x][y] = data;
+	// Encoded tiles are moved in, not copied
+	tile[x][y] = std::move(data);
 }
 
 const std::string metaTile::get(int x, int y)
@@ -55,67 +61,134 @@ const std::string metaTile::get(int x, int y)
 // Returns the offset within the meta-tile index table
 int metaTile::xyz_to_meta_offset(int x, int y, int z)
 {
-	unsigned char mask = METATILE - 1;
-	return (x & mask) * METATILE + (y & mask);
+	int mask = size_ - 1;
+	return (x & mask) * size_ + (y & mask);
+}
+
+// Compares the tiles with those of the stored metatile, returns how many of them changed
+int metaTile::compare(struct storage_backend * store)
+{
+	// Reused by the metatiles compared on the same thread, it only grows
+	static thread_local std::string stored;
+	const struct meta_layout *m;
+	int ox, oy, len, header_size = sizeof(struct meta_layout) + sizeof(struct entry) * size_ * size_;
+	int num_changed = 0;
+
+	len = store->metatile_read(store, xmlconfig_.c_str(), options_.c_str(), x_, y_, z_, &stored[0], stored.size());
+
+	if (len > (int)stored.size()) {
+		stored.resize(len);
+		len = store->metatile_read(store, xmlconfig_.c_str(), options_.c_str(), x_, y_, z_, &stored[0], stored.size());
+	}
+
+	m = (const struct meta_layout *)stored.data();
+
+	// Without a stored metatile of the same layout all tiles count as changed
+	if (len < header_size || len > (int)stored.size() || memcmp(m->magic, META_MAGIC, strlen(META_MAGIC)) ||
+			m->count != size_ * size_ || m->x != x_ || m->y != y_ || m->z != z_) {
+		for (ox = 0; ox < size_; ox++) {
+			for (oy = 0; oy < size_; oy++) {
+				changed[ox][oy] = true;
+			}
+		}
+
+		return size_ * size_;
+	}
+
+	for (ox = 0; ox < size_; ox++) {
+		for (oy = 0; oy < size_; oy++) {
+			const struct entry *e = &(m->index[xyz_to_meta_offset(x_ + ox, y_ + oy, z_)]);
+
+			changed[ox][oy] = e->offset < header_size || e->size < 0 || e->offset > len - e->size ||
+					  (size_t)e->size != tile[ox][oy].size() || memcmp(stored.data() + e->offset, tile[ox][oy].data(), e->size);
+			num_changed += changed[ox][oy];
+		}
+	}
+
+	return num_changed;
 }
 
 void metaTile::save(struct storage_backend * store)
 {
+	// Reused by the metatiles saved on the same thread, it only grows
+	static thread_local std::string metatilebuffer;
 	int ox, oy, limit;
 	ssize_t offset;
 	struct meta_layout m;
-	struct entry offsets[METATILE * METATILE];
-	char * metatilebuffer;
+	struct entry offsets[METATILE_MAX * METATILE_MAX];
+	const std::string *payloads[METATILE_MAX * METATILE_MAX];
+	int payload_offsets[METATILE_MAX * METATILE_MAX];
+	size_t payload_hashes[METATILE_MAX * METATILE_MAX];
+	// Index of the payload + 1 by the hash of its content, 0 for free slots
+	short payload_slots[PAYLOAD_SLOTS];
+	int header_size = sizeof(struct meta_layout) + sizeof(struct entry) * size_ * size_;
+	int i, num_payloads = 0;
 	char *tmp;
 
+	// Metatiles rendered again without changes are only marked as fresh, where the storage backend can.
+	// Elsewhere reading the stored metatile back may cost as much as writing it.
+	if (store->metatile_read && store->metatile_touch && compare(store) == 0 && store->metatile_touch(store, xmlconfig_.c_str(), options_.c_str(), x_, y_, z_) == 0) {
+		g_logger(G_LOG_LEVEL_DEBUG, "Metatile %s %d %d %d is unchanged, not written again", xmlconfig_.c_str(), z_, x_, y_);
+		return;
+	}
+
 	memset(&m, 0, sizeof(m));
 	memset(&offsets, 0, sizeof(offsets));
+	memset(&payload_slots, 0, sizeof(payload_slots));
 
 	// Create and write header
-	m.count = METATILE * METATILE;
+	m.count = size_ * size_;
 	memcpy(m.magic, META_MAGIC, strlen(META_MAGIC));
 	m.x = x_;
 	m.y = y_;
 	m.z = z_;
 
 	offset = header_size;
-	limit = METATILE;
+	limit = size_;
 
-	// Generate offset table
+	// Generate offset table, identical tiles (e.g. of a solid colour) point at the same payload
 	for (ox = 0; ox < limit; ox++) {
 		for (oy = 0; oy < limit; oy++) {
 			int mt = xyz_to_meta_offset(x_ + ox, y_ + oy, z_);
-			offsets[mt].offset = offset;
+			size_t hash = std::hash<std::string>()(tile[ox][oy]);
+			unsigned int slot = hash % PAYLOAD_SLOTS;
+
+			// Linear probing, the content is only compared on equal hashes
+			for (; (i = payload_slots[slot] - 1) >= 0; slot = (slot + 1) % PAYLOAD_SLOTS) {
+				if (payload_hashes[i] == hash && *payloads[i] == tile[ox][oy]) {
+					break;
+				}
+			}
+
+			if (i < 0) {
+				i = num_payloads;
+				payload_slots[slot] = ++num_payloads;
+				payloads[i] = &tile[ox][oy];
+				payload_hashes[i] = hash;
+				payload_offsets[i] = offset;
+				offset += tile[ox][oy].size();
+			}
+
+			offsets[mt].offset = payload_offsets[i];
 			offsets[mt].size   = tile[ox][oy].size();
-			offset += offsets[mt].size;
 		}
 	}
 
-	metatilebuffer = (char *) malloc(offset);
-
-	if (metatilebuffer == 0) {
-		g_logger(G_LOG_LEVEL_WARNING, "Failed to write metatile. Out of memory");
-		return;
-	}
-
-	memset(metatilebuffer, 0, offset);
-	memcpy(metatilebuffer, &m, sizeof(m));
-	memcpy(metatilebuffer + sizeof(m), &offsets, sizeof(offsets));
+	// Header and index are all written, so only the tiles are copied in after them
+	metatilebuffer.resize(offset);
+	memcpy(&metatilebuffer[0], &m, sizeof(m));
+	memcpy(&metatilebuffer[sizeof(m)], &offsets, sizeof(struct entry) * size_ * size_);
 
 	// Write tiles
-	for (ox = 0; ox < limit; ox++) {
-		for (oy = 0; oy < limit; oy++) {
-			memcpy(metatilebuffer + offsets[xyz_to_meta_offset(x_ + ox, y_ + oy, z_)].offset, (const void *)tile[ox][oy].data(), tile[ox][oy].size());
-		}
+	for (i = 0; i < num_payloads; i++) {
+		memcpy(&metatilebuffer[payload_offsets[i]], (const void *)payloads[i]->data(), payloads[i]->size());
 	}
 
-	if (store->metatile_write(store, xmlconfig_.c_str(), options_.c_str(), x_, y_, z_, metatilebuffer, offset) != offset) {
+	if (store->metatile_write(store, xmlconfig_.c_str(), options_.c_str(), x_, y_, z_, metatilebuffer.data(), offset) != offset) {
 		tmp = (char *)malloc(sizeof(char) * PATH_MAX);
 		g_logger(G_LOG_LEVEL_WARNING, "Failed to write metatile to %s", store->tile_storage_id(store, xmlconfig_.c_str(), options_.c_str(), x_, y_, z_, tmp));
 		free(tmp);
 	}
-
-	free(metatilebuffer);
 }
 
 
@@ -128,12 +201,14 @@ void metaTile::expire_tiles(int sock, const char *host, const char *uri)
 	g_logger(G_LOG_LEVEL_INFO, "Purging metatile via HTCP cache expiry");
 	int ox, oy;
 	int limit = (1 << z_);
-	limit = MIN(limit, METATILE);
+	limit = MIN(limit, size_);
 
-	// Generate offset table
+	// Only the tiles which changed since the metatile was stored are purged
 	for (ox = 0; ox < limit; ox++) {
 		for (oy = 0; oy < limit; oy++) {
-			cache_expire(sock, host, uri, (x_ + ox), (y_ + oy), z_);
+			if (changed[ox][oy]) {
+				cache_expire(sock, host, uri, (x_ + ox), (y_ + oy), z_);
+			}
 		}
 	}
 }
@@ -64,6 +64,7 @@
 #include "renderd.h"
 #include "renderd_config.h"
 #include "store.h"
+#include "store_file_utils.h"
 #include "sys_utils.h"
 
 module AP_MODULE_DECLARE_DATA tile_module;
@@ -340,6 +341,17 @@ static int request_tile(request_rec *r, struct protocol *cmd, int renderImmediat
 		cmd->cmd = cmdRenderBulk;
 	}
 
+	if (renderImmediately) {
+		// Let renderd know how long we are going to wait for the tile
+		if (cmd->ver < 3) {
+			strcpy(cmd->mimetype, "image/png");
+			strcpy(cmd->options, "");
+		}
+
+		cmd->ver = PROTO_VER;
+		cmd->timeout = (renderImmediately > 2 ? scfg->request_timeout_priority : scfg->request_timeout);
+	}
+
 	ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Requesting style(%s) z(%d) x(%d) y(%d) from renderer with priority %d", cmd->xmlname, cmd->z, cmd->x, cmd->y, cmd->cmd);
 
 	do {
@@ -349,11 +361,15 @@ static int request_tile(request_rec *r, struct protocol *cmd, int renderImmediat
 				break;
 
 			case 3:
+				ret = send(fd, cmd, sizeof(struct protocol_v3), 0);
+				break;
+
+			case 4:
 				ret = send(fd, cmd, sizeof(struct protocol), 0);
 				break;
 		}
 
-		if ((ret == sizeof(struct protocol_v2)) || (ret == sizeof(struct protocol))) {
+		if ((ret == sizeof(struct protocol_v2)) || (ret == sizeof(struct protocol_v3)) || (ret == sizeof(struct protocol))) {
 			break;
 		}
 
@@ -375,7 +391,7 @@ static int request_tile(request_rec *r, struct protocol *cmd, int renderImmediat
 	} while (retry--);
 
 	if (renderImmediately) {
-		int timeout = (renderImmediately > 2 ? scfg->request_timeout_priority : scfg->request_timeout);
+		int timeout = cmd->timeout;
 		struct pollfd rx;
 		int s;
 
@@ -408,7 +424,13 @@ static int request_tile(request_rec *r, struct protocol *cmd, int renderImmediat
 
 				// first integer in message is protocol version
 				if (already_read >= sizeof(int)) {
-					want = (resp.ver == 3) ? sizeof(struct protocol) : sizeof(struct protocol_v2);
+					if (resp.ver == 4) {
+						want = sizeof(struct protocol);
+					} else if (resp.ver == 3) {
+						want = sizeof(struct protocol_v3);
+					} else {
+						want = sizeof(struct protocol_v2);
+					}
 				}
 
 				// do we have a complete packet?
@@ -2036,6 +2058,7 @@ static const char *add_tile_config(cmd_parms *cmd, void *mconfig, int argc, char
 	char *fileExtension = "png";
 	char *mimeType = "image/png";
 	char *tile_dir = "";
+	char *metatileSize = NULL;
 
 	for (int i = 2; i < argc; i++) {
 		char *value = strchr(argv[i], '=');
@@ -2053,6 +2076,8 @@ static const char *add_tile_config(cmd_parms *cmd, void *mconfig, int argc, char
 				mimeType = value;
 			} else if (!strcmp(argv[i], "tile_dir")) {
 				tile_dir = value;
+			} else if (!strcmp(argv[i], "metatile_size")) {
+				metatileSize = value;
 			}
 		}
 	}
@@ -2061,6 +2086,17 @@ static const char *add_tile_config(cmd_parms *cmd, void *mconfig, int argc, char
 		return "AddTileConfig error, the configured zoom level lies outside of the range supported by this server";
 	}
 
+	// Has to match the metatile_size of the style in the renderd config file
+	if (metatileSize) {
+		int sizes[MAX_ZOOM + 1];
+
+		if (parse_metatile_sizes(metatileSize, sizes) != 0) {
+			return "AddTileConfig error, the configured metatile size is invalid";
+		}
+
+		metatile_size_set(name, sizes);
+	}
+
 	return _add_tile_config(cmd, baseuri, name, minzoom, maxzoom, 1, 1, fileExtension, mimeType, "", "", "", "", tile_dir, 0);
 }
 
@@ -2080,6 +2116,7 @@ static const char *load_tile_config(cmd_parms *cmd, void *mconfig, const char *c
 
 	for (int i = 0; i < XMLCONFIGS_MAX; i++) {
 		if (maps[i].xmlname != NULL) {
+			metatile_size_set(maps[i].xmlname, maps[i].metatile_sizes);
 			result = _add_tile_config(cmd,
 						  maps[i].xmluri, maps[i].xmlname, maps[i].min_zoom, maps[i].max_zoom, maps[i].aspect_x, maps[i].aspect_y,
 						  maps[i].file_extension, maps[i].mime_type, maps[i].description, maps[i].attribution,
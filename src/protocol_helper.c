@@ -18,6 +18,7 @@
 #include "protocol.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
@@ -29,7 +30,7 @@ int send_cmd(struct protocol * cmd, int fd)
 	int ret;
 	g_logger(G_LOG_LEVEL_DEBUG, "Sending render cmd(%i %s %i/%i/%i) with protocol version %i to fd %i", cmd->cmd, cmd->xmlname, cmd->z, cmd->x, cmd->y, cmd->ver, fd);
 
-	if ((cmd->ver > 3) || (cmd->ver < 1)) {
+	if ((cmd->ver > 4) || (cmd->ver < 1)) {
 		g_logger(G_LOG_LEVEL_ERROR, "Failed to send render cmd with unknown protocol version %i on fd %d", cmd->ver, fd);
 		return -1;
 	}
@@ -44,11 +45,15 @@ int send_cmd(struct protocol * cmd, int fd)
 			break;
 
 		case 3:
+			ret = send(fd, cmd, sizeof(struct protocol_v3), 0);
+			break;
+
+		case 4:
 			ret = send(fd, cmd, sizeof(struct protocol), 0);
 			break;
 	}
 
-	if ((ret != sizeof(struct protocol)) && (ret != sizeof(struct protocol_v2)) && (ret != sizeof(struct protocol_v1))) {
+	if ((ret != sizeof(struct protocol)) && (ret != sizeof(struct protocol_v3)) && (ret != sizeof(struct protocol_v2)) && (ret != sizeof(struct protocol_v1))) {
 		g_logger(G_LOG_LEVEL_ERROR, "Failed to send render cmd on fd %i", fd);
 		g_logger(G_LOG_LEVEL_ERROR, "send error: %s", strerror(errno));
 	}
@@ -70,7 +75,7 @@ int recv_cmd(struct protocol * cmd, int fd,  int block)
 		return 0;
 	}
 
-	if ((cmd->ver > 3) || (cmd->ver < 1)) {
+	if ((cmd->ver > 4) || (cmd->ver < 1)) {
 		g_logger(G_LOG_LEVEL_WARNING, "Failed to receive render cmd with unknown protocol version %i", cmd->ver);
 		return -1;
 	}
@@ -87,6 +92,10 @@ int recv_cmd(struct protocol * cmd, int fd,  int block)
 			break;
 
 		case 3:
+			ret2 = recv(fd, ((void*)cmd) + sizeof(struct protocol_v1), sizeof(struct protocol_v3) - sizeof(struct protocol_v1), block ? MSG_WAITALL : MSG_DONTWAIT);
+			break;
+
+		case 4:
 			ret2 = recv(fd, ((void*)cmd) + sizeof(struct protocol_v1), sizeof(struct protocol) - sizeof(struct protocol_v1), block ? MSG_WAITALL : MSG_DONTWAIT);
 			break;
 	}
@@ -98,10 +107,143 @@ int recv_cmd(struct protocol * cmd, int fd,  int block)
 
 	ret += ret2;
 
-	if ((ret == sizeof(struct protocol)) || (ret == sizeof(struct protocol_v1)) || (ret == sizeof(struct protocol_v2))) {
+	if ((ret == sizeof(struct protocol)) || (ret == sizeof(struct protocol_v1)) || (ret == sizeof(struct protocol_v2)) || (ret == sizeof(struct protocol_v3))) {
 		return ret;
 	}
 
 	g_logger(G_LOG_LEVEL_WARNING, "Socket read wrong number of bytes: %i -> %li, %li", ret, sizeof(struct protocol_v2), sizeof(struct protocol));
 	return 0;
 }
+
+/* Size of a command of protocol version ver, 0 if the version is unknown */
+int cmd_size(int ver)
+{
+	switch (ver) {
+		case 1:
+			return sizeof(struct protocol_v1);
+
+		case 2:
+			return sizeof(struct protocol_v2);
+
+		case 3:
+			return sizeof(struct protocol_v3);
+
+		case 4:
+			return sizeof(struct protocol);
+
+		default:
+			return 0;
+	}
+}
+
+/* Take a command off the start of the len bytes received in buf. Returns the number
+ * of bytes it took up, 0 if the command is not complete yet or -1 if it is invalid.
+ */
+int parse_cmd(struct protocol *cmd, const char *buf, size_t len)
+{
+	const struct protocol_v1 *header = (const struct protocol_v1 *)buf;
+	size_t size;
+
+	if (len < sizeof(struct protocol_v1)) {
+		return 0;
+	}
+
+	size = cmd_size(header->ver);
+
+	if (size == 0) {
+		g_logger(G_LOG_LEVEL_WARNING, "Failed to receive render cmd with unknown protocol version %i", header->ver);
+		return -1;
+	}
+
+	if (len < size) {
+		return 0;
+	}
+
+	memset(cmd, 0, sizeof(*cmd));
+	memcpy(cmd, buf, size);
+
+	return size;
+}
+
+/* Take the header of a frame of protocol version 5 off the start of buf, returns like
+ * parse_cmd. The requests or responses it announces follow it.
+ */
+int parse_frame(struct protocol_frame *frame, const char *buf, size_t len)
+{
+	if (len < sizeof(struct protocol_frame)) {
+		return 0;
+	}
+
+	memcpy(frame, buf, sizeof(struct protocol_frame));
+
+	if ((frame->ver != PROTO_VER_FRAMED) || (frame->length % sizeof(struct protocol_v5) != 0) || (frame->length > PROTO_FRAME_MAX * sizeof(struct protocol_v5))) {
+		g_logger(G_LOG_LEVEL_WARNING, "Failed to receive frame of %u bytes with protocol version %i", frame->length, frame->ver);
+		return -1;
+	}
+
+	return sizeof(struct protocol_frame);
+}
+
+/* Send num requests or responses in one frame of protocol version 5, returns the number
+ * of bytes sent or -1
+ */
+int send_frame(const struct protocol_v5 *entries, int num, int fd)
+{
+	struct protocol_frame frame;
+	struct iovec iov[2];
+	ssize_t ret;
+
+	if ((num < 1) || (num > PROTO_FRAME_MAX)) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to send frame with %i entries on fd %d", num, fd);
+		return -1;
+	}
+
+	frame.ver = PROTO_VER_FRAMED;
+	frame.length = num * sizeof(struct protocol_v5);
+	iov[0].iov_base = &frame;
+	iov[0].iov_len = sizeof(frame);
+	iov[1].iov_base = (void *)entries;
+	iov[1].iov_len = frame.length;
+
+	ret = writev(fd, iov, 2);
+
+	if (ret != sizeof(frame) + frame.length) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to send frame on fd %i: %s", fd, strerror(errno));
+		return -1;
+	}
+
+	return ret;
+}
+
+/* Wait for a frame of protocol version 5 and store its up to max requests or responses
+ * in entries, returns their number or -1
+ */
+int recv_frame(struct protocol_v5 *entries, int max, int fd)
+{
+	struct protocol_frame frame;
+	char header[sizeof(struct protocol_frame)];
+	int num;
+
+	if (recv(fd, header, sizeof(header), MSG_WAITALL) != sizeof(header)) {
+		g_logger(G_LOG_LEVEL_DEBUG, "Failed to read frame on fd %i", fd);
+		return -1;
+	}
+
+	if (parse_frame(&frame, header, sizeof(header)) < 0) {
+		return -1;
+	}
+
+	num = frame.length / sizeof(struct protocol_v5);
+
+	if (num > max) {
+		g_logger(G_LOG_LEVEL_WARNING, "Frame of %i entries on fd %i exceeds the %i expected", num, fd, max);
+		return -1;
+	}
+
+	if ((frame.length > 0) && (recv(fd, entries, frame.length, MSG_WAITALL) != frame.length)) {
+		g_logger(G_LOG_LEVEL_WARNING, "Socket prematurely closed: %i", fd);
+		return -1;
+	}
+
+	return num;
+}
@@ -31,6 +31,7 @@
 #include "render_submit_queue.h"
 #include "renderd_config.h"
 #include "store.h"
+#include "store_file_utils.h"
 
 // macros handling our tile marking arrays (these are essentially bit arrays
 // that have one bit for each tile on the respective zoom level; since we only
@@ -122,11 +123,6 @@ int main(int argc, char **argv)
 	int excess_zoomlevels = 0;
 	int mt = METATILE;
 
-	while (mt > 1) {
-		excess_zoomlevels++;
-		mt >>= 1;
-	}
-
 	foreground = 1;
 
 	while (1) {
@@ -304,6 +300,18 @@ int main(int argc, char **argv)
 			tile_dir = strndup(maps[map_section_num].tile_dir, PATH_MAX);
 			tile_dir_passed = 1;
 		}
+
+		metatile_size_set(mapname, maps[map_section_num].metatile_sizes);
+	}
+
+	// The smallest meta-tile size of the style decides, where it sets sizes by zoom level
+	for (z = min_zoom; z <= max_zoom; z++) {
+		mt = MIN(mt, metatile_size(mapname, z));
+	}
+
+	while (mt > 1) {
+		excess_zoomlevels++;
+		mt >>= 1;
 	}
 
 	// initialise arrays for tile markings
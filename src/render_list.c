@@ -33,6 +33,7 @@
 #include "render_submit_queue.h"
 #include "renderd_config.h"
 #include "store.h"
+#include "store_file_utils.h"
 
 #ifndef METATILE
 #warning("render_list not implemented for non-metatile mode. Feel free to submit fix")
@@ -358,6 +359,8 @@ int main(int argc, char **argv)
 			tile_dir = strndup(maps[map_section_num].tile_dir, PATH_MAX);
 			tile_dir_passed = 1;
 		}
+
+		metatile_size_set(mapname, maps[map_section_num].metatile_sizes);
 	}
 
 	if (all) {
@@ -466,8 +469,8 @@ int main(int argc, char **argv)
 
 			g_logger(G_LOG_LEVEL_MESSAGE, "Rendering all tiles for zoom %i from (%i, %i) to (%i, %i)", z, min_x, min_y, current_max_x, current_max_y);
 
-			for (x = min_x; x <= current_max_x; x += METATILE) {
-				for (y = min_y; y <= current_max_y; y += METATILE) {
+			for (x = min_x; x <= current_max_x; x += metatile_size(mapname, z)) {
+				for (y = min_y; y <= current_max_y; y += metatile_size(mapname, z)) {
 					if (!force) {
 						s = store->tile_stat(store, mapname, "", x, y, z);
 					}
@@ -15,13 +15,17 @@
  * along with this program; If not, see http://www.gnu.org/licenses/.
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -31,6 +35,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -43,20 +48,121 @@
 #include "renderd.h"
 #include "renderd_config.h"
 #include "request_queue.h"
+#include "request_queue_journal.h"
+#include "request_queue_spool.h"
+#include "store_file_utils.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+// Number of ready fds handled per wakeup of process_loop
+#define EVENTS_MAX 256
+// Number of connections the table is sized for at first, it grows as needed
+#define CONNECTIONS_INITIAL 64
+// Bytes buffered per connection, room for several pipelined commands
+#define CONNECTION_BUFFER (4 * sizeof(struct protocol))
+// Most bytes of responses buffered for a client, which is disconnected beyond that
+#define CONNECTION_OUTPUT_MAX (1024 * sizeof(struct protocol))
+
+// Requests in flight to a slave at most, per render thread of the slave
+#define SLAVE_INFLIGHT_FACTOR 4
+// Work queued on a slave beyond one request per render thread, in ms of its throughput
+#define SLAVE_BACKLOG 200
+// Interval over which the throughput of a slave is measured (ms)
+#define SLAVE_RATE_INTERVAL 1000
+// How often the watcher of a slave checks whether it stopped responding (ms)
+#define SLAVE_WATCH_INTERVAL 1000
+// A slave that has not responded to any of its requests for this long is reconnected (s)
+#define SLAVE_STALL_TIMEOUT 600
+// Bounds of the time between attempts to connect to a slave that can not be reached (s)
+#define SLAVE_BACKOFF_MIN 1
+#define SLAVE_BACKOFF_MAX 64
+// Points on the ring of locality routing per render thread of a slave
+#define SLAVE_RING_POINTS 64
+// Requests are routed by the ancestor this many zoom levels up of their metatile
+#define SLAVE_REGION_ZOOM 6
+// Most requests a slave has under locality routing, in percent of its share of all of them
+#define SLAVE_LOAD_BOUND 125
+
+#ifndef HAVE_SYS_EPOLL_H
+#define PFD_LISTEN          0
+#define PFD_EXIT_PIPE       1
+#define PFD_COMPLETION_PIPE 2
+#define PFD_SPECIAL_COUNT   3
+#endif
+
+/* A client connection, with what has been received of its next command */
+struct connection {
+	int fd;
+	size_t len;
+	char buf[CONNECTION_BUFFER];
+	// Bytes of requests left in the frame being received, with protocol version 5
+	size_t frame_left;
+	// Responses the client was not ready to receive yet
+	char *out;
+	size_t out_len;
+	size_t out_size;
+#ifndef HAVE_SYS_EPOLL_H
+	// Index into connection_table.pfd
+	int slot;
+#endif
+};
 
-#define PFD_LISTEN        0
-#define PFD_EXIT_PIPE     1
-#define PFD_SPECIAL_COUNT 2
+/* Client connections of process_loop indexed by fd, so their number is only
+ * limited by the number of open files
+ */
+struct connection_table {
+	struct connection *conns;
+	int size;
+	int num;
+	// Only used without epoll, listen and exit fd followed by the connections
+	struct pollfd *pfd;
+#ifdef HAVE_SYS_EPOLL_H
+	int epoll_fd;
+#endif
+};
 
 #ifndef MAIN_ALREADY_DEFINED
 static pthread_t *render_threads;
 static pthread_t *slave_threads;
-static struct sigaction sigPipeAction, sigExitAction;
+static struct sigaction sigPipeAction, sigExitAction, sigReloadAction;
 static pthread_t stats_thread;
+static pthread_t reload_thread;
+static struct request_queue_journal *render_queue_journal;
+// Written to by the SIGHUP handler, the reload thread reads from the other end
+static int reload_pipe_fd = -1;
+static const char *reload_config_file_name;
 #endif
 
 static int exit_pipe_fd;
 
+// Dispatchers of the slaves of the master renderd, for the stats file
+static struct slave_dispatcher *slave_dispatchers;
+static int num_slave_dispatchers;
+
+/* Consistent hashing ring of locality routing, sorted by hash. NULL if requests are sent
+ * to whichever slave fetches them.
+ */
+struct slave_ring_point {
+	uint64_t hash;
+	struct slave_dispatcher *slave;
+};
+
+static struct slave_ring_point *slave_ring;
+static int slave_ring_size;
+static struct slave_dispatcher *slave_ring_slaves;
+static int slave_ring_num;
+
+/* Rendered items whose responses are sent by process_loop, linked through completedNext.
+ * Pushed by any thread and taken off all at once by process_loop, which is woken up
+ * through the completion pipe. While it is -1, responses are sent by send_response.
+ */
+static struct item *completed;
+static int completion_pipe_fd = -1;
+// Render threads in send_response that may still push to completed and write to the pipe
+static int completion_pushers;
+
 struct request_queue * render_request_queue;
 
 static const char *cmdStr(enum protoCmd c)
@@ -94,7 +200,28 @@ static const char *cmdStr(enum protoCmd c)
 
 
 
-void send_response(struct item *item, enum protoCmd rsp, int render_time)
+/* Fill entry with the request or response of protocol version 5 for req */
+static void to_protocol_v5(struct protocol_v5 *entry, const struct protocol *req, uint64_t id)
+{
+	memset(entry, 0, sizeof(struct protocol_v5));
+	entry->id = id;
+	entry->cmd = req->cmd;
+	entry->x = req->x;
+	entry->y = req->y;
+	entry->z = req->z;
+	memcpy(entry->xmlname, req->xmlname, XMLCONFIG_MAX);
+	memcpy(entry->mimetype, req->mimetype, XMLCONFIG_MAX);
+	memcpy(entry->options, req->options, XMLCONFIG_MAX);
+	entry->timeout = req->timeout;
+}
+
+static void connection_send(struct connection_table *table, int fd, struct protocol *cmd);
+static void connection_send_frame(struct connection_table *table, int fd, const struct protocol_v5 *entries, int num);
+
+/* Send the response to the clients waiting for a rendered item, through the connections
+ * of process_loop if there is a table
+ */
+static void respond(struct connection_table *table, struct item *item, enum protoCmd rsp, int render_time)
 {
 	request_queue_remove_request(render_request_queue, item, render_time);
 
@@ -106,32 +233,92 @@ void send_response(struct item *item, enum protoCmd rsp, int render_time)
 			req->cmd = rsp;
 			g_logger(G_LOG_LEVEL_DEBUG, "Sending message %s to %d", cmdStr(rsp), item->fd);
 
-			send_cmd(req, item->fd);
+			if (req->ver == PROTO_VER_FRAMED) {
+				struct protocol_v5 entry;
 
+				to_protocol_v5(&entry, req, item->id);
+
+				if (table == NULL) {
+					send_frame(&entry, 1, item->fd);
+				} else if (item->fd < table->size && table->conns[item->fd].fd != FD_INVALID) {
+					connection_send_frame(table, item->fd, &entry, 1);
+				}
+			} else if (table == NULL) {
+				send_cmd(req, item->fd);
+			} else if (item->fd < table->size && table->conns[item->fd].fd != FD_INVALID) {
+				connection_send(table, item->fd, req);
+			}
 		}
 
 		prev = item;
 		item = item->duplicates;
-		free(prev);
+		request_queue_free_item(render_request_queue, prev);
 	}
 }
 
-enum protoCmd rx_request(struct protocol *req, int fd)
+/* Hand the rendered item over to process_loop, so that render threads never wait for
+ * slow clients. The item stays in the request queue until then, which picks up
+ * further requests for it as duplicates.
+ */
+void send_response(struct item *item, enum protoCmd rsp, int render_time)
 {
-	struct item  *item;
+	struct item *head;
+	int wakeup_fd;
+	char c = 0;
 
-	// Upgrade version 1 and 2 to  version 3
-	if (req->ver == 1) {
-		strcpy(req->xmlname, "default");
+	// Counted before looking at the pipe, so that process_loop waits for this push when it stops
+	__atomic_add_fetch(&completion_pushers, 1, __ATOMIC_SEQ_CST);
+	wakeup_fd = __atomic_load_n(&completion_pipe_fd, __ATOMIC_SEQ_CST);
+
+	if (wakeup_fd < 0) {
+		__atomic_sub_fetch(&completion_pushers, 1, __ATOMIC_SEQ_CST);
+		respond(NULL, item, rsp, render_time);
+		return;
 	}
 
-	if (req->ver < 3) {
-		strcpy(req->mimetype, "image/png");
-		strcpy(req->options, "");
-	} else if (req->ver != 3) {
-		g_logger(G_LOG_LEVEL_ERROR, "Bad protocol version %d", req->ver);
-		return cmdNotDone;
+	item->response = rsp;
+	item->renderTime = render_time;
+	head = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+
+	do {
+		item->completedNext = head;
+	} while (!__atomic_compare_exchange_n(&completed, &head, item, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// Only wake up process_loop if it may have taken all items off before
+	if (head == NULL && write(wakeup_fd, &c, sizeof(c)) < 0 && errno != EAGAIN) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to write to the completion pipe: %s", strerror(errno));
+	}
+
+	__atomic_sub_fetch(&completion_pushers, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Send the responses of all items handed over by send_response, in the order they came in */
+static void respond_completed(struct connection_table *table, int completion_read)
+{
+	struct item *item, *next, *ordered = NULL;
+	char buf[64];
+
+	// Drained before taking the items, so that no wakeup for later items is lost
+	while (read(completion_read, buf, sizeof(buf)) > 0);
+
+	item = __atomic_exchange_n(&completed, NULL, __ATOMIC_ACQUIRE);
+
+	for (; item != NULL; item = next) {
+		next = item->completedNext;
+		item->completedNext = ordered;
+		ordered = item;
+	}
+
+	for (item = ordered; item != NULL; item = next) {
+		next = item->completedNext;
+		respond(table, item, item->response, item->renderTime);
 	}
+}
+
+/* Queue the request of any protocol version, upgraded to struct protocol */
+static enum protoCmd queue_request(struct protocol *req, uint64_t id, int fd)
+{
+	struct item *item;
 
 	g_logger(G_LOG_LEVEL_DEBUG, "Got command %s fd(%d) xml(%s), z(%d), x(%d), y(%d), mime(%s), options(%s)",
 		 cmdStr(req->cmd), fd, req->xmlname, req->z, req->x, req->y, req->mimetype, req->options);
@@ -142,24 +329,26 @@ enum protoCmd rx_request(struct protocol *req, int fd)
 		return cmdNotDone;
 	}
 
-	item = (struct item *)malloc(sizeof(*item));
+	item = request_queue_alloc_item(render_request_queue);
 
 	if (!item) {
-		g_logger(G_LOG_LEVEL_ERROR, "malloc failed");
 		return cmdNotDone;
 	}
 
 	item->req = *req;
+	item->id = id;
 	item->duplicates = NULL;
 	item->fd = (req->cmd == cmdDirty) ? FD_INVALID : fd;
+	item->deadline = (req->timeout > 0) ? request_queue_clock() + (int64_t)req->timeout * 1000 : 0;
 
 #ifdef METATILE
 	/* Round down request coordinates to the nearest N (should be a power of 2)
 	 * Note: request path is no longer consistent but this will be recalculated
 	 * when the metatile is being rendered.
 	 */
-	item->mx = item->req.x & ~(METATILE - 1);
-	item->my = item->req.y & ~(METATILE - 1);
+	int size = metatile_size(item->req.xmlname, item->req.z);
+	item->mx = item->req.x & ~(size - 1);
+	item->my = item->req.y & ~(size - 1);
 #else
 	item->mx = item->req.x;
 	item->my = item->req.y;
@@ -168,6 +357,52 @@ enum protoCmd rx_request(struct protocol *req, int fd)
 	return request_queue_add_request(render_request_queue, item);
 }
 
+enum protoCmd rx_request(struct protocol *req, int fd)
+{
+	// Upgrade version 1, 2 and 3 to version 4
+	if (req->ver == 1) {
+		strcpy(req->xmlname, "default");
+	}
+
+	if (req->ver < 3) {
+		strcpy(req->mimetype, "image/png");
+		strcpy(req->options, "");
+	}
+
+	if (req->ver < 4) {
+		req->timeout = 0;
+	} else if (req->ver != 4) {
+		g_logger(G_LOG_LEVEL_ERROR, "Bad protocol version %d", req->ver);
+		return cmdNotDone;
+	}
+
+	return queue_request(req, 0, fd);
+}
+
+/* Queue a request received in a frame of protocol version 5, its response is sent in a
+ * frame of its own once it has been rendered
+ */
+enum protoCmd rx_request_v5(const struct protocol_v5 *req, int fd)
+{
+	struct protocol cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.ver = PROTO_VER_FRAMED;
+	cmd.cmd = req->cmd;
+	cmd.x = req->x;
+	cmd.y = req->y;
+	cmd.z = req->z;
+	memcpy(cmd.xmlname, req->xmlname, XMLCONFIG_MAX);
+	memcpy(cmd.mimetype, req->mimetype, XMLCONFIG_MAX);
+	memcpy(cmd.options, req->options, XMLCONFIG_MAX);
+	cmd.xmlname[XMLCONFIG_MAX - 1] = 0;
+	cmd.mimetype[XMLCONFIG_MAX - 1] = 0;
+	cmd.options[XMLCONFIG_MAX - 1] = 0;
+	cmd.timeout = req->timeout;
+
+	return queue_request(&cmd, req->id, fd);
+}
+
 void request_exit(void)
 {
 	// Any write to the exit pipe will trigger a graceful exit
@@ -180,549 +415,1533 @@ void request_exit(void)
 	}
 }
 
-void process_loop(int listen_fd)
+/* Grow the connection table so that it has a slot for fd */
+static int connections_grow(struct connection_table *table, int fd)
 {
-	int num_cslots = 0;
-	int num_conns = 0;
-	int pipefds[2];
-	int exit_pipe_read;
-	struct pollfd pfd[MAX_CONNECTIONS + 2];
+	int size = table->size ? table->size : CONNECTIONS_INITIAL;
+	struct connection *conns;
 
-	bzero(pfd, sizeof(pfd));
+	while (size <= fd) {
+		size *= 2;
+	}
 
-	// A pipe is used to allow the render threads to request an exit by the main process
-	if (pipe(pipefds)) {
-		g_logger(G_LOG_LEVEL_ERROR, "Failed to create pipe");
-		return;
+	conns = (struct connection *)realloc(table->conns, size * sizeof(struct connection));
+
+	if (conns == NULL) {
+		return -1;
 	}
 
-	exit_pipe_fd = pipefds[1];
-	exit_pipe_read = pipefds[0];
+	for (int i = table->size; i < size; i++) {
+		conns[i].fd = FD_INVALID;
+		conns[i].len = 0;
+		conns[i].out = NULL;
+		conns[i].out_len = 0;
+		conns[i].out_size = 0;
+	}
 
-	pfd[PFD_LISTEN].fd = listen_fd;
-	pfd[PFD_LISTEN].events = POLLIN;
-	pfd[PFD_EXIT_PIPE].fd = exit_pipe_read;
-	pfd[PFD_EXIT_PIPE].events = POLLIN;
+	table->conns = conns;
 
-	while (1) {
-		struct sockaddr_un in_addr;
-		socklen_t in_addrlen = sizeof(in_addr);
-		int incoming, num, i;
-
-		// timeout -1 means infinite timeout,
-		// a value of 0 would return immediately
-		num = poll(pfd, num_cslots + PFD_SPECIAL_COUNT, -1);
-
-		if (num == -1) {
-			g_logger(G_LOG_LEVEL_DEBUG, "poll(): %s", strerror(errno));
-		} else if (num) {
-			if (pfd[PFD_EXIT_PIPE].revents & POLLIN) {
-				g_logger(G_LOG_LEVEL_INFO, "Received exit request, exiting process_loop");
-				break;
-			}
+#ifndef HAVE_SYS_EPOLL_H
+	struct pollfd *pfd = (struct pollfd *)realloc(table->pfd, (size + PFD_SPECIAL_COUNT) * sizeof(struct pollfd));
 
-			g_logger(G_LOG_LEVEL_DEBUG, "Data is available now on %d fds", num);
-
-			if (pfd[PFD_LISTEN].revents & POLLIN) {
-				incoming = accept(listen_fd, (struct sockaddr *) &in_addr, &in_addrlen);
-
-				if (incoming < 0) {
-					g_logger(G_LOG_LEVEL_ERROR, "accept(): %s", strerror(errno));
-				} else {
-					int add = 0;
-
-					// Search for unused slot
-					for (i = 0; i < num_cslots; i++) {
-						if (pfd[i + PFD_SPECIAL_COUNT].fd < 0) {
-							add = 1;
-							break;
-						}
-					}
-
-					// No unused slot found, add at end if space available
-					if (!add) {
-						if (num_cslots == MAX_CONNECTIONS) {
-							g_logger(G_LOG_LEVEL_WARNING, "Connection limit(%d) reached. Dropping connection", MAX_CONNECTIONS);
-							close(incoming);
-						} else {
-							i = num_cslots;
-							add = 1;
-							num_cslots++;
-						}
-					}
-
-					if (add) {
-						pfd[i + PFD_SPECIAL_COUNT].fd = incoming;
-						pfd[i + PFD_SPECIAL_COUNT].events = POLLIN;
-						num_conns ++;
-						g_logger(G_LOG_LEVEL_DEBUG, "Got incoming connection, fd %d, number %d, total conns %d, total slots %d", incoming, i, num_conns, num_cslots);
-					}
-				}
-			}
+	if (pfd == NULL) {
+		return -1;
+	}
 
-			for (i = 0; num && (i < num_cslots); i++) {
-				int fd = pfd[i + PFD_SPECIAL_COUNT].fd;
-
-				if (fd >= 0 && pfd[i + PFD_SPECIAL_COUNT].revents & POLLIN) {
-					struct protocol cmd;
-					int ret = 0;
-					memset(&cmd, 0, sizeof(cmd));
-
-					// TODO: to get highest performance we should loop here until we get EAGAIN
-					ret = recv_cmd(&cmd, fd, 0);
-
-					if (ret < 1) {
-						num_conns--;
-						g_logger(G_LOG_LEVEL_DEBUG, "Connection %d, fd %d closed, now %d left, total slots %d", i, fd, num_conns, num_cslots);
-						request_queue_clear_requests_by_fd(render_request_queue, fd);
-						close(fd);
-						pfd[i + PFD_SPECIAL_COUNT].fd = -1;
-					} else  {
-						enum protoCmd rsp = rx_request(&cmd, fd);
-
-						if (rsp == cmdNotDone) {
-							cmd.cmd = rsp;
-							g_logger(G_LOG_LEVEL_DEBUG, "Sending NotDone response(%d)", rsp);
-							ret = send_cmd(&cmd, fd);
-						}
-					}
-				}
-			}
-		} else {
-			g_logger(G_LOG_LEVEL_ERROR, "Poll timeout");
-		}
+	table->pfd = pfd;
+#endif
+
+	table->size = size;
+	return 0;
+}
+
+static void connections_close(struct connection_table *table);
+
+static int connections_init(struct connection_table *table, int listen_fd, int exit_fd, int completion_fd)
+{
+	table->conns = NULL;
+	table->size = 0;
+	table->num = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	table->pfd = NULL;
+	table->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (table->epoll_fd < 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "epoll_create1(): %s", strerror(errno));
+		return -1;
+	}
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = listen_fd;
+
+	if (epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "epoll_ctl(): %s", strerror(errno));
+		connections_close(table);
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = exit_fd;
+
+	if (epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, exit_fd, &ev) < 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "epoll_ctl(): %s", strerror(errno));
+		connections_close(table);
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = completion_fd;
+
+	if (epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, completion_fd, &ev) < 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "epoll_ctl(): %s", strerror(errno));
+		connections_close(table);
+		return -1;
+	}
+#else
+	table->pfd = NULL;
+#endif
+
+	if (connections_grow(table, 0) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to allocate connection table");
+		connections_close(table);
+		return -1;
 	}
+
+#ifndef HAVE_SYS_EPOLL_H
+	table->pfd[PFD_LISTEN].fd = listen_fd;
+	table->pfd[PFD_LISTEN].events = POLLIN;
+	table->pfd[PFD_EXIT_PIPE].fd = exit_fd;
+	table->pfd[PFD_EXIT_PIPE].events = POLLIN;
+	table->pfd[PFD_COMPLETION_PIPE].fd = completion_fd;
+	table->pfd[PFD_COMPLETION_PIPE].events = POLLIN;
+#endif
+
+	return 0;
 }
 
-/**
- * Periodically write out current stats to a stats file. This information
- * can then be used to monitor performance of renderd e.g. with a munin plugin
- */
-void *stats_writeout_thread(void * arg)
+static void connection_open(struct connection_table *table, int fd)
 {
-	stats_struct lStats;
-	int dirtQueueLength;
-	int reqQueueLength;
-	int reqPrioQueueLength;
-	int reqLowQueueLength;
-	int reqBulkQueueLength;
-	int i;
+	if (fd >= table->size && connections_grow(table, fd) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to grow connection table, dropping connection");
+		close(fd);
+		return;
+	}
 
-	int noFailedAttempts = 0;
-	char tmpName[PATH_MAX];
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
 
-	snprintf(tmpName, sizeof(tmpName), "%s.tmp", config.stats_filename);
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.fd = fd;
 
-	g_logger(G_LOG_LEVEL_DEBUG, "Starting stats writeout thread: %lu", (unsigned long) pthread_self());
+	if (epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "epoll_ctl(): %s", strerror(errno));
+		close(fd);
+		return;
+	}
+#else
+	table->conns[fd].slot = table->num + PFD_SPECIAL_COUNT;
+	table->pfd[table->conns[fd].slot].fd = fd;
+	table->pfd[table->conns[fd].slot].events = POLLIN;
+	table->pfd[table->conns[fd].slot].revents = 0;
+#endif
 
-	while (1) {
-		request_queue_copy_stats(render_request_queue, &lStats);
+	table->conns[fd].fd = fd;
+	table->conns[fd].len = 0;
+	table->conns[fd].frame_left = 0;
+	table->num++;
+	g_logger(G_LOG_LEVEL_DEBUG, "Got incoming connection, fd %d, total conns %d", fd, table->num);
+}
 
-		reqPrioQueueLength = request_queue_no_requests_queued(render_request_queue, cmdRenderPrio);
-		reqQueueLength = request_queue_no_requests_queued(render_request_queue, cmdRender);
-		reqLowQueueLength = request_queue_no_requests_queued(render_request_queue, cmdRenderLow);
-		dirtQueueLength = request_queue_no_requests_queued(render_request_queue, cmdDirty);
-		reqBulkQueueLength = request_queue_no_requests_queued(render_request_queue, cmdRenderBulk);
+static void connection_close(struct connection_table *table, int fd)
+{
+#ifndef HAVE_SYS_EPOLL_H
+	// Move the last connection into the poll slot that becomes free
+	int slot = table->conns[fd].slot;
+	int last = table->num + PFD_SPECIAL_COUNT - 1;
 
-		FILE * statfile = fopen(tmpName, "w");
+	table->pfd[slot] = table->pfd[last];
+	table->conns[table->pfd[slot].fd].slot = slot;
+#endif
 
-		if (statfile == NULL) {
-			g_logger(G_LOG_LEVEL_WARNING, "Failed to open stats file: %i", errno);
-			noFailedAttempts++;
+	table->conns[fd].fd = FD_INVALID;
+	table->conns[fd].len = 0;
+	table->conns[fd].out_len = 0;
+	table->num--;
+	g_logger(G_LOG_LEVEL_DEBUG, "Connection fd %d closed, now %d left", fd, table->num);
 
-			if (noFailedAttempts > 3) {
-				g_logger(G_LOG_LEVEL_ERROR, "Failed repeatedly to write stats, giving up");
-				break;
-			}
+	// Closing the fd also takes it out of the epoll set
+	request_queue_clear_requests_by_fd(render_request_queue, fd);
+	close(fd);
+}
 
-			continue;
-		} else {
-			fprintf(statfile, "ReqQueueLength: %i\n", reqQueueLength);
-			fprintf(statfile, "ReqPrioQueueLength: %i\n", reqPrioQueueLength);
-			fprintf(statfile, "ReqLowQueueLength: %i\n", reqLowQueueLength);
-			fprintf(statfile, "ReqBulkQueueLength: %i\n", reqBulkQueueLength);
-			fprintf(statfile, "DirtQueueLength: %i\n", dirtQueueLength);
-			fprintf(statfile, "DropedRequest: %li\n", lStats.noReqDroped);
-			fprintf(statfile, "ReqRendered: %li\n", lStats.noReqRender);
-			fprintf(statfile, "TimeRendered: %li\n", lStats.timeReqRender);
-			fprintf(statfile, "ReqPrioRendered: %li\n", lStats.noReqPrioRender);
-			fprintf(statfile, "TimePrioRendered: %li\n", lStats.timeReqPrioRender);
-			fprintf(statfile, "ReqLowRendered: %li\n", lStats.noReqLowRender);
-			fprintf(statfile, "TimeLowRendered: %li\n", lStats.timeReqLowRender);
-			fprintf(statfile, "ReqBulkRendered: %li\n", lStats.noReqBulkRender);
-			fprintf(statfile, "TimeBulkRendered: %li\n", lStats.timeReqBulkRender);
-			fprintf(statfile, "DirtyRendered: %li\n", lStats.noDirtyRender);
-			fprintf(statfile, "TimeDirtyRendered: %li\n", lStats.timeReqDirty);
+/* Wait for connections with data, returns the number of fds stored in ready */
+static int connections_wait(struct connection_table *table, int *ready, int max)
+{
+	int num;
 
-			for (i = 0; i <= MAX_ZOOM; i++) {
-				fprintf(statfile, "ZoomRendered%02i: %li\n", i, lStats.noZoomRender[i]);
-			}
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[EVENTS_MAX];
 
-			for (i = 0; i <= MAX_ZOOM; i++) {
-				fprintf(statfile, "TimeRenderedZoom%02i: %li\n", i, lStats.timeZoomRender[i]);
-			}
+	num = epoll_wait(table->epoll_fd, events, (max < EVENTS_MAX) ? max : EVENTS_MAX, -1);
 
-			fclose(statfile);
+	for (int i = 0; i < num; i++) {
+		ready[i] = events[i].data.fd;
+	}
+#else
+	int found = 0;
 
-			if (rename(tmpName, config.stats_filename)) {
-				g_logger(G_LOG_LEVEL_WARNING, "Failed to overwrite stats file: %i", errno);
-				noFailedAttempts++;
+	num = poll(table->pfd, table->num + PFD_SPECIAL_COUNT, -1);
 
-				if (noFailedAttempts > 6) {
-					g_logger(G_LOG_LEVEL_ERROR, "Failed repeatedly to overwrite stats, giving up");
-					break;
-				}
+	// Fds of connections closed while handling ready come after them in the table
+	for (int i = 0; num > 0 && found < max && i < table->num + PFD_SPECIAL_COUNT; i++) {
+		if (table->pfd[i].revents) {
+			ready[found++] = table->pfd[i].fd;
+			num--;
+		}
+	}
 
-				continue;
-			}
+	num = (num < 0) ? num : found;
+#endif
+
+	return num;
+}
+
+static void connections_close(struct connection_table *table)
+{
+	for (int fd = 0; fd < table->size; fd++) {
+		if (table->conns[fd].fd != FD_INVALID) {
+			connection_close(table, fd);
 		}
 
-		sleep(10);
+		free(table->conns[fd].out);
 	}
 
-	return NULL;
+#ifdef HAVE_SYS_EPOLL_H
+	close(table->epoll_fd);
+#endif
+	free(table->pfd);
+	free(table->conns);
 }
 
-int client_socket_init(renderd_config * sConfig)
+/* Send what could not be sent to the client before, as far as it takes it now */
+static void connection_flush(struct connection_table *table, int fd)
 {
-	int fd, s;
-	struct sockaddr_un * addrU;
-	struct addrinfo hints;
-	struct addrinfo *result, *rp;
-	char portnum[16];
-	char ipstring[INET6_ADDRSTRLEN];
+	struct connection *conn = &(table->conns[fd]);
+	size_t start = 0;
 
-	if (sConfig->ipport > 0) {
-		g_logger(G_LOG_LEVEL_INFO, "Initialising TCP/IP client socket to %s:%i", sConfig->iphostname, sConfig->ipport);
+	while (start < conn->out_len) {
+		ssize_t ret = send(fd, conn->out + start, conn->out_len - start, MSG_DONTWAIT);
 
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-		hints.ai_socktype = SOCK_STREAM; /* TCP socket */
-		hints.ai_flags = 0;
-		hints.ai_protocol = 0;          /* Any protocol */
-		hints.ai_canonname = NULL;
-		hints.ai_addr = NULL;
-		hints.ai_next = NULL;
-		snprintf(portnum, 16, "%i", sConfig->ipport);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
 
-		s = getaddrinfo(sConfig->iphostname, portnum, &hints, &result);
+		if (ret < 0) {
+			// Closed connections are noticed when reading from them
+			break;
+		}
 
-		if (s != 0) {
-			g_logger(G_LOG_LEVEL_INFO, "failed to resolve hostname of rendering slave");
-			return FD_INVALID;
+		start += ret;
+	}
+
+	conn->out_len -= start;
+	memmove(conn->out, conn->out + start, conn->out_len);
+
+#ifndef HAVE_SYS_EPOLL_H
+
+	if (conn->out_len == 0) {
+		table->pfd[conn->slot].events = POLLIN;
+	}
+
+#endif
+}
+
+/* Send the num buffers of iov to the client without blocking, what it is not ready for
+ * is kept until it is
+ */
+static void connection_write(struct connection_table *table, int fd, const struct iovec *iov, int num)
+{
+	struct connection *conn = &(table->conns[fd]);
+	size_t size = 0;
+
+	for (int i = 0; i < num; i++) {
+		size += iov[i].iov_len;
+	}
+
+	if (conn->out_len + size > CONNECTION_OUTPUT_MAX) {
+		g_logger(G_LOG_LEVEL_WARNING, "Client on fd %d does not receive its responses, closing connection", fd);
+		connection_close(table, fd);
+		return;
+	}
+
+	if (conn->out_len + size > conn->out_size) {
+		size_t out_size = conn->out_size ? conn->out_size : CONNECTION_BUFFER;
+		char *out;
+
+		while (out_size < conn->out_len + size) {
+			out_size *= 2;
 		}
 
-		/* getaddrinfo() returns a list of address structures.
-		   Try each address until we successfully connect. */
-		for (rp = result; rp != NULL; rp = rp->ai_next) {
-			switch (rp->ai_family) {
+		out = (char *)realloc(conn->out, out_size);
+
+		if (out == NULL) {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to buffer response on fd %d", fd);
+			return;
+		}
+
+		conn->out = out;
+		conn->out_size = out_size;
+	}
+
+	for (int i = 0; i < num; i++) {
+		memcpy(conn->out + conn->out_len, iov[i].iov_base, iov[i].iov_len);
+		conn->out_len += iov[i].iov_len;
+	}
+
+#ifndef HAVE_SYS_EPOLL_H
+	table->pfd[conn->slot].events = POLLIN | POLLOUT;
+#endif
+
+	connection_flush(table, fd);
+}
+
+static void connection_send(struct connection_table *table, int fd, struct protocol *cmd)
+{
+	struct iovec iov;
+
+	iov.iov_base = cmd;
+	iov.iov_len = cmd_size(cmd->ver);
+	connection_write(table, fd, &iov, 1);
+}
+
+/* Send num responses in one frame of protocol version 5 */
+static void connection_send_frame(struct connection_table *table, int fd, const struct protocol_v5 *entries, int num)
+{
+	struct protocol_frame frame;
+	struct iovec iov[2];
+
+	frame.ver = PROTO_VER_FRAMED;
+	frame.length = num * sizeof(struct protocol_v5);
+	iov[0].iov_base = &frame;
+	iov[0].iov_len = sizeof(frame);
+	iov[1].iov_base = (void *)entries;
+	iov[1].iov_len = frame.length;
+	connection_write(table, fd, iov, 2);
+}
+
+/* Accept all pending connections, the listen socket is non-blocking */
+static void connections_accept(struct connection_table *table, int listen_fd)
+{
+	while (1) {
+#ifdef HAVE_ACCEPT4
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+#else
+		int fd = accept(listen_fd, NULL, NULL);
+#endif
+
+		if (fd >= 0) {
+			connection_open(table, fd);
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return;
+		} else if (errno != EINTR && errno != ECONNABORTED) {
+			g_logger(G_LOG_LEVEL_ERROR, "accept(): %s", strerror(errno));
+			return;
+		}
+	}
+}
+
+/* Responses to requests of protocol version 5 that are answered right away, collected
+ * while receiving a frame and sent together
+ */
+static struct protocol_v5 frame_replies[PROTO_FRAME_MAX];
+static int frame_replies_num;
+
+static void connection_send_replies(struct connection_table *table, int fd)
+{
+	if (frame_replies_num > 0 && table->conns[fd].fd != FD_INVALID) {
+		connection_send_frame(table, fd, frame_replies, frame_replies_num);
+	}
+
+	frame_replies_num = 0;
+}
+
+/* Take the requests of a frame of protocol version 5 off the start of the len bytes
+ * received in buf, as far as they are complete. Returns the number of bytes used.
+ */
+static size_t connection_read_frame(struct connection_table *table, int fd, const char *buf, size_t len)
+{
+	struct connection *conn = &(table->conns[fd]);
+	size_t start = 0;
+
+	while (conn->fd != FD_INVALID && conn->frame_left > 0 && len - start >= sizeof(struct protocol_v5)) {
+		struct protocol_v5 req;
+		enum protoCmd rsp;
+
+		memcpy(&req, buf + start, sizeof(req));
+		start += sizeof(req);
+		conn->frame_left -= sizeof(req);
+		rsp = rx_request_v5(&req, fd);
+
+		if (rsp == cmdNotDone) {
+			req.cmd = rsp;
+			frame_replies[frame_replies_num++] = req;
+		}
+
+		if (conn->frame_left == 0 || frame_replies_num == PROTO_FRAME_MAX) {
+			connection_send_replies(table, fd);
+		}
+	}
+
+	return start;
+}
+
+/* Handle all commands received on the connection, until no more data is available */
+static void connection_read(struct connection_table *table, int fd)
+{
+	struct connection *conn = &(table->conns[fd]);
+
+	while (conn->fd != FD_INVALID) {
+		struct protocol cmd;
+		struct protocol_frame frame;
+		size_t start = 0;
+		int used = 1;
+		ssize_t ret = recv(fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, MSG_DONTWAIT);
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret <= 0) {
+			connection_close(table, fd);
+			return;
+		}
+
+		conn->len += ret;
+
+		while (conn->fd != FD_INVALID && used > 0) {
+			enum protoCmd rsp;
+			int ver;
+
+			if (conn->frame_left > 0) {
+				used = connection_read_frame(table, fd, conn->buf + start, conn->len - start);
+				start += used;
+				continue;
+			}
+
+			if (conn->len - start < sizeof(ver)) {
+				break;
+			}
+
+			memcpy(&ver, conn->buf + start, sizeof(ver));
+
+			if (ver == PROTO_VER_FRAMED) {
+				if ((used = parse_frame(&frame, conn->buf + start, conn->len - start)) > 0) {
+					start += used;
+					conn->frame_left = frame.length;
+				}
+
+				continue;
+			}
+
+			if ((used = parse_cmd(&cmd, conn->buf + start, conn->len - start)) <= 0) {
+				continue;
+			}
+
+			start += used;
+			rsp = rx_request(&cmd, fd);
+
+			if (rsp == cmdNotDone) {
+				cmd.cmd = rsp;
+				g_logger(G_LOG_LEVEL_DEBUG, "Sending NotDone response(%d)", rsp);
+				connection_send(table, fd, &cmd);
+			}
+		}
+
+		// Responses to the part of a frame received so far are not held back
+		connection_send_replies(table, fd);
+
+		if (conn->fd == FD_INVALID) {
+			return;
+		}
+
+		if (used < 0) {
+			connection_close(table, fd);
+			return;
+		}
+
+		// Keep the start of an incomplete command for the next read
+		conn->len -= start;
+		memmove(conn->buf, conn->buf + start, conn->len);
+	}
+}
+
+void process_loop(int listen_fd)
+{
+	struct connection_table table;
+	int ready[EVENTS_MAX];
+	int exit_pipe[2], completion_pipe[2];
+	int exit_pipe_read, completion_pipe_read;
+	int running = 1;
+
+	// A pipe is used to allow the render threads to request an exit by the main process
+	if (pipe(exit_pipe)) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to create pipe");
+		return;
+	}
+
+	exit_pipe_read = exit_pipe[0];
+
+	// Wakes up the loop when render threads hand over responses, see send_response
+	if (pipe(completion_pipe)) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to create pipe");
+		close(exit_pipe[0]);
+		close(exit_pipe[1]);
+		return;
+	}
+
+	completion_pipe_read = completion_pipe[0];
+	fcntl(completion_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(completion_pipe[1], F_SETFL, O_NONBLOCK);
+
+	// All pending connections are accepted at once, until there are no more
+	if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) < 0 || connections_init(&table, listen_fd, exit_pipe_read, completion_pipe_read) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to set up the connections: %s", strerror(errno));
+		close(exit_pipe[0]);
+		close(exit_pipe[1]);
+		close(completion_pipe[0]);
+		close(completion_pipe[1]);
+		return;
+	}
+
+	exit_pipe_fd = exit_pipe[1];
+	__atomic_store_n(&completion_pipe_fd, completion_pipe[1], __ATOMIC_RELEASE);
+
+	while (running) {
+		int num = connections_wait(&table, ready, EVENTS_MAX);
+
+		if (num < 0) {
+			if (errno != EINTR) {
+				g_logger(G_LOG_LEVEL_DEBUG, "Waiting for connections: %s", strerror(errno));
+			}
+
+			continue;
+		}
+
+		g_logger(G_LOG_LEVEL_DEBUG, "Data is available now on %d fds", num);
+
+		for (int i = 0; i < num; i++) {
+			if (ready[i] == exit_pipe_read) {
+				g_logger(G_LOG_LEVEL_INFO, "Received exit request, exiting process_loop");
+				running = 0;
+				break;
+			} else if (ready[i] == completion_pipe_read) {
+				respond_completed(&table, completion_pipe_read);
+			} else if (ready[i] == listen_fd) {
+				connections_accept(&table, listen_fd);
+			} else if (ready[i] < table.size && table.conns[ready[i]].fd != FD_INVALID) {
+				if (table.conns[ready[i]].out_len > 0) {
+					connection_flush(&table, ready[i]);
+				}
+
+				connection_read(&table, ready[i]);
+			}
+		}
+	}
+
+	// Items rendered from now on are responded to by the render threads, the ones that
+	// saw the pipe before are waited for
+	__atomic_store_n(&completion_pipe_fd, -1, __ATOMIC_SEQ_CST);
+	respond_completed(&table, completion_pipe_read);
+
+	while (__atomic_load_n(&completion_pushers, __ATOMIC_SEQ_CST) > 0 || __atomic_load_n(&completed, __ATOMIC_ACQUIRE) != NULL) {
+		sched_yield();
+		respond_completed(&table, completion_pipe_read);
+	}
+
+	close(completion_pipe[0]);
+	close(completion_pipe[1]);
+	connections_close(&table);
+}
+
+/**
+ * Periodically write out current stats to a stats file. This information
+ * can then be used to monitor performance of renderd e.g. with a munin plugin
+ */
+void *stats_writeout_thread(void * arg)
+{
+	stats_struct lStats;
+	int dirtQueueLength;
+	int reqQueueLength;
+	int reqPrioQueueLength;
+	int reqLowQueueLength;
+	int reqBulkQueueLength;
+	int i;
+	const char *styleName;
+
+	int noFailedAttempts = 0;
+	char tmpName[PATH_MAX];
+
+	snprintf(tmpName, sizeof(tmpName), "%s.tmp", config.stats_filename);
+
+	g_logger(G_LOG_LEVEL_DEBUG, "Starting stats writeout thread: %lu", (unsigned long) pthread_self());
+
+	while (1) {
+		request_queue_copy_stats(render_request_queue, &lStats);
+
+		reqPrioQueueLength = request_queue_no_requests_queued(render_request_queue, cmdRenderPrio);
+		reqQueueLength = request_queue_no_requests_queued(render_request_queue, cmdRender);
+		reqLowQueueLength = request_queue_no_requests_queued(render_request_queue, cmdRenderLow);
+		dirtQueueLength = request_queue_no_requests_queued(render_request_queue, cmdDirty);
+		reqBulkQueueLength = request_queue_no_requests_queued(render_request_queue, cmdRenderBulk);
+
+		FILE * statfile = fopen(tmpName, "w");
+
+		if (statfile == NULL) {
+			g_logger(G_LOG_LEVEL_WARNING, "Failed to open stats file: %i", errno);
+			noFailedAttempts++;
+
+			if (noFailedAttempts > 3) {
+				g_logger(G_LOG_LEVEL_ERROR, "Failed repeatedly to write stats, giving up");
+				break;
+			}
+
+			continue;
+		} else {
+			fprintf(statfile, "ReqQueueLength: %i\n", reqQueueLength);
+			fprintf(statfile, "ReqPrioQueueLength: %i\n", reqPrioQueueLength);
+			fprintf(statfile, "ReqLowQueueLength: %i\n", reqLowQueueLength);
+			fprintf(statfile, "ReqBulkQueueLength: %i\n", reqBulkQueueLength);
+			fprintf(statfile, "DirtQueueLength: %i\n", dirtQueueLength);
+			fprintf(statfile, "QueueOrder: %s\n", config.queue_order);
+			fprintf(statfile, "DropedRequest: %li\n", lStats.noReqDroped);
+			fprintf(statfile, "DemotedRequest: %li\n", lStats.noReqDemoted);
+			fprintf(statfile, "RejectedRequest: %li\n", lStats.noReqRejected);
+			fprintf(statfile, "DirtSpoolLength: %li\n", lStats.noReqSpooled);
+			fprintf(statfile, "SpilledRequest: %li\n", lStats.noReqSpilled);
+			fprintf(statfile, "RefilledRequest: %li\n", lStats.noReqRefilled);
+			fprintf(statfile, "ItemPoolSize: %i\n", ITEM_POOL_SIZE);
+			fprintf(statfile, "ItemsInUse: %li\n", lStats.noItemInUse);
+			fprintf(statfile, "ItemsAllocated: %li\n", lStats.noItemAlloc);
+			fprintf(statfile, "ItemsMalloced: %li\n", lStats.noItemMalloc);
+			fprintf(statfile, "IndexResized: %li\n", lStats.noIdxResize);
+			fprintf(statfile, "ReqRendered: %li\n", lStats.noReqRender);
+			fprintf(statfile, "TimeRendered: %li\n", lStats.timeReqRender);
+			fprintf(statfile, "ReqPrioRendered: %li\n", lStats.noReqPrioRender);
+			fprintf(statfile, "TimePrioRendered: %li\n", lStats.timeReqPrioRender);
+			fprintf(statfile, "ReqLowRendered: %li\n", lStats.noReqLowRender);
+			fprintf(statfile, "TimeLowRendered: %li\n", lStats.timeReqLowRender);
+			fprintf(statfile, "ReqBulkRendered: %li\n", lStats.noReqBulkRender);
+			fprintf(statfile, "TimeBulkRendered: %li\n", lStats.timeReqBulkRender);
+			fprintf(statfile, "DirtyRendered: %li\n", lStats.noDirtyRender);
+			fprintf(statfile, "TimeDirtyRendered: %li\n", lStats.timeReqDirty);
+			fprintf(statfile, "TimeRasterised: %li\n", lStats.timeRasterise);
+			fprintf(statfile, "TimeEncoded: %li\n", lStats.timeEncode);
+
+			for (i = 0; i <= MAX_ZOOM; i++) {
+				fprintf(statfile, "ZoomRendered%02i: %li\n", i, lStats.noZoomRender[i]);
+			}
+
+			for (i = 0; i <= MAX_ZOOM; i++) {
+				fprintf(statfile, "TimeRenderedZoom%02i: %li\n", i, lStats.timeZoomRender[i]);
+			}
+
+			for (i = 0; i < lStats.noThreads; i++) {
+				fprintf(statfile, "TimeOutsideRenderThread%02i: %li\n", i, lStats.timeThreadOutside[i] / 1000);
+			}
+
+			for (i = 0; i < num_slave_dispatchers; i++) {
+				struct slave_dispatcher *slave = &slave_dispatchers[i];
+
+				fprintf(statfile, "InFlightSlave_%s: %i\n", slave->config->name, __atomic_load_n(&(slave->num), __ATOMIC_RELAXED));
+				fprintf(statfile, "DispatchedSlave_%s: %li\n", slave->config->name, __atomic_load_n(&(slave->noDispatched), __ATOMIC_RELAXED));
+				fprintf(statfile, "RenderedSlave_%s: %li\n", slave->config->name, __atomic_load_n(&(slave->noCompleted), __ATOMIC_RELAXED));
+				fprintf(statfile, "FailedSlave_%s: %li\n", slave->config->name, __atomic_load_n(&(slave->noFailed), __ATOMIC_RELAXED));
+				fprintf(statfile, "RoutedSlave_%s: %li\n", slave->config->name, __atomic_load_n(&(slave->noRouted), __ATOMIC_RELAXED));
+			}
+
+			for (i = 1; (styleName = request_queue_style_name(render_request_queue, i)) != NULL; i++) {
+				fprintf(statfile, "QueueLengthStyle_%s: %li\n", styleName, lStats.noStyleQueued[i]);
+				fprintf(statfile, "RenderedStyle_%s: %li\n", styleName, lStats.noStyleRender[i]);
+				fprintf(statfile, "TimeRenderedStyle_%s: %li\n", styleName, lStats.timeStyleRender[i]);
+				fprintf(statfile, "TimeWaitedStyle_%s: %li\n", styleName, lStats.timeStyleWait[i]);
+				fprintf(statfile, "LoadedStyle_%s: %li\n", styleName, lStats.noStyleLoad[i]);
+				fprintf(statfile, "TimeLoadedStyle_%s: %li\n", styleName, lStats.timeStyleLoad[i]);
+				fprintf(statfile, "ParameterizedHitStyle_%s: %li\n", styleName, lStats.noStyleParameterizedHit[i]);
+				fprintf(statfile, "ParameterizedMissStyle_%s: %li\n", styleName, lStats.noStyleParameterizedMiss[i]);
+			}
+
+			fclose(statfile);
+
+			if (rename(tmpName, config.stats_filename)) {
+				g_logger(G_LOG_LEVEL_WARNING, "Failed to overwrite stats file: %i", errno);
+				noFailedAttempts++;
+
+				if (noFailedAttempts > 6) {
+					g_logger(G_LOG_LEVEL_ERROR, "Failed repeatedly to overwrite stats, giving up");
+					break;
+				}
+
+				continue;
+			}
+		}
+
+		sleep(10);
+	}
+
+	return NULL;
+}
+
+int client_socket_init(renderd_config * sConfig)
+{
+	int fd, s;
+	struct sockaddr_un * addrU;
+	struct addrinfo hints;
+	struct addrinfo *result, *rp;
+	char portnum[16];
+	char ipstring[INET6_ADDRSTRLEN];
+
+	if (sConfig->ipport > 0) {
+		g_logger(G_LOG_LEVEL_INFO, "Initialising TCP/IP client socket to %s:%i", sConfig->iphostname, sConfig->ipport);
+
+		memset(&hints, 0, sizeof(struct addrinfo));
+		hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
+		hints.ai_socktype = SOCK_STREAM; /* TCP socket */
+		hints.ai_flags = 0;
+		hints.ai_protocol = 0;          /* Any protocol */
+		hints.ai_canonname = NULL;
+		hints.ai_addr = NULL;
+		hints.ai_next = NULL;
+		snprintf(portnum, 16, "%i", sConfig->ipport);
+
+		s = getaddrinfo(sConfig->iphostname, portnum, &hints, &result);
+
+		if (s != 0) {
+			g_logger(G_LOG_LEVEL_INFO, "failed to resolve hostname of rendering slave");
+			return FD_INVALID;
+		}
+
+		/* getaddrinfo() returns a list of address structures.
+		   Try each address until we successfully connect. */
+		for (rp = result; rp != NULL; rp = rp->ai_next) {
+			switch (rp->ai_family) {
 				case AF_INET:
 					inet_ntop(AF_INET, &(((struct sockaddr_in *)rp->ai_addr)->sin_addr), ipstring, rp->ai_addrlen);
 					break;
 
-				case AF_INET6:
-					inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)rp->ai_addr)->sin6_addr), ipstring, rp->ai_addrlen);
-					break;
+				case AF_INET6:
+					inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)rp->ai_addr)->sin6_addr), ipstring, rp->ai_addrlen);
+					break;
+
+				default:
+					snprintf(ipstring, sizeof(ipstring), "address family %d", rp->ai_family);
+					break;
+			}
+
+			g_logger(G_LOG_LEVEL_DEBUG, "Connecting TCP socket to rendering daemon at %s", ipstring);
+			fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+
+			if (fd < 0) {
+				continue;
+			}
+
+			if (connect(fd, rp->ai_addr, rp->ai_addrlen) != 0) {
+				g_logger(G_LOG_LEVEL_WARNING, "failed to connect to rendering daemon (%s), trying next ip", ipstring);
+				close(fd);
+				fd = -1;
+				continue;
+			} else {
+				break;
+			}
+		}
+
+		freeaddrinfo(result);
+
+		if (fd < 0) {
+			g_logger(G_LOG_LEVEL_WARNING, "failed to connect to %s:%i", sConfig->iphostname, sConfig->ipport);
+			return FD_INVALID;
+		}
+
+		g_logger(G_LOG_LEVEL_INFO, "socket %s:%i initialised to fd %i", sConfig->iphostname, sConfig->ipport, fd);
+	} else {
+		g_logger(G_LOG_LEVEL_INFO, "Initialising unix client socket on %s",
+			 sConfig->socketname);
+		addrU = (struct sockaddr_un *)malloc(sizeof(struct sockaddr_un));
+		fd = socket(PF_UNIX, SOCK_STREAM, 0);
+
+		if (fd < 0) {
+			g_logger(G_LOG_LEVEL_WARNING, "Could not obtain socket: %i", fd);
+			free(addrU);
+			return FD_INVALID;
+		}
+
+		bzero(addrU, sizeof(struct sockaddr_un));
+		addrU->sun_family = AF_UNIX;
+		strncpy(addrU->sun_path, sConfig->socketname, sizeof(addrU->sun_path) - 1);
+
+		if (connect(fd, (struct sockaddr *) addrU, sizeof(struct sockaddr_un)) < 0) {
+			g_logger(G_LOG_LEVEL_WARNING, "socket connect failed for: %s",
+				 sConfig->socketname);
+			close(fd);
+			free(addrU);
+			return FD_INVALID;
+		}
+
+		free(addrU);
+		g_logger(G_LOG_LEVEL_INFO, "socket %s initialised to fd %i", sConfig->socketname,
+			 fd);
+	}
+
+	return fd;
+}
+
+int server_socket_init(renderd_config *sConfig)
+{
+	struct sockaddr_un addrU;
+	struct sockaddr_in6 addrI;
+	mode_t old;
+	int fd;
+
+	if (sConfig->ipport > 0) {
+		const int enable = 1;
+
+		g_logger(G_LOG_LEVEL_INFO, "Initialising TCP/IP server socket on %s:%i",
+			 sConfig->iphostname, sConfig->ipport);
+		fd = socket(PF_INET6, SOCK_STREAM, 0);
+
+		if (fd < 0) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "failed to create IP socket");
+			exit(2);
+		}
+
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "setsockopt SO_REUSEADDR failed for: %s:%i",
+				 sConfig->iphostname, sConfig->ipport);
+			exit(3);
+		}
+
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "setsockopt SO_REUSEPORT failed for: %s:%i",
+				 sConfig->iphostname, sConfig->ipport);
+			exit(3);
+		}
+
+		bzero(&addrI, sizeof(addrI));
+		addrI.sin6_family = AF_INET6;
+		addrI.sin6_addr = in6addr_any;
+		addrI.sin6_port = htons(sConfig->ipport);
+
+		if (bind(fd, (struct sockaddr *) &addrI, sizeof(addrI)) < 0) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "socket bind failed for: %s:%i",
+				 sConfig->iphostname, sConfig->ipport);
+			close(fd);
+			exit(3);
+		}
+	} else {
+		g_logger(G_LOG_LEVEL_INFO, "Initialising unix server socket on %s",
+			 sConfig->socketname);
+
+		fd = socket(PF_UNIX, SOCK_STREAM, 0);
+
+		if (fd < 0) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "failed to create unix socket");
+			exit(2);
+		}
+
+		bzero(&addrU, sizeof(addrU));
+		addrU.sun_family = AF_UNIX;
+		strncpy(addrU.sun_path, sConfig->socketname, sizeof(addrU.sun_path) - 1);
+
+		unlink(addrU.sun_path);
+
+		old = umask(0); // Need daemon socket to be writeable by apache
+
+		if (bind(fd, (struct sockaddr *) &addrU, sizeof(addrU)) < 0) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "socket bind failed for: %s", sConfig->socketname);
+			close(fd);
+			exit(3);
+		}
+
+		umask(old);
+	}
+
+	if (listen(fd, QUEUE_MAX) < 0) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "socket listen failed for %d", QUEUE_MAX);
+		close(fd);
+		exit(4);
+	}
+
+	g_logger(G_LOG_LEVEL_DEBUG, "Created server socket %i", fd);
+
+	return fd;
+
+}
+
+static uint64_t slave_mix(uint64_t h)
+{
+	// Finaliser of splitmix64, spreads neighbouring regions over the ring
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+static uint64_t slave_region_hash(const struct item *item)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int shift = (item->req.z < SLAVE_REGION_ZOOM) ? item->req.z : SLAVE_REGION_ZOOM;
+
+	// FNV-1a over the style, then the region
+	for (const char *c = item->req.xmlname; *c; c++) {
+		h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+	}
+
+	h = slave_mix(h ^ (uint64_t)(item->req.z - shift));
+	h = slave_mix(h ^ (uint64_t)(uint32_t)(item->mx >> shift));
+	return slave_mix(h ^ ((uint64_t)(uint32_t)(item->my >> shift) << 32));
+}
+
+static int slave_ring_cmp(const void *a, const void *b)
+{
+	uint64_t ha = ((const struct slave_ring_point *)a)->hash;
+	uint64_t hb = ((const struct slave_ring_point *)b)->hash;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/* Route requests of the num slaves by the region of their metatile, so that every slave
+ * renders the same regions and finds their data in its caches
+ */
+int slave_routing_init(struct slave_dispatcher *slaves, int num)
+{
+	int size = 0;
+
+	free(slave_ring);
+	slave_ring = NULL;
+
+	// Without slaves, requests go to whichever slave fetches them again
+	if (num == 0) {
+		return 0;
+	}
+
+	for (int i = 0; i < num; i++) {
+		size += slaves[i].config->num_threads * SLAVE_RING_POINTS;
+	}
+
+	slave_ring = (struct slave_ring_point *)malloc(sizeof(struct slave_ring_point) * size);
+
+	if (slave_ring == NULL) {
+		return -1;
+	}
+
+	slave_ring_size = 0;
+
+	for (int i = 0; i < num; i++) {
+		// Points only depend on the name of the slave, so they stay put when others are added
+		uint64_t h = 0xcbf29ce484222325ULL;
+
+		for (const char *c = slaves[i].config->name; *c; c++) {
+			h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+		}
+
+		for (int j = 0; j < slaves[i].config->num_threads * SLAVE_RING_POINTS; j++) {
+			slave_ring[slave_ring_size].hash = slave_mix(h + j);
+			slave_ring[slave_ring_size++].slave = &slaves[i];
+		}
+	}
+
+	qsort(slave_ring, slave_ring_size, sizeof(struct slave_ring_point), slave_ring_cmp);
+	slave_ring_slaves = slaves;
+	slave_ring_num = num;
+
+	return 0;
+}
+
+/* Hand item over to the slave, unless it is not connected or has its share of requests
+ * already. Returns 1 if it took the item.
+ */
+static int slave_route_to(struct slave_dispatcher *slave, struct item *item, int bound)
+{
+	int taken = 0, idle = 0;
+
+	pthread_mutex_lock(&(slave->lock));
+
+	if (__atomic_load_n(&(slave->connected), __ATOMIC_RELAXED) && __atomic_load_n(&(slave->num), __ATOMIC_RELAXED) + slave->numRouted < bound && slave->numRouted < slave->size) {
+		slave->routed[(slave->routedHead + slave->numRouted) % slave->size] = item;
+		__atomic_add_fetch(&(slave->numRouted), 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(slave->noRouted), 1, __ATOMIC_RELAXED);
+		idle = slave->idle;
+		slave->idle = 0;
+		taken = 1;
+	}
+
+	pthread_mutex_unlock(&(slave->lock));
+
+	if (idle) {
+		request_queue_wakeup(render_request_queue);
+	}
+
+	return taken;
+}
+
+/* Pass item fetched by the dispatcher of self, which is about to send pending requests,
+ * on to the slave its region is routed to. Walking the ring from the hash of the region,
+ * slaves that are not connected or have more than SLAVE_LOAD_BOUND percent of their
+ * share of the requests in flight are passed over. Returns the dispatcher that took
+ * item, self if it is to send item to its slave.
+ */
+struct slave_dispatcher *slave_route(struct slave_dispatcher *self, struct item *item, int pending)
+{
+	uint64_t hash = slave_region_hash(item);
+	int lo = 0, hi = slave_ring_size, load = 1 + pending, threads = 0;
+	int visited[MAX_SLAVES] = {0};
+
+	for (int i = 0; i < slave_ring_num; i++) {
+		struct slave_dispatcher *slave = &slave_ring_slaves[i];
+
+		if (__atomic_load_n(&(slave->connected), __ATOMIC_RELAXED)) {
+			load += __atomic_load_n(&(slave->num), __ATOMIC_RELAXED) + __atomic_load_n(&(slave->numRouted), __ATOMIC_RELAXED);
+			threads += slave->config->num_threads;
+		}
+	}
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (slave_ring[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (int i = 0; i < slave_ring_size && threads > 0; i++) {
+		struct slave_dispatcher *slave = slave_ring[(lo + i) % slave_ring_size].slave;
+		int index = slave - slave_ring_slaves;
+		int bound = (load * slave->config->num_threads * SLAVE_LOAD_BOUND + threads * 100 - 1) / (threads * 100);
+
+		if (visited[index]) {
+			continue;
+		}
+
+		visited[index] = 1;
+
+		// Requests are not passed over a slave with render threads that have nothing to do
+		if (bound < slave->config->num_threads) {
+			bound = slave->config->num_threads;
+		}
+
+		if (bound > slave->window) {
+			bound = slave->window;
+		}
+
+		if (slave == self) {
+			if (self->num + pending + __atomic_load_n(&(self->numRouted), __ATOMIC_RELAXED) < bound) {
+				return self;
+			}
+		} else if (slave_route_to(slave, item, bound)) {
+			return slave;
+		}
+	}
+
+	return self;
+}
+
+/* Take a request another dispatcher routed to slave. If there is none and block is set,
+ * the dispatcher is going to wait for requests and wakeups is set for that.
+ */
+static struct item *slave_take_routed(struct slave_dispatcher *slave, int block, int *wakeups)
+{
+	struct item *item = NULL;
+
+	pthread_mutex_lock(&(slave->lock));
+
+	if (slave->numRouted > 0) {
+		item = slave->routed[slave->routedHead];
+		slave->routedHead = (slave->routedHead + 1) % slave->size;
+		__atomic_sub_fetch(&(slave->numRouted), 1, __ATOMIC_RELAXED);
+	} else if (block) {
+		slave->idle = 1;
+		*wakeups = request_queue_wakeups(render_request_queue);
+	}
+
+	pthread_mutex_unlock(&(slave->lock));
+
+	return item;
+}
+
+/* Take the response frame received from the slave and send the responses of its requests
+ * on to the clients. Returns -1 if the slave sent something invalid.
+ */
+static int slave_receive(struct slave_dispatcher *slave)
+{
+	struct protocol_v5 rsps[PROTO_FRAME_MAX];
+	int64_t now = request_queue_clock();
+	int num = recv_frame(rsps, PROTO_FRAME_MAX, slave->fd);
+
+	if (num < 0) {
+		return -1;
+	}
+
+	for (int i = 0; i < num; i++) {
+		uint64_t id = rsps[i].id;
+
+		if (id >= (uint64_t)slave->size || slave->inflight[id] == NULL) {
+			g_logger(G_LOG_LEVEL_ERROR, "Renderd slave %s responded to unknown request %lu", slave->config->name, (unsigned long)id);
+			return -1;
+		}
+
+		if (rsps[i].cmd != cmdDone) {
+			g_logger(G_LOG_LEVEL_ERROR, "Request from Renderd slave %s did not complete correctly", slave->config->name);
+			// Instead of sleeping, give a slave that is overloaded or failing less to do
+			slave->rate /= 2;
+		}
+
+		send_response(slave->inflight[id], rsps[i].cmd, -1);
+		slave->inflight[id] = NULL;
+		__atomic_sub_fetch(&(slave->num), 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(slave->noCompleted), 1, __ATOMIC_RELAXED);
+		slave->rateCount++;
+	}
+
+	slave->progress = now;
+
+	// The throughput is only measured while the slave had something to do all the time
+	if (slave->num == 0) {
+		slave->rateStart = 0;
+	} else if (slave->rateStart == 0) {
+		slave->rateStart = now;
+		slave->rateCount = 0;
+	} else if (now - slave->rateStart >= SLAVE_RATE_INTERVAL) {
+		double rate = slave->rateCount * 1000.0 / (now - slave->rateStart);
+
+		slave->rate = (slave->rate > 0) ? (slave->rate + rate) / 2 : rate;
+		slave->rateStart = now;
+		slave->rateCount = 0;
+	}
+
+	// One request per render thread of the slave, and a backlog to cover the round trip
+	slave->window = slave->config->num_threads + (int)(slave->rate * SLAVE_BACKLOG / 1000);
+
+	if (slave->window > slave->size) {
+		slave->window = slave->size;
+	}
+
+	return num;
+}
+
+/* Take the responses the slave has sent already, returns their number */
+static int slave_receive_ready(struct slave_dispatcher *slave)
+{
+	struct pollfd pfd;
+	int ret, num = 0;
+
+	pfd.fd = slave->fd;
+	pfd.events = POLLIN;
+
+	while (slave->num > 0 && poll(&pfd, 1, 0) > 0 && (ret = slave_receive(slave)) > 0) {
+		num += ret;
+	}
+
+	return num;
+}
+
+/* Answer the requests in flight on a connection to the slave that failed and close it */
+static void slave_fail(struct slave_dispatcher *slave)
+{
+	for (int i = 0; i < slave->size; i++) {
+		if (slave->inflight[i]) {
+			send_response(slave->inflight[i], cmdNotDone, -1);
+			slave->inflight[i] = NULL;
+			__atomic_add_fetch(&(slave->noFailed), 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_store_n(&(slave->num), 0, __ATOMIC_RELAXED);
+	slave->rateStart = 0;
+
+	// Nothing is routed to the slave any more, what was is not done either
+	pthread_mutex_lock(&(slave->lock));
+	__atomic_store_n(&(slave->connected), 0, __ATOMIC_RELAXED);
+
+	for (; slave->numRouted > 0; __atomic_sub_fetch(&(slave->numRouted), 1, __ATOMIC_RELAXED)) {
+		send_response(slave->routed[slave->routedHead], cmdNotDone, -1);
+		slave->routedHead = (slave->routedHead + 1) % slave->size;
+		__atomic_add_fetch(&(slave->noFailed), 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&(slave->lock));
 
-				default:
-					snprintf(ipstring, sizeof(ipstring), "address family %d", rp->ai_family);
-					break;
-			}
+	if (slave->fd != FD_INVALID) {
+		close(slave->fd);
+		slave->fd = FD_INVALID;
+	}
+}
 
-			g_logger(G_LOG_LEVEL_DEBUG, "Connecting TCP socket to rendering daemon at %s", ipstring);
-			fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+/* Fill entry with the request to render item on the slave, with id */
+static void slave_request(struct protocol_v5 *entry, struct item *item, int id)
+{
+	to_protocol_v5(entry, &item->req, id);
+	entry->cmd = cmdRender;
+	entry->timeout = 0;
+
+	// Pass on how much longer the client is going to wait
+	if (item->deadline > 0) {
+		int64_t remaining = item->deadline - request_queue_clock();
+		entry->timeout = (remaining > 1000) ? (int)(remaining / 1000) : 1;
+	}
+}
 
-			if (fd < 0) {
-				continue;
-			}
+int slave_dispatcher_init(struct slave_dispatcher *slave, renderd_config *sConfig)
+{
+	memset(slave, 0, sizeof(struct slave_dispatcher));
+	slave->config = sConfig;
+	slave->fd = FD_INVALID;
+	slave->size = sConfig->num_threads * SLAVE_INFLIGHT_FACTOR;
+	slave->window = sConfig->num_threads;
+	slave->inflight = (struct item **)calloc(slave->size, sizeof(struct item *));
+	slave->routed = (struct item **)calloc(slave->size, sizeof(struct item *));
+	pthread_mutex_init(&(slave->lock), NULL);
+	pthread_cond_init(&(slave->watchCond), NULL);
+
+	return (slave->inflight == NULL || slave->routed == NULL) ? -1 : 0;
+}
 
-			if (connect(fd, rp->ai_addr, rp->ai_addrlen) != 0) {
-				g_logger(G_LOG_LEVEL_WARNING, "failed to connect to rendering daemon (%s), trying next ip", ipstring);
-				close(fd);
-				fd = -1;
-				continue;
-			} else {
-				break;
-			}
-		}
+/* Wake up the dispatcher of the slave, waiting for requests while it has requests in
+ * flight, once the slave responds or has not responded for too long
+ */
+static void *slave_watch_thread(void *arg)
+{
+	struct slave_dispatcher *slave = (struct slave_dispatcher *)arg;
 
-		freeaddrinfo(result);
+	pthread_mutex_lock(&(slave->lock));
 
-		if (fd < 0) {
-			g_logger(G_LOG_LEVEL_WARNING, "failed to connect to %s:%i", sConfig->iphostname, sConfig->ipport);
-			return FD_INVALID;
+	while (!slave->watchExit) {
+		struct pollfd pfd;
+		int ret;
+
+		if (!slave->watching) {
+			pthread_cond_wait(&(slave->watchCond), &(slave->lock));
+			continue;
 		}
 
-		g_logger(G_LOG_LEVEL_INFO, "socket %s:%i initialised to fd %i", sConfig->iphostname, sConfig->ipport, fd);
-	} else {
-		g_logger(G_LOG_LEVEL_INFO, "Initialising unix client socket on %s",
-			 sConfig->socketname);
-		addrU = (struct sockaddr_un *)malloc(sizeof(struct sockaddr_un));
-		fd = socket(PF_UNIX, SOCK_STREAM, 0);
+		pfd.fd = slave->fd;
+		pfd.events = POLLIN;
+		pthread_mutex_unlock(&(slave->lock));
+		ret = poll(&pfd, 1, SLAVE_WATCH_INTERVAL);
+		pthread_mutex_lock(&(slave->lock));
 
-		if (fd < 0) {
-			g_logger(G_LOG_LEVEL_WARNING, "Could not obtain socket: %i", fd);
-			free(addrU);
-			return FD_INVALID;
+		// The dispatcher does not touch the connection while it is watched
+		if (slave->watching && pfd.fd == slave->fd && (ret > 0 || request_queue_clock() - slave->progress > SLAVE_STALL_TIMEOUT * 1000)) {
+			slave->watching = 0;
+			request_queue_wakeup(render_request_queue);
 		}
+	}
 
-		bzero(addrU, sizeof(struct sockaddr_un));
-		addrU->sun_family = AF_UNIX;
-		strncpy(addrU->sun_path, sConfig->socketname, sizeof(addrU->sun_path) - 1);
+	pthread_mutex_unlock(&(slave->lock));
 
-		if (connect(fd, (struct sockaddr *) addrU, sizeof(struct sockaddr_un)) < 0) {
-			g_logger(G_LOG_LEVEL_WARNING, "socket connect failed for: %s",
-				 sConfig->socketname);
-			close(fd);
-			free(addrU);
-			return FD_INVALID;
-		}
+	return NULL;
+}
 
-		free(addrU);
-		g_logger(G_LOG_LEVEL_INFO, "socket %s initialised to fd %i", sConfig->socketname,
-			 fd);
+/* Start or stop watching the slave for responses while the dispatcher waits for requests */
+static void slave_watch(struct slave_dispatcher *slave, int watching)
+{
+	pthread_mutex_lock(&(slave->lock));
+	slave->watching = watching;
+
+	if (watching) {
+		pthread_cond_signal(&(slave->watchCond));
 	}
 
-	return fd;
+	pthread_mutex_unlock(&(slave->lock));
 }
 
-int server_socket_init(renderd_config *sConfig)
+/* Keep requests in flight on the connection to the slave, until it fails. Returns the
+ * number of responses the slave sent.
+ */
+static int slave_dispatch_connected(struct slave_dispatcher *slave)
 {
-	struct sockaddr_un addrU;
-	struct sockaddr_in6 addrI;
-	mode_t old;
-	int fd;
+	struct protocol_v5 reqs[PROTO_FRAME_MAX];
+	int completed = 0, reconnected = 0;
 
-	if (sConfig->ipport > 0) {
-		const int enable = 1;
+	while (1) {
+		struct pollfd pfd;
+		int num = 0, ret, id = 0;
+
+		while (slave->num + num < slave->window && num < PROTO_FRAME_MAX) {
+			// Wait for requests before the first one of a frame only
+			int block = (num == 0), wakeups = 0;
+			struct item *item = slave_ring ? slave_take_routed(slave, block, &wakeups) : NULL;
+			int fetched = (item == NULL);
+
+			if (item == NULL && block && slave_ring == NULL && slave->num == 0) {
+				// Nothing else to wait for while no request is in flight
+				item = request_queue_fetch_request(render_request_queue);
+			} else if (item == NULL && block) {
+				if (slave_ring == NULL) {
+					wakeups = request_queue_wakeups(render_request_queue);
+				}
 
-		g_logger(G_LOG_LEVEL_INFO, "Initialising TCP/IP server socket on %s:%i",
-			 sConfig->iphostname, sConfig->ipport);
-		fd = socket(PF_INET6, SOCK_STREAM, 0);
+				// Woken up by the watcher once the slave responds
+				slave_watch(slave, slave->num > 0);
+				item = request_queue_fetch_request_or_wakeup(render_request_queue, wakeups);
+				slave_watch(slave, 0);
 
-		if (fd < 0) {
-			g_logger(G_LOG_LEVEL_CRITICAL, "failed to create IP socket");
-			exit(2);
-		}
+				if (slave_ring) {
+					pthread_mutex_lock(&(slave->lock));
+					slave->idle = 0;
+					pthread_mutex_unlock(&(slave->lock));
+				}
 
-		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
-			g_logger(G_LOG_LEVEL_CRITICAL, "setsockopt SO_REUSEADDR failed for: %s:%i",
-				 sConfig->iphostname, sConfig->ipport);
-			exit(3);
-		}
+				// Woken up for responses, or for a request routed to this slave
+				if (item == NULL) {
+					break;
+				}
+			} else if (item == NULL) {
+				item = request_queue_try_fetch_request(render_request_queue);
+			}
 
-		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
-			g_logger(G_LOG_LEVEL_CRITICAL, "setsockopt SO_REUSEPORT failed for: %s:%i",
-				 sConfig->iphostname, sConfig->ipport);
-			exit(3);
-		}
+			if (item == NULL) {
+				break;
+			}
 
-		bzero(&addrI, sizeof(addrI));
-		addrI.sin6_family = AF_INET6;
-		addrI.sin6_addr = in6addr_any;
-		addrI.sin6_port = htons(sConfig->ipport);
+			// Requests fetched from the queue may be routed to another slave
+			if (fetched && slave_ring && slave_route(slave, item, num) != slave) {
+				continue;
+			}
 
-		if (bind(fd, (struct sockaddr *) &addrI, sizeof(addrI)) < 0) {
-			g_logger(G_LOG_LEVEL_CRITICAL, "socket bind failed for: %s:%i",
-				 sConfig->iphostname, sConfig->ipport);
-			close(fd);
-			exit(3);
+			while (slave->inflight[id]) {
+				id++;
+			}
+
+			slave->inflight[id] = item;
+			slave_request(&reqs[num++], item, id);
 		}
-	} else {
-		g_logger(G_LOG_LEVEL_INFO, "Initialising unix server socket on %s",
-			 sConfig->socketname);
 
-		fd = socket(PF_UNIX, SOCK_STREAM, 0);
+		if (num > 0) {
+			g_logger(G_LOG_LEVEL_DEBUG, "Dispatching %i requests to Renderd slave %s on fd %i", num, slave->config->name, slave->fd);
 
-		if (fd < 0) {
-			g_logger(G_LOG_LEVEL_CRITICAL, "failed to create unix socket");
-			exit(2);
+			if (slave->num == 0 && slave->rateStart == 0) {
+				slave->rateStart = request_queue_clock();
+				slave->rateCount = 0;
+			}
+
+			__atomic_add_fetch(&(slave->num), num, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&(slave->noDispatched), num, __ATOMIC_RELAXED);
+			ret = send_frame(reqs, num, slave->fd);
+
+			// A connection that was idle may have been closed by a restart of the slave
+			if (ret < 0 && slave->num == num && !reconnected) {
+				g_logger(G_LOG_LEVEL_WARNING, "Failed to send requests to Renderd slave %s, reconnecting", slave->config->name);
+				close(slave->fd);
+				reconnected = 1;
+				slave->fd = client_socket_init(slave->config);
+				ret = (slave->fd == FD_INVALID) ? -1 : send_frame(reqs, num, slave->fd);
+			}
+
+			if (ret < 0) {
+				// Responses the slave sent before it went away are still good
+				completed += slave_receive_ready(slave);
+				slave_fail(slave);
+				return completed;
+			}
+
+			if (slave->num == num) {
+				slave->progress = request_queue_clock();
+			}
 		}
 
-		bzero(&addrU, sizeof(addrU));
-		addrU.sun_family = AF_UNIX;
-		strncpy(addrU.sun_path, sConfig->socketname, sizeof(addrU.sun_path) - 1);
+		// Wait for responses only while no more requests can be sent, until then the
+		// watcher wakes the dispatcher up for them
+		pfd.fd = slave->fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, (slave->num < slave->window) ? 0 : SLAVE_WATCH_INTERVAL);
 
-		unlink(addrU.sun_path);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
 
-		old = umask(0); // Need daemon socket to be writeable by apache
+		if (ret > 0) {
+			ret = slave_receive(slave);
 
-		if (bind(fd, (struct sockaddr *) &addrU, sizeof(addrU)) < 0) {
-			g_logger(G_LOG_LEVEL_CRITICAL, "socket bind failed for: %s", sConfig->socketname);
-			close(fd);
-			exit(3);
+			if (ret < 0) {
+				g_logger(G_LOG_LEVEL_ERROR, "Connection to Renderd slave %s failed", slave->config->name);
+				slave_fail(slave);
+				return completed;
+			}
+
+			completed += ret;
+			reconnected = 0;
+		} else if (ret < 0 || (slave->num > 0 && request_queue_clock() - slave->progress > SLAVE_STALL_TIMEOUT * 1000)) {
+			g_logger(G_LOG_LEVEL_ERROR, "Renderd slave %s stopped responding", slave->config->name);
+			slave_fail(slave);
+			return completed;
 		}
+	}
+}
 
-		umask(old);
+/* Keep requests in flight on a connection to the slave, until it fails. Requests are sent
+ * in frames of protocol version 5 and matched with their responses by id, which come
+ * back in the order they were rendered. Returns -1 if the slave could not be connected
+ * to, otherwise the number of responses it sent.
+ */
+int slave_dispatch(struct slave_dispatcher *slave)
+{
+	int completed;
+
+	slave->fd = client_socket_init(slave->config);
+
+	if (slave->fd == FD_INVALID) {
+		return -1;
 	}
 
-	if (listen(fd, QUEUE_MAX) < 0) {
-		g_logger(G_LOG_LEVEL_CRITICAL, "socket listen failed for %d", QUEUE_MAX);
-		close(fd);
-		exit(4);
+	slave->progress = request_queue_clock();
+	pthread_mutex_lock(&(slave->lock));
+	__atomic_store_n(&(slave->connected), 1, __ATOMIC_RELAXED);
+	slave->watching = 0;
+	slave->watchExit = 0;
+	pthread_mutex_unlock(&(slave->lock));
+
+	if (pthread_create(&(slave->watcher), NULL, slave_watch_thread, slave) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Could not spawn watcher thread of Renderd slave %s", slave->config->name);
+		slave_fail(slave);
+		return -1;
 	}
 
-	g_logger(G_LOG_LEVEL_DEBUG, "Created server socket %i", fd);
+	completed = slave_dispatch_connected(slave);
 
-	return fd;
+	pthread_mutex_lock(&(slave->lock));
+	slave->watchExit = 1;
+	pthread_cond_signal(&(slave->watchCond));
+	pthread_mutex_unlock(&(slave->lock));
+	pthread_join(slave->watcher, NULL);
 
+	return completed;
 }
 
 /**
- * This function is used as a the start function for the slave renderer thread.
- * It pulls a request from the central queue of requests and dispatches it to
- * the slave renderer. It then blocks and waits for the response with no timeout.
- * As it only sends one request at a time (there are as many slave_thread threads as there
- * are rendering threads on the slaves) nothing gets queued on the slave and should get
- * rendered immediately. Thus overall, requests should be nicely load balanced between
- * all the rendering threads available both locally and in the slaves.
+ * This function is used as the start function of the dispatcher thread of a slave
+ * renderer. It keeps enough requests of the central queue in flight to keep all
+ * render threads of the slave busy, and more the faster it renders them, so that
+ * requests are load balanced between the render threads available both locally and
+ * in the slaves by how quickly each of them gets through its work. A slave that can
+ * not be reached is tried again after exponentially growing intervals, while its
+ * share of the requests is rendered elsewhere.
  */
 void *slave_thread(void * arg)
 {
-	renderd_config * sConfig = (renderd_config *) arg;
-
-	int pfd = FD_INVALID;
-	int retry, seconds = 30;
-	size_t ret_size;
-
-	struct protocol * resp;
-	struct protocol * req_slave;
-
-	req_slave = (struct protocol *)malloc(sizeof(struct protocol));
-	resp = (struct protocol *)malloc(sizeof(struct protocol));
-	bzero(req_slave, sizeof(struct protocol));
-	bzero(resp, sizeof(struct protocol));
+	struct slave_dispatcher *slave = (struct slave_dispatcher *)arg;
+	int backoff = SLAVE_BACKOFF_MIN;
 
 	g_logger(G_LOG_LEVEL_DEBUG, "Starting slave thread: %lu", (unsigned long) pthread_self());
 
 	while (1) {
-		if (pfd == FD_INVALID) {
-			pfd = client_socket_init(sConfig);
-
-			if (pfd == FD_INVALID) {
-				if (sConfig->ipport > 0) {
-					g_logger(G_LOG_LEVEL_ERROR, "Failed to connect to Renderd slave at %s:%i, trying again in %i seconds", sConfig->iphostname, sConfig->ipport, seconds);
-				} else {
-					g_logger(G_LOG_LEVEL_ERROR, "Failed to connect to Renderd slave at %s, trying again in %i seconds", sConfig->socketname, seconds);
-				}
-
-				sleep(seconds);
-				continue;
-			}
+		// A slave that fails again right after connecting is not retried right away either
+		if (slave_dispatch(slave) > 0) {
+			backoff = SLAVE_BACKOFF_MIN;
+			continue;
 		}
 
-		enum protoCmd ret;
-		struct item *item = request_queue_fetch_request(render_request_queue);
-
-		if (item) {
-			struct protocol *req = &item->req;
-			req_slave->ver = PROTO_VER;
-			req_slave->cmd = cmdRender;
-			strcpy(req_slave->xmlname, req->xmlname);
-			strcpy(req_slave->mimetype, req->mimetype);
-			strcpy(req_slave->options, req->options);
-			req_slave->x = req->x;
-			req_slave->y = req->y;
-			req_slave->z = req->z;
+		if (slave->config->ipport > 0) {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to connect to Renderd slave at %s:%i, trying again in %i seconds", slave->config->iphostname, slave->config->ipport, backoff);
+		} else {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to connect to Renderd slave at %s, trying again in %i seconds", slave->config->socketname, backoff);
+		}
 
-			/*Dispatch request to slave renderd*/
-			retry = 2;
+		sleep(backoff);
+		backoff = (backoff * 2 > SLAVE_BACKOFF_MAX) ? SLAVE_BACKOFF_MAX : backoff * 2;
+	}
 
-			if (sConfig->ipport > 0) {
-				g_logger(G_LOG_LEVEL_INFO, "Dispatching request to Renderd slave at %s:%i on fd %i", sConfig->iphostname, sConfig->ipport, pfd);
-			} else {
-				g_logger(G_LOG_LEVEL_INFO, "Dispatching request to Renderd slave at %s on fd %i", sConfig->socketname, pfd);
-			}
+	return NULL;
+}
 
-			do {
-				ret_size = send_cmd(req_slave, pfd);
+#ifndef MAIN_ALREADY_DEFINED
+static void request_reload(void)
+{
+	// Only async-signal-safe calls here, the reload thread does the logging
+	char c = 0;
 
-				if (ret_size == sizeof(struct protocol)) {
-					//correctly sent command to slave
-					break;
-				}
+	if (write(reload_pipe_fd, &c, sizeof(c)) < 0) {
+		return;
+	}
+}
 
-				if (errno != EPIPE) {
-					g_logger(G_LOG_LEVEL_ERROR, "Failed to send cmd to Renderd slave, shutting down slave thread");
-					free(resp);
-					free(req_slave);
-					close(pfd);
-					return NULL;
-				}
+/* Reload the map sections of the config file. Returns 0 if the render threads
+ * switch to the new styles, errors in the config file keep the current ones.
+ */
+static int reload_map_sections(const char *config_file_name)
+{
+	xmlconfigitem *reloaded = (xmlconfigitem *)calloc(XMLCONFIGS_MAX, sizeof(xmlconfigitem));
 
-				g_logger(G_LOG_LEVEL_WARNING, "Failed to send cmd to Renderd slave, retrying");
-				close(pfd);
-				pfd = client_socket_init(sConfig);
+	if (reloaded == NULL) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to allocate memory for reloading the map styles");
+		return -1;
+	}
 
-				if (pfd == FD_INVALID) {
-					g_logger(G_LOG_LEVEL_ERROR, "Failed to re-connect to Renderd slave, dropping request");
-					ret = cmdNotDone;
-					send_response(item, ret, -1);
-					break;
-				}
-			} while (retry--);
+	if (load_map_sections(NULL, config_file_name, reloaded, config.tile_dir, config.num_threads) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to parse config file '%s', keeping the current map styles", config_file_name);
+		free(reloaded);
+		return -1;
+	}
 
-			if (pfd == FD_INVALID || ret_size != sizeof(struct protocol)) {
-				continue;
-			}
+	if (render_reload(reloaded) != 0) {
+		free_map_sections(reloaded);
+		free(reloaded);
+		return -1;
+	}
 
-			ret_size = 0;
-			retry = 10;
+	// Requests stay queued, new styles get their own sub-queues for new requests
+	for (int i = 0; i < XMLCONFIGS_MAX; i++) {
+		if (reloaded[i].xmlname != NULL) {
+			metatile_size_set(reloaded[i].xmlname, reloaded[i].metatile_sizes);
+			request_queue_add_style(render_request_queue, reloaded[i].xmlname, reloaded[i].weight);
+		}
+	}
 
-			while ((ret_size < sizeof(struct protocol)) && (retry > 0)) {
-				ret_size = recv(pfd, resp + ret_size, (sizeof(struct protocol)
-								       - ret_size), 0);
+	free_map_sections(maps);
+	memcpy(maps, reloaded, sizeof(xmlconfigitem) * XMLCONFIGS_MAX);
+	free(reloaded);
 
-				if ((errno == EPIPE) || ret_size == 0) {
-					close(pfd);
-					pfd = FD_INVALID;
-					ret_size = 0;
-					g_logger(G_LOG_LEVEL_ERROR, "Pipe to Renderd slave closed");
-					break;
-				}
+	return 0;
+}
 
-				retry--;
-			}
+/**
+ * Reloads the map styles on SIGHUP while renderd keeps accepting and rendering
+ * requests with the current ones. Only the map sections of the config file are
+ * reloaded, changes to the renderd and mapnik sections need a restart.
+ */
+static void *reload_thread_main(void *arg)
+{
+	int fd = *(int *)arg;
+	ssize_t n;
+	char c;
 
-			if (ret_size < sizeof(struct protocol)) {
-				if (sConfig->ipport > 0) {
-					g_logger(G_LOG_LEVEL_ERROR, "Invalid reply from Renderd slave at %s:%i, trying again in %i seconds", sConfig->iphostname, sConfig->ipport, seconds);
-				} else {
-					g_logger(G_LOG_LEVEL_ERROR, "Invalid reply from Renderd slave at %s, trying again in %i seconds", sConfig->socketname, seconds);
-				}
+	g_logger(G_LOG_LEVEL_DEBUG, "Starting reload thread: %lu", (unsigned long) pthread_self());
 
-				ret = cmdNotDone;
-				send_response(item, ret, -1);
-				sleep(seconds);
-			} else {
-				ret = resp->cmd;
-				send_response(item, ret, -1);
-
-				if (resp->cmd != cmdDone) {
-					if (sConfig->ipport > 0) {
-						g_logger(G_LOG_LEVEL_ERROR, "Request from Renderd slave at %s:%i did not complete correctly", sConfig->iphostname, sConfig->ipport);
-					} else {
-						g_logger(G_LOG_LEVEL_ERROR, "Request from Renderd slave at %s did not complete correctly", sConfig->socketname);
-					}
-
-					//Sleep for a while to make sure we don't overload the renderer
-					//This only happens if it didn't correctly block on the rendering
-					//request
-					sleep(seconds);
-				}
-			}
+	while (1) {
+		n = read(fd, &c, sizeof(c));
 
-		} else {
-			sleep(1); // TODO: Use an event to indicate there are new requests
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			break;
 		}
+
+		g_logger(G_LOG_LEVEL_INFO, "Reloading map styles from config file '%s'", reload_config_file_name);
+		reload_map_sections(reload_config_file_name);
 	}
 
-	free(resp);
-	free(req_slave);
 	return NULL;
 }
 
-#ifndef MAIN_ALREADY_DEFINED
 int main(int argc, char **argv)
 {
 	const char *config_file_name_default = RENDERD_CONFIG;
@@ -734,7 +1953,8 @@ int main(int argc, char **argv)
 	int config_file_name_passed = 0;
 	int active_renderd_section_num_passed = 0;
 
-	int fd, i, j, k;
+	int fd, i, k;
+	int reload_pipe[2];
 
 	int c;
 
@@ -804,6 +2024,13 @@ int main(int argc, char **argv)
 
 	process_config_file(config_file_name, active_renderd_section_num, G_LOG_LEVEL_INFO);
 
+	// Kept for reloading the map styles, renderd changes into / when it daemonizes
+	reload_config_file_name = realpath(config_file_name, NULL);
+
+	if (reload_config_file_name == NULL) {
+		reload_config_file_name = strndup(config_file_name, PATH_MAX);
+	}
+
 	if (config_file_name_passed) {
 		free((void *)config_file_name);
 	}
@@ -816,6 +2043,22 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	for (i = 0; i < XMLCONFIGS_MAX; i++) {
+		if (maps[i].xmlname != NULL) {
+			metatile_size_set(maps[i].xmlname, maps[i].metatile_sizes);
+			request_queue_add_style(render_request_queue, maps[i].xmlname, maps[i].weight);
+		}
+	}
+
+	// The render threads of the slaves are kept busy by the dispatchers, so they count as well
+	request_queue_set_admission(render_request_queue, config.num_threads + ((active_renderd_section_num == 0) ? num_slave_threads : 0));
+
+	if (strcmp(config.queue_order, "hilbert") == 0) {
+		request_queue_set_order(render_request_queue, queueOrderHilbert);
+	} else if (strcmp(config.queue_order, "morton") == 0) {
+		request_queue_set_order(render_request_queue, queueOrderMorton);
+	}
+
 	fd = server_socket_init(&config);
 
 #if 0
@@ -836,9 +2079,21 @@ int main(int argc, char **argv)
 		return 6;
 	}
 
-	sigExitAction.sa_handler = (void *) request_exit;
+	if (pipe(reload_pipe) != 0) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Failed to create reload pipe");
+		close(fd);
+		return 6;
+	}
 
-	sigaction(SIGHUP, &sigExitAction, NULL);
+	// A reload requested while one is going on is done right after it, more are dropped
+	fcntl(reload_pipe[1], F_SETFL, O_NONBLOCK);
+	reload_pipe_fd = reload_pipe[1];
+
+	sigReloadAction.sa_handler = (void *) request_reload;
+
+	sigaction(SIGHUP, &sigReloadAction, NULL);
+
+	sigExitAction.sa_handler = (void *) request_exit;
 
 	sigaction(SIGINT, &sigExitAction, NULL);
 
@@ -863,6 +2118,32 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (strnlen(config.queue_spool, PATH_MAX - 1)) {
+		struct request_queue_spool *spool = request_queue_spool_open(config.queue_spool);
+
+		if (spool == NULL) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "Could not open queue spool %s", config.queue_spool);
+			close(fd);
+			return 7;
+		}
+
+		request_queue_set_spool(render_request_queue, spool);
+	}
+
+	/* the journal has a writer thread, so it can only be opened after daemonizing */
+	if (strnlen(config.queue_journal, PATH_MAX - 1)) {
+		render_queue_journal = request_queue_journal_open(config.queue_journal, config.queue_journal_sync);
+
+		if (render_queue_journal == NULL) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "Could not open queue journal %s", config.queue_journal);
+			close(fd);
+			return 7;
+		}
+
+		g_logger(G_LOG_LEVEL_INFO, "Queued %i requests from queue journal", request_queue_journal_replay(render_queue_journal, render_request_queue));
+		request_queue_set_journal(render_request_queue, render_queue_journal);
+	}
+
 	if (strnlen(config.stats_filename, PATH_MAX - 1)) {
 		if (pthread_create(&stats_thread, NULL, stats_writeout_thread, NULL)) {
 			g_logger(G_LOG_LEVEL_CRITICAL, "Could not spawn stats writeout thread");
@@ -873,6 +2154,12 @@ int main(int argc, char **argv)
 		g_logger(G_LOG_LEVEL_INFO, "No stats file specified in config. Stats reporting disabled");
 	}
 
+	if (render_init_encoders(config.encode_threads) != 0) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Could not spawn encoder threads");
+		close(fd);
+		return 7;
+	}
+
 	render_threads = (pthread_t *) malloc(sizeof(pthread_t) * config.num_threads);
 
 	for (i = 0; i < config.num_threads; i++) {
@@ -883,18 +2170,36 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (pthread_create(&reload_thread, NULL, reload_thread_main, (void *) &reload_pipe[0])) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Could not spawn reload thread");
+		close(fd);
+		return 7;
+	}
+
 	if (active_renderd_section_num == 0) {
-		// Only the master renderd opens connections to its slaves
-		k = 0;
-		slave_threads = (pthread_t *) malloc(sizeof(pthread_t) * num_slave_threads);
+		// Only the master renderd opens connections to its slaves, one dispatcher thread each
+		slave_threads = (pthread_t *) malloc(sizeof(pthread_t) * MAX_SLAVES);
+		slave_dispatchers = (struct slave_dispatcher *) malloc(sizeof(struct slave_dispatcher) * MAX_SLAVES);
 
 		for (i = 1; i < MAX_SLAVES; i++) {
-			for (j = 0; j < config_slaves[i].num_threads; j++) {
-				if (pthread_create(&slave_threads[k++], NULL, slave_thread, (void *) &config_slaves[i])) {
-					g_logger(G_LOG_LEVEL_CRITICAL, "Could not spawn slave thread");
-					close(fd);
-					return 7;
-				}
+			if (config_slaves[i].num_threads != 0 && slave_dispatcher_init(&slave_dispatchers[num_slave_dispatchers++], &config_slaves[i]) != 0) {
+				g_logger(G_LOG_LEVEL_CRITICAL, "Failed to initialise slave dispatcher");
+				close(fd);
+				return 7;
+			}
+		}
+
+		if (num_slave_dispatchers > 0 && strcmp(config.slave_routing, "locality") == 0 && slave_routing_init(slave_dispatchers, num_slave_dispatchers) != 0) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "Failed to initialise slave routing");
+			close(fd);
+			return 7;
+		}
+
+		for (k = 0; k < num_slave_dispatchers; k++) {
+			if (pthread_create(&slave_threads[k], NULL, slave_thread, (void *) &slave_dispatchers[k])) {
+				g_logger(G_LOG_LEVEL_CRITICAL, "Could not spawn slave thread");
+				close(fd);
+				return 7;
 			}
 		}
 	} else {
@@ -908,6 +2213,13 @@ int main(int argc, char **argv)
 
 	process_loop(fd);
 
+	if (render_queue_journal) {
+		// Render threads are still running, detach the journal so they no longer append to it
+		request_queue_set_journal(render_request_queue, NULL);
+		request_queue_journal_close(render_queue_journal);
+		render_queue_journal = NULL;
+	}
+
 	unlink(config.socketname);
 	free_map_sections(maps);
 	free_renderd_sections(config_slaves);
@@ -17,6 +17,7 @@
 
 #define _GNU_SOURCE
 
+#include <stdio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -139,6 +140,10 @@ void free_renderd_section(renderd_config renderd_section)
 	free((void *)renderd_section.mapnik_plugins_dir);
 	free((void *)renderd_section.name);
 	free((void *)renderd_section.pid_filename);
+	free((void *)renderd_section.queue_journal);
+	free((void *)renderd_section.queue_order);
+	free((void *)renderd_section.queue_spool);
+	free((void *)renderd_section.slave_routing);
 	free((void *)renderd_section.socketname);
 	free((void *)renderd_section.stats_filename);
 	free((void *)renderd_section.tile_dir);
@@ -193,134 +198,225 @@ int min_max_int_opt(const char *opt_arg, const char *opt_type_name, int minimum,
 	return opt;
 }
 
-void process_map_sections(dictionary *ini, const char *config_file_name, xmlconfigitem *maps_dest, const char *default_tile_dir, int num_threads)
+#ifdef METATILE
+/* Parse meta-tile sizes given as SIZE or SIZE:MINZOOM-MAXZOOM into sizes by zoom level,
+ * zoom levels without a size use METATILE. Returns 0, or -1 if the sizes are invalid.
+ */
+int parse_metatile_sizes(const char *metatile_size, int *sizes)
 {
-	int ini_loaded_here = 0;
-	int map_section_num = -1;
+	char *copy, *context;
+	const char *part;
 
-	if (!ini) {
-		ini = iniparser_load(config_file_name);
-		ini_loaded_here = 1;
+	for (int z = 0; z <= MAX_ZOOM; z++) {
+		sizes[z] = METATILE;
+	}
 
-		if (!ini) {
-			g_logger(G_LOG_LEVEL_CRITICAL, "Failed to load config file (process_map_sections): '%s'", config_file_name);
-			exit(1);
+	copy = strndup(metatile_size, INILINE_MAX);
+
+	if (copy == NULL) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "parse_metatile_sizes: strndup error");
+		return -1;
+	}
+
+	// A size on its own applies to all zoom levels, SIZE:MINZOOM-MAXZOOM only to those zoom levels
+	for (part = strtok_r(copy, " ", &context); part; part = strtok_r(NULL, " ", &context)) {
+		int size, min_zoom = 0, max_zoom = MAX_ZOOM, len = 0;
+
+		if (sscanf(part, "%d%n:%d-%d%n", &size, &len, &min_zoom, &max_zoom, &len) < 1 || part[len] != '\0') {
+			g_logger(G_LOG_LEVEL_CRITICAL, "Specified metatile size (%s) is invalid, it must be SIZE or SIZE:MINZOOM-MAXZOOM, e.g., '8 16:0-6'.", part);
+			free(copy);
+			return -1;
+		} else if (size < 1 || size > METATILE_MAX || (size & (size - 1))) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "Specified metatile size (%i) must be a power of 2 between %i and %i.", size, 1, METATILE_MAX);
+			free(copy);
+			return -1;
+		} else if (min_zoom < 0 || min_zoom > max_zoom || max_zoom > MAX_ZOOM) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "Specified metatile size zoom levels (%i-%i) must be within %i-%i.", min_zoom, max_zoom, 0, MAX_ZOOM);
+			free(copy);
+			return -1;
+		}
+
+		for (int z = min_zoom; z <= max_zoom; z++) {
+			sizes[z] = size;
 		}
 	}
 
-	bzero(maps_dest, sizeof(xmlconfigitem) * XMLCONFIGS_MAX);
+	free(copy);
+	return 0;
+}
+#endif
 
-	g_logger(G_LOG_LEVEL_DEBUG, "Parsing map config section(s)");
+/* Parse one map config section into map_dest, returns 0 or 7 if a setting is invalid */
+static int process_map_section(dictionary *ini, const char *section, xmlconfigitem *map_dest, const char *default_tile_dir, int num_threads)
+{
+	char *ini_type_copy, *ini_type_context;
+	const char *ini_type, *ini_type_part, *ini_metatile_size;
+	int ini_type_part_maxlen = 64, ini_type_part_num = 0;
+
+	copy_string(section, &map_dest->xmlname, XMLCONFIG_MAX);
+
+	process_config_int(ini, section, "aspectx", &map_dest->aspect_x, 1);
+	process_config_int(ini, section, "aspecty", &map_dest->aspect_y, 1);
+	process_config_int(ini, section, "tilesize", &map_dest->tile_px_size, 256);
+	process_config_string(ini, section, "attribution", &map_dest->attribution, "", PATH_MAX);
+	process_config_string(ini, section, "cors", &map_dest->cors, "", PATH_MAX);
+	process_config_string(ini, section, "description", &map_dest->description, "", PATH_MAX);
+	process_config_string(ini, section, "host", &map_dest->host, "", PATH_MAX);
+	process_config_string(ini, section, "htcphost", &map_dest->htcpip, "", PATH_MAX);
+	process_config_string(ini, section, "parameterize_style", &map_dest->parameterization, "", PATH_MAX);
+	process_config_string(ini, section, "server_alias", &map_dest->server_alias, "", PATH_MAX);
+	process_config_string(ini, section, "tiledir", &map_dest->tile_dir, default_tile_dir, PATH_MAX);
+	process_config_string(ini, section, "uri", &map_dest->xmluri, "", PATH_MAX);
+	process_config_string(ini, section, "xml", &map_dest->xmlfile, "", PATH_MAX);
+
+	process_config_double(ini, section, "scale", &map_dest->scale_factor, 1.0);
+
+	if (map_dest->scale_factor < 0.1) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified scale factor (%lf) is too small, must be greater than or equal to %lf.", map_dest->scale_factor, 0.1);
+		return 7;
+	} else if (map_dest->scale_factor > 8.0) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified scale factor (%lf) is too large, must be less than or equal to %lf.", map_dest->scale_factor, 8.0);
+		return 7;
+	}
 
-	for (int section_num = 0; section_num < iniparser_getnsec(ini); section_num++) {
-		const char *section = iniparser_getsecname(ini, section_num);
+	process_config_int(ini, section, "maxzoom", &map_dest->max_zoom, MAX_ZOOM);
 
-		if (strncmp(section, "renderd", 7) && strcmp(section, "mapnik")) { // this is a map config section
-			char *ini_type_copy, *ini_type_context;
-			const char *ini_type, *ini_type_part;
-			int ini_type_part_maxlen = 64, ini_type_part_num = 0;
+	if (map_dest->max_zoom < 0) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified max zoom (%i) is too small, must be greater than or equal to %i.", map_dest->max_zoom, 0);
+		return 7;
+	} else if (map_dest->max_zoom > MAX_ZOOM) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified max zoom (%i) is too large, must be less than or equal to %i.", map_dest->max_zoom, MAX_ZOOM);
+		return 7;
+	}
 
-			map_section_num++;
-			g_logger(G_LOG_LEVEL_DEBUG, "Parsing map config section %i: %s", map_section_num, section);
+	process_config_int(ini, section, "minzoom", &map_dest->min_zoom, 0);
 
-			if (map_section_num >= XMLCONFIGS_MAX) {
-				g_logger(G_LOG_LEVEL_CRITICAL, "Can't handle more than %i map config sections", XMLCONFIGS_MAX);
-				exit(7);
-			}
+	if (map_dest->min_zoom < 0) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified min zoom (%i) is too small, must be greater than or equal to %i.", map_dest->min_zoom, 0);
+		return 7;
+	} else if (map_dest->min_zoom > map_dest->max_zoom) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified min zoom (%i) is larger than max zoom (%i).", map_dest->min_zoom, map_dest->max_zoom);
+		return 7;
+	}
 
-			copy_string(section, &maps_dest[map_section_num].xmlname, XMLCONFIG_MAX);
-
-			process_config_int(ini, section, "aspectx", &maps_dest[map_section_num].aspect_x, 1);
-			process_config_int(ini, section, "aspecty", &maps_dest[map_section_num].aspect_y, 1);
-			process_config_int(ini, section, "tilesize", &maps_dest[map_section_num].tile_px_size, 256);
-			process_config_string(ini, section, "attribution", &maps_dest[map_section_num].attribution, "", PATH_MAX);
-			process_config_string(ini, section, "cors", &maps_dest[map_section_num].cors, "", PATH_MAX);
-			process_config_string(ini, section, "description", &maps_dest[map_section_num].description, "", PATH_MAX);
-			process_config_string(ini, section, "host", &maps_dest[map_section_num].host, "", PATH_MAX);
-			process_config_string(ini, section, "htcphost", &maps_dest[map_section_num].htcpip, "", PATH_MAX);
-			process_config_string(ini, section, "parameterize_style", &maps_dest[map_section_num].parameterization, "", PATH_MAX);
-			process_config_string(ini, section, "server_alias", &maps_dest[map_section_num].server_alias, "", PATH_MAX);
-			process_config_string(ini, section, "tiledir", &maps_dest[map_section_num].tile_dir, default_tile_dir, PATH_MAX);
-			process_config_string(ini, section, "uri", &maps_dest[map_section_num].xmluri, "", PATH_MAX);
-			process_config_string(ini, section, "xml", &maps_dest[map_section_num].xmlfile, "", PATH_MAX);
-
-			process_config_double(ini, section, "scale", &maps_dest[map_section_num].scale_factor, 1.0);
-
-			if (maps_dest[map_section_num].scale_factor < 0.1) {
-				g_logger(G_LOG_LEVEL_CRITICAL, "Specified scale factor (%lf) is too small, must be greater than or equal to %lf.", maps_dest[map_section_num].scale_factor, 0.1);
-				exit(7);
-			} else if (maps_dest[map_section_num].scale_factor > 8.0) {
-				g_logger(G_LOG_LEVEL_CRITICAL, "Specified scale factor (%lf) is too large, must be less than or equal to %lf.", maps_dest[map_section_num].scale_factor, 8.0);
-				exit(7);
-			}
+	process_config_bool(ini, section, "lazy_load", &map_dest->lazy_load, 0);
+	process_config_int(ini, section, "lazy_unload", &map_dest->lazy_unload, 0);
 
-			process_config_int(ini, section, "maxzoom", &maps_dest[map_section_num].max_zoom, MAX_ZOOM);
+	if (map_dest->lazy_unload < 0) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified lazy unload (%i) is too small, must be greater than or equal to %i.", map_dest->lazy_unload, 0);
+		return 7;
+	}
 
-			if (maps_dest[map_section_num].max_zoom < 0) {
-				g_logger(G_LOG_LEVEL_CRITICAL, "Specified max zoom (%i) is too small, must be greater than or equal to %i.", maps_dest[map_section_num].max_zoom, 0);
-				exit(7);
-			} else if (maps_dest[map_section_num].max_zoom > MAX_ZOOM) {
-				g_logger(G_LOG_LEVEL_CRITICAL, "Specified max zoom (%i) is too large, must be less than or equal to %i.", maps_dest[map_section_num].max_zoom, MAX_ZOOM);
-				exit(7);
-			}
+	process_config_int(ini, section, "weight", &map_dest->weight, 1);
 
-			process_config_int(ini, section, "minzoom", &maps_dest[map_section_num].min_zoom, 0);
+	if (map_dest->weight < 1) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified weight (%i) is too small, must be greater than or equal to %i.", map_dest->weight, 1);
+		return 7;
+	}
 
-			if (maps_dest[map_section_num].min_zoom < 0) {
-				g_logger(G_LOG_LEVEL_CRITICAL, "Specified min zoom (%i) is too small, must be greater than or equal to %i.", maps_dest[map_section_num].min_zoom, 0);
-				exit(7);
-			} else if (maps_dest[map_section_num].min_zoom > maps_dest[map_section_num].max_zoom) {
-				g_logger(G_LOG_LEVEL_CRITICAL, "Specified min zoom (%i) is larger than max zoom (%i).", maps_dest[map_section_num].min_zoom, maps_dest[map_section_num].max_zoom);
-				exit(7);
-			}
+#ifdef METATILE
+	process_config_string(ini, section, "metatile_size", &ini_metatile_size, "", INILINE_MAX);
 
-			process_config_string(ini, section, "type", &ini_type, "png image/png png256", INILINE_MAX);
-			ini_type_copy = strndup(ini_type, INILINE_MAX);
+	if (parse_metatile_sizes(ini_metatile_size, map_dest->metatile_sizes) != 0) {
+		free((void *)ini_metatile_size);
+		return 7;
+	}
 
-			for (ini_type_part = strtok_r(ini_type_copy, " ", &ini_type_context);
-					ini_type_part;
-					ini_type_part = strtok_r(NULL, " ", &ini_type_context)) {
-				switch (ini_type_part_num) {
-					case 0:
-						copy_string(ini_type_part, &maps_dest[map_section_num].file_extension, ini_type_part_maxlen);
-						break;
+	free((void *)ini_metatile_size);
+#endif
 
-					case 1:
-						copy_string(ini_type_part, &maps_dest[map_section_num].mime_type, ini_type_part_maxlen);
-						break;
+	process_config_string(ini, section, "type", &ini_type, "png image/png png256", INILINE_MAX);
+	ini_type_copy = strndup(ini_type, INILINE_MAX);
+
+	for (ini_type_part = strtok_r(ini_type_copy, " ", &ini_type_context);
+			ini_type_part;
+			ini_type_part = strtok_r(NULL, " ", &ini_type_context)) {
+		switch (ini_type_part_num) {
+			case 0:
+				copy_string(ini_type_part, &map_dest->file_extension, ini_type_part_maxlen);
+				break;
+
+			case 1:
+				copy_string(ini_type_part, &map_dest->mime_type, ini_type_part_maxlen);
+				break;
+
+			case 2:
+				copy_string(ini_type_part, &map_dest->output_format, ini_type_part_maxlen);
+				break;
+
+			default:
+				g_logger(G_LOG_LEVEL_CRITICAL, "Specified type (%s) has too many parts, there must be no more than 3, e.g., 'png image/png png256'.", ini_type);
+				free(ini_type_copy);
+				free((void *)ini_type);
+				return 7;
+		}
 
-					case 2:
-						copy_string(ini_type_part, &maps_dest[map_section_num].output_format, ini_type_part_maxlen);
-						break;
+		ini_type_part_num++;
+	}
 
-					default:
-						g_logger(G_LOG_LEVEL_CRITICAL, "Specified type (%s) has too many parts, there must be no more than 3, e.g., 'png image/png png256'.", ini_type);
-						exit(7);
-				}
+	if (ini_type_part_num < 2) {
+		g_logger(G_LOG_LEVEL_CRITICAL, "Specified type (%s) has too few parts, there must be at least 2, e.g., 'png image/png'.", ini_type);
+		free(ini_type_copy);
+		free((void *)ini_type);
+		return 7;
+	}
 
-				ini_type_part_num++;
-			}
+	if (ini_type_part_num < 3) {
+		copy_string("png256", &map_dest->output_format, ini_type_part_maxlen);
+	}
 
-			if (ini_type_part_num < 2) {
-				g_logger(G_LOG_LEVEL_CRITICAL, "Specified type (%s) has too few parts, there must be at least 2, e.g., 'png image/png'.", ini_type);
-				exit(7);
-			}
+	g_logger(G_LOG_LEVEL_DEBUG, "\tRead %s:%s:file_extension: '%s'", section, "type", map_dest->file_extension);
+	g_logger(G_LOG_LEVEL_DEBUG, "\tRead %s:%s:mime_type: '%s'", section, "type", map_dest->mime_type);
+	g_logger(G_LOG_LEVEL_DEBUG, "\tRead %s:%s:output_format: '%s'", section, "type", map_dest->output_format);
 
-			if (ini_type_part_num < 3) {
-				copy_string("png256", &maps_dest[map_section_num].output_format, ini_type_part_maxlen);
-			}
+	/* Pass this information into the rendering threads,
+	 * as it is needed to configure mapniks number of connections
+	 */
+	map_dest->num_threads = num_threads;
 
-			g_logger(G_LOG_LEVEL_DEBUG, "\tRead %s:%s:file_extension: '%s'", section, "type", maps_dest[map_section_num].file_extension);
-			g_logger(G_LOG_LEVEL_DEBUG, "\tRead %s:%s:mime_type: '%s'", section, "type", maps_dest[map_section_num].mime_type);
-			g_logger(G_LOG_LEVEL_DEBUG, "\tRead %s:%s:output_format: '%s'", section, "type", maps_dest[map_section_num].output_format);
+	free(ini_type_copy);
+	free((void *)ini_type);
 
-			/* Pass this information into the rendering threads,
-			 * as it is needed to configure mapniks number of connections
-			 */
-			maps_dest[map_section_num].num_threads = num_threads;
+	return 0;
+}
 
-			free(ini_type_copy);
-			free((void *)ini_type);
+/* Parse the map config sections without exiting on errors, so the map styles can be
+ * reloaded by a running renderd. Returns 0, or the exit code of process_map_sections
+ * with maps_dest left empty.
+ */
+int load_map_sections(dictionary *ini, const char *config_file_name, xmlconfigitem *maps_dest, const char *default_tile_dir, int num_threads)
+{
+	int ini_loaded_here = 0;
+	int map_section_num = -1;
+	int res = 0;
+
+	if (!ini) {
+		ini = iniparser_load(config_file_name);
+		ini_loaded_here = 1;
+
+		if (!ini) {
+			g_logger(G_LOG_LEVEL_CRITICAL, "Failed to load config file (process_map_sections): '%s'", config_file_name);
+			return 1;
+		}
+	}
+
+	bzero(maps_dest, sizeof(xmlconfigitem) * XMLCONFIGS_MAX);
+
+	g_logger(G_LOG_LEVEL_DEBUG, "Parsing map config section(s)");
+
+	for (int section_num = 0; res == 0 && section_num < iniparser_getnsec(ini); section_num++) {
+		const char *section = iniparser_getsecname(ini, section_num);
+
+		if (strncmp(section, "renderd", 7) && strcmp(section, "mapnik")) { // this is a map config section
+			map_section_num++;
+			g_logger(G_LOG_LEVEL_DEBUG, "Parsing map config section %i: %s", map_section_num, section);
+
+			if (map_section_num >= XMLCONFIGS_MAX) {
+				g_logger(G_LOG_LEVEL_CRITICAL, "Can't handle more than %i map config sections", XMLCONFIGS_MAX);
+				res = 7;
+			} else {
+				res = process_map_section(ini, section, &maps_dest[map_section_num], default_tile_dir, num_threads);
+			}
 		}
 	}
 
@@ -328,9 +424,25 @@ void process_map_sections(dictionary *ini, const char *config_file_name, xmlconf
 		iniparser_freedict(ini);
 	}
 
-	if (map_section_num < 0) {
+	if (res == 0 && map_section_num < 0) {
 		g_logger(G_LOG_LEVEL_CRITICAL, "No map config sections were found in file: %s", config_file_name);
-		exit(1);
+		res = 1;
+	}
+
+	if (res != 0) {
+		free_map_sections(maps_dest);
+		bzero(maps_dest, sizeof(xmlconfigitem) * XMLCONFIGS_MAX);
+	}
+
+	return res;
+}
+
+void process_map_sections(dictionary *ini, const char *config_file_name, xmlconfigitem *maps_dest, const char *default_tile_dir, int num_threads)
+{
+	int res = load_map_sections(ini, config_file_name, maps_dest, default_tile_dir, num_threads);
+
+	if (res != 0) {
+		exit(res);
 	}
 }
 
@@ -424,10 +536,16 @@ void process_renderd_sections(dictionary *ini, const char *config_file_name, ren
 
 			copy_string(section, &configs_dest[renderd_section_num].name, renderd_strlen + 2);
 
+			process_config_int(ini, section, "encode_threads", &configs_dest[renderd_section_num].encode_threads, 0);
 			process_config_int(ini, section, "ipport", &configs_dest[renderd_section_num].ipport, 0);
 			process_config_int(ini, section, "num_threads", &configs_dest[renderd_section_num].num_threads, NUM_THREADS);
+			process_config_bool(ini, section, "queue_journal_sync", &configs_dest[renderd_section_num].queue_journal_sync, 0);
 			process_config_string(ini, section, "iphostname", &configs_dest[renderd_section_num].iphostname, "", INILINE_MAX);
 			process_config_string(ini, section, "pid_file", &configs_dest[renderd_section_num].pid_filename, RENDERD_PIDFILE, PATH_MAX);
+			process_config_string(ini, section, "queue_journal", &configs_dest[renderd_section_num].queue_journal, "", PATH_MAX);
+			process_config_string(ini, section, "queue_order", &configs_dest[renderd_section_num].queue_order, "fifo", INILINE_MAX);
+			process_config_string(ini, section, "queue_spool", &configs_dest[renderd_section_num].queue_spool, "", PATH_MAX);
+			process_config_string(ini, section, "slave_routing", &configs_dest[renderd_section_num].slave_routing, "any", INILINE_MAX);
 			process_config_string(ini, section, "socketname", &configs_dest[renderd_section_num].socketname, RENDERD_SOCKET, PATH_MAX);
 			process_config_string(ini, section, "stats_file", &configs_dest[renderd_section_num].stats_filename, "", PATH_MAX);
 			process_config_string(ini, section, "tile_dir", &configs_dest[renderd_section_num].tile_dir, RENDERD_TILE_DIR, PATH_MAX);
@@ -436,6 +554,23 @@ void process_renderd_sections(dictionary *ini, const char *config_file_name, ren
 				configs_dest[renderd_section_num].num_threads = sysconf(_SC_NPROCESSORS_ONLN);
 			}
 
+			if (configs_dest[renderd_section_num].encode_threads == -1) {
+				configs_dest[renderd_section_num].encode_threads = sysconf(_SC_NPROCESSORS_ONLN);
+			} else if (configs_dest[renderd_section_num].encode_threads < -1) {
+				g_logger(G_LOG_LEVEL_CRITICAL, "Specified encode_threads (%i) is too small, must be greater than or equal to %i.", configs_dest[renderd_section_num].encode_threads, -1);
+				exit(7);
+			}
+
+			if (strcmp(configs_dest[renderd_section_num].queue_order, "fifo") != 0 && strcmp(configs_dest[renderd_section_num].queue_order, "morton") != 0 && strcmp(configs_dest[renderd_section_num].queue_order, "hilbert") != 0) {
+				g_logger(G_LOG_LEVEL_CRITICAL, "Specified queue_order (%s) is not supported, it must be one of 'fifo', 'morton' or 'hilbert'.", configs_dest[renderd_section_num].queue_order);
+				exit(7);
+			}
+
+			if (strcmp(configs_dest[renderd_section_num].slave_routing, "any") != 0 && strcmp(configs_dest[renderd_section_num].slave_routing, "locality") != 0) {
+				g_logger(G_LOG_LEVEL_CRITICAL, "Specified slave_routing (%s) is not supported, it must be one of 'any' or 'locality'.", configs_dest[renderd_section_num].slave_routing);
+				exit(7);
+			}
+
 			if (strnlen(configs_dest[renderd_section_num].socketname, PATH_MAX) >= renderd_socketname_maxlen) {
 				g_logger(G_LOG_LEVEL_CRITICAL, "Specified socketname (%s) exceeds maximum allowed length of %i.", configs_dest[renderd_section_num].socketname, renderd_socketname_maxlen);
 				exit(7);
@@ -511,6 +646,16 @@ void process_config_file(const char *config_file_name, int active_renderd_sectio
 
 		g_logger(G_LOG_LEVEL_DEBUG, "\trenderd(%i): num_threads = '%i'", i, config_slaves[i].num_threads);
 		g_logger(G_LOG_LEVEL_DEBUG, "\trenderd(%i): pid_file = '%s'", i, config_slaves[i].pid_filename);
+		g_logger(G_LOG_LEVEL_DEBUG, "\trenderd(%i): queue_order = '%s'", i, config_slaves[i].queue_order);
+
+		if (strnlen(config_slaves[i].queue_spool, PATH_MAX)) {
+			g_logger(G_LOG_LEVEL_DEBUG, "\trenderd(%i): queue_spool = '%s'", i, config_slaves[i].queue_spool);
+		}
+
+		if (strnlen(config_slaves[i].queue_journal, PATH_MAX)) {
+			g_logger(G_LOG_LEVEL_DEBUG, "\trenderd(%i): queue_journal = '%s'", i, config_slaves[i].queue_journal);
+			g_logger(G_LOG_LEVEL_DEBUG, "\trenderd(%i): queue_journal_sync = '%s'", i, config_slaves[i].queue_journal_sync ? "true" : "false");
+		}
 
 		if (strnlen(config_slaves[i].stats_filename, PATH_MAX)) {
 			g_logger(G_LOG_LEVEL_DEBUG, "\trenderd(%i): stats_file = '%s'", i, config_slaves[i].stats_filename);
@@ -527,11 +672,26 @@ void process_config_file(const char *config_file_name, int active_renderd_sectio
 
 	g_logger(log_level, "\trenderd: num_threads = '%i'", config.num_threads);
 
+	if (config.encode_threads > 0) {
+		g_logger(log_level, "\trenderd: encode_threads = '%i'", config.encode_threads);
+	}
+
 	if (active_renderd_section_num == 0 && num_slave_threads > 0) {
 		g_logger(log_level, "\trenderd: num_slave_threads = '%i'", num_slave_threads);
+		g_logger(log_level, "\trenderd: slave_routing = '%s'", config.slave_routing);
 	}
 
 	g_logger(log_level, "\trenderd: pid_file = '%s'", config.pid_filename);
+	g_logger(log_level, "\trenderd: queue_order = '%s'", config.queue_order);
+
+	if (strnlen(config.queue_spool, PATH_MAX)) {
+		g_logger(log_level, "\trenderd: queue_spool = '%s'", config.queue_spool);
+	}
+
+	if (strnlen(config.queue_journal, PATH_MAX)) {
+		g_logger(log_level, "\trenderd: queue_journal = '%s'", config.queue_journal);
+		g_logger(log_level, "\trenderd: queue_journal_sync = '%s'", config.queue_journal_sync ? "true" : "false");
+	}
 
 	if (strnlen(config.stats_filename, PATH_MAX)) {
 		g_logger(log_level, "\trenderd: stats_file = '%s'", config.stats_filename);
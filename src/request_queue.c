@@ -21,265 +21,1066 @@
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "render_config.h"
 #include "request_queue.h"
+#include "request_queue_journal.h"
+#include "request_queue_spool.h"
 #include "g_logger.h"
 
-static int calcHashKey(struct request_queue *queue, struct item *item)
+/* Order in which the queues are served by request_queue_fetch_request */
+static const enum queueEnum fetch_order[] = {queueRequestPrio, queueRequest, queueRequestLow, queueDirty, queueRequestBulk};
+
+/* Milliseconds on the monotonic clock, the time base of item deadlines */
+int64_t request_queue_clock(void)
 {
-	uint64_t xmlnameHash = 0;
-	uint64_t key;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Final mixing step of MurmurHash3, spreads every input bit over the whole word */
+static uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* FNV-1a style hash of a style name buffer, a word at a time */
+static uint64_t style_hash(const char *name)
+{
+	uint64_t key = 0xcbf29ce484222325ULL;
+
+	for (int i = 0; i < XMLCONFIG_MAX; i += sizeof(uint64_t)) {
+		uint64_t word = 0;
+		int len = XMLCONFIG_MAX - i;
+		const char *end;
+
+		if (len > sizeof(uint64_t)) {
+			len = sizeof(uint64_t);
+		}
+
+		// Only hash up to the terminating NUL, the rest of the buffer is undefined
+		end = memchr(name + i, 0, len);
 
-	for (int i = 0; (item->req.xmlname[i] != 0) && (i < sizeof(item->req.xmlname)); i++) {
-		xmlnameHash += item->req.xmlname[i];
+		if (end != NULL) {
+			len = end - (name + i);
+		}
+
+		memcpy(&word, name + i, len);
+		key = (key ^ word) * 0x100000001b3ULL;
+
+		if (end != NULL) {
+			break;
+		}
 	}
 
-	key = ((uint64_t)(xmlnameHash & 0x1FF) << 52) + ((uint64_t)(item->req.z) << 48) + ((uint64_t)(item->mx & 0xFFFFFF) << 24) + (item->my & 0xFFFFFF);
-	return key % queue->hashidxSize;
+	return key;
 }
 
-static struct item * lookup_item_idx(struct request_queue * queue, struct item * item)
+static uint64_t calcHashKey(struct item *item)
 {
-	struct item_idx * nextItem;
-	struct item * test;
+	uint64_t key = style_hash(item->req.xmlname);
 
-	int key = calcHashKey(queue, item);
+	key ^= (uint64_t)item->req.z * 0x9e3779b97f4a7c15ULL;
+	key = mix64(key ^ (((uint64_t)(uint32_t)item->mx << 32) | (uint32_t)item->my));
 
-	if (queue->item_hashidx[key].item == NULL) {
-		return NULL;
+	// 0 marks an empty slot in the index
+	return key ? key : 1;
+}
+
+/* Spread the low 32 bits of x out to the even bits of the result */
+static uint64_t morton_spread(uint64_t x)
+{
+	x &= 0xFFFFFFFFULL;
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+	x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x << 2)) & 0x3333333333333333ULL;
+	x = (x | (x << 1)) & 0x5555555555555555ULL;
+	return x;
+}
+
+/* Distance along the Hilbert curve filling a 2^MAX_ZOOM grid. Every zoom level
+ * only uses the corner [0, 2^z) of it, which the curve fills contiguously.
+ */
+static uint64_t hilbert_distance(uint32_t x, uint32_t y)
+{
+	uint64_t d = 0;
+
+	for (uint32_t s = 1U << (MAX_ZOOM - 1); s > 0; s >>= 1) {
+		uint32_t rx = (x & s) ? 1 : 0;
+		uint32_t ry = (y & s) ? 1 : 0;
+
+		d += (uint64_t)s * s * ((3 * rx) ^ ry);
+
+		// Rotate the quadrant so the curve continues where it left off
+		if (ry == 0) {
+			uint32_t t;
+
+			if (rx == 1) {
+				x = s - 1 - (x & (s - 1));
+				y = s - 1 - (y & (s - 1));
+			}
+
+			t = x;
+			x = y;
+			y = t;
+		}
+
+		x &= s - 1;
+		y &= s - 1;
+	}
+
+	return d;
+}
+
+/* Sort key of an item in an ordered queue. Every style has its own sub-queue, so items
+ * are only grouped by zoom, to render neighbouring metatiles of one layer after each other.
+ */
+static uint64_t curve_key(enum queueOrder order, struct item *item)
+{
+	const uint64_t curve_mask = (1ULL << (2 * MAX_ZOOM)) - 1;
+	uint32_t x = (uint32_t)item->mx & ((1U << MAX_ZOOM) - 1);
+	uint32_t y = (uint32_t)item->my & ((1U << MAX_ZOOM) - 1);
+	uint64_t d;
+
+	if (order == queueOrderHilbert) {
+		d = hilbert_distance(x, y);
+	} else {
+		d = morton_spread(x) | (morton_spread(y) << 1);
+	}
+
+	return ((uint64_t)(item->req.z & 0x1F) << (2 * MAX_ZOOM)) | (d & curve_mask);
+}
+
+static int heap_push(struct request_queue_heap * heap, uint64_t key, struct item * item)
+{
+	int i;
+
+	if (heap->num == heap->size) {
+		int size = heap->size ? 2 * heap->size : 64;
+		struct item_order *entries = (struct item_order *)realloc(heap->entries, size * sizeof(struct item_order));
+
+		if (entries == NULL) {
+			return 0;
+		}
+
+		heap->entries = entries;
+		heap->size = size;
+	}
+
+	// Sift up
+	for (i = heap->num++; i > 0 && heap->entries[(i - 1) / 2].key > key; i = (i - 1) / 2) {
+		heap->entries[i] = heap->entries[(i - 1) / 2];
+	}
+
+	heap->entries[i].key = key;
+	heap->entries[i].item = item;
+	return 1;
+}
+
+/* Remove and return the entry with the smallest key (heap must not be empty) */
+static struct item_order heap_pop(struct request_queue_heap * heap)
+{
+	struct item_order top = heap->entries[0];
+	struct item_order last = heap->entries[--heap->num];
+	int i = 0;
+
+	// Sift down
+	while (2 * i + 1 < heap->num) {
+		int child = 2 * i + 1;
+
+		if ((child + 1 < heap->num) && (heap->entries[child + 1].key < heap->entries[child].key)) {
+			child++;
+		}
+
+		if (last.key <= heap->entries[child].key) {
+			break;
+		}
+
+		heap->entries[i] = heap->entries[child];
+		i = child;
+	}
+
+	heap->entries[i] = last;
+	return top;
+}
+
+static struct request_queue_idx *idx_shard(struct request_queue *queue, uint64_t key)
+{
+	// The low bits select the slot within a shard, so use the high bits for the shard
+	return &(queue->idx[(key >> 32) & (HASHIDX_SHARDS - 1)]);
+}
+
+static int item_equal(struct item *a, struct item *b)
+{
+	return (a->mx == b->mx) && (a->my == b->my) && (a->req.z == b->req.z) && (!strcmp(a->req.xmlname, b->req.xmlname));
+}
+
+/* Distance of the entry in slot i from the slot its hash maps to */
+static unsigned int probe_distance(struct request_queue_idx *idx, unsigned int i)
+{
+	return (i - (unsigned int)idx->slots[i].hash) & (idx->size - 1);
+}
+
+static int idx_alloc(struct request_queue_idx *idx, unsigned int size)
+{
+	idx->slots = (struct item_idx *)calloc(size, sizeof(struct item_idx));
+
+	if (idx->slots == NULL) {
+		return -1;
+	}
+
+	idx->size = size;
+	idx->num = 0;
+	return 0;
+}
+
+static void idx_put(struct request_queue_idx *idx, uint64_t key, struct item *item)
+{
+	struct item_idx entry = {key, item};
+	unsigned int mask = idx->size - 1;
+	unsigned int i = key & mask;
+	unsigned int dist = 0;
+
+	while (idx->slots[i].hash != 0) {
+		unsigned int slot_dist = probe_distance(idx, i);
+
+		// Robin hood: take the slot from entries closer to their home slot
+		if (slot_dist < dist) {
+			struct item_idx tmp = idx->slots[i];
+			idx->slots[i] = entry;
+			entry = tmp;
+			dist = slot_dist;
+		}
+
+		i = (i + 1) & mask;
+		dist++;
+	}
+
+	idx->slots[i] = entry;
+	idx->num++;
+}
+
+static void idx_resize(struct request_queue_idx *idx, unsigned int size)
+{
+	struct item_idx *old_slots = idx->slots;
+	unsigned int old_size = idx->size;
+
+	if (idx_alloc(idx, size) != 0) {
+		// Keep working with the current table, it still has free slots
+		g_logger(G_LOG_LEVEL_WARNING, "Failed to resize request queue index to %u slots", size);
+		idx->slots = old_slots;
+		idx->size = old_size;
+		return;
+	}
+
+	for (unsigned int i = 0; i < old_size; i++) {
+		if (old_slots[i].hash != 0) {
+			idx_put(idx, old_slots[i].hash, old_slots[i].item);
+		}
+	}
+
+	free(old_slots);
+}
+
+static void count_idx_resize(struct request_queue * queue)
+{
+	pthread_mutex_lock(&(queue->statsLock));
+	queue->stats.noIdxResize++;
+	pthread_mutex_unlock(&(queue->statsLock));
+}
+
+/* Returns the slot holding an item equal to item, or -1 if there is none */
+static int idx_find(struct request_queue_idx *idx, uint64_t key, struct item *item)
+{
+	unsigned int mask = idx->size - 1;
+	unsigned int i = key & mask;
+
+	for (unsigned int dist = 0; idx->slots[i].hash != 0 && probe_distance(idx, i) >= dist; dist++) {
+		if ((idx->slots[i].hash == key) && item_equal(item, idx->slots[i].item)) {
+			return i;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	return -1;
+}
+
+static struct item * lookup_item_idx(struct request_queue * queue, struct item * item, uint64_t key)
+{
+	struct request_queue_idx *idx = idx_shard(queue, key);
+	int i = idx_find(idx, key, item);
+
+	return (i < 0) ? NULL : idx->slots[i].item;
+}
+
+static void insert_item_idx(struct request_queue * queue, struct item *item, uint64_t key)
+{
+	struct request_queue_idx *idx = idx_shard(queue, key);
+
+	// Keep the load factor below 3/4
+	if (4 * (idx->num + 1) > 3 * idx->size) {
+		idx_resize(idx, 2 * idx->size);
+		count_idx_resize(queue);
+	}
+
+	idx_put(idx, key, item);
+}
+
+static void remove_item_idx(struct request_queue * queue, struct item * item, uint64_t key)
+{
+	struct request_queue_idx *idx = idx_shard(queue, key);
+	unsigned int mask = idx->size - 1;
+	int found = idx_find(idx, key, item);
+	unsigned int i, next;
+
+	if (found < 0) {
+		//item not in index;
+		return;
+	}
+
+	// Backward shift deletion, so no tombstones are needed
+	for (i = found, next = (i + 1) & mask; idx->slots[next].hash != 0 && probe_distance(idx, next) > 0; i = next, next = (next + 1) & mask) {
+		idx->slots[i] = idx->slots[next];
+	}
+
+	idx->slots[i].hash = 0;
+	idx->slots[i].item = NULL;
+	idx->num--;
+
+	// Give memory back after a burst of requests, with some hysteresis
+	if ((idx->size > HASHIDX_SIZE) && (8 * idx->num < idx->size)) {
+		idx_resize(idx, idx->size / 2);
+		count_idx_resize(queue);
+	}
+}
+
+static struct request_queue_fd *fd_bucket(struct request_queue * queue, int fd)
+{
+	return &(queue->fds[fd & (FDIDX_SIZE - 1)]);
+}
+
+static void waiter_unlink_locked(struct request_queue_fd * bucket, struct item * item)
+{
+	if (item->waiterPrev) {
+		item->waiterPrev->waiterNext = item->waiterNext;
 	} else {
-		nextItem = &(queue->item_hashidx[key]);
+		bucket->waiters = item->waiterNext;
+	}
+
+	if (item->waiterNext) {
+		item->waiterNext->waiterPrev = item->waiterPrev;
+	}
+}
+
+/* Record that the client on item->fd waits for item, so it can be found when the
+ * connection closes (call with the index shard lock of item held)
+ */
+static void waiter_link(struct request_queue * queue, struct item * item)
+{
+	struct request_queue_fd *bucket;
+
+	if (item->fd == FD_INVALID) {
+		return;
+	}
+
+	bucket = fd_bucket(queue, item->fd);
+	pthread_mutex_lock(&(bucket->lock));
+	item->waiterPrev = NULL;
+	item->waiterNext = bucket->waiters;
+
+	if (bucket->waiters) {
+		bucket->waiters->waiterPrev = item;
+	}
+
+	bucket->waiters = item;
+	pthread_mutex_unlock(&(bucket->lock));
+}
+
+/* Forget the client of item, unless request_queue_clear_requests_by_fd already did */
+static void waiter_unlink(struct request_queue * queue, struct item * item)
+{
+	struct request_queue_fd *bucket;
+	int fd = __atomic_load_n(&(item->fd), __ATOMIC_RELAXED);
+
+	if (fd == FD_INVALID) {
+		return;
+	}
+
+	bucket = fd_bucket(queue, fd);
+	pthread_mutex_lock(&(bucket->lock));
+
+	// The fd is only invalidated with the bucket lock held
+	if (item->fd == fd) {
+		waiter_unlink_locked(bucket, item);
+	}
+
+	pthread_mutex_unlock(&(bucket->lock));
+}
+
+/* Forget the client of item and do not send it a response any more */
+static void waiter_detach(struct request_queue * queue, struct item * item)
+{
+	struct request_queue_fd *bucket;
+	int fd = __atomic_load_n(&(item->fd), __ATOMIC_RELAXED);
+
+	if (fd == FD_INVALID) {
+		return;
+	}
+
+	bucket = fd_bucket(queue, fd);
+	pthread_mutex_lock(&(bucket->lock));
+
+	if (item->fd == fd) {
+		waiter_unlink_locked(bucket, item);
+		__atomic_store_n(&(item->fd), FD_INVALID, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&(bucket->lock));
+}
+
+static enum protoCmd pending(struct request_queue * queue, struct item *test, uint64_t key)
+{
+	// check all queues and render list to see if this request already queued
+	// If so, add this new request as a duplicate
+	// call with the lock of the index shard of key held
+	struct item *item;
+
+	item = lookup_item_idx(queue, test, key);
+
+	if (item != NULL) {
+		if ((item->inQueue == queueRender) || (item->inQueue == queueRequest) || (item->inQueue == queueRequestPrio) || (item->inQueue == queueRequestLow)) {
+			test->duplicates = item->duplicates;
+			item->duplicates = test;
+			test->inQueue = queueDuplicate;
+			return cmdIgnore;
+		} else if ((item->inQueue == queueDirty) || (item->inQueue == queueRequestBulk)) {
+			return cmdNotDone;
+		}
+	}
+
+	return cmdRender;
+}
+
+static void list_init(struct request_queue_list * list)
+{
+	pthread_mutex_init(&(list->lock), NULL);
+	list->num = 0;
+	list->order = queueOrderFifo;
+
+	for (int i = 0; i < STYLES_MAX; i++) {
+		list->subs[i].head.next = list->subs[i].head.prev = &(list->subs[i].head);
+	}
+}
+
+/* Append item to the tail of the sub-queue of its style (call with list->lock held) */
+static void list_append(struct request_queue_list * list, struct item * item)
+{
+	struct request_queue_sub *sub = &(list->subs[item->style]);
+
+	// A style that becomes active again must not claim the service it missed while idle
+	if ((sub->num == 0) && (sub->vtime < list->vtime)) {
+		sub->vtime = list->vtime;
+	}
+
+	item->next = &(sub->head);
+	item->prev = sub->head.prev;
+	item->prev->next = item;
+	sub->head.prev = item;
+	sub->num++;
+	__atomic_add_fetch(&(list->num), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(list->work), item->cost, __ATOMIC_RELAXED);
+}
+
+/* Unlink item from list (call with list->lock held) */
+static void list_unlink(struct request_queue_list * list, struct item * item)
+{
+	item->next->prev = item->prev;
+	item->prev->next = item->next;
+	list->subs[item->style].num--;
+	__atomic_sub_fetch(&(list->num), 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&(list->work), item->cost, __ATOMIC_RELAXED);
+}
+
+static int list_length(struct request_queue_list * list)
+{
+	return __atomic_load_n(&(list->num), __ATOMIC_RELAXED);
+}
+
+/* Append item to list, keeping the sweep heaps of ordered lists up to date
+ * (call with list->lock held). Returns 0 if the item could not be added.
+ */
+static int list_insert(struct request_queue_list * list, enum queueEnum queueType, struct item * item, uint64_t key)
+{
+	struct request_queue_sub *sub = &(list->subs[item->style]);
+
+	if (list->order != queueOrderFifo) {
+		// Items behind the current position have to wait for the next sweep
+		if (!heap_push(&(sub->sweep[(key >= sub->position) ? sub->ahead : !sub->ahead]), key, item)) {
+			return 0;
+		}
+	}
+
+	item->inQueue = queueType;
+	item->originatedQueue = queueType;
+	list_append(list, item);
+	return 1;
+}
+
+/* Whether item can still be rendered before its deadline if it is added to the list
+ * of queueType, given the estimated work queued ahead of it and being rendered. Items
+ * without a deadline are always admitted.
+ */
+static int list_admit(struct request_queue * queue, enum queueEnum queueType, struct item * item)
+{
+	int threads = queue->admissionThreads;
+	int64_t ahead, finish;
+
+	if ((threads <= 0) || (item->deadline == 0)) {
+		return 1;
+	}
+
+	// On average the metatiles being rendered are half done
+	ahead = __atomic_load_n(&(queue->lists[queueRender].work), __ATOMIC_RELAXED) / 2;
+
+	for (int i = 0; i < sizeof(fetch_order) / sizeof(fetch_order[0]); i++) {
+		ahead += __atomic_load_n(&(queue->lists[fetch_order[i]].work), __ATOMIC_RELAXED);
+
+		if (fetch_order[i] == queueType) {
+			break;
+		}
+	}
+
+	finish = item->queued + ahead / threads + item->cost;
+
+	if (finish <= item->deadline) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&(queue->statsLock));
+	queue->stats.noReqRejected++;
+	pthread_mutex_unlock(&(queue->statsLock));
+
+	return 0;
+}
+
+/* Try to append a new item to one of the waiting queues, respecting its limit */
+static int list_push(struct request_queue * queue, enum queueEnum queueType, struct item * item, int limit)
+{
+	struct request_queue_list *list = &(queue->lists[queueType]);
+	uint64_t key = 0;
+	int added = 0;
+
+	if (list_length(list) >= limit) {
+		return 0;
+	}
+
+	// Rather than time out, the client falls back on what it has and the item becomes dirty
+	if (list->deadlines && !list_admit(queue, queueType, item)) {
+		return 0;
+	}
+
+	if (list->order != queueOrderFifo) {
+		key = curve_key(list->order, item);
+	}
+
+	pthread_mutex_lock(&(list->lock));
+
+	if (list->num < limit) {
+		added = list_insert(list, queueType, item, key);
+	}
+
+	pthread_mutex_unlock(&(list->lock));
+
+	return added;
+}
+
+/* Whether a client is still waiting for the response to item. Clients without a
+ * deadline (older protocol versions) are assumed to be waiting, whatever happens.
+ */
+static int waiter_alive(struct item * item, int64_t now)
+{
+	return (item->deadline == 0) || ((__atomic_load_n(&(item->fd), __ATOMIC_RELAXED) != FD_INVALID) && (item->deadline > now));
+}
+
+/* Whether the client and all duplicates of item have gone away or given up waiting
+ * (call with the index shard lock of item held)
+ */
+static int item_expired(struct item * item, int64_t now)
+{
+	for (struct item *waiter = item; waiter != NULL; waiter = waiter->duplicates) {
+		if (waiter_alive(waiter, now)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Move item to the dirty queue if nobody is waiting for it any more, so it does not
+ * hold up requests that can still be delivered in time (call with list->lock held).
+ * Returns 1 if the item was moved.
+ */
+static int list_demote(struct request_queue * queue, struct request_queue_list * list, struct item * item, int64_t now)
+{
+	struct request_queue_list *dirtyList = &(queue->lists[queueDirty]);
+	struct request_queue_idx *idx;
+	uint64_t key = 0;
+	int demoted = 0;
+
+	// Cheap check on the original request before looking at its duplicates
+	if (waiter_alive(item, now)) {
+		return 0;
+	}
+
+	// The duplicates and inQueue are guarded by the index lock, which is normally taken
+	// before the list lock, so only try to get it and leave the item for the next fetch
+	idx = idx_shard(queue, calcHashKey(item));
 
-		while (nextItem != NULL) {
-			test = nextItem->item;
+	if (pthread_mutex_trylock(&(idx->lock)) != 0) {
+		return 0;
+	}
+
+	if (item_expired(item, now)) {
+		if (dirtyList->order != queueOrderFifo) {
+			key = curve_key(dirtyList->order, item);
+		}
 
-			if ((item->mx == test->mx) && (item->my == test->my)
-					&& (item->req.z == test->req.z) && (!strcmp(
-								item->req.xmlname, test->req.xmlname))) {
-				return test;
+		pthread_mutex_lock(&(dirtyList->lock));
+
+		if (dirtyList->num < DIRTY_LIMIT) {
+			list_unlink(list, item);
+
+			if (list_insert(dirtyList, queueDirty, item, key)) {
+				demoted = 1;
+
+				// Like any dirty request, the demoted one is rendered without
+				// anybody waiting for it, its clients have given up already
+				for (struct item *waiter = item; waiter != NULL; waiter = waiter->duplicates) {
+					waiter_detach(queue, waiter);
+				}
+
+				if (queue->journal) {
+					request_queue_journal_append(queue->journal, journalAdd, item);
+				}
 			} else {
-				nextItem = nextItem->next;
+				list_append(list, item);
+			}
+		}
+
+		pthread_mutex_unlock(&(dirtyList->lock));
+	}
+
+	pthread_mutex_unlock(&(idx->lock));
+
+	if (demoted) {
+		pthread_mutex_lock(&(queue->statsLock));
+		queue->stats.noReqDemoted++;
+		pthread_mutex_unlock(&(queue->statsLock));
+	}
+
+	return demoted;
+}
+
+/* Earliest deadline first: the item with the earliest deadline that can still be met.
+ * Requests without a deadline are served in order, nothing queued after them may
+ * overtake them. Returns NULL if all items were demoted (call with list->lock held).
+ */
+static struct item *list_take_deadline(struct request_queue * queue, struct request_queue_list * list, struct request_queue_sub * sub)
+{
+	int64_t now = request_queue_clock();
+	struct item *item, *next, *best = NULL;
+
+	for (item = sub->head.next; item != &(sub->head); item = next) {
+		next = item->next;
+
+		if (list_demote(queue, list, item, now)) {
+			continue;
+		}
+
+		if (item->deadline == 0) {
+			if (best == NULL) {
+				best = item;
+			}
+
+			break;
+		}
+
+		if ((best == NULL) || (item->deadline < best->deadline)) {
+			best = item;
+		}
+	}
+
+	return best;
+}
+
+/* Next item to serve from a non empty sub-queue, without unlinking it (call with list->lock held) */
+static struct item *list_take_sub(struct request_queue * queue, struct request_queue_list * list, struct request_queue_sub * sub)
+{
+	struct item_order next;
+
+	if (list->deadlines) {
+		return list_take_deadline(queue, list, sub);
+	}
+
+	if (list->order == queueOrderFifo) {
+		return sub->head.next;
+	}
+
+	// Nothing left ahead of the sweep, start over from the beginning of the curve
+	if (sub->sweep[sub->ahead].num == 0) {
+		sub->ahead = !sub->ahead;
+	}
+
+	next = heap_pop(&(sub->sweep[sub->ahead]));
+	sub->position = next.key;
+	return next.item;
+}
+
+/* Share the render threads between the styles queued on list by start time fair
+ * queueing: serve the style that has received the least render time relative to
+ * its weight, then charge it the expected render time of one of its metatiles.
+ * Returns NULL if all items were demoted (call with list->lock held).
+ */
+static struct item *list_take(struct request_queue * queue, struct request_queue_list * list)
+{
+	int noStyles = __atomic_load_n(&(queue->noStyles), __ATOMIC_ACQUIRE);
+
+	while (list->num) {
+		struct request_queue_sub *sub = NULL;
+		struct request_queue_style *style;
+		struct item *item;
+
+		for (int i = 0; i < noStyles; i++) {
+			if ((list->subs[i].num > 0) && ((sub == NULL) || (list->subs[i].vtime < sub->vtime))) {
+				sub = &(list->subs[i]);
 			}
 		}
+
+		item = list_take_sub(queue, list, sub);
+
+		if (item == NULL) {
+			// Everything on this sub-queue was demoted, try the next style
+			continue;
+		}
+
+		style = &(queue->styles[item->style]);
+		list->vtime = sub->vtime;
+		sub->vtime += (int64_t)__atomic_load_n(&(style->cost), __ATOMIC_RELAXED) * STYLE_WEIGHT_SCALE / __atomic_load_n(&(style->weight), __ATOMIC_RELAXED);
+		return item;
+	}
+
+	return NULL;
+}
+
+/* Take the next item of the highest priority non empty queue and move it onto the render list */
+static struct item *list_pop(struct request_queue * queue)
+{
+	struct request_queue_list *renderList = &(queue->lists[queueRender]);
+
+	for (int i = 0; i < sizeof(fetch_order) / sizeof(fetch_order[0]); i++) {
+		struct request_queue_list *list = &(queue->lists[fetch_order[i]]);
+		struct item *item = NULL;
+
+		// Skip empty queues without touching their lock
+		if (list_length(list) == 0) {
+			continue;
+		}
+
+		pthread_mutex_lock(&(list->lock));
+
+		item = list_take(queue, list);
+
+		if (item) {
+			list_unlink(list, item);
+
+			// The item must stay on a list for request_queue_clear_requests_by_fd to find it
+			pthread_mutex_lock(&(renderList->lock));
+			list_append(renderList, item);
+			pthread_mutex_unlock(&(renderList->lock));
+		}
+
+		pthread_mutex_unlock(&(list->lock));
+
+		if (item) {
+			__atomic_sub_fetch(&(queue->noQueued), 1, __ATOMIC_SEQ_CST);
+			return item;
+		}
+	}
+
+	return NULL;
+}
+
+/* Index of the registered style of item, 0 for styles that were not registered */
+static int style_lookup(struct request_queue * queue, struct item * item)
+{
+	uint64_t hash = style_hash(item->req.xmlname);
+
+	int noStyles = __atomic_load_n(&(queue->noStyles), __ATOMIC_ACQUIRE);
+
+	for (int i = 1; i < noStyles; i++) {
+		if ((queue->styles[i].hash == hash) && (!strcmp(queue->styles[i].name, item->req.xmlname))) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+/* Move items from the spool to the dirty queue while it is short, by one fetcher at a time */
+static void spool_refill(struct request_queue * queue)
+{
+	struct request_queue_list *dirtyList = &(queue->lists[queueDirty]);
+	struct item *item;
+	long popped = 0, refilled = 0;
+
+	if (list_length(dirtyList) >= SPOOL_REFILL_WATERMARK || request_queue_spool_depth(queue->spool) == 0) {
+		return;
+	}
+
+	if (__atomic_exchange_n(&(queue->refilling), 1, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+	while (popped < SPOOL_REFILL_BATCH) {
+		uint64_t key;
+		enum protoCmd status;
+
+		if ((item = request_queue_alloc_item(queue)) == NULL) {
+			break;
+		}
+
+		if (!request_queue_spool_pop(queue->spool, item)) {
+			request_queue_free_item(queue, item);
+			break;
+		}
+
+		item->style = style_lookup(queue, item);
+		item->queued = request_queue_clock();
+		item->cost = __atomic_load_n(&(queue->zoomCost[item->req.z]), __ATOMIC_RELAXED);
+		key = calcHashKey(item);
+		popped++;
+
+		pthread_mutex_lock(&(idx_shard(queue, key)->lock));
+
+		// The metatile may have been queued again while it was spooled
+		status = pending(queue, item, key);
+
+		if (status == cmdIgnore) {
+			pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+			refilled++;
+			continue;
+		}
+
+		if (status == cmdNotDone) {
+			pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+			request_queue_free_item(queue, item);
+			continue;
+		}
+
+		if (!list_push(queue, queueDirty, item, DIRTY_LIMIT)) {
+			// Filled up by new requests in the meantime
+			request_queue_spool_push(queue->spool, item, key);
+			pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+			request_queue_free_item(queue, item);
+			break;
+		}
+
+		insert_item_idx(queue, item, key);
+		pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+		__atomic_add_fetch(&(queue->noQueued), 1, __ATOMIC_SEQ_CST);
+		refilled++;
+	}
+
+	__atomic_store_n(&(queue->refilling), 0, __ATOMIC_SEQ_CST);
+
+	if (refilled == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&(queue->statsLock));
+	queue->stats.noReqRefilled += refilled;
+	pthread_mutex_unlock(&(queue->statsLock));
+
+	if (__atomic_load_n(&(queue->noWaiting), __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&(queue->qLock));
+		pthread_cond_broadcast(&(queue->qCond));
+		pthread_mutex_unlock(&(queue->qLock));
+	}
+}
+
+/* Mark the item taken off the lists as being rendered and count it */
+static struct item *fetched(struct request_queue *queue, struct item *item)
+{
+	uint64_t key = calcHashKey(item);
+
+	pthread_mutex_lock(&(idx_shard(queue, key)->lock));
+	item->inQueue = queueRender;
+	pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+
+	pthread_mutex_lock(&(queue->statsLock));
+
+	switch (item->originatedQueue) {
+		case queueRequestPrio:
+			queue->stats.noReqPrioRender++;
+			break;
+
+		case queueRequest:
+			queue->stats.noReqRender++;
+			break;
+
+		case queueRequestLow:
+			queue->stats.noReqLowRender++;
+			break;
+
+		case queueDirty:
+			queue->stats.noDirtyRender++;
+			break;
+
+		case queueRequestBulk:
+			queue->stats.noReqBulkRender++;
+			break;
+
+		default:
+			break;
+	}
+
+	queue->stats.noStyleRender[item->style]++;
+	queue->stats.timeStyleWait[item->style] += request_queue_clock() - item->queued;
+	pthread_mutex_unlock(&(queue->statsLock));
+
+	return item;
+}
+
+struct item *request_queue_fetch_request(struct request_queue * queue)
+{
+	struct item *item;
+
+	if (queue->spool) {
+		spool_refill(queue);
+	}
+
+	while ((item = list_pop(queue)) == NULL) {
+		pthread_mutex_lock(&(queue->qLock));
+		__atomic_add_fetch(&(queue->noWaiting), 1, __ATOMIC_SEQ_CST);
+
+		while (__atomic_load_n(&(queue->noQueued), __ATOMIC_SEQ_CST) <= 0) {
+			pthread_cond_wait(&(queue->qCond), &(queue->qLock));
+		}
+
+		__atomic_sub_fetch(&(queue->noWaiting), 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&(queue->qLock));
 	}
 
-	return NULL;
+	return fetched(queue, item);
 }
 
-static void insert_item_idx(struct request_queue * queue, struct item *item)
+/* Like request_queue_fetch_request, but returns NULL instead of waiting if nothing is queued */
+struct item *request_queue_try_fetch_request(struct request_queue * queue)
 {
-	struct item_idx * nextItem;
-	struct item_idx * prevItem;
-
-	int key = calcHashKey(queue, item);
+	struct item *item;
 
-	if (queue->item_hashidx[key].item == NULL) {
-		queue->item_hashidx[key].item = item;
-	} else {
-		prevItem = &(queue->item_hashidx[key]);
-		nextItem = queue->item_hashidx[key].next;
+	if (queue->spool) {
+		spool_refill(queue);
+	}
 
-		while (nextItem) {
-			prevItem = nextItem;
-			nextItem = nextItem->next;
-		}
+	item = list_pop(queue);
 
-		nextItem = (struct item_idx *)malloc(sizeof(struct item_idx));
-		nextItem->item = item;
-		nextItem->next = NULL;
-		prevItem->next = nextItem;
-	}
+	return item ? fetched(queue, item) : NULL;
 }
 
-static void remove_item_idx(struct request_queue * queue, struct item * item)
+/* Like request_queue_fetch_request, but returns NULL once request_queue_wakeup has been
+ * called more often than the wakeups counted by request_queue_wakeups before
+ */
+struct item *request_queue_fetch_request_or_wakeup(struct request_queue * queue, int wakeups)
 {
-	int key = calcHashKey(queue, item);
-	struct item_idx * nextItem;
-	struct item_idx * prevItem;
-	struct item * test;
+	struct item *item;
 
-	if (queue->item_hashidx[key].item == NULL) {
-		//item not in index;
-		return;
+	if (queue->spool) {
+		spool_refill(queue);
 	}
 
-	prevItem = &(queue->item_hashidx[key]);
-	nextItem = &(queue->item_hashidx[key]);
-
-	while (nextItem != NULL) {
-		test = nextItem->item;
-
-		if ((item->mx == test->mx) && (item->my == test->my) && (item->req.z
-				== test->req.z) && (!strcmp(item->req.xmlname,
-						    test->req.xmlname))) {
-			/*
-			 * Found item, removing it from list
-			 */
-			nextItem->item = NULL;
-
-			if (nextItem->next != NULL) {
-				if (nextItem == &(queue->item_hashidx[key])) {
-					prevItem = nextItem->next;
-					memcpy(&(queue->item_hashidx[key]), nextItem->next,
-					       sizeof(struct item_idx));
-					free(prevItem);
-				} else {
-					prevItem->next = nextItem->next;
-				}
-			} else {
-				prevItem->next = NULL;
-			}
+	while ((item = list_pop(queue)) == NULL) {
+		int woken;
 
-			if (nextItem != &(queue->item_hashidx[key])) {
-				free(nextItem);
-			}
+		pthread_mutex_lock(&(queue->qLock));
+		__atomic_add_fetch(&(queue->noWaiting), 1, __ATOMIC_SEQ_CST);
 
-			return;
-		} else {
-			prevItem = nextItem;
-			nextItem = nextItem->next;
+		while (__atomic_load_n(&(queue->noQueued), __ATOMIC_SEQ_CST) <= 0 && queue->noWakeups == wakeups) {
+			pthread_cond_wait(&(queue->qCond), &(queue->qLock));
 		}
-	}
-}
-
-static enum protoCmd pending(struct request_queue * queue, struct item *test)
-{
-	// check all queues and render list to see if this request already queued
-	// If so, add this new request as a duplicate
-	// call with qLock held
-	struct item *item;
 
-	item = lookup_item_idx(queue, test);
+		__atomic_sub_fetch(&(queue->noWaiting), 1, __ATOMIC_SEQ_CST);
+		woken = (queue->noWakeups != wakeups);
+		pthread_mutex_unlock(&(queue->qLock));
 
-	if (item != NULL) {
-		if ((item->inQueue == queueRender) || (item->inQueue == queueRequest) || (item->inQueue == queueRequestPrio) || (item->inQueue == queueRequestLow)) {
-			test->duplicates = item->duplicates;
-			item->duplicates = test;
-			test->inQueue = queueDuplicate;
-			return cmdIgnore;
-		} else if ((item->inQueue == queueDirty) || (item->inQueue == queueRequestBulk)) {
-			return cmdNotDone;
+		if (woken) {
+			item = list_pop(queue);
+			break;
 		}
 	}
 
-	return cmdRender;
+	return item ? fetched(queue, item) : NULL;
 }
 
-struct item *request_queue_fetch_request(struct request_queue * queue)
+int request_queue_wakeups(struct request_queue * queue)
 {
-	struct item *item = NULL;
+	int wakeups;
 
 	pthread_mutex_lock(&(queue->qLock));
+	wakeups = queue->noWakeups;
+	pthread_mutex_unlock(&(queue->qLock));
 
-	while ((queue->reqNum == 0) && (queue->dirtyNum == 0) && (queue->reqLowNum == 0) && (queue->reqPrioNum == 0) && (queue->reqBulkNum == 0)) {
-		pthread_cond_wait(&(queue->qCond), &(queue->qLock));
-	}
-
-	if (queue->reqPrioNum) {
-		item = queue->reqPrioHead.next;
-		queue->reqPrioNum--;
-		queue->stats.noReqPrioRender++;
-	} else if (queue->reqNum) {
-		item = queue->reqHead.next;
-		queue->reqNum--;
-		queue->stats.noReqRender++;
-	} else if (queue->reqLowNum) {
-		item = queue->reqLowHead.next;
-		queue->reqLowNum--;
-		queue->stats.noReqLowRender++;
-	} else if (queue->dirtyNum) {
-		item = queue->dirtyHead.next;
-		queue->dirtyNum--;
-		queue->stats.noDirtyRender++;
-	} else if (queue->reqBulkNum) {
-		item = queue->reqBulkHead.next;
-		queue->reqBulkNum--;
-		queue->stats.noReqBulkRender++;
-	}
-
-	if (item) {
-		item->next->prev = item->prev;
-		item->prev->next = item->next;
-
-		//Add item to render queue
-		item->prev = &(queue->renderHead);
-		item->next = queue->renderHead.next;
-		queue->renderHead.next->prev = item;
-		queue->renderHead.next = item;
-		item->inQueue = queueRender;
-	}
-
-	pthread_mutex_unlock(&queue->qLock);
+	return wakeups;
+}
 
-	return item;
+/* Make fetchers in request_queue_fetch_request_or_wakeup return, others go back to sleep */
+void request_queue_wakeup(struct request_queue * queue)
+{
+	pthread_mutex_lock(&(queue->qLock));
+	queue->noWakeups++;
+	pthread_cond_broadcast(&(queue->qCond));
+	pthread_mutex_unlock(&(queue->qLock));
 }
 
 /* If a fd becomes invalid for returning request information, remove it from all
- * requests to not send feedback to invalid FDs
+ * requests to not send feedback to invalid FDs. Only the items waiting on fds in
+ * the same bucket are looked at.
  */
 void request_queue_clear_requests_by_fd(struct request_queue * queue, int fd)
 {
-	struct item *item, *dupes, *queueHead;
-
-	/**Only need to look up on the shorter request and render queue,
-	 * as the all requests on the dirty queue already have a FD_INVALID
-	 * as a file descriptor, so using the linear list shouldn't be a problem
-	 */
-	pthread_mutex_lock(&(queue->qLock));
-
-	for (int i = 0; i < 4; i++) {
-		switch (i) {
-			case 0: {
-				queueHead = &(queue->reqHead);
-				break;
-			}
-
-			case 1: {
-				queueHead = &(queue->renderHead);
-				break;
-			}
-
-			case 2: {
-				queueHead = &(queue->reqPrioHead);
-				break;
-			}
-
-			case 3: {
-				queueHead = &(queue->reqBulkHead);
-				break;
-			}
-		}
+	struct request_queue_fd *bucket = fd_bucket(queue, fd);
+	struct item *item, *next;
 
-		item = queueHead->next;
+	pthread_mutex_lock(&(bucket->lock));
 
-		while (item != queueHead) {
-			if (item->fd == fd) {
-				item->fd = FD_INVALID;
-			}
-
-			dupes = item->duplicates;
-
-			while (dupes) {
-				if (dupes->fd == fd) {
-					dupes->fd = FD_INVALID;
-				}
+	for (item = bucket->waiters; item != NULL; item = next) {
+		next = item->waiterNext;
 
-				dupes = dupes->duplicates;
-			}
-
-			item = item->next;
+		if (item->fd == fd) {
+			waiter_unlink_locked(bucket, item);
+			__atomic_store_n(&(item->fd), FD_INVALID, __ATOMIC_RELAXED);
 		}
 	}
 
-	pthread_mutex_unlock(&(queue->qLock));
+	pthread_mutex_unlock(&(bucket->lock));
 }
 
 enum protoCmd request_queue_add_request(struct request_queue * queue, struct item *item)
 {
 	enum protoCmd status;
 	const struct protocol *req;
-	struct item *list = NULL;
+	uint64_t key;
+	int added = 0, spooled;
 	req = &(item->req);
 
 	if (queue == NULL) {
@@ -287,88 +1088,136 @@ enum protoCmd request_queue_add_request(struct request_queue * queue, struct ite
 		exit(3);
 	}
 
-	pthread_mutex_lock(&(queue->qLock));
+	item->style = style_lookup(queue, item);
+	item->queued = request_queue_clock();
+	item->cost = __atomic_load_n(&(queue->zoomCost[req->z]), __ATOMIC_RELAXED);
+
+	key = calcHashKey(item);
+	pthread_mutex_lock(&(idx_shard(queue, key)->lock));
 
 	// Check for a matching request in the current rendering or dirty queues
-	status = pending(queue, item);
+	status = pending(queue, item, key);
 
 	if (status == cmdNotDone) {
 		// We found a match in the dirty queue, can not wait for it
-		pthread_mutex_unlock(&(queue->qLock));
-		free(item);
+		pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+		request_queue_free_item(queue, item);
 		return cmdNotDone;
 	}
 
 	if (status == cmdIgnore) {
 		// Found a match in render queue, item added as duplicate
-		pthread_mutex_unlock(&(queue->qLock));
+		waiter_link(queue, item);
+		pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
 		return cmdIgnore;
 	}
 
 	// New request, add it to render or dirty queue
-	if ((req->cmd == cmdRender) && (queue->reqNum < REQ_LIMIT)) {
-		list = &(queue->reqHead);
-		item->inQueue = queueRequest;
-		item->originatedQueue = queueRequest;
-		queue->reqNum++;
-	} else if ((req->cmd == cmdRenderPrio) && (queue->reqPrioNum < REQ_LIMIT)) {
-		list = &(queue->reqPrioHead);
-		item->inQueue = queueRequestPrio;
-		item->originatedQueue = queueRequestPrio;
-		queue->reqPrioNum++;
-	} else if ((req->cmd == cmdRenderLow) && (queue->reqLowNum < REQ_LIMIT)) {
-		list = &(queue->reqLowHead);
-		item->inQueue = queueRequestLow;
-		item->originatedQueue = queueRequestLow;
-		queue->reqLowNum++;
-	} else if ((req->cmd == cmdRenderBulk) && (queue->reqBulkNum < REQ_LIMIT)) {
-		list = &(queue->reqBulkHead);
-		item->inQueue = queueRequestBulk;
-		item->originatedQueue = queueRequestBulk;
-		queue->reqBulkNum++;
-	} else if (queue->dirtyNum < DIRTY_LIMIT) {
-		list = &(queue->dirtyHead);
-		item->inQueue = queueDirty;
-		item->originatedQueue = queueDirty;
-		queue->dirtyNum++;
+	if (req->cmd == cmdRender) {
+		added = list_push(queue, queueRequest, item, REQ_LIMIT);
+	} else if (req->cmd == cmdRenderPrio) {
+		added = list_push(queue, queueRequestPrio, item, REQ_LIMIT);
+	} else if (req->cmd == cmdRenderLow) {
+		added = list_push(queue, queueRequestLow, item, REQ_LIMIT);
+	} else if (req->cmd == cmdRenderBulk) {
+		added = list_push(queue, queueRequestBulk, item, REQ_LIMIT);
+	}
+
+	if (!added) {
 		item->fd = FD_INVALID; // No response after render
-	} else {
+		added = list_push(queue, queueDirty, item, DIRTY_LIMIT);
+	}
+
+	if (!added && queue->spool && (spooled = request_queue_spool_push(queue->spool, item, key))) {
+		// The dirty queue is full, it is refilled from the spool as it drains
+		if (queue->journal && spooled == 1) {
+			item->originatedQueue = queueDirty;
+			request_queue_journal_append(queue->journal, journalAdd, item);
+		}
+
+		pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+
+		if (spooled == 1) {
+			pthread_mutex_lock(&(queue->statsLock));
+			queue->stats.noReqSpilled++;
+			pthread_mutex_unlock(&(queue->statsLock));
+		}
+
+		request_queue_free_item(queue, item);
+		return cmdNotDone;
+	}
+
+	if (!added) {
 		// The queue is severely backlogged. Drop request
+		pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+		pthread_mutex_lock(&(queue->statsLock));
 		queue->stats.noReqDroped++;
-		pthread_mutex_unlock(&(queue->qLock));
-		free(item);
+		pthread_mutex_unlock(&(queue->statsLock));
+		request_queue_free_item(queue, item);
 		return cmdNotDone;
 	}
 
-	if (list) {
-		item->next = list;
-		item->prev = list->prev;
-		item->prev->next = item;
-		list->prev = item;
-		/* In addition to the linked list, add item to a hash table index
-		 * for faster lookup of pending requests.
-		 */
-		insert_item_idx(queue, item);
+	/* In addition to the linked list, add item to a hash table index
+	 * for faster lookup of pending requests.
+	 */
+	insert_item_idx(queue, item, key);
+	waiter_link(queue, item);
+	status = (item->originatedQueue == queueDirty) ? cmdNotDone : cmdIgnore;
 
-		pthread_cond_signal(&queue->qCond);
-	} else {
-		free(item);
+	// The index now covers the metatile, so a spooled copy of it must not be refilled
+	if (queue->spool && request_queue_spool_depth(queue->spool) > 0) {
+		request_queue_spool_remove(queue->spool, item, key);
+	}
+
+	// Logged under the index lock, so the records of a metatile are in order
+	if (queue->journal && (item->originatedQueue == queueDirty || item->originatedQueue == queueRequestBulk)) {
+		request_queue_journal_append(queue->journal, journalAdd, item);
 	}
+	pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+
+	// Wake up a sleeping fetcher, if there is one
+	__atomic_add_fetch(&(queue->noQueued), 1, __ATOMIC_SEQ_CST);
 
-	pthread_mutex_unlock(&queue->qLock);
+	if (__atomic_load_n(&(queue->noWaiting), __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&(queue->qLock));
+		pthread_cond_signal(&(queue->qCond));
+		pthread_mutex_unlock(&(queue->qLock));
+	}
 
-	return (list == &(queue->dirtyHead)) ? cmdNotDone : cmdIgnore;
+	return status;
 }
 
 void request_queue_remove_request(struct request_queue * queue, struct item * request, int render_time)
 {
-	pthread_mutex_lock(&(queue->qLock));
+	struct request_queue_list *renderList = &(queue->lists[queueRender]);
+	uint64_t key = calcHashKey(request);
+	int cost;
 
 	if (request->inQueue != queueRender) {
 		g_logger(G_LOG_LEVEL_WARNING, "Removing request from queue, even though not on rendering queue");
 	}
 
+	pthread_mutex_lock(&(renderList->lock));
+	list_unlink(renderList, request);
+	pthread_mutex_unlock(&(renderList->lock));
+
+	pthread_mutex_lock(&(idx_shard(queue, key)->lock));
+	remove_item_idx(queue, request, key);
+
+	// Duplicates can only be added while the item is in the index, so the chain is final
+	for (struct item *waiter = request; waiter != NULL; waiter = waiter->duplicates) {
+		waiter_unlink(queue, waiter);
+	}
+
+	if (queue->journal && (request->originatedQueue == queueDirty || request->originatedQueue == queueRequestBulk)) {
+		request_queue_journal_append(queue->journal, journalDone, request);
+	}
+
+	pthread_mutex_unlock(&(idx_shard(queue, key)->lock));
+
 	if (render_time > 0) {
+		pthread_mutex_lock(&(queue->statsLock));
+
 		switch (request->originatedQueue) {
 			case queueRequestPrio: {
 				queue->stats.timeReqPrioRender += render_time;
@@ -401,53 +1250,175 @@ void request_queue_remove_request(struct request_queue * queue, struct item * re
 
 		queue->stats.noZoomRender[request->req.z]++;
 		queue->stats.timeZoomRender[request->req.z] += render_time;
+		queue->stats.timeStyleRender[request->style] += render_time;
+
+		// Moving average of the render time, used to share the render threads between styles
+		cost = __atomic_load_n(&(queue->styles[request->style].cost), __ATOMIC_RELAXED);
+		cost += (render_time - cost) / 8;
+		__atomic_store_n(&(queue->styles[request->style].cost), (cost > 0) ? cost : 1, __ATOMIC_RELAXED);
+
+		// Same per zoom level, used to estimate whether requests can be rendered in time
+		cost = __atomic_load_n(&(queue->zoomCost[request->req.z]), __ATOMIC_RELAXED);
+		cost = (cost > 0) ? cost + (render_time - cost) / 8 : render_time;
+		__atomic_store_n(&(queue->zoomCost[request->req.z]), (cost > 0) ? cost : 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&(queue->statsLock));
 	}
-
-	request->next->prev = request->prev;
-	request->prev->next = request->next;
-	remove_item_idx(queue, request);
-	pthread_mutex_unlock(&(queue->qLock));
 }
 
 int request_queue_no_requests_queued(struct request_queue * queue, enum protoCmd priority)
 {
-	int noReq = -1;
-	pthread_mutex_lock(&(queue->qLock));
-
 	switch (priority) {
 		case cmdRenderPrio:
-			noReq = queue->reqPrioNum;
-			break;
+			return list_length(&(queue->lists[queueRequestPrio]));
 
 		case cmdRender:
-			noReq = queue->reqNum;
-			break;
+			return list_length(&(queue->lists[queueRequest]));
 
 		case cmdRenderLow:
-			noReq = queue->reqLowNum;
-			break;
+			return list_length(&(queue->lists[queueRequestLow]));
 
 		case cmdDirty:
-			noReq = queue->dirtyNum;
-			break;
+			return list_length(&(queue->lists[queueDirty]));
 
 		case cmdRenderBulk:
-			noReq = queue->reqBulkNum;
-			break;
+			return list_length(&(queue->lists[queueRequestBulk]));
 
 		default:
-			break;
+			return -1;
+	}
+}
+
+/* Give a render thread its own slot in the stats, returns -1 once all are taken */
+int request_queue_add_thread(struct request_queue * queue)
+{
+	int thread = -1;
+
+	pthread_mutex_lock(&(queue->statsLock));
+
+	if (queue->stats.noThreads < THREAD_STATS_MAX) {
+		thread = queue->stats.noThreads++;
+	}
+
+	pthread_mutex_unlock(&(queue->statsLock));
+
+	return thread;
+}
+
+/* Account for time (us) a render thread spent outside of rendering */
+void request_queue_thread_time(struct request_queue * queue, int thread, long outside)
+{
+	if (thread < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&(queue->statsLock));
+	queue->stats.timeThreadOutside[thread] += outside;
+	pthread_mutex_unlock(&(queue->statsLock));
+}
+
+/* Account the time (ms) it took to load the style of request on demand before rendering it */
+void request_queue_style_load(struct request_queue * queue, struct item * request, long load_time)
+{
+	pthread_mutex_lock(&(queue->statsLock));
+	queue->stats.noStyleLoad[request->style]++;
+	queue->stats.timeStyleLoad[request->style] += load_time;
+	pthread_mutex_unlock(&(queue->statsLock));
+}
+
+/* Account how much of the render time (ms) of a metatile went to rasterising and encoding */
+void request_queue_render_phases(struct request_queue * queue, long rasterise_time, long encode_time)
+{
+	pthread_mutex_lock(&(queue->statsLock));
+	queue->stats.timeRasterise += rasterise_time;
+	queue->stats.timeEncode += encode_time;
+	pthread_mutex_unlock(&(queue->statsLock));
+}
+
+/* Account whether the render of request reused a parameterized map of its style */
+void request_queue_style_parameterized(struct request_queue * queue, struct item * request, int hit)
+{
+	pthread_mutex_lock(&(queue->statsLock));
+
+	if (hit) {
+		queue->stats.noStyleParameterizedHit[request->style]++;
+	} else {
+		queue->stats.noStyleParameterizedMiss[request->style]++;
 	}
 
-	pthread_mutex_unlock(&queue->qLock);
-	return noReq;
+	pthread_mutex_unlock(&(queue->statsLock));
 }
 
 void request_queue_copy_stats(struct request_queue * queue, stats_struct * stats)
 {
-	pthread_mutex_lock(&(queue->qLock));
+	pthread_mutex_lock(&(queue->statsLock));
 	memcpy(stats, &(queue->stats), sizeof(stats_struct));
-	pthread_mutex_unlock(&queue->qLock);
+	pthread_mutex_unlock(&(queue->statsLock));
+
+	stats->noReqSpooled = queue->spool ? request_queue_spool_depth(queue->spool) : 0;
+
+	pthread_mutex_lock(&(queue->pool.lock));
+	stats->noItemAlloc = queue->pool.noAlloc;
+	stats->noItemMalloc = queue->pool.noMalloc;
+	stats->noItemInUse = queue->pool.noInUse;
+	pthread_mutex_unlock(&(queue->pool.lock));
+
+	// Queue lengths per style are not kept as counters, but summed up on demand
+	memset(stats->noStyleQueued, 0, sizeof(stats->noStyleQueued));
+
+	for (int i = 0; i < sizeof(fetch_order) / sizeof(fetch_order[0]); i++) {
+		struct request_queue_list *list = &(queue->lists[fetch_order[i]]);
+
+		pthread_mutex_lock(&(list->lock));
+
+		for (int j = 0; j < STYLES_MAX; j++) {
+			stats->noStyleQueued[j] += list->subs[j].num;
+		}
+
+		pthread_mutex_unlock(&(list->lock));
+	}
+}
+
+/* Register a style (map section) to get its own share of the render threads,
+ * proportional to weight. Requests for styles that are not registered share
+ * style 0. Registering a style again only changes its weight, so that styles can be
+ * registered while requests are queued, by one thread at a time. Returns the index
+ * of the style.
+ */
+int request_queue_add_style(struct request_queue * queue, const char *xmlname, int weight)
+{
+	struct request_queue_style *style;
+	int noStyles = __atomic_load_n(&(queue->noStyles), __ATOMIC_ACQUIRE);
+
+	weight = (weight > 0) ? weight : 1;
+
+	for (int i = 1; i < noStyles; i++) {
+		if (!strncmp(queue->styles[i].name, xmlname, XMLCONFIG_MAX - 1)) {
+			__atomic_store_n(&(queue->styles[i].weight), weight, __ATOMIC_RELAXED);
+			return i;
+		}
+	}
+
+	if (noStyles >= STYLES_MAX) {
+		g_logger(G_LOG_LEVEL_WARNING, "Can't handle more than %i styles in the request queue, %s shares the default style", STYLES_MAX - 1, xmlname);
+		return 0;
+	}
+
+	style = &(queue->styles[noStyles]);
+	strncpy(style->name, xmlname, XMLCONFIG_MAX - 1);
+	style->hash = style_hash(style->name);
+	style->weight = weight;
+	style->cost = STYLE_COST_INITIAL;
+
+	// Published once complete, lookups only see the styles before noStyles
+	__atomic_store_n(&(queue->noStyles), noStyles + 1, __ATOMIC_RELEASE);
+
+	return noStyles;
+}
+
+/* Name of a registered style, NULL if there is no style with that index */
+const char *request_queue_style_name(struct request_queue * queue, int style)
+{
+	return ((style > 0) && (style < __atomic_load_n(&(queue->noStyles), __ATOMIC_ACQUIRE))) ? queue->styles[style].name : NULL;
 }
 
 struct request_queue * request_queue_init()
@@ -476,6 +1447,55 @@ struct request_queue * request_queue_init()
 		return NULL;
 	}
 
+	pthread_mutex_init(&(queue->statsLock), NULL);
+	pthread_mutex_init(&(queue->pool.lock), NULL);
+
+	// Left to calloc, so that only the pages of items that have been used are touched
+	queue->pool.slab = (struct item *)calloc(ITEM_POOL_SIZE, sizeof(struct item));
+
+	if (queue->pool.slab == NULL) {
+		g_logger(G_LOG_LEVEL_WARNING, "Failed to allocate item pool for request_queue, using malloc instead");
+	}
+
+	for (int i = 0; i < HASHIDX_SHARDS; i++) {
+		pthread_mutex_init(&(queue->idx[i].lock), NULL);
+
+		if (idx_alloc(&(queue->idx[i]), HASHIDX_SIZE) != 0) {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to allocate index for request_queue");
+
+			while (i >= 0) {
+				pthread_mutex_destroy(&(queue->idx[i].lock));
+				free(queue->idx[i--].slots);
+			}
+
+			free(queue->pool.slab);
+			pthread_mutex_destroy(&(queue->pool.lock));
+			pthread_mutex_destroy(&(queue->statsLock));
+			pthread_cond_destroy(&(queue->qCond));
+			pthread_mutex_destroy(&(queue->qLock));
+			free(queue);
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i < QUEUE_LISTS; i++) {
+		list_init(&(queue->lists[i]));
+	}
+
+	for (int i = 0; i < FDIDX_SIZE; i++) {
+		pthread_mutex_init(&(queue->fds[i].lock), NULL);
+	}
+
+	// The interactive queues are served earliest deadline first
+	queue->lists[queueRequestPrio].deadlines = 1;
+	queue->lists[queueRequest].deadlines = 1;
+	queue->lists[queueRequestLow].deadlines = 1;
+
+	// Catch all for requests of styles that were not registered
+	queue->styles[0].weight = 1;
+	queue->styles[0].cost = STYLE_COST_INITIAL;
+	queue->noStyles = 1;
+
 	queue->stats.noDirtyRender = 0;
 	queue->stats.noReqDroped = 0;
 	queue->stats.noReqRender = 0;
@@ -483,23 +1503,154 @@ struct request_queue * request_queue_init()
 	queue->stats.noReqLowRender = 0;
 	queue->stats.noReqBulkRender = 0;
 
-	queue->reqHead.next = queue->reqHead.prev = &(queue->reqHead);
-	queue->reqPrioHead.next = queue->reqPrioHead.prev = &(queue->reqPrioHead);
-	queue->reqLowHead.next = queue->reqLowHead.prev = &(queue->reqLowHead);
-	queue->reqBulkHead.next = queue->reqBulkHead.prev = &(queue->reqBulkHead);
-	queue->dirtyHead.next = queue->dirtyHead.prev = &(queue->dirtyHead);
-	queue->renderHead.next = queue->renderHead.prev = &(queue->renderHead);
-	queue->hashidxSize = HASHIDX_SIZE;
-	queue->item_hashidx = (struct item_idx *) malloc(sizeof(struct item_idx) * queue->hashidxSize);
-	bzero(queue->item_hashidx, sizeof(struct item_idx) * queue->hashidxSize);
-
 	return queue;
 }
 
+/* Select the order of the dirty and bulk queues, call before any request is added */
+void request_queue_set_order(struct request_queue * queue, enum queueOrder order)
+{
+	const enum queueEnum ordered[] = {queueDirty, queueRequestBulk};
+
+	for (int i = 0; i < sizeof(ordered) / sizeof(ordered[0]); i++) {
+		struct request_queue_list *list = &(queue->lists[ordered[i]]);
+
+		pthread_mutex_lock(&(list->lock));
+
+		if (list->num) {
+			g_logger(G_LOG_LEVEL_WARNING, "Not changing the order of a non empty queue");
+		} else {
+			list->order = order;
+
+			for (int j = 0; j < STYLES_MAX; j++) {
+				list->subs[j].ahead = 0;
+				list->subs[j].position = 0;
+			}
+		}
+
+		pthread_mutex_unlock(&(list->lock));
+	}
+}
+
+/* Log the dirty and bulk queues to journal from now on, call before any request is
+ * added (except those replayed from the journal). Setting it to NULL detaches the
+ * journal, after which it can be closed while the queue is still in use.
+ */
+void request_queue_set_journal(struct request_queue * queue, struct request_queue_journal * journal)
+{
+	int i;
+
+	// Records are appended under an index lock, so no append is under way with all of them held
+	for (i = 0; i < HASHIDX_SHARDS; i++) {
+		pthread_mutex_lock(&(queue->idx[i].lock));
+	}
+
+	queue->journal = journal;
+
+	for (i = HASHIDX_SHARDS - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&(queue->idx[i].lock));
+	}
+}
+
+/* Spool requests beyond DIRTY_LIMIT instead of dropping them, call before any
+ * request is added and close the spool after the queue
+ */
+void request_queue_set_spool(struct request_queue * queue, struct request_queue_spool * spool)
+{
+	queue->spool = spool;
+}
+
+/* Reject interactive requests that threads can not render before their deadline,
+ * 0 turns admission control off
+ */
+void request_queue_set_admission(struct request_queue * queue, int threads)
+{
+	queue->admissionThreads = threads;
+}
+
+static int pool_owns(struct request_queue_pool * pool, struct item * item)
+{
+	return (pool->slab != NULL) && (item >= pool->slab) && (item < pool->slab + ITEM_POOL_SIZE);
+}
+
+/* Get a zeroed item for a request. Items come from a pool sized for full queues,
+ * so that there is no allocation per request in steady state, and are only malloced
+ * once the pool is exhausted. Returns NULL if that fails as well.
+ */
+struct item *request_queue_alloc_item(struct request_queue * queue)
+{
+	struct request_queue_pool *pool = &(queue->pool);
+	struct item *item = NULL;
+
+	pthread_mutex_lock(&(pool->lock));
+
+	if (pool->free) {
+		item = pool->free;
+		pool->free = item->duplicates;
+	} else if (pool->slab && pool->carved < ITEM_POOL_SIZE) {
+		item = &(pool->slab[pool->carved++]);
+	} else {
+		pool->noMalloc++;
+	}
+
+	pool->noAlloc++;
+
+	if (item) {
+		pool->noInUse++;
+	}
+
+	pthread_mutex_unlock(&(pool->lock));
+
+	if (item) {
+		memset(item, 0, sizeof(struct item));
+	} else if ((item = (struct item *)calloc(1, sizeof(struct item))) == NULL) {
+		g_logger(G_LOG_LEVEL_ERROR, "malloc failed");
+	}
+
+	return item;
+}
+
+/* Give back an item, which may also have been malloced by the caller */
+void request_queue_free_item(struct request_queue * queue, struct item * item)
+{
+	struct request_queue_pool *pool = &(queue->pool);
+
+	if (!pool_owns(pool, item)) {
+		free(item);
+		return;
+	}
+
+	pthread_mutex_lock(&(pool->lock));
+	item->duplicates = pool->free;
+	pool->free = item;
+	pool->noInUse--;
+	pthread_mutex_unlock(&(pool->lock));
+}
+
 void request_queue_close(struct request_queue * queue)
 {
 	//TODO: Free items if the queues are not empty at closing time
+	for (int i = 0; i < QUEUE_LISTS; i++) {
+		pthread_mutex_destroy(&(queue->lists[i].lock));
+
+		for (int j = 0; j < STYLES_MAX; j++) {
+			free(queue->lists[i].subs[j].sweep[0].entries);
+			free(queue->lists[i].subs[j].sweep[1].entries);
+		}
+	}
+
+	for (int i = 0; i < HASHIDX_SHARDS; i++) {
+		pthread_mutex_destroy(&(queue->idx[i].lock));
+		free(queue->idx[i].slots);
+	}
+
+	for (int i = 0; i < FDIDX_SIZE; i++) {
+		pthread_mutex_destroy(&(queue->fds[i].lock));
+	}
+
+	pthread_mutex_destroy(&(queue->pool.lock));
+	free(queue->pool.slab);
+	pthread_mutex_destroy(&(queue->statsLock));
+	pthread_cond_destroy(&(queue->qCond));
 	pthread_mutex_destroy(&(queue->qLock));
-	free(queue->item_hashidx);
 	free(queue);
 }
@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2007 - 2023 by mod_tile contributors (see AUTHORS file)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see http://www.gnu.org/licenses/.
+ */
+
+/* Append only journal of the dirty and bulk queues, so that renderd can pick up
+ * where it left off after a restart or crash. Each queued item is logged as an
+ * add record and each rendered item as a done record; on startup the items whose
+ * last record is an add are queued again. Records are batched in memory and
+ * written by a separate thread, so logging costs an enqueue no more than a copy.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "g_logger.h"
+#include "render_config.h"
+#include "request_queue.h"
+#include "request_queue_journal.h"
+
+struct request_queue_journal {
+	char path[PATH_MAX];
+	int fd;
+	// Whether to fdatasync after every batch of records
+	int sync;
+	pthread_t flusher;
+	pthread_mutex_t lock;
+	// Signalled when records are appended and when the journal is closed
+	pthread_cond_t append_cond;
+	// Signalled when a batch has been written
+	pthread_cond_t flush_cond;
+	// Records waiting to be written, swapped with spare by the flusher
+	struct journal_record *pending;
+	struct journal_record *spare;
+	int num;
+	int pending_size;
+	int spare_size;
+	// Net number of add records among the pending ones
+	long pending_live;
+	// Set while the flusher compacts the file, producers then grow pending instead of waiting
+	int compacting;
+	// Sequence numbers of the last record appended, written and synced
+	uint64_t appended;
+	uint64_t flushed;
+	uint64_t synced;
+	int sync_requested;
+	int closing;
+	// Records in the file and the number of them and of the pending records that are still live
+	long records;
+	long live;
+	// Live records found at open, until they are replayed
+	struct journal_record *replay;
+	int noReplay;
+};
+
+static uint32_t record_checksum(const struct journal_record *record)
+{
+	const unsigned char *p = (const unsigned char *)record;
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < offsetof(struct journal_record, checksum); i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+static int record_valid(const struct journal_record *record)
+{
+	return (record->magic == JOURNAL_MAGIC) && ((record->op == journalAdd) || (record->op == journalDone)) && (record->checksum == record_checksum(record));
+}
+
+/* Order of records by the metatile they refer to */
+static int record_tile_compare(const struct journal_record *a, const struct journal_record *b)
+{
+	int res = strncmp(a->xmlname, b->xmlname, XMLCONFIG_MAX);
+
+	if (res != 0) {
+		return res;
+	}
+
+	if (a->z != b->z) {
+		return (a->z < b->z) ? -1 : 1;
+	}
+
+	if (a->x != b->x) {
+		return (a->x < b->x) ? -1 : 1;
+	}
+
+	if (a->y != b->y) {
+		return (a->y < b->y) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* Records of the same metatile are ordered by their position in the file, so
+ * the last record of each metatile sorts last
+ */
+static int record_compare(const void *a, const void *b)
+{
+	const struct journal_record *ra = *(const struct journal_record **)a;
+	const struct journal_record *rb = *(const struct journal_record **)b;
+	int res = record_tile_compare(ra, rb);
+
+	if (res != 0) {
+		return res;
+	}
+
+	return (ra < rb) ? -1 : (ra > rb);
+}
+
+static int record_position(const void *a, const void *b)
+{
+	const struct journal_record *ra = *(const struct journal_record **)a;
+	const struct journal_record *rb = *(const struct journal_record **)b;
+
+	return (ra < rb) ? -1 : (ra > rb);
+}
+
+/* Reduce records to the add records that were not followed by a done record of the
+ * same metatile, in their original order. Returns the number of live records.
+ */
+static int records_live(struct journal_record *records, int num)
+{
+	struct journal_record **sorted;
+	int live = 0;
+
+	if (num == 0) {
+		return 0;
+	}
+
+	sorted = malloc(sizeof(struct journal_record *) * num);
+
+	if (sorted == NULL) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to allocate memory for the queue journal");
+		return 0;
+	}
+
+	for (int i = 0; i < num; i++) {
+		sorted[i] = &(records[i]);
+	}
+
+	qsort(sorted, num, sizeof(struct journal_record *), record_compare);
+
+	for (int i = 0; i < num; i++) {
+		int last = (i == num - 1) || (record_tile_compare(sorted[i], sorted[i + 1]) != 0);
+
+		if (last && sorted[i]->op == journalAdd) {
+			sorted[live++] = sorted[i];
+		}
+	}
+
+	qsort(sorted, live, sizeof(struct journal_record *), record_position);
+
+	// Pointers are in increasing order, so compacting in place never overwrites a pending record
+	for (int i = 0; i < live; i++) {
+		records[i] = *sorted[i];
+	}
+
+	free(sorted);
+	return live;
+}
+
+static int write_records(int fd, const struct journal_record *records, int num)
+{
+	const char *buf = (const char *)records;
+	size_t left = sizeof(struct journal_record) * num;
+
+	while (left > 0) {
+		ssize_t res = write(fd, buf, left);
+
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		buf += res;
+		left -= res;
+	}
+
+	return 0;
+}
+
+/* Read all valid records of the journal file. A torn or corrupt record ends the
+ * journal, anything after it is discarded. Returns the number of records read.
+ */
+static int read_records(const char *path, struct journal_record **records)
+{
+	struct stat st;
+	int fd, num = 0;
+
+	*records = NULL;
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to open queue journal %s: %s", path, strerror(errno));
+		}
+
+		return 0;
+	}
+
+	if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct journal_record)) {
+		size_t max = st.st_size / sizeof(struct journal_record);
+		*records = malloc(sizeof(struct journal_record) * max);
+
+		while (*records != NULL && num < max) {
+			ssize_t res = read(fd, &((*records)[num]), sizeof(struct journal_record));
+
+			if (res < 0 && errno == EINTR) {
+				continue;
+			}
+
+			if (res != sizeof(struct journal_record) || !record_valid(&((*records)[num]))) {
+				g_logger(G_LOG_LEVEL_WARNING, "Queue journal %s is truncated or corrupt after %i records, ignoring the rest", path, num);
+				break;
+			}
+
+			num++;
+		}
+	}
+
+	close(fd);
+	return num;
+}
+
+/* Replace the journal file by one with only the given records (called by the
+ * flusher, or before it is started)
+ */
+static int journal_rewrite(struct request_queue_journal *journal, const struct journal_record *records, int num)
+{
+	char tmp[PATH_MAX + 4];
+	int fd, old;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", journal->path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to create queue journal %s: %s", tmp, strerror(errno));
+		return -1;
+	}
+
+	if (write_records(fd, records, num) != 0 || fdatasync(fd) != 0 || rename(tmp, journal->path) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to write queue journal %s: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	close(fd);
+	fd = open(journal->path, O_WRONLY | O_APPEND);
+
+	if (fd < 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to open queue journal %s: %s", journal->path, strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&(journal->lock));
+	old = journal->fd;
+	journal->fd = fd;
+	journal->records = num;
+	// Records appended since the file was read are not in it yet, but still count
+	journal->live = num + journal->pending_live;
+	pthread_mutex_unlock(&(journal->lock));
+
+	if (old >= 0) {
+		close(old);
+	}
+
+	return 0;
+}
+
+static void journal_compact(struct request_queue_journal *journal)
+{
+	struct journal_record *records;
+	int num = read_records(journal->path, &records);
+	int live = records_live(records, num);
+
+	if (journal_rewrite(journal, records, live) == 0) {
+		g_logger(G_LOG_LEVEL_DEBUG, "Compacted queue journal %s from %i to %i records", journal->path, num, live);
+	}
+
+	free(records);
+}
+
+static void *journal_flusher(void *arg)
+{
+	struct request_queue_journal *journal = arg;
+
+	pthread_mutex_lock(&(journal->lock));
+
+	while (1) {
+		struct journal_record *batch;
+		int num, size, sync, compact;
+
+		while (journal->num == 0 && !journal->closing && !(journal->sync_requested && journal->synced < journal->flushed)) {
+			pthread_cond_wait(&(journal->append_cond), &(journal->lock));
+		}
+
+		size = journal->spare_size;
+
+		if (journal->num == 0 && journal->closing) {
+			break;
+		}
+
+		batch = journal->pending;
+		num = journal->num;
+		journal->pending = journal->spare;
+		journal->num = 0;
+		journal->spare_size = journal->pending_size;
+		journal->pending_size = size;
+		journal->pending_live = 0;
+		sync = journal->sync || journal->sync_requested || journal->closing;
+		journal->sync_requested = 0;
+		// Producers may have been waiting for room in the buffer
+		pthread_cond_broadcast(&(journal->flush_cond));
+		pthread_mutex_unlock(&(journal->lock));
+
+		if (write_records(journal->fd, batch, num) != 0) {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to write queue journal %s: %s", journal->path, strerror(errno));
+		}
+
+		if (sync && fdatasync(journal->fd) != 0) {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to sync queue journal %s: %s", journal->path, strerror(errno));
+		}
+
+		pthread_mutex_lock(&(journal->lock));
+		journal->spare = batch;
+		journal->flushed += num;
+		journal->records += num;
+
+		if (sync) {
+			journal->synced = journal->flushed;
+		}
+
+		compact = (journal->records >= JOURNAL_COMPACT_MIN) && (journal->records >= JOURNAL_COMPACT_RATIO * journal->live);
+		pthread_cond_broadcast(&(journal->flush_cond));
+
+		if (compact) {
+			journal->compacting = 1;
+			pthread_mutex_unlock(&(journal->lock));
+			journal_compact(journal);
+			pthread_mutex_lock(&(journal->lock));
+			journal->compacting = 0;
+
+			if (journal->pending_size > JOURNAL_BUFFER_RECORDS) {
+				g_logger(G_LOG_LEVEL_DEBUG, "Queue journal %s buffers up to %i records after compacting", journal->path, journal->pending_size);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&(journal->lock));
+	return NULL;
+}
+
+/* Open the journal at path, creating it if needed, and start logging to it. The
+ * requests left over in it are kept for request_queue_journal_replay. With sync set,
+ * every batch of records is flushed to disk before it counts as written.
+ */
+struct request_queue_journal *request_queue_journal_open(const char *path, int sync)
+{
+	struct request_queue_journal *journal = calloc(1, sizeof(struct request_queue_journal));
+	int num;
+
+	if (journal == NULL) {
+		return NULL;
+	}
+
+	strncpy(journal->path, path, PATH_MAX - 5);
+	journal->fd = -1;
+	journal->sync = sync;
+	journal->pending = malloc(sizeof(struct journal_record) * JOURNAL_BUFFER_RECORDS);
+	journal->spare = malloc(sizeof(struct journal_record) * JOURNAL_BUFFER_RECORDS);
+	journal->pending_size = JOURNAL_BUFFER_RECORDS;
+	journal->spare_size = JOURNAL_BUFFER_RECORDS;
+	pthread_mutex_init(&(journal->lock), NULL);
+	pthread_cond_init(&(journal->append_cond), NULL);
+	pthread_cond_init(&(journal->flush_cond), NULL);
+
+	if (journal->pending == NULL || journal->spare == NULL) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to allocate memory for the queue journal");
+		request_queue_journal_close(journal);
+		return NULL;
+	}
+
+	// Drop everything that is no longer needed right away, so the file starts out small
+	num = read_records(path, &(journal->replay));
+	journal->noReplay = records_live(journal->replay, num);
+
+	if (journal_rewrite(journal, journal->replay, journal->noReplay) != 0) {
+		request_queue_journal_close(journal);
+		return NULL;
+	}
+
+	if (pthread_create(&(journal->flusher), NULL, journal_flusher, journal) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Could not spawn queue journal thread");
+		close(journal->fd);
+		journal->fd = -1;
+		request_queue_journal_close(journal);
+		return NULL;
+	}
+
+	g_logger(G_LOG_LEVEL_INFO, "Opened queue journal %s with %i of %i records pending", path, journal->noReplay, num);
+
+	return journal;
+}
+
+/* Queue the requests left over in the journal, call before it is attached to the
+ * queue. Returns the number of requests queued.
+ */
+int request_queue_journal_replay(struct request_queue_journal *journal, struct request_queue *queue)
+{
+	int queued = 0;
+
+	for (int i = 0; i < journal->noReplay; i++) {
+		struct journal_record *record = &(journal->replay[i]);
+		struct item *item = request_queue_alloc_item(queue);
+
+		if (item == NULL) {
+			break;
+		}
+
+		item->req.ver = PROTO_VER;
+		item->req.cmd = record->cmd;
+		item->req.x = record->x;
+		item->req.y = record->y;
+		item->req.z = record->z;
+		memcpy(item->req.xmlname, record->xmlname, XMLCONFIG_MAX);
+		memcpy(item->req.mimetype, record->mimetype, XMLCONFIG_MAX);
+		memcpy(item->req.options, record->options, XMLCONFIG_MAX);
+		item->req.xmlname[XMLCONFIG_MAX - 1] = '\0';
+		item->req.mimetype[XMLCONFIG_MAX - 1] = '\0';
+		item->req.options[XMLCONFIG_MAX - 1] = '\0';
+		item->mx = record->x;
+		item->my = record->y;
+		item->fd = FD_INVALID;
+		item->duplicates = NULL;
+
+		request_queue_add_request(queue, item);
+		queued++;
+	}
+
+	free(journal->replay);
+	journal->replay = NULL;
+	journal->noReplay = 0;
+
+	// The replayed items are still in the file, count them as live again
+	pthread_mutex_lock(&(journal->lock));
+	journal->live = journal->records;
+	pthread_mutex_unlock(&(journal->lock));
+
+	return queued;
+}
+
+/* Log that item was queued on (journalAdd) or rendered from (journalDone) the dirty
+ * or bulk queue. Only blocks if the flusher has fallen a whole buffer behind writing,
+ * while it compacts the file the buffer grows instead.
+ */
+void request_queue_journal_append(struct request_queue_journal *journal, enum journalOp op, const struct item *item)
+{
+	struct journal_record *record;
+
+	pthread_mutex_lock(&(journal->lock));
+
+	while (journal->num >= journal->pending_size && !journal->closing && !journal->compacting) {
+		pthread_cond_wait(&(journal->flush_cond), &(journal->lock));
+	}
+
+	if (journal->num >= journal->pending_size && journal->compacting) {
+		struct journal_record *grown = realloc(journal->pending, sizeof(struct journal_record) * journal->pending_size * 2);
+
+		if (grown != NULL) {
+			journal->pending = grown;
+			journal->pending_size *= 2;
+		}
+	}
+
+	if (journal->num >= journal->pending_size) {
+		pthread_mutex_unlock(&(journal->lock));
+		return;
+	}
+
+	record = &(journal->pending[journal->num]);
+	memset(record, 0, sizeof(struct journal_record));
+	record->magic = JOURNAL_MAGIC;
+	record->op = op;
+	record->cmd = (item->originatedQueue == queueRequestBulk) ? cmdRenderBulk : cmdDirty;
+	record->x = item->mx;
+	record->y = item->my;
+	record->z = item->req.z;
+	strncpy(record->xmlname, item->req.xmlname, XMLCONFIG_MAX - 1);
+	strncpy(record->mimetype, item->req.mimetype, XMLCONFIG_MAX - 1);
+	strncpy(record->options, item->req.options, XMLCONFIG_MAX - 1);
+	record->checksum = record_checksum(record);
+
+	journal->live += (op == journalAdd) ? 1 : -1;
+	journal->pending_live += (op == journalAdd) ? 1 : -1;
+
+	if (journal->num++ == 0) {
+		pthread_cond_signal(&(journal->append_cond));
+	}
+
+	journal->appended++;
+	pthread_mutex_unlock(&(journal->lock));
+}
+
+/* Wait until all records appended so far are on disk */
+void request_queue_journal_sync(struct request_queue_journal *journal)
+{
+	pthread_mutex_lock(&(journal->lock));
+
+	uint64_t target = journal->appended;
+
+	while (journal->synced < target && !journal->closing) {
+		journal->sync_requested = 1;
+		pthread_cond_signal(&(journal->append_cond));
+		pthread_cond_wait(&(journal->flush_cond), &(journal->lock));
+	}
+
+	pthread_mutex_unlock(&(journal->lock));
+}
+
+/* Write and sync the remaining records, then free the journal. Nothing may be
+ * appended to it any more.
+ */
+void request_queue_journal_close(struct request_queue_journal *journal)
+{
+	if (journal->fd >= 0) {
+		pthread_mutex_lock(&(journal->lock));
+		journal->closing = 1;
+		pthread_cond_broadcast(&(journal->append_cond));
+		pthread_cond_broadcast(&(journal->flush_cond));
+		pthread_mutex_unlock(&(journal->lock));
+		pthread_join(journal->flusher, NULL);
+
+		if (fdatasync(journal->fd) != 0) {
+			g_logger(G_LOG_LEVEL_ERROR, "Failed to sync queue journal %s: %s", journal->path, strerror(errno));
+		}
+
+		close(journal->fd);
+	}
+
+	pthread_cond_destroy(&(journal->flush_cond));
+	pthread_cond_destroy(&(journal->append_cond));
+	pthread_mutex_destroy(&(journal->lock));
+	free(journal->replay);
+	free(journal->spare);
+	free(journal->pending);
+	free(journal);
+}
@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2007 - 2023 by mod_tile contributors (see AUTHORS file)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see http://www.gnu.org/licenses/.
+ */
+
+/* Overflow of the dirty queue. Requests that do not fit into the dirty queue are
+ * appended to memory mapped segment files and read back in the same order as the
+ * dirty queue drains. Only a set of the spooled metatiles is kept in memory, to not
+ * spool the same metatile twice. The spool does not survive a
+ * restart, use the queue journal for that.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "g_logger.h"
+#include "render_config.h"
+#include "request_queue_spool.h"
+
+#define SPOOL_SEGMENT_SIZE (sizeof(struct spool_record) * SPOOL_SEGMENT_RECORDS)
+
+struct spool_segment {
+	unsigned long seq;
+	struct spool_record *records;
+	int pos;
+};
+
+/* Entry of the set of spooled metatiles. Keys may collide, so the metatile is kept
+ * along with its key, keys of 0 mark empty slots.
+ */
+struct spool_key {
+	uint64_t key;
+	int32_t x;
+	int32_t y;
+	int32_t z;
+	char xmlname[XMLCONFIG_MAX];
+};
+
+struct request_queue_spool {
+	// Leaves room for the segment file names
+	char dir[PATH_MAX - 32];
+	pthread_mutex_t lock;
+	// Number of spooled items, read without the lock
+	int num;
+	// Segments are numbered in the order they are written, read is the oldest
+	struct spool_segment read;
+	struct spool_segment write;
+	// Open addressing set of the spooled metatiles
+	struct spool_key *keys;
+	unsigned int size;
+	unsigned int used;
+};
+
+static void segment_path(struct request_queue_spool *spool, unsigned long seq, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/spool-%08lu.seg", spool->dir, seq);
+}
+
+static struct spool_record *segment_map(struct request_queue_spool *spool, unsigned long seq, int create)
+{
+	char path[PATH_MAX];
+	void *records;
+	int fd;
+
+	segment_path(spool, seq, path);
+	fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0600);
+
+	if (fd < 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to open spool segment %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (create && ftruncate(fd, SPOOL_SEGMENT_SIZE) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to size spool segment %s: %s", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	records = mmap(NULL, SPOOL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (records == MAP_FAILED) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to map spool segment %s: %s", path, strerror(errno));
+
+		if (create) {
+			unlink(path);
+		}
+
+		return NULL;
+	}
+
+	return records;
+}
+
+static void segment_unmap(struct spool_segment *segment)
+{
+	if (segment->records) {
+		munmap(segment->records, SPOOL_SEGMENT_SIZE);
+		segment->records = NULL;
+	}
+}
+
+static void set_key(struct spool_key *entry, uint64_t key, int x, int y, int z, const char *xmlname)
+{
+	memset(entry, 0, sizeof(struct spool_key));
+	entry->key = key ? key : 1;
+	entry->x = x;
+	entry->y = y;
+	entry->z = z;
+	strncpy(entry->xmlname, xmlname, XMLCONFIG_MAX - 1);
+}
+
+static int keys_alloc(struct request_queue_spool *spool, unsigned int size)
+{
+	struct spool_key *old = spool->keys;
+	unsigned int oldSize = spool->size;
+
+	spool->keys = calloc(size, sizeof(struct spool_key));
+
+	if (spool->keys == NULL) {
+		spool->keys = old;
+		return -1;
+	}
+
+	spool->size = size;
+
+	for (unsigned int i = 0; i < oldSize; i++) {
+		if (old[i].key) {
+			unsigned int j = old[i].key & (size - 1);
+
+			while (spool->keys[j].key) {
+				j = (j + 1) & (size - 1);
+			}
+
+			spool->keys[j] = old[i];
+		}
+	}
+
+	free(old);
+	return 0;
+}
+
+static int keys_equal(const struct spool_key *a, const struct spool_key *b)
+{
+	return (a->key == b->key) && (a->x == b->x) && (a->y == b->y) && (a->z == b->z) && !strcmp(a->xmlname, b->xmlname);
+}
+
+/* Slot of the metatile, or the empty slot where it would go */
+static unsigned int keys_find(struct request_queue_spool *spool, const struct spool_key *entry)
+{
+	unsigned int i = entry->key & (spool->size - 1);
+
+	while (spool->keys[i].key && !keys_equal(&(spool->keys[i]), entry)) {
+		i = (i + 1) & (spool->size - 1);
+	}
+
+	return i;
+}
+
+/* Backward shift deletion, so the set needs no tombstones */
+static void keys_remove(struct request_queue_spool *spool, const struct spool_key *entry)
+{
+	unsigned int mask = spool->size - 1;
+	unsigned int i = keys_find(spool, entry);
+	unsigned int j = i;
+
+	if (spool->keys[i].key == 0) {
+		return;
+	}
+
+	while (1) {
+		j = (j + 1) & mask;
+
+		if (spool->keys[j].key == 0) {
+			break;
+		}
+
+		// Move the entry at j into the hole at i unless its home slot lies between them
+		unsigned int home = spool->keys[j].key & mask;
+
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			spool->keys[i] = spool->keys[j];
+			i = j;
+		}
+	}
+
+	spool->keys[i].key = 0;
+	spool->used--;
+
+	if (spool->size > SPOOL_KEYS_SIZE && spool->used < spool->size / 8) {
+		keys_alloc(spool, spool->size / 2);
+	}
+}
+
+/* Remove segments left over from an earlier run, their items are gone from the index */
+static void remove_stale_segments(struct request_queue_spool *spool)
+{
+	char path[PATH_MAX + 256];
+	struct dirent *entry;
+	DIR *dir = opendir(spool->dir);
+
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		size_t len = strlen(entry->d_name);
+
+		if (strncmp(entry->d_name, "spool-", 6) == 0 && len > 4 && strcmp(entry->d_name + len - 4, ".seg") == 0) {
+			snprintf(path, sizeof(path), "%s/%s", spool->dir, entry->d_name);
+			unlink(path);
+		}
+	}
+
+	closedir(dir);
+}
+
+struct request_queue_spool *request_queue_spool_open(const char *dir)
+{
+	struct request_queue_spool *spool = calloc(1, sizeof(struct request_queue_spool));
+
+	if (spool == NULL) {
+		return NULL;
+	}
+
+	strncpy(spool->dir, dir, sizeof(spool->dir) - 1);
+	pthread_mutex_init(&(spool->lock), NULL);
+
+	if (keys_alloc(spool, SPOOL_KEYS_SIZE) != 0) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to allocate memory for the spool");
+		request_queue_spool_close(spool);
+		return NULL;
+	}
+
+	remove_stale_segments(spool);
+	spool->write.records = segment_map(spool, 0, 1);
+
+	if (spool->write.records == NULL) {
+		request_queue_spool_close(spool);
+		return NULL;
+	}
+
+	spool->read.records = segment_map(spool, 0, 0);
+
+	if (spool->read.records == NULL) {
+		request_queue_spool_close(spool);
+		return NULL;
+	}
+
+	g_logger(G_LOG_LEVEL_INFO, "Spooling dirty requests beyond %i to %s", DIRTY_LIMIT, dir);
+
+	return spool;
+}
+
+/* Append item to the spool, unless its metatile is spooled already. Returns 1 if
+ * item was spooled, 2 if its metatile was spooled already and 0 if it could not be.
+ */
+int request_queue_spool_push(struct request_queue_spool *spool, const struct item *item, uint64_t key)
+{
+	struct spool_record *record;
+	struct spool_key entry;
+	unsigned int slot;
+
+	set_key(&entry, key, item->mx, item->my, item->req.z, item->req.xmlname);
+	pthread_mutex_lock(&(spool->lock));
+	slot = keys_find(spool, &entry);
+
+	if (spool->keys[slot].key) {
+		pthread_mutex_unlock(&(spool->lock));
+		return 2;
+	}
+
+	if (spool->write.pos == SPOOL_SEGMENT_RECORDS) {
+		struct spool_record *records = segment_map(spool, spool->write.seq + 1, 1);
+
+		if (records == NULL) {
+			pthread_mutex_unlock(&(spool->lock));
+			return 0;
+		}
+
+		segment_unmap(&(spool->write));
+		spool->write.records = records;
+		spool->write.seq++;
+		spool->write.pos = 0;
+	}
+
+	if ((spool->used + 1) * 2 > spool->size) {
+		if (keys_alloc(spool, spool->size * 2) != 0) {
+			pthread_mutex_unlock(&(spool->lock));
+			return 0;
+		}
+
+		slot = keys_find(spool, &entry);
+	}
+
+	record = &(spool->write.records[spool->write.pos++]);
+	memset(record, 0, sizeof(struct spool_record));
+	record->key = entry.key;
+	record->cmd = item->req.cmd;
+	record->x = item->mx;
+	record->y = item->my;
+	record->z = item->req.z;
+	strncpy(record->xmlname, item->req.xmlname, XMLCONFIG_MAX - 1);
+	strncpy(record->mimetype, item->req.mimetype, XMLCONFIG_MAX - 1);
+	strncpy(record->options, item->req.options, XMLCONFIG_MAX - 1);
+
+	spool->keys[slot] = entry;
+	spool->used++;
+	__atomic_add_fetch(&(spool->num), 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(spool->lock));
+
+	return 1;
+}
+
+/* Fill the zeroed item with the oldest request of the spool and take it off,
+ * returns 0 if the spool is empty
+ */
+int request_queue_spool_pop(struct request_queue_spool *spool, struct item *item)
+{
+	struct spool_record *record;
+	struct spool_key entry;
+
+	pthread_mutex_lock(&(spool->lock));
+
+	// Records whose metatile has been removed from the set were queued by other means
+	do {
+		if (spool->num == 0) {
+			pthread_mutex_unlock(&(spool->lock));
+			return 0;
+		}
+
+		// A fully read segment is never written again, as writing moved on to a later one
+		if (spool->read.pos == SPOOL_SEGMENT_RECORDS) {
+			char path[PATH_MAX];
+			struct spool_record *records = segment_map(spool, spool->read.seq + 1, 0);
+
+			if (records == NULL) {
+				pthread_mutex_unlock(&(spool->lock));
+				return 0;
+			}
+
+			segment_unmap(&(spool->read));
+			segment_path(spool, spool->read.seq, path);
+			unlink(path);
+			spool->read.records = records;
+			spool->read.seq++;
+			spool->read.pos = 0;
+		}
+
+		record = &(spool->read.records[spool->read.pos++]);
+		set_key(&entry, record->key, record->x, record->y, record->z, record->xmlname);
+	} while (spool->keys[keys_find(spool, &entry)].key == 0);
+
+	item->req.ver = PROTO_VER;
+	item->req.cmd = record->cmd;
+	item->req.x = record->x;
+	item->req.y = record->y;
+	item->req.z = record->z;
+	memcpy(item->req.xmlname, record->xmlname, XMLCONFIG_MAX);
+	memcpy(item->req.mimetype, record->mimetype, XMLCONFIG_MAX);
+	memcpy(item->req.options, record->options, XMLCONFIG_MAX);
+	item->mx = record->x;
+	item->my = record->y;
+	item->fd = FD_INVALID;
+
+	keys_remove(spool, &entry);
+	__atomic_sub_fetch(&(spool->num), 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(spool->lock));
+
+	return 1;
+}
+
+/* Forget the spooled metatile of item with key, because it has been queued by other
+ * means. Its record is skipped when it is read.
+ */
+void request_queue_spool_remove(struct request_queue_spool *spool, const struct item *item, uint64_t key)
+{
+	struct spool_key entry;
+
+	set_key(&entry, key, item->mx, item->my, item->req.z, item->req.xmlname);
+	pthread_mutex_lock(&(spool->lock));
+
+	if (spool->keys[keys_find(spool, &entry)].key) {
+		keys_remove(spool, &entry);
+		__atomic_sub_fetch(&(spool->num), 1, __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&(spool->lock));
+}
+
+int request_queue_spool_depth(struct request_queue_spool *spool)
+{
+	return __atomic_load_n(&(spool->num), __ATOMIC_SEQ_CST);
+}
+
+/* Free the spool and remove its segment files, the spooled items are lost */
+void request_queue_spool_close(struct request_queue_spool *spool)
+{
+	char path[PATH_MAX];
+
+	if (spool->write.records) {
+		for (unsigned long seq = spool->read.seq; seq <= spool->write.seq; seq++) {
+			segment_path(spool, seq, path);
+			unlink(path);
+		}
+	}
+
+	segment_unmap(&(spool->read));
+	segment_unmap(&(spool->write));
+	pthread_mutex_destroy(&(spool->lock));
+	free(spool->keys);
+	free(spool);
+}
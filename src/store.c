@@ -16,6 +16,7 @@
 
 
 #include "store.h"
+#include "store_dedup.h"
 #include "store_file.h"
 #include "store_memcached.h"
 #include "store_rados.h"
@@ -57,6 +58,12 @@ struct storage_backend * init_storage_backend(const char * options)
 		}
 	}
 
+	if (strstr(options, "dedup://") == options) {
+		g_logger(G_LOG_LEVEL_DEBUG, "init_storage_backend: initialising dedup storage backend at: %s", options);
+		store = init_storage_dedup(options);
+		return store;
+	}
+
 	if (strstr(options, "rados://") == options) {
 		g_logger(G_LOG_LEVEL_DEBUG, "init_storage_backend: initialising rados storage backend at: %s", options);
 		store = init_storage_rados(options);
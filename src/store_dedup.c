@@ -0,0 +1,788 @@
+/*
+ * Copyright (c) 2007 - 2023 by mod_tile contributors (see AUTHORS file)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see http://www.gnu.org/licenses/.
+ */
+
+/* Content addressed meta-tile file storage
+ *
+ * Meta-tiles are stored in the same tree as by the file storage, but
+ * tiles repeating across meta-tiles (e.g. open ocean or empty land) are
+ * stored once, as a blob named after the hash of the tile, in a blob
+ * store alongside the meta-tiles. The index entry of such a tile has the
+ * negated size of the tile and points at the hash of the blob in the
+ * meta-tile instead of at the tile.
+ *
+ * A tile becomes a blob when it is written a second time (or its blob
+ * already exists), so tiles occurring once cost no more than with the
+ * file storage. Blobs count the meta-tiles referencing them and are
+ * deleted when the last one is replaced or deleted. The count of a blob
+ * is changed with the blob locked. Meta-tiles are written and deleted
+ * under one of DEDUP_LOCKS locks picked by their path, so the blobs of a
+ * replaced meta-tile are released once, while other meta-tiles are
+ * written in parallel.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "g_logger.h"
+#include "metatile.h"
+#include "render_config.h"
+#include "store.h"
+#include "store_dedup.h"
+#include "store_file.h"
+#include "store_file_utils.h"
+
+// Hashes of recently written tiles and of their meta-tiles, a tile seen again in another meta-tile is stored as a blob
+#define DEDUP_SEEN_MAX 65536
+// Locks of the meta-tiles being written or deleted
+#define DEDUP_LOCKS 64
+// Attempts at reading a tile whose blob is replaced meanwhile, or at referencing a blob being deleted
+#define DEDUP_RETRIES 4
+// Returned by dedup_tile_read_once if the blob of the tile is gone
+#define DEDUP_BLOB_GONE -9
+
+struct dedup_ctx {
+	struct storage_backend *file;
+	char tile_dir[PATH_MAX];
+};
+
+static uint64_t seen[DEDUP_SEEN_MAX], seen_meta[DEDUP_SEEN_MAX];
+
+static uint64_t dedup_hash(const char *buf, int len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static void dedup_blob_path(struct dedup_ctx *ctx, uint64_t hash, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%s/%02x/%016" PRIx64, ctx->tile_dir, DEDUP_BLOB_DIR, (unsigned int)(hash >> 56), hash);
+}
+
+static int read_full(int fd, char *buf, size_t len, off_t offset)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		ssize_t got = pread(fd, buf + pos, len - pos, offset + pos);
+
+		if (got <= 0) {
+			return -1;
+		}
+
+		pos += got;
+	}
+
+	return 0;
+}
+
+/* Lock the meta-tile with the given path hash against other writers, returns the file
+ * descriptor to unlock it with or -1
+ */
+static int dedup_lock(struct dedup_ctx *ctx, uint64_t meta_hash)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s/.locks/%02x", ctx->tile_dir, DEDUP_BLOB_DIR, (unsigned int)(meta_hash % DEDUP_LOCKS));
+
+	if (mkdirp(path)) {
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT, 0666);
+
+	if (fd < 0) {
+		g_logger(G_LOG_LEVEL_WARNING, "Error opening meta-tile lock %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX)) {
+		g_logger(G_LOG_LEVEL_WARNING, "Error locking meta-tile lock %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void dedup_unlock(int fd)
+{
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+/* Open and lock an existing blob, returns -1 if there is none (errno ENOENT) or on errors.
+ * A blob deleted while waiting for the lock counts as none.
+ */
+static int dedup_blob_open(const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX) || fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_nlink == 0) {
+		close(fd);
+		errno = ENOENT;
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Create the blob of a tile with one reference. Returns 0, 1 if another writer created
+ * it first or -1 on errors.
+ */
+static int dedup_blob_create(const char *path, const char *tile, int size)
+{
+	char tmp[PATH_MAX];
+	struct dedup_blob blob;
+	int fd, ret;
+
+	if (mkdirp(path)) {
+		return -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+
+	if (fd < 0) {
+		g_logger(G_LOG_LEVEL_WARNING, "Error creating blob %s: %s", tmp, strerror(errno));
+		return -1;
+	}
+
+	memcpy(blob.magic, DEDUP_BLOB_MAGIC, sizeof(blob.magic));
+	blob.refs = 1;
+
+	if (write(fd, &blob, sizeof(blob)) != sizeof(blob) || write(fd, tile, size) != size) {
+		g_logger(G_LOG_LEVEL_WARNING, "Error writing blob %s: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	close(fd);
+
+	// Unlike rename, link does not replace a blob created meanwhile along with its references
+	ret = link(tmp, path) ? ((errno == EEXIST) ? 1 : -1) : 0;
+	unlink(tmp);
+	return ret;
+}
+
+/* Add a reference to the blob of a tile, creating it if needed. Returns -1 if the tile
+ * has to be stored in the meta-tile, i.e. on errors or hash collisions.
+ */
+static int dedup_blob_ref(struct dedup_ctx *ctx, uint64_t hash, const char *tile, int size)
+{
+	char path[PATH_MAX];
+	struct dedup_blob blob;
+	struct stat st;
+	char *data;
+	int attempt, fd, ret;
+
+	dedup_blob_path(ctx, hash, path, sizeof(path));
+
+	for (attempt = 0; attempt < DEDUP_RETRIES; attempt++) {
+		fd = dedup_blob_open(path);
+
+		if (fd >= 0) {
+			ret = -1;
+
+			if (fstat(fd, &st) == 0 && st.st_size == sizeof(blob) + size && read_full(fd, (char *)&blob, sizeof(blob), 0) == 0 && !memcmp(blob.magic, DEDUP_BLOB_MAGIC, sizeof(blob.magic))) {
+				data = malloc(size);
+
+				if (data && read_full(fd, data, size, sizeof(blob)) == 0 && !memcmp(data, tile, size)) {
+					blob.refs++;
+					ret = (pwrite(fd, &blob, sizeof(blob), 0) == sizeof(blob)) ? 0 : -1;
+				}
+
+				free(data);
+			}
+
+			close(fd);
+			return ret;
+		}
+
+		if (errno != ENOENT) {
+			return -1;
+		}
+
+		ret = dedup_blob_create(path, tile, size);
+
+		if (ret <= 0) {
+			return ret;
+		}
+	}
+
+	return -1;
+}
+
+/* Drop a reference to a blob, deleting it with the last one */
+static void dedup_blob_unref(struct dedup_ctx *ctx, uint64_t hash)
+{
+	char path[PATH_MAX];
+	struct dedup_blob blob;
+	int fd;
+
+	dedup_blob_path(ctx, hash, path, sizeof(path));
+	fd = dedup_blob_open(path);
+
+	if (fd < 0) {
+		return;
+	}
+
+	if (read_full(fd, (char *)&blob, sizeof(blob), 0) == 0) {
+		// Deleted while still locked, so nobody adds a reference to it meanwhile
+		if (--blob.refs <= 0) {
+			unlink(path);
+		} else if (pwrite(fd, &blob, sizeof(blob), 0) != sizeof(blob)) {
+			g_logger(G_LOG_LEVEL_WARNING, "Error writing blob %s: %s", path, strerror(errno));
+		}
+	}
+
+	close(fd);
+}
+
+/* Collect the distinct blobs referenced by a meta-tile, returns how many there are */
+static int dedup_meta_refs(const char *path, uint64_t *hashes)
+{
+	struct meta_layout *m = (struct meta_layout *)malloc(sizeof(struct meta_layout) + METATILE_MAX * METATILE_MAX * sizeof(struct entry));
+	int fd, i, j, num = 0;
+	uint64_t hash;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0 || m == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		free(m);
+		return 0;
+	}
+
+	if (read_full(fd, (char *)m, sizeof(struct meta_layout), 0) == 0 && !memcmp(m->magic, DEDUP_MAGIC, strlen(DEDUP_MAGIC)) &&
+			meta_layout_offset(m, m->x, m->y) == 0 && read_full(fd, (char *)m->index, m->count * sizeof(struct entry), sizeof(struct meta_layout)) == 0) {
+		for (i = 0; i < m->count; i++) {
+			if (m->index[i].size >= 0 || read_full(fd, (char *)&hash, sizeof(hash), m->index[i].offset)) {
+				continue;
+			}
+
+			for (j = 0; j < num && hashes[j] != hash; j++);
+
+			if (j == num) {
+				hashes[num++] = hash;
+			}
+		}
+	}
+
+	close(fd);
+	free(m);
+	return num;
+}
+
+static int dedup_tile_read_once(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int *compressed, char *log_msg)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+	unsigned int header_len = sizeof(struct meta_layout);
+	struct meta_layout *m = (struct meta_layout *)malloc(header_len);
+	struct entry index;
+	char path[PATH_MAX];
+	int meta_offset, fd, tile_size, file_offset = 0;
+	uint64_t hash;
+
+	xyzo_to_meta(path, sizeof(path), ctx->tile_dir, xmlconfig, options, x, y, z);
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		snprintf(log_msg, PATH_MAX - 1, "Could not open metatile %s. Reason: %s\n", path, strerror(errno));
+		free(m);
+		return -1;
+	}
+
+	if (read_full(fd, (char *)m, header_len, 0)) {
+		snprintf(log_msg, PATH_MAX - 1, "Meta file %s too small to contain header\n", path);
+		close(fd);
+		free(m);
+		return -3;
+	}
+
+	*compressed = !memcmp(m->magic, META_MAGIC_COMPRESSED, strlen(META_MAGIC_COMPRESSED));
+
+	if (memcmp(m->magic, META_MAGIC, strlen(META_MAGIC)) && memcmp(m->magic, DEDUP_MAGIC, strlen(DEDUP_MAGIC)) && !*compressed) {
+		snprintf(log_msg, PATH_MAX - 1, "Meta file %s header magic mismatch\n", path);
+		close(fd);
+		free(m);
+		return -4;
+	}
+
+	meta_offset = meta_layout_offset(m, x, y);
+
+	if (meta_offset < 0) {
+		snprintf(log_msg, PATH_MAX - 1, "Meta file %s header bad count %d for tile %d/%d/%d\n", path, m->count, z, x, y);
+		close(fd);
+		free(m);
+		return -5;
+	}
+
+	if (read_full(fd, (char *)&index, sizeof(index), header_len + meta_offset * sizeof(struct entry))) {
+		snprintf(log_msg, PATH_MAX - 1, "Meta file %s too small to contain header\n", path);
+		close(fd);
+		free(m);
+		return -3;
+	}
+
+	tile_size = index.size;
+
+	if (tile_size < 0) {
+		// The tile is a blob, the meta-tile only holds its hash
+		tile_size = -tile_size;
+
+		if (read_full(fd, (char *)&hash, sizeof(hash), index.offset)) {
+			snprintf(log_msg, PATH_MAX - 1, "Failed to read blob hash from file %s\n", path);
+			close(fd);
+			free(m);
+			return -8;
+		}
+
+		close(fd);
+		dedup_blob_path(ctx, hash, path, sizeof(path));
+		fd = open(path, O_RDONLY);
+
+		if (fd < 0) {
+			snprintf(log_msg, PATH_MAX - 1, "Could not open blob %s. Reason: %s\n", path, strerror(errno));
+			free(m);
+			return (errno == ENOENT) ? DEDUP_BLOB_GONE : -1;
+		}
+
+		file_offset = sizeof(struct dedup_blob);
+	} else {
+		file_offset = index.offset;
+	}
+
+	free(m);
+
+	if ((size_t)tile_size > sz) {
+		snprintf(log_msg, PATH_MAX - 1, "Truncating tile %d to fit buffer of %zd\n", tile_size, sz);
+		close(fd);
+		return -6;
+	}
+
+	if (read_full(fd, buf, tile_size, file_offset)) {
+		snprintf(log_msg, PATH_MAX - 1, "Failed to read data from file %s. Reason: %s\n", path, strerror(errno));
+		close(fd);
+		return -8;
+	}
+
+	close(fd);
+	return tile_size;
+}
+
+/* The blob of a tile is only deleted after its meta-tile was replaced, so a blob that
+ * is gone means the meta-tile has to be read again
+ */
+static int dedup_tile_read(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int *compressed, char *log_msg)
+{
+	int attempt, ret;
+
+	for (attempt = 0; attempt < DEDUP_RETRIES; attempt++) {
+		ret = dedup_tile_read_once(store, xmlconfig, options, x, y, z, buf, sz, compressed, log_msg);
+
+		if (ret != DEDUP_BLOB_GONE) {
+			return ret;
+		}
+	}
+
+	return -1;
+}
+
+static struct stat_info dedup_tile_stat(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+
+	return ctx->file->tile_stat(ctx->file, xmlconfig, options, x, y, z);
+}
+
+static char *dedup_tile_storage_id(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z, char *string)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+	char meta_path[PATH_MAX];
+
+	xyzo_to_meta(meta_path, sizeof(meta_path), ctx->tile_dir, xmlconfig, options, x, y, z);
+	snprintf(string, PATH_MAX - 1, "dedup://%s", meta_path);
+	return string;
+}
+
+/* Check that a meta-tile is a plain one, with all tiles within the buffer */
+static int dedup_meta_valid(const char *buf, int sz)
+{
+	const struct meta_layout *m = (const struct meta_layout *)buf;
+	int header_len, i;
+
+	if (sz < (int)sizeof(struct meta_layout) || memcmp(m->magic, META_MAGIC, strlen(META_MAGIC)) || meta_layout_offset(m, m->x, m->y) != 0) {
+		return 0;
+	}
+
+	header_len = sizeof(struct meta_layout) + m->count * sizeof(struct entry);
+
+	if (sz < header_len) {
+		return 0;
+	}
+
+	for (i = 0; i < m->count; i++) {
+		if (m->index[i].size < 0 || m->index[i].offset < header_len || m->index[i].offset > sz - m->index[i].size) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int dedup_metatile_write(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z, const char *buf, int sz)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+	const struct meta_layout *m = (const struct meta_layout *)buf;
+	struct meta_layout *out_m;
+	uint64_t hashes[METATILE_MAX * METATILE_MAX], refs[METATILE_MAX * METATILE_MAX], old_refs[METATILE_MAX * METATILE_MAX];
+	int shared[METATILE_MAX * METATILE_MAX], blob[METATILE_MAX * METATILE_MAX];
+	char path[PATH_MAX], meta_path[PATH_MAX];
+	int i, j, fd, num_refs = 0, num_old_refs, offset = 0, ret;
+	uint64_t meta_hash, slot;
+	char *out = NULL;
+
+	xyzo_to_meta(meta_path, sizeof(meta_path), ctx->tile_dir, xmlconfig, options, x, y, z);
+	meta_hash = dedup_hash(meta_path, strlen(meta_path));
+
+	// Only plain meta-tiles are deduplicated, anything else is stored as it is
+	if (dedup_meta_valid(buf, sz)) {
+		out = malloc(sz + m->count * sizeof(uint64_t));
+	}
+
+	if (out) {
+		for (i = 0; i < m->count; i++) {
+			// Identical tiles within the meta-tile already share their payload
+			for (shared[i] = 0; shared[i] < i; shared[i]++) {
+				if (m->index[shared[i]].offset == m->index[i].offset && m->index[shared[i]].size == m->index[i].size) {
+					break;
+				}
+			}
+
+			blob[i] = 0;
+
+			if (shared[i] < i || m->index[i].size == 0) {
+				continue;
+			}
+
+			hashes[i] = dedup_hash(buf + m->index[i].offset, m->index[i].size);
+
+			// Re-rendering the same meta-tile does not make its tiles repeat
+			slot = hashes[i] % DEDUP_SEEN_MAX;
+
+			if (__atomic_exchange_n(&seen[slot], hashes[i], __ATOMIC_RELAXED) == hashes[i] && __atomic_exchange_n(&seen_meta[slot], meta_hash, __ATOMIC_RELAXED) != meta_hash) {
+				blob[i] = 1;
+			} else {
+				__atomic_store_n(&seen_meta[slot], meta_hash, __ATOMIC_RELAXED);
+				dedup_blob_path(ctx, hashes[i], path, sizeof(path));
+				blob[i] = (access(path, F_OK) == 0);
+			}
+		}
+	}
+
+	fd = dedup_lock(ctx, meta_hash);
+
+	if (fd < 0) {
+		free(out);
+		return -1;
+	}
+
+	if (out) {
+		out_m = (struct meta_layout *)out;
+		offset = sizeof(struct meta_layout) + m->count * sizeof(struct entry);
+		memcpy(out, buf, offset);
+
+		for (i = 0; i < m->count; i++) {
+			// A blob is referenced once per meta-tile, like dedup_meta_refs counts it, tiles repeating
+			// it at another offset share the hash entry of the first one
+			for (j = 0; blob[i] && j < i && !(shared[j] == j && out_m->index[j].size < 0 && hashes[j] == hashes[i]); j++);
+
+			if (shared[i] < i) {
+				out_m->index[i] = out_m->index[shared[i]];
+			} else if (blob[i] && j < i) {
+				out_m->index[i] = out_m->index[j];
+			} else if (blob[i] && dedup_blob_ref(ctx, hashes[i], buf + m->index[i].offset, m->index[i].size) == 0) {
+				refs[num_refs++] = hashes[i];
+				memcpy(out + offset, &hashes[i], sizeof(uint64_t));
+				out_m->index[i].offset = offset;
+				out_m->index[i].size = -m->index[i].size;
+				offset += sizeof(uint64_t);
+			} else {
+				memcpy(out + offset, buf + m->index[i].offset, m->index[i].size);
+				out_m->index[i].offset = offset;
+				offset += m->index[i].size;
+			}
+		}
+
+		memcpy(out_m->magic, DEDUP_MAGIC, strlen(DEDUP_MAGIC));
+	}
+
+	num_old_refs = dedup_meta_refs(meta_path, old_refs);
+
+	if (num_refs > 0) {
+		ret = ctx->file->metatile_write(ctx->file, xmlconfig, options, x, y, z, out, offset);
+	} else {
+		ret = ctx->file->metatile_write(ctx->file, xmlconfig, options, x, y, z, buf, sz);
+	}
+
+	// Drop the blobs of the replaced meta-tile, or of the new one if it failed to be written
+	if (ret < 0) {
+		for (i = 0; i < num_refs; i++) {
+			dedup_blob_unref(ctx, refs[i]);
+		}
+	} else {
+		for (i = 0; i < num_old_refs; i++) {
+			dedup_blob_unref(ctx, old_refs[i]);
+		}
+	}
+
+	dedup_unlock(fd);
+	free(out);
+
+	return (ret < 0) ? -1 : sz;
+}
+
+static int dedup_metatile_delete(struct storage_backend *store, const char *xmlconfig, int x, int y, int z)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+	uint64_t refs[METATILE_MAX * METATILE_MAX];
+	char meta_path[PATH_MAX];
+	int i, fd, num_refs, ret;
+
+	xyz_to_meta(meta_path, sizeof(meta_path), ctx->tile_dir, xmlconfig, x, y, z);
+	fd = dedup_lock(ctx, dedup_hash(meta_path, strlen(meta_path)));
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	num_refs = dedup_meta_refs(meta_path, refs);
+	ret = ctx->file->metatile_delete(ctx->file, xmlconfig, x, y, z);
+
+	if (ret == 0) {
+		for (i = 0; i < num_refs; i++) {
+			dedup_blob_unref(ctx, refs[i]);
+		}
+	}
+
+	dedup_unlock(fd);
+	return ret;
+}
+
+static int dedup_metatile_expire(struct storage_backend *store, const char *xmlconfig, int x, int y, int z)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+
+	return ctx->file->metatile_expire(ctx->file, xmlconfig, x, y, z);
+}
+
+/* Read a meta-tile back with the tiles of its blobs in place, as it was written */
+static int dedup_metatile_read(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+	struct meta_layout *m, *out_m = (struct meta_layout *)buf;
+	char path[PATH_MAX];
+	int i, j, fd, len, header_len, offset, ret = -1;
+	uint64_t hash;
+	char *raw;
+
+	len = ctx->file->metatile_read(ctx->file, xmlconfig, options, x, y, z, NULL, 0);
+
+	if (len < (int)sizeof(struct meta_layout) || (raw = malloc(len)) == NULL) {
+		return -1;
+	}
+
+	if (ctx->file->metatile_read(ctx->file, xmlconfig, options, x, y, z, raw, len) != len) {
+		free(raw);
+		return -1;
+	}
+
+	m = (struct meta_layout *)raw;
+
+	// Plain meta-tiles are stored as they are
+	if (memcmp(m->magic, DEDUP_MAGIC, strlen(DEDUP_MAGIC))) {
+		if ((size_t)len <= sz) {
+			memcpy(buf, raw, len);
+		}
+
+		free(raw);
+		return len;
+	}
+
+	header_len = sizeof(struct meta_layout) + m->count * sizeof(struct entry);
+
+	if (meta_layout_offset(m, m->x, m->y) != 0 || len < header_len) {
+		free(raw);
+		return -1;
+	}
+
+	// Tiles sharing a payload or a blob keep sharing it
+	for (i = 0, offset = header_len; i < m->count; i++) {
+		for (j = 0; j < i && m->index[j].offset != m->index[i].offset; j++);
+
+		offset += (j < i) ? 0 : abs(m->index[i].size);
+	}
+
+	if ((size_t)offset > sz) {
+		free(raw);
+		return offset;
+	}
+
+	memcpy(buf, raw, header_len);
+	memcpy(out_m->magic, META_MAGIC, strlen(META_MAGIC));
+
+	for (i = 0, offset = header_len; i < m->count; i++) {
+		int size = abs(m->index[i].size);
+
+		out_m->index[i].offset = offset;
+		out_m->index[i].size = size;
+
+		if (m->index[i].offset < header_len || m->index[i].offset > len - ((m->index[i].size < 0) ? (int)sizeof(hash) : size)) {
+			break;
+		}
+
+		for (j = 0; j < i && m->index[j].offset != m->index[i].offset; j++);
+
+		if (j < i) {
+			out_m->index[i].offset = out_m->index[j].offset;
+			continue;
+		} else if (m->index[i].size >= 0) {
+			memcpy(buf + offset, raw + m->index[i].offset, size);
+		} else {
+			memcpy(&hash, raw + m->index[i].offset, sizeof(hash));
+			dedup_blob_path(ctx, hash, path, sizeof(path));
+			fd = open(path, O_RDONLY);
+
+			if (fd < 0) {
+				break;
+			}
+
+			j = read_full(fd, buf + offset, size, sizeof(struct dedup_blob));
+			close(fd);
+
+			if (j) {
+				break;
+			}
+		}
+
+		offset += size;
+	}
+
+	if (i == m->count) {
+		ret = offset;
+	}
+
+	free(raw);
+	return ret;
+}
+
+static int dedup_metatile_touch(struct storage_backend *store, const char *xmlconfig, const char *options, int x, int y, int z)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+
+	return ctx->file->metatile_touch(ctx->file, xmlconfig, options, x, y, z);
+}
+
+static int dedup_close_storage(struct storage_backend *store)
+{
+	struct dedup_ctx *ctx = (struct dedup_ctx *)(store->storage_ctx);
+
+	ctx->file->close_storage(ctx->file);
+	free(ctx->file);
+	free(ctx);
+	store->storage_ctx = NULL;
+	return 0;
+}
+
+struct storage_backend *init_storage_dedup(const char *connection_string)
+{
+	struct storage_backend *store;
+	struct dedup_ctx *ctx;
+	struct stat st;
+	const char *tile_dir = connection_string + strlen("dedup://");
+
+	if (stat(tile_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		g_logger(G_LOG_LEVEL_ERROR, "init_storage_dedup: %s is not a directory", tile_dir);
+		return NULL;
+	}
+
+	store = malloc(sizeof(struct storage_backend));
+	ctx = malloc(sizeof(struct dedup_ctx));
+
+	if (store == NULL || ctx == NULL) {
+		g_logger(G_LOG_LEVEL_ERROR, "init_storage_dedup: Failed to allocate memory for storage backend");
+		free(store);
+		free(ctx);
+		return NULL;
+	}
+
+	snprintf(ctx->tile_dir, sizeof(ctx->tile_dir), "%s", tile_dir);
+	ctx->file = init_storage_file(tile_dir);
+
+	if (ctx->file == NULL) {
+		free(store);
+		free(ctx);
+		return NULL;
+	}
+
+	store->storage_ctx = ctx;
+	store->tile_read = &dedup_tile_read;
+	store->tile_stat = &dedup_tile_stat;
+	store->metatile_write = &dedup_metatile_write;
+	store->metatile_delete = &dedup_metatile_delete;
+	store->metatile_expire = &dedup_metatile_expire;
+	store->metatile_read = &dedup_metatile_read;
+	store->metatile_touch = &dedup_metatile_touch;
+	store->tile_storage_id = &dedup_tile_storage_id;
+	store->close_storage = &dedup_close_storage;
+
+	return store;
+}
@@ -70,11 +70,12 @@ static int file_tile_read(struct storage_backend * store, const char *xmlconfig,
 	char path[PATH_MAX];
 	int meta_offset, fd;
 	unsigned int pos;
-	unsigned int header_len = sizeof(struct meta_layout) + METATILE * METATILE * sizeof(struct entry);
+	unsigned int header_len = sizeof(struct meta_layout);
 	struct meta_layout *m = (struct meta_layout *)malloc(header_len);
+	struct entry index;
 	size_t file_offset, tile_size;
 
-	meta_offset = xyzo_to_meta(path, sizeof(path), store->storage_ctx, xmlconfig, options, x, y, z);
+	xyzo_to_meta(path, sizeof(path), store->storage_ctx, xmlconfig, options, x, y, z);
 
 	fd = open(path, O_RDONLY);
 
@@ -122,19 +123,27 @@ static int file_tile_read(struct storage_backend * store, const char *xmlconfig,
 		*compressed = 0;
 	}
 
-	// Currently this code only works with fixed metatile sizes (due to xyz_to_meta above)
-	if (m->count != (METATILE * METATILE)) {
-		snprintf(log_msg, PATH_MAX - 1, "Meta file %s header bad count %d != %d\n", path, m->count, METATILE * METATILE);
+	// The meta-tile may have been written with another size than the one configured now
+	meta_offset = meta_layout_offset(m, x, y);
+
+	if (meta_offset < 0) {
+		snprintf(log_msg, PATH_MAX - 1, "Meta file %s header bad count %d for tile %d/%d/%d\n", path, m->count, z, x, y);
 		free(m);
 		close(fd);
 		return -5;
 	}
 
-	file_offset = m->index[meta_offset].offset;
-	tile_size   = m->index[meta_offset].size;
-
 	free(m);
 
+	if (pread(fd, &index, sizeof(index), header_len + meta_offset * sizeof(struct entry)) != sizeof(index)) {
+		snprintf(log_msg, PATH_MAX - 1, "Meta file %s too small to contain header\n", path);
+		close(fd);
+		return -3;
+	}
+
+	file_offset = index.offset;
+	tile_size   = index.size;
+
 	if (tile_size > sz) {
 		snprintf(log_msg, PATH_MAX - 1, "Truncating tile %zd to fit buffer of %zd\n", tile_size, sz);
 		tile_size = sz;
@@ -296,6 +305,63 @@ static int file_metatile_expire(struct storage_backend * store, const char *xmlc
 	return 0;
 }
 
+static int file_metatile_read(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz)
+{
+	char name[PATH_MAX];
+	struct stat s;
+	size_t pos = 0;
+	int fd;
+
+	xyzo_to_meta(name, sizeof(name), store->storage_ctx, xmlconfig, options, x, y, z);
+	fd = open(name, O_RDONLY);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (fstat(fd, &s) < 0 || s.st_size > INT_MAX) {
+		close(fd);
+		return -1;
+	}
+
+	while (pos < (size_t)s.st_size && (size_t)s.st_size <= sz) {
+		ssize_t got = read(fd, buf + pos, s.st_size - pos);
+
+		if (got <= 0) {
+			close(fd);
+			return -1;
+		}
+
+		pos += got;
+	}
+
+	close(fd);
+	return s.st_size;
+}
+
+static int file_metatile_touch(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z)
+{
+	char name[PATH_MAX];
+	struct stat s;
+	struct utimbuf touchTime;
+
+	xyzo_to_meta(name, sizeof(name), store->storage_ctx, xmlconfig, options, x, y, z);
+
+	if (stat(name, &s) < 0) {
+		return -1;
+	}
+
+	touchTime.actime = s.st_atime; // Don't modify atime, as that is used for tile cache purging
+	touchTime.modtime = time(NULL);
+
+	if (utime(name, &touchTime) < 0) {
+		g_logger(G_LOG_LEVEL_WARNING, "Failed to touch metatile %s: %s", name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 static int file_close_storage(struct storage_backend * store)
 {
 	free(store->storage_ctx);
@@ -320,6 +386,8 @@ struct storage_backend * init_storage_file(const char * tile_dir)
 	store->metatile_write = &file_metatile_write;
 	store->metatile_delete = &file_metatile_delete;
 	store->metatile_expire = &file_metatile_expire;
+	store->metatile_read = &file_metatile_read;
+	store->metatile_touch = &file_metatile_touch;
 	store->tile_storage_id = &file_tile_storage_id;
 	store->close_storage = &file_close_storage;
 
@@ -23,12 +23,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "protocol.h"
 #include "render_config.h"
 #include "store_file.h"
 #include "store_file_utils.h"
 #include "g_logger.h"
+#include "metatile.h"
 
 // Build parent directories for the specified file name
 // Note: the part following the trailing / is ignored
@@ -171,15 +173,103 @@ int path_to_xyz(const char *tilepath, const char *path, char *xmlconfig, int *px
 }
 
 #ifdef METATILE
+/* Styles with meta-tile sizes other than METATILE. Sizes can be set while meta-tiles
+ * are read and written (renderd reloads its styles), so a table is never changed once
+ * published, setting sizes publishes a changed copy instead. Replaced tables are not
+ * freed, as readers may still be looking at them, reloads are rare enough for that.
+ */
+struct metatile_size_table {
+	int num;
+	struct {
+		char xmlconfig[XMLCONFIG_MAX];
+		int sizes[MAX_ZOOM + 1];
+	} styles[XMLCONFIGS_MAX];
+};
+static struct metatile_size_table *metatile_sizes;
+static pthread_mutex_t metatile_sizes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void metatile_size_set(const char *xmlconfig, const int *sizes)
+{
+	struct metatile_size_table *table;
+	int i;
+
+	pthread_mutex_lock(&metatile_sizes_lock);
+	table = (struct metatile_size_table *)calloc(1, sizeof(struct metatile_size_table));
+
+	if (table == NULL) {
+		g_logger(G_LOG_LEVEL_ERROR, "Failed to allocate memory for meta-tile sizes");
+		pthread_mutex_unlock(&metatile_sizes_lock);
+		return;
+	}
+
+	if (metatile_sizes != NULL) {
+		memcpy(table, metatile_sizes, sizeof(struct metatile_size_table));
+	}
+
+	for (i = 0; i < table->num && strcmp(table->styles[i].xmlconfig, xmlconfig); i++);
+
+	if (i == XMLCONFIGS_MAX) {
+		g_logger(G_LOG_LEVEL_ERROR, "Can't set meta-tile sizes of more than %i styles", XMLCONFIGS_MAX);
+		free(table);
+		pthread_mutex_unlock(&metatile_sizes_lock);
+		return;
+	}
+
+	strncpy(table->styles[i].xmlconfig, xmlconfig, XMLCONFIG_MAX - 1);
+	memcpy(table->styles[i].sizes, sizes, sizeof(table->styles[i].sizes));
+
+	if (i == table->num) {
+		table->num++;
+	}
+
+	__atomic_store_n(&metatile_sizes, table, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&metatile_sizes_lock);
+}
+
+int metatile_size(const char *xmlconfig, int z)
+{
+	const struct metatile_size_table *table = __atomic_load_n(&metatile_sizes, __ATOMIC_ACQUIRE);
+	int i;
+
+	if (z < 0 || z > MAX_ZOOM || table == NULL) {
+		return METATILE;
+	}
+
+	for (i = 0; i < table->num; i++) {
+		if (!strcmp(table->styles[i].xmlconfig, xmlconfig)) {
+			return table->styles[i].sizes[z];
+		}
+	}
+
+	return METATILE;
+}
+
+// The size of a meta-tile is given by its count, so that readers handle meta-tiles of any size
+int meta_layout_offset(const struct meta_layout *m, int x, int y)
+{
+	int size = 1;
+
+	while (size * size < m->count && size < METATILE_MAX) {
+		size <<= 1;
+	}
+
+	if (size * size != m->count || x < m->x || x >= m->x + size || y < m->y || y >= m->y + size) {
+		return -1;
+	}
+
+	return (x - m->x) * size + (y - m->y);
+}
+
 // Returns the path to the meta-tile and the offset within the meta-tile
 int xyzo_to_meta(char *path, size_t len, const char *tile_dir, const char *xmlconfig, const char *options, int x, int y, int z)
 {
-	unsigned char i, hash[5], offset, mask;
+	unsigned char i, hash[5];
+	int offset, mask, size = metatile_size(xmlconfig, z);
 
 	// Each meta tile winds up in its own file, with several in each leaf directory
 	// the .meta tile name is beasd on the sub-tile at (0,0)
-	mask = METATILE - 1;
-	offset = (x & mask) * METATILE + (y & mask);
+	mask = size - 1;
+	offset = (x & mask) * size + (y & mask);
 	x &= ~mask;
 	y &= ~mask;
 
@@ -38,6 +38,7 @@
 
 #include "store.h"
 #include "metatile.h"
+#include "store_file_utils.h"
 #include "render_config.h"
 #include "protocol.h"
 #include "g_logger.h"
@@ -48,7 +49,7 @@ static char * memcached_xyzo_to_storagekey(const char *xmlconfig, const char *op
 {
 	int mask;
 
-	mask = METATILE - 1;
+	mask = metatile_size(xmlconfig, z) - 1;
 	x &= ~mask;
 	y &= ~mask;
 
@@ -71,18 +72,15 @@ static int memcached_tile_read(struct storage_backend * store, const char *xmlco
 
 	char meta_path[PATH_MAX];
 	int meta_offset;
-	unsigned int header_len = sizeof(struct meta_layout) + METATILE * METATILE * sizeof(struct entry);
+	unsigned int header_len = sizeof(struct meta_layout);
 	struct meta_layout *m = (struct meta_layout *)malloc(header_len);
+	struct entry index;
 	size_t file_offset, tile_size;
-	int mask;
 	uint32_t flags;
 	size_t len;
 	memcached_return_t rc;
 	char * buf_raw;
 
-	mask = METATILE - 1;
-	meta_offset = (x & mask) * METATILE + (y & mask);
-
 	memcached_xyzo_to_storagekey(xmlconfig, options, x, y, z, meta_path);
 	buf_raw = memcached_get(store->storage_ctx, meta_path, strlen(meta_path), &len, &flags, &rc);
 
@@ -105,15 +103,18 @@ static int memcached_tile_read(struct storage_backend * store, const char *xmlco
 		*compressed = 0;
 	}
 
-	// Currently this code only works with fixed metatile sizes (due to xyz_to_meta above)
-	if (m->count != (METATILE * METATILE)) {
-		snprintf(log_msg, 1024, "Meta file header bad count %d != %d\n", m->count, METATILE * METATILE);
+	// The meta-tile may have been written with another size than the one configured now
+	meta_offset = meta_layout_offset(m, x, y);
+
+	if (meta_offset < 0) {
+		snprintf(log_msg, 1024, "Meta file header bad count %d for tile %d/%d/%d\n", m->count, z, x, y);
 		free(m);
 		return -5;
 	}
 
-	file_offset = m->index[meta_offset].offset + sizeof(struct stat_info);
-	tile_size   = m->index[meta_offset].size;
+	memcpy(&index, buf_raw + sizeof(struct stat_info) + header_len + meta_offset * sizeof(struct entry), sizeof(index));
+	file_offset = index.offset + sizeof(struct stat_info);
+	tile_size   = index.size;
 
 	free(m);
 
@@ -132,16 +133,14 @@ static struct stat_info memcached_tile_stat(struct storage_backend * store, cons
 {
 	struct stat_info tile_stat;
 	char meta_path[PATH_MAX];
-	unsigned int header_len = sizeof(struct meta_layout) + METATILE * METATILE * sizeof(struct entry);
+	unsigned int header_len = sizeof(struct meta_layout);
 	struct meta_layout *m = (struct meta_layout *)malloc(header_len);
+	struct entry index;
 	char * buf;
 	size_t len;
 	uint32_t flags;
 	memcached_return_t rc;
-	int offset, mask;
-
-	mask = METATILE - 1;
-	offset = (x & mask) * METATILE + (y & mask);
+	int offset;
 
 	memcached_xyzo_to_storagekey(xmlconfig, options, x, y, z, meta_path);
 	buf = memcached_get(store->storage_ctx, meta_path, strlen(meta_path), &len, &flags, &rc);
@@ -158,7 +157,14 @@ static struct stat_info memcached_tile_stat(struct storage_backend * store, cons
 
 	memcpy(&tile_stat, buf, sizeof(struct stat_info));
 	memcpy(m, buf + sizeof(struct stat_info), header_len);
-	tile_stat.size = m->index[offset].size;
+	offset = meta_layout_offset(m, x, y);
+
+	if (offset < 0) {
+		tile_stat.size = -1;
+	} else {
+		memcpy(&index, buf + sizeof(struct stat_info) + header_len + offset * sizeof(struct entry), sizeof(index));
+		tile_stat.size = index.size;
+	}
 
 	free(m);
 	free(buf);
@@ -312,6 +318,8 @@ struct storage_backend * init_storage_memcached(const char * connection_string)
 	store->metatile_write = &memcached_metatile_write;
 	store->metatile_delete = &memcached_metatile_delete;
 	store->metatile_expire = &memcached_metatile_expire;
+	store->metatile_read = NULL;
+	store->metatile_touch = NULL;
 	store->tile_storage_id = &memcached_tile_storage_id;
 	store->close_storage = &memcached_close_storage;
 
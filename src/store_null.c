@@ -103,6 +103,8 @@ struct storage_backend *init_storage_null()
 	store->metatile_write = &metatile_write;
 	store->metatile_delete = &metatile_delete;
 	store->metatile_expire = &metatile_expire;
+	store->metatile_read = NULL;
+	store->metatile_touch = NULL;
 	store->tile_storage_id = &tile_storage_id;
 	store->close_storage = &close_storage;
 
@@ -41,6 +41,7 @@
 #include "store.h"
 #include "store_rados.h"
 #include "metatile.h"
+#include "store_file_utils.h"
 #include "render_config.h"
 #include "protocol.h"
 #include "g_logger.h"
@@ -67,7 +68,7 @@ static char * rados_xyzo_to_storagekey(const char *xmlconfig, const char *option
 {
 	int mask;
 
-	mask = METATILE - 1;
+	mask = metatile_size(xmlconfig, z) - 1;
 	x &= ~mask;
 	y &= ~mask;
 
@@ -86,9 +87,10 @@ static char * read_meta_data(struct storage_backend * store, const char *xmlconf
 	int err;
 	char meta_path[PATH_MAX];
 	struct rados_ctx * ctx = (struct rados_ctx *)store->storage_ctx;
-	unsigned int header_len = sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE * METATILE * sizeof(struct entry);
+	// Large enough for the index of a meta-tile of any size, shorter meta-tiles just read less
+	unsigned int header_len = sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE_MAX * METATILE_MAX * sizeof(struct entry);
 
-	mask = METATILE - 1;
+	mask = metatile_size(xmlconfig, z) - 1;
 	x &= ~mask;
 	y &= ~mask;
 
@@ -127,16 +129,13 @@ static int rados_tile_read(struct storage_backend * store, const char *xmlconfig
 
 	char meta_path[PATH_MAX];
 	int meta_offset;
-	unsigned int header_len = sizeof(struct meta_layout) + METATILE * METATILE * sizeof(struct entry);
+	unsigned int header_len = sizeof(struct meta_layout);
 	struct meta_layout *m = (struct meta_layout *)malloc(header_len);
+	struct entry index;
 	size_t file_offset, tile_size;
-	int mask;
 	int err;
 	char * buf_raw;
 
-	mask = METATILE - 1;
-	meta_offset = (x & mask) * METATILE + (y & mask);
-
 	rados_xyzo_to_storagekey(xmlconfig, options, x, y, z, meta_path);
 
 	buf_raw = read_meta_data(store, xmlconfig, options, x, y, z);
@@ -161,15 +160,18 @@ static int rados_tile_read(struct storage_backend * store, const char *xmlconfig
 		*compressed = 0;
 	}
 
-	// Currently this code only works with fixed metatile sizes (due to xyz_to_meta above)
-	if (m->count != (METATILE * METATILE)) {
-		snprintf(log_msg, 1024, "Meta file header bad count %d != %d\n", m->count, METATILE * METATILE);
+	// The meta-tile may have been written with another size than the one configured now
+	meta_offset = meta_layout_offset(m, x, y);
+
+	if (meta_offset < 0) {
+		snprintf(log_msg, 1024, "Meta file header bad count %d for tile %d/%d/%d\n", m->count, z, x, y);
 		free(m);
 		return -5;
 	}
 
-	file_offset = m->index[meta_offset].offset + sizeof(struct stat_info);
-	tile_size   = m->index[meta_offset].size;
+	memcpy(&index, buf_raw + sizeof(struct stat_info) + header_len + meta_offset * sizeof(struct entry), sizeof(index));
+	file_offset = index.offset + sizeof(struct stat_info);
+	tile_size   = index.size;
 
 	free(m);
 
@@ -193,10 +195,7 @@ static struct stat_info rados_tile_stat(struct storage_backend * store, const ch
 {
 	struct stat_info tile_stat;
 	char * buf;
-	int offset, mask;
-
-	mask = METATILE - 1;
-	offset = (x & mask) * METATILE + (y & mask);
+	int offset;
 
 	buf = read_meta_data(store, xmlconfig, options, x, y, z);
 
@@ -210,7 +209,8 @@ static struct stat_info rados_tile_stat(struct storage_backend * store, const ch
 	}
 
 	memcpy(&tile_stat, buf, sizeof(struct stat_info));
-	tile_stat.size = ((struct meta_layout *)(buf + sizeof(struct stat_info)))->index[offset].size;
+	offset = meta_layout_offset((struct meta_layout *)(buf + sizeof(struct stat_info)), x, y);
+	tile_stat.size = offset < 0 ? -1 : ((struct meta_layout *)(buf + sizeof(struct stat_info)))->index[offset].size;
 
 	return tile_stat;
 }
@@ -409,7 +409,7 @@ struct storage_backend * init_storage_rados(const char * connection_string)
 
 	g_logger(G_LOG_LEVEL_DEBUG, "init_storage_rados: Initialised rados backend for pool %s with config %s", ctx->pool, conf);
 
-	ctx->metadata_cache.data = malloc(sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE * METATILE * sizeof(struct entry));
+	ctx->metadata_cache.data = malloc(sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE_MAX * METATILE_MAX * sizeof(struct entry));
 
 	if (ctx->metadata_cache.data == NULL) {
 		rados_ioctx_destroy(ctx->io);
@@ -434,6 +434,8 @@ struct storage_backend * init_storage_rados(const char * connection_string)
 	store->metatile_write = &rados_metatile_write;
 	store->metatile_delete = &rados_metatile_delete;
 	store->metatile_expire = &rados_metatile_expire;
+	store->metatile_read = NULL;
+	store->metatile_touch = NULL;
 	store->tile_storage_id = &rados_tile_storage_id;
 	store->close_storage = &rados_close_storage;
 
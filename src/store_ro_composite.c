@@ -291,6 +291,8 @@ struct storage_backend * init_storage_ro_composite(const char * connection_strin
 	store->metatile_write = &ro_composite_metatile_write;
 	store->metatile_delete = &ro_composite_metatile_delete;
 	store->metatile_expire = &ro_composite_metatile_expire;
+	store->metatile_read = NULL;
+	store->metatile_touch = NULL;
 	store->tile_storage_id = &ro_composite_tile_storage_id;
 	store->close_storage = &ro_composite_close_storage;
 
@@ -326,6 +326,8 @@ struct storage_backend * init_storage_ro_http_proxy(const char * connection_stri
 	store->metatile_write = &ro_http_proxy_metatile_write;
 	store->metatile_delete = &ro_http_proxy_metatile_delete;
 	store->metatile_expire = &ro_http_proxy_metatile_expire;
+	store->metatile_read = NULL;
+	store->metatile_touch = NULL;
 	store->tile_storage_id = &ro_http_proxy_tile_storage_id;
 	store->close_storage = &ro_http_proxy_close_storage;
 
@@ -17,23 +17,38 @@
 
 // https://github.com/catchorg/Catch2/blob/v2.13.9/docs/own-main.md#let-catch2-take-full-control-of-args-and-config
 #define CATCH_CONFIG_RUNNER
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <dirent.h>
 #include <glib.h>
+#include <mapnik/datasource_cache.hpp>
+#include <mapnik/image.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/load_map.hpp>
+#include <mapnik/map.hpp>
 #include <mapnik/version.hpp>
 #include <math.h>
+#include <new>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <time.h>
 #include <tuple>
 #include <unistd.h>
+#include <vector>
 
 #if MAPNIK_MAJOR_VERSION >= 4
 #include <mapnik/geometry/box2d.hpp>
@@ -52,14 +67,26 @@
 #include "render_config.h"
 #include "renderd.h"
 #include "request_queue.h"
+#include "request_queue_journal.h"
+#include "request_queue_spool.h"
 #include "store.h"
+#include "store_dedup.h"
+#include "store_file_utils.h"
 
 #define NO_QUEUE_REQUESTS 9
 #define NO_TEST_REPEATS 100
 #define NO_THREADS 100
+#define NO_BENCHMARK_REQUESTS 200
+#define NO_PIPELINED_REQUESTS 16
+#define NO_LOAD_REQUESTS 100000
+#define NO_BENCHMARK_MAPS 48
+#define NO_BENCHMARK_RENDERS 200
+#define NO_CACHED_PAGES 64
 
 extern struct projectionconfig *get_projection(const char *srs);
-extern mapnik::box2d<double> tile2prjbounds(struct projectionconfig *prj, int x, int y, int z);
+extern mapnik::box2d<double> tile2prjbounds(struct projectionconfig *prj, int x, int y, int z, int size);
+extern bool tile_solid(const mapnik::image_rgba8 &buf, int xx, int yy, int tilesize, uint32_t *colour);
+extern enum protoCmd encode_metatile(const mapnik::image_rgba8 &buf, const char *format, int tilesize, unsigned int size_tx, unsigned int size_ty, metaTile &tiles);
 
 // mutex to guard access to the shared render request counter
 static pthread_mutex_t item_counter_lock;
@@ -115,6 +142,165 @@ void *fetch_thread(void *arg)
 	return NULL;
 }
 
+struct wakeup_fetch {
+	struct request_queue *queue;
+	int wakeups;
+	struct item *item;
+};
+
+void *wakeup_fetch_thread(void *arg)
+{
+	struct wakeup_fetch *fetch = (struct wakeup_fetch *)arg;
+
+	fetch->item = request_queue_fetch_request_or_wakeup(fetch->queue, fetch->wakeups);
+	return NULL;
+}
+
+void *fetch_remove_thread(void *arg)
+{
+	struct request_queue *queue = (struct request_queue *)arg;
+
+	for (int i = 0; i < NO_BENCHMARK_REQUESTS; i++) {
+		struct item *item = request_queue_fetch_request(queue);
+		request_queue_remove_request(queue, item, 0);
+		free(item);
+	}
+
+	return NULL;
+}
+
+void *benchmark_addition_thread(void *arg)
+{
+	struct request_queue *queue = (struct request_queue *)arg;
+
+	for (int i = 0; i < NO_BENCHMARK_REQUESTS; i++) {
+		request_queue_add_request(queue, init_render_request(cmdDirty));
+	}
+
+	return NULL;
+}
+
+void *process_loop_thread(void *arg)
+{
+	process_loop(*(int *)arg);
+	return NULL;
+}
+
+int listen_socket(const std::string &socket_name)
+{
+	struct sockaddr_un addr;
+	int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_name.c_str(), sizeof(addr.sun_path) - 1);
+	unlink(socket_name.c_str());
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int connect_socket(const std::string &socket_name)
+{
+	struct sockaddr_un addr;
+	int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_name.c_str(), sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Counts the file descriptors open in this process
+int count_open_fds(void)
+{
+	DIR *fd_dir = opendir("/proc/self/fd");
+	int count = 0;
+
+	if (fd_dir == NULL) {
+		return -1;
+	}
+
+	while (readdir(fd_dir) != NULL) {
+		count++;
+	}
+
+	closedir(fd_dir);
+	return count;
+}
+
+/* A slave renderd that waits for two requests in flight and answers them in reverse
+ * order, rounds times, and then goes away
+ */
+struct fake_slave {
+	int listen_fd;
+	int rounds;
+	// Requests taken before they are answered, in reverse order, after delay ms
+	int batch;
+	int delay;
+	int max_inflight;
+	int answered;
+};
+
+void *fake_slave_thread(void *arg)
+{
+	struct fake_slave *slave = (struct fake_slave *)arg;
+	struct protocol_v5 reqs[PROTO_FRAME_MAX];
+	int fd = accept(slave->listen_fd, NULL, NULL);
+	int num = 0, ret = 0;
+
+	close(slave->listen_fd);
+
+	for (int round = 0; round < slave->rounds && ret >= 0; round++) {
+		while (num < slave->batch && (ret = recv_frame(reqs + num, PROTO_FRAME_MAX - num, fd)) >= 0) {
+			num += ret;
+		}
+
+		slave->max_inflight = std::max(slave->max_inflight, num);
+		usleep(slave->delay * 1000);
+
+		for (int i = num - 1; i >= 0 && ret >= 0; i--) {
+			reqs[i].cmd = cmdDone;
+			ret = send_frame(&reqs[i], 1, fd);
+			slave->answered++;
+		}
+
+		num = 0;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+void *slave_dispatch_thread(void *arg)
+{
+	slave_dispatch((struct slave_dispatcher *)arg);
+	return NULL;
+}
+
+struct protocol init_dirty_cmd(int x)
+{
+	struct protocol cmd;
+
+	bzero(&cmd, sizeof(cmd));
+	cmd.ver = PROTO_VER;
+	cmd.cmd = cmdDirty;
+	cmd.x = x * METATILE;
+	cmd.z = 18;
+	strcpy(cmd.xmlname, "default");
+	return cmd;
+}
+
 std::string create_tile_dir(const std::string &dir_name = "mod_tile_test", const char *tmp_dir = getenv("TMPDIR"))
 {
 	if (tmp_dir == NULL) {
@@ -565,435 +751,2300 @@ TEST_CASE("renderd/queueing", "request queueing")
 
 		request_queue_close(queue);
 	}
-}
-
-TEST_CASE("renderd", "tile generation")
-{
-	int found, ret;
-	std::string err_log_lines, out_log_lines;
 
-	SECTION("render_init", "should throw nice error if paths are invalid") {
-		start_capture();
-		render_init("doesnotexist", "doesnotexist", 1);
-		std::tie(err_log_lines, out_log_lines) = end_capture();
+	SECTION("renderd/queueing/clear fd of duplicates", "test if the clearing of fd reaches duplicates and all queues") {
+		struct request_queue *queue = request_queue_init();
+		struct item *low, *render, *duplicate, *other;
+
+		low = init_render_request(cmdRenderLow);
+		low->fd = 7;
+		request_queue_add_request(queue, low);
+		render = init_render_request(cmdRender);
+		render->fd = 8;
+		request_queue_add_request(queue, render);
+		duplicate = init_render_request(cmdRender);
+		duplicate->mx = render->mx;
+		duplicate->fd = 7;
+		REQUIRE(request_queue_add_request(queue, duplicate) == cmdIgnore);
+
+		// Shares the bucket of fd 7
+		other = init_render_request(cmdRenderLow);
+		other->fd = 7 + FDIDX_SIZE;
+		request_queue_add_request(queue, other);
+
+		request_queue_clear_requests_by_fd(queue, 7);
+		REQUIRE(low->fd == FD_INVALID);
+		REQUIRE(duplicate->fd == FD_INVALID);
+		REQUIRE(render->fd == 8);
+		REQUIRE(other->fd == 7 + FDIDX_SIZE);
+
+		REQUIRE(request_queue_fetch_request(queue) == render);
+		request_queue_remove_request(queue, render, 0);
+		request_queue_clear_requests_by_fd(queue, 8);
+		REQUIRE(render->fd == 8);
+		free(render);
+		free(duplicate);
+
+		for (struct item *item : {low, other}) {
+			REQUIRE(request_queue_fetch_request(queue) == item);
+			request_queue_remove_request(queue, item, 0);
+			free(item);
+		}
 
-		found = err_log_lines.find("Unable to open font directory: doesnotexist");
-		REQUIRE(found > -1);
+		request_queue_close(queue);
 	}
 
-	SECTION("rx_request/bad", "should return cmdNotDone") {
-		int pipefd[2];
-		pipe(pipefd);
-		struct protocol *req = (struct protocol *)malloc(sizeof(struct protocol));
-		std::string expected_mimetype = "image/png", expected_options = "", expected_xmlname = "default";
+	SECTION("renderd/queueing/wakeup", "test if fetchers waiting for a wakeup return without a request") {
+		request_queue *queue = request_queue_init();
+		struct wakeup_fetch fetch = {queue, request_queue_wakeups(queue), (struct item *)1};
+		struct item *item = init_render_request(cmdRender);
+		pthread_t thread;
 
-		req->x = 1024;
-		req->y = 1024;
-		req->z = 10;
-		strcpy(req->mimetype, "mimetype");
-		strcpy(req->options, "options");
-		strcpy(req->xmlname, "xmlname");
+		REQUIRE(request_queue_try_fetch_request(queue) == NULL);
 
-		// Unknown command
-		req->cmd = (enum protoCmd)4096;
+		pthread_create(&thread, NULL, wakeup_fetch_thread, &fetch);
+		request_queue_wakeup(queue);
+		pthread_join(thread, NULL);
+		REQUIRE(fetch.item == NULL);
 
-		// Invalid version
-		req->ver = 4;
+		// Queued requests are still returned after a wakeup
+		request_queue_add_request(queue, item);
+		REQUIRE(request_queue_fetch_request_or_wakeup(queue, fetch.wakeups) == item);
 
-		start_capture();
-		ret = rx_request(req, pipefd[1]);
-		std::tie(err_log_lines, out_log_lines) = end_capture();
+		request_queue_close(queue);
+	}
 
-		REQUIRE(ret == cmdNotDone);
-		found = err_log_lines.find("Bad protocol version " + std::to_string(req->ver));
-		REQUIRE(found > -1);
+	SECTION("renderd/queueing/item pool", "test if items are reused from the pool without allocations") {
+		struct request_queue *queue = request_queue_init();
+		std::vector<struct item *> items;
+		struct item *item, *first = NULL;
+		stats_struct stats;
+
+		for (int i = 0; i < NO_TEST_REPEATS; i++) {
+			item = request_queue_alloc_item(queue);
+			REQUIRE(item != NULL);
+			REQUIRE(item->duplicates == NULL);
+			first = first ? first : item;
+			REQUIRE(item == first);
+
+			item->req.ver = PROTO_VER;
+			item->req.cmd = cmdRender;
+			strcpy(item->req.xmlname, "default");
+			item->mx = i;
+			REQUIRE(request_queue_add_request(queue, item) == cmdIgnore);
+			REQUIRE(request_queue_fetch_request(queue) == item);
+			request_queue_remove_request(queue, item, 0);
+			request_queue_free_item(queue, item);
+		}
 
-		// Valid version
-		req->ver = 1;
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noItemAlloc == NO_TEST_REPEATS);
+		REQUIRE(stats.noItemMalloc == 0);
+		REQUIRE(stats.noItemInUse == 0);
 
-		REQUIRE((std::string)req->mimetype != expected_mimetype);
-		REQUIRE((std::string)req->options != expected_options);
-		REQUIRE((std::string)req->xmlname != expected_xmlname);
+		// Only falls back to malloc once the pool is exhausted
+		for (int i = 0; i <= ITEM_POOL_SIZE; i++) {
+			items.push_back(request_queue_alloc_item(queue));
+		}
 
-		start_capture();
-		ret = rx_request(req, pipefd[1]);
-		std::tie(err_log_lines, out_log_lines) = end_capture();
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noItemMalloc == 1);
+		REQUIRE(stats.noItemInUse == ITEM_POOL_SIZE);
 
-		REQUIRE((std::string)req->mimetype == expected_mimetype);
-		REQUIRE((std::string)req->options == expected_options);
-		REQUIRE((std::string)req->xmlname == expected_xmlname);
+		for (struct item *pooled : items) {
+			request_queue_free_item(queue, pooled);
+		}
 
-		REQUIRE(ret == cmdNotDone);
-		found = err_log_lines.find("Ignoring invalid command Unknown fd(" + std::to_string(pipefd[1]));
-		REQUIRE(found > -1);
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noItemInUse == 0);
 
-		// Valid command
-		req->cmd = cmdNotDone;
+		request_queue_close(queue);
+	}
 
-		start_capture();
-		ret = rx_request(req, pipefd[1]);
-		std::tie(err_log_lines, out_log_lines) = end_capture();
+	SECTION("renderd/queueing/curve order", "test if the dirty queue is served along the Hilbert curve") {
+		struct request_queue *queue = request_queue_init();
+		struct item *item, *prev = NULL;
 
-		REQUIRE(ret == cmdNotDone);
-		found = err_log_lines.find("Ignoring invalid command NotDone fd(" + std::to_string(pipefd[1]));
-		REQUIRE(found > -1);
+		request_queue_set_order(queue, queueOrderHilbert);
 
-		free(req);
-	}
+		// Queue an 8x8 block of metatiles in reverse row order
+		for (int i = 63; i >= 0; i--) {
+			item = init_render_request(cmdDirty);
+			item->req.z = 10;
+			item->mx = (i % 8) * METATILE;
+			item->my = (i / 8) * METATILE;
+			REQUIRE(request_queue_add_request(queue, item) == cmdNotDone);
+		}
 
-	SECTION("send_response", "should complete") {
-		auto rsp = GENERATE(cmdRender, cmdRenderPrio, cmdRenderLow, cmdRenderBulk);
+		// Each metatile must be a neighbour of the one rendered before it
+		for (int i = 0; i < 64; i++) {
+			item = request_queue_fetch_request(queue);
+			REQUIRE(item != NULL);
 
-		render_request_queue = request_queue_init();
-		struct item *item = init_render_request(rsp);
-		request_queue_add_request(render_request_queue, item);
+			if (prev != NULL) {
+				REQUIRE(abs(item->mx - prev->mx) + abs(item->my - prev->my) == METATILE);
+				request_queue_remove_request(queue, prev, 0);
+				free(prev);
+			}
 
-		start_capture(1);
-		send_response(item, rsp, -1);
-		std::tie(err_log_lines, out_log_lines) = end_capture();
+			prev = item;
+		}
 
-		found = out_log_lines.find("Sending message Render");
-		REQUIRE(found > -1);
+		request_queue_remove_request(queue, prev, 0);
+		free(prev);
 
-		request_queue_close(render_request_queue);
-		SUCCEED();
+		request_queue_close(queue);
 	}
-}
 
-TEST_CASE("storage-backend", "Tile storage backend router")
-{
-	int found;
-	std::string err_log_lines, out_log_lines, tile_dir = create_tile_dir();
-
-	SECTION("storage/initialise", "should return NULL") {
-		start_capture();
+	SECTION("renderd/queueing/curve order sweep", "test if requests behind the sweep wait for the next pass") {
+		struct request_queue *queue = request_queue_init();
+		struct item *item, *first, *behind, *ahead;
 
-		// empty string
-		std::string empty;
-		REQUIRE(init_storage_backend(empty.c_str()) == NULL);
+		request_queue_set_order(queue, queueOrderMorton);
 
-		// invalid path
-		std::string tile_dir_invalid;
-		tile_dir_invalid = tile_dir + "/" + "invalid";
-		REQUIRE(init_storage_backend(tile_dir_invalid.c_str()) == NULL);
+		first = init_render_request(cmdDirty);
+		first->mx = first->my = 4 * METATILE;
+		request_queue_add_request(queue, first);
+		REQUIRE(request_queue_fetch_request(queue) == first);
 
-		// file
-		std::string file_name;
-		file_name = tile_dir + "/" + "file";
-		std::ofstream file{file_name};
-		REQUIRE(init_storage_backend(file_name.c_str()) == NULL);
-		std::remove(file_name.c_str());
+		behind = init_render_request(cmdDirty);
+		behind->mx = behind->my = 0;
+		request_queue_add_request(queue, behind);
+		ahead = init_render_request(cmdDirty);
+		ahead->mx = ahead->my = 8 * METATILE;
+		request_queue_add_request(queue, ahead);
 
-		// non-existent backend
-		char non_existent_backend[] = "non-existent backend";
-		REQUIRE(init_storage_backend(non_existent_backend) == NULL);
+		REQUIRE(request_queue_fetch_request(queue) == ahead);
+		REQUIRE(request_queue_fetch_request(queue) == behind);
 
-		// Check log output
-		std::tie(err_log_lines, out_log_lines) = end_capture();
+		for (struct item *done : {first, ahead, behind}) {
+			request_queue_remove_request(queue, done, 0);
+			free(done);
+		}
 
-		// empty string
-		found = err_log_lines.find("init_storage_backend: Options string was empty");
-		REQUIRE(found > -1);
+		// Interactive requests are still served first and in FIFO order
+		first = init_render_request(cmdRender);
+		first->mx = 8 * METATILE;
+		request_queue_add_request(queue, first);
+		item = init_render_request(cmdRender);
+		item->mx = 0;
+		request_queue_add_request(queue, item);
+		REQUIRE(request_queue_fetch_request(queue) == first);
+		REQUIRE(request_queue_fetch_request(queue) == item);
+		request_queue_remove_request(queue, first, 0);
+		request_queue_remove_request(queue, item, 0);
+		free(first);
+		free(item);
 
-		// invalid path
-		found = err_log_lines.find("init_storage_backend: Failed to stat");
-		REQUIRE(found > -1);
-		found = err_log_lines.find("No such file or directory");
-		REQUIRE(found > -1);
+		request_queue_close(queue);
+	}
 
-		// file
-		found = err_log_lines.find("is not a directory");
-		REQUIRE(found > -1);
+	SECTION("renderd/queueing/deadline order", "test if requests are served earliest deadline first") {
+		struct request_queue *queue = request_queue_init();
+		struct item *late, *early, *none, *after;
+		int64_t now = request_queue_clock();
+
+		late = init_render_request(cmdRender);
+		late->fd = 1;
+		late->deadline = now + 20000;
+		request_queue_add_request(queue, late);
+		early = init_render_request(cmdRender);
+		early->fd = 2;
+		early->deadline = now + 10000;
+		request_queue_add_request(queue, early);
+		none = init_render_request(cmdRender);
+		none->fd = 3;
+		request_queue_add_request(queue, none);
+		after = init_render_request(cmdRender);
+		after->fd = 4;
+		after->deadline = now + 5000;
+		request_queue_add_request(queue, after);
+
+		// Requests without a deadline can not be overtaken by later ones
+		REQUIRE(request_queue_fetch_request(queue) == early);
+		REQUIRE(request_queue_fetch_request(queue) == late);
+		REQUIRE(request_queue_fetch_request(queue) == none);
+		REQUIRE(request_queue_fetch_request(queue) == after);
+
+		for (struct item *done : {early, late, none, after}) {
+			request_queue_remove_request(queue, done, 0);
+			free(done);
+		}
 
-		// non-existent backend
-		found = err_log_lines.find("init_storage_backend: No valid storage backend found for options: non-existent backend");
-		REQUIRE(found > -1);
+		request_queue_close(queue);
 	}
 
-	delete_tile_dir(tile_dir);
-}
-
-TEST_CASE("file storage-backend", "File Tile storage backend")
-{
-	std::string tile_dir = create_tile_dir();
-	std::string xmlconfig("default");
+	SECTION("renderd/queueing/deadline demotion", "test if requests nobody waits for are moved to the dirty queue") {
+		struct request_queue *queue = request_queue_init();
+		struct item *expired, *duplicate, *waiting, *item;
+		stats_struct stats;
+		int64_t now = request_queue_clock();
+
+		expired = init_render_request(cmdRenderPrio);
+		expired->fd = 1;
+		expired->deadline = now - 1000;
+		request_queue_add_request(queue, expired);
+
+		// Kept on the interactive path as long as one duplicate still waits
+		waiting = init_render_request(cmdRenderPrio);
+		waiting->fd = 2;
+		waiting->deadline = now - 1000;
+		request_queue_add_request(queue, waiting);
+		duplicate = init_render_request(cmdRenderPrio);
+		duplicate->mx = waiting->mx;
+		duplicate->fd = 3;
+		duplicate->deadline = now + 10000;
+		REQUIRE(request_queue_add_request(queue, duplicate) == cmdIgnore);
 
-	SECTION("storage/initialise", "should return tile_dir storage_ctx") {
-		struct storage_backend *store = NULL;
+		item = init_render_request(cmdRender);
+		item->fd = 4;
+		item->deadline = now + 10000;
+		request_queue_add_request(queue, item);
 
-		store = init_storage_backend(tile_dir.c_str());
-		REQUIRE(store != NULL);
-		REQUIRE((char *)store->storage_ctx == tile_dir);
+		REQUIRE(request_queue_fetch_request(queue) == waiting);
+		REQUIRE(request_queue_no_requests_queued(queue, cmdRenderPrio) == 0);
+		REQUIRE(request_queue_no_requests_queued(queue, cmdDirty) == 1);
+		REQUIRE(request_queue_fetch_request(queue) == item);
+		REQUIRE(request_queue_fetch_request(queue) == expired);
+		REQUIRE(expired->originatedQueue == queueDirty);
+		REQUIRE(expired->fd == FD_INVALID);
+		REQUIRE(duplicate->fd == 3);
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noReqDemoted == 1);
+		REQUIRE(stats.noDirtyRender == 1);
+
+		for (struct item *done : {waiting, item, expired}) {
+			request_queue_remove_request(queue, done, 0);
+			free(done);
+		}
 
-		store->close_storage(store);
+		free(duplicate);
+		request_queue_close(queue);
 	}
 
-	SECTION("storage/stat/non existent", "should return 0 size") {
-		struct storage_backend *store = NULL;
-		struct stat_info sinfo;
+	SECTION("renderd/queueing/admission control", "test if requests that can not be rendered in time are rejected") {
+		struct request_queue *queue = request_queue_init();
+		struct item *item;
+		stats_struct stats;
+		int64_t deadline;
 
-		store = init_storage_backend(tile_dir.c_str());
-		REQUIRE(store != NULL);
+		request_queue_set_admission(queue, 2);
 
-		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 0, 0, 0);
-		REQUIRE(sinfo.size < 0);
+		// Learn that metatiles of zoom 0 take a second to render
+		item = init_render_request(cmdRender);
+		request_queue_add_request(queue, item);
+		REQUIRE(request_queue_fetch_request(queue) == item);
+		request_queue_remove_request(queue, item, 1000);
+		free(item);
 
-		store->close_storage(store);
-	}
+		// Two threads get through four requests within 2.5s
+		deadline = request_queue_clock() + 2600;
 
-	SECTION("storage/read/non existent", "should return 0 size") {
-		struct storage_backend *store = NULL;
-		int size;
-		char *buf = (char *)malloc(10000);
-		int compressed;
-		char *err_msg = (char *)malloc(10000);
+		for (int i = 0; i < 5; i++) {
+			item = init_render_request(cmdRender);
+			item->fd = 10 + i;
+			item->deadline = deadline;
+			REQUIRE(request_queue_add_request(queue, item) == ((i < 4) ? cmdIgnore : cmdNotDone));
+		}
 
-		store = init_storage_backend(tile_dir.c_str());
-		REQUIRE(store != NULL);
+		REQUIRE(request_queue_no_requests_queued(queue, cmdRender) == 4);
+		REQUIRE(request_queue_no_requests_queued(queue, cmdDirty) == 1);
+
+		// Higher priorities do not wait for the request queue, lower ones do
+		item = init_render_request(cmdRenderPrio);
+		item->deadline = deadline;
+		REQUIRE(request_queue_add_request(queue, item) == cmdIgnore);
+		item = init_render_request(cmdRenderLow);
+		item->deadline = deadline;
+		REQUIRE(request_queue_add_request(queue, item) == cmdNotDone);
+
+		// Requests without a deadline are only limited by the queue length
+		item = init_render_request(cmdRender);
+		REQUIRE(request_queue_add_request(queue, item) == cmdIgnore);
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noReqRejected == 2);
+
+		while ((request_queue_no_requests_queued(queue, cmdRenderPrio) + request_queue_no_requests_queued(queue, cmdRender) + request_queue_no_requests_queued(queue, cmdDirty)) > 0) {
+			item = request_queue_fetch_request(queue);
+			request_queue_remove_request(queue, item, 0);
+			free(item);
+		}
+
+		request_queue_close(queue);
+	}
+
+	SECTION("renderd/queueing/style weights", "test if the render threads are shared between styles by weight") {
+		struct request_queue *queue = request_queue_init();
+		struct item *item;
+		stats_struct stats;
+		int rendered[3] = {0, 0, 0};
+
+		REQUIRE(request_queue_add_style(queue, "light", 1) == 1);
+		REQUIRE(request_queue_add_style(queue, "heavy", 3) == 2);
+		REQUIRE(std::string(request_queue_style_name(queue, 2)) == "heavy");
+		REQUIRE(request_queue_style_name(queue, 3) == NULL);
+
+		// The light style fills the queue first
+		for (int i = 0; i < 8; i++) {
+			for (const char *style : {"light", "heavy"}) {
+				item = init_render_request(cmdRender);
+				strcpy(item->req.xmlname, style);
+				request_queue_add_request(queue, item);
+			}
+		}
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noStyleQueued[1] == 8);
+		REQUIRE(stats.noStyleQueued[2] == 8);
+
+		for (int i = 0; i < 8; i++) {
+			item = request_queue_fetch_request(queue);
+			rendered[item->style]++;
+			request_queue_remove_request(queue, item, 0);
+			free(item);
+		}
+
+		REQUIRE(rendered[1] == 2);
+		REQUIRE(rendered[2] == 6);
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noStyleQueued[1] == 6);
+		REQUIRE(stats.noStyleQueued[2] == 2);
+		REQUIRE(stats.noStyleRender[2] == 6);
+
+		request_queue_close(queue);
+	}
+
+	SECTION("renderd/queueing/style reload", "test if styles can be registered again while requests are queued") {
+		struct request_queue *queue = request_queue_init();
+		struct item *item;
+		stats_struct stats;
+
+		REQUIRE(request_queue_add_style(queue, "light", 1) == 1);
+
+		item = init_render_request(cmdRender);
+		strcpy(item->req.xmlname, "added");
+		request_queue_add_request(queue, item);
+
+		// A reload changes the weight of known styles and adds new ones after them
+		REQUIRE(request_queue_add_style(queue, "added", 2) == 2);
+		REQUIRE(request_queue_add_style(queue, "light", 3) == 1);
+		REQUIRE(queue->styles[1].weight == 3);
+
+		item = init_render_request(cmdRender);
+		strcpy(item->req.xmlname, "added");
+		request_queue_add_request(queue, item);
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noStyleQueued[0] == 1);
+		REQUIRE(stats.noStyleQueued[2] == 1);
+
+		// Requests queued before the style was added are still served
+		for (int i = 0; i < 2; i++) {
+			item = request_queue_fetch_request(queue);
+			REQUIRE(item != NULL);
+			request_queue_style_load(queue, item, 250);
+			request_queue_remove_request(queue, item, 0);
+			free(item);
+		}
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noStyleQueued[0] == 0);
+		REQUIRE(stats.noStyleQueued[2] == 0);
+		REQUIRE(stats.noStyleLoad[0] == 1);
+		REQUIRE(stats.noStyleLoad[2] == 1);
+		REQUIRE(stats.timeStyleLoad[2] == 250);
+
+		request_queue_close(queue);
+	}
+
+	SECTION("renderd/queueing/style parameterized", "test if reused parameterized maps are counted by style") {
+		struct request_queue *queue = request_queue_init();
+		struct item *item;
+		stats_struct stats;
+
+		REQUIRE(request_queue_add_style(queue, "language", 1) == 1);
+
+		for (int i = 0; i < 3; i++) {
+			item = init_render_request(cmdRender);
+			strcpy(item->req.xmlname, "language");
+			item->req.x = i * METATILE;
+			request_queue_add_request(queue, item);
+		}
+
+		// The first render parameterizes the map, the others reuse it
+		for (int i = 0; i < 3; i++) {
+			item = request_queue_fetch_request(queue);
+			REQUIRE(item != NULL);
+			request_queue_style_parameterized(queue, item, i > 0);
+			request_queue_remove_request(queue, item, 0);
+			free(item);
+		}
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noStyleParameterizedMiss[1] == 1);
+		REQUIRE(stats.noStyleParameterizedHit[1] == 2);
+		REQUIRE(stats.noStyleParameterizedHit[0] == 0);
+
+		request_queue_close(queue);
+	}
+
+	SECTION("renderd/queueing/journal", "test if the dirty and bulk queues are restored from the journal") {
+		std::string journal_file = std::tmpnam(nullptr);
+		struct request_queue *queue = request_queue_init();
+		struct request_queue_journal *journal = request_queue_journal_open(journal_file.c_str(), 1);
+		struct item *items[4], *item;
+		std::vector<struct item *> pending;
+		struct stat st;
+		FILE *torn;
+		int first;
+
+		REQUIRE(journal != NULL);
+		REQUIRE(request_queue_journal_replay(journal, queue) == 0);
+		request_queue_set_journal(queue, journal);
+
+		for (int i = 0; i < 4; i++) {
+			items[i] = init_render_request((i < 3) ? cmdDirty : cmdRenderBulk);
+			request_queue_add_request(queue, items[i]);
+		}
+
+		first = items[0]->mx;
+
+		// Interactive requests are not journaled
+		item = init_render_request(cmdRender);
+		request_queue_add_request(queue, item);
+		REQUIRE(request_queue_fetch_request(queue) == item);
+		request_queue_remove_request(queue, item, 0);
+		free(item);
+
+		// The first dirty request is rendered, the others are lost in a crash
+		REQUIRE(request_queue_fetch_request(queue) == items[0]);
+		request_queue_remove_request(queue, items[0], 0);
+
+		for (int i = 1; i < 4; i++) {
+			REQUIRE(request_queue_fetch_request(queue) == items[i]);
+		}
+
+		for (int i = 0; i < 4; i++) {
+			free(items[i]);
+		}
+
+		request_queue_journal_close(journal);
+		request_queue_close(queue);
+
+		// A record torn by the crash is ignored
+		torn = fopen(journal_file.c_str(), "ab");
+		REQUIRE(torn != NULL);
+		fwrite("torn", 1, 4, torn);
+		fclose(torn);
+
+		queue = request_queue_init();
+		journal = request_queue_journal_open(journal_file.c_str(), 0);
+		REQUIRE(journal != NULL);
+
+		// Compacted to the pending requests when opened
+		REQUIRE(stat(journal_file.c_str(), &st) == 0);
+		REQUIRE(st.st_size == 3 * sizeof(struct journal_record));
+
+		REQUIRE(request_queue_journal_replay(journal, queue) == 3);
+		request_queue_set_journal(queue, journal);
+		REQUIRE(request_queue_no_requests_queued(queue, cmdDirty) == 2);
+		REQUIRE(request_queue_no_requests_queued(queue, cmdRenderBulk) == 1);
+
+		for (int i = 1; i < 4; i++) {
+			item = request_queue_fetch_request(queue);
+			REQUIRE(item->mx == first + i);
+			REQUIRE(item->req.cmd == ((i < 3) ? cmdDirty : cmdRenderBulk));
+			REQUIRE(std::string(item->req.xmlname) == "default");
+			request_queue_remove_request(queue, item, 0);
+			request_queue_free_item(queue, item);
+		}
+
+		request_queue_journal_close(journal);
+		request_queue_close(queue);
+
+		queue = request_queue_init();
+		journal = request_queue_journal_open(journal_file.c_str(), 0);
+		REQUIRE(request_queue_journal_replay(journal, queue) == 0);
+		request_queue_set_journal(queue, journal);
+
+		// Compacted while requests are logged, every 1000th request is left pending
+		for (int i = 0; i < 4 * JOURNAL_COMPACT_MIN; i++) {
+			item = init_render_request(cmdDirty);
+			request_queue_add_request(queue, item);
+			REQUIRE(request_queue_fetch_request(queue) == item);
+
+			if (i % 1000) {
+				request_queue_remove_request(queue, item, 0);
+				free(item);
+			} else {
+				pending.push_back(item);
+			}
+		}
+
+		// Detached, the journal can be closed while the queue is still in use
+		request_queue_set_journal(queue, NULL);
+		request_queue_journal_close(journal);
+		item = init_render_request(cmdDirty);
+		request_queue_add_request(queue, item);
+		REQUIRE(request_queue_fetch_request(queue) == item);
+		request_queue_remove_request(queue, item, 0);
+		free(item);
+		request_queue_close(queue);
+
+		for (struct item *pending_item : pending) {
+			free(pending_item);
+		}
+
+		REQUIRE(stat(journal_file.c_str(), &st) == 0);
+		REQUIRE((size_t)st.st_size < 2 * JOURNAL_COMPACT_MIN * sizeof(struct journal_record));
+
+		queue = request_queue_init();
+		journal = request_queue_journal_open(journal_file.c_str(), 0);
+		REQUIRE(request_queue_journal_replay(journal, queue) == (4 * JOURNAL_COMPACT_MIN + 999) / 1000);
+		request_queue_journal_close(journal);
+		request_queue_close(queue);
+		std::remove(journal_file.c_str());
+	}
+
+	SECTION("renderd/queueing/spool", "test if dirty requests beyond the limit are spooled and refilled") {
+		char spool_dir[] = "/tmp/mod_tile_test_spool.XXXXXX";
+		struct request_queue *queue = request_queue_init();
+		struct request_queue_spool *spool;
+		struct item *item;
+		stats_struct stats;
+		int first = -1, fetched = 0;
+
+		REQUIRE(mkdtemp(spool_dir) != NULL);
+		spool = request_queue_spool_open(spool_dir);
+		REQUIRE(spool != NULL);
+		request_queue_set_spool(queue, spool);
+
+		for (int i = 0; i < DIRTY_LIMIT + 100; i++) {
+			item = init_render_request(cmdDirty);
+			first = (first < 0) ? item->mx : first;
+			REQUIRE(request_queue_add_request(queue, item) == cmdNotDone);
+		}
+
+		// Metatiles already spooled are not spooled twice
+		item = init_render_request(cmdDirty);
+		item->mx = first + DIRTY_LIMIT;
+		REQUIRE(request_queue_add_request(queue, item) == cmdNotDone);
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(request_queue_no_requests_queued(queue, cmdDirty) == DIRTY_LIMIT);
+		REQUIRE(stats.noReqDroped == 0);
+		REQUIRE(stats.noReqSpilled == 100);
+		REQUIRE(stats.noReqSpooled == 100);
+
+		// A spooled metatile that is requested again is only rendered once
+		item = init_render_request(cmdRender);
+		item->mx = first + DIRTY_LIMIT + 99;
+		REQUIRE(request_queue_add_request(queue, item) == cmdIgnore);
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(stats.noReqSpooled == 99);
+
+		while (request_queue_no_requests_queued(queue, cmdRender) + request_queue_no_requests_queued(queue, cmdDirty) > 0) {
+			item = request_queue_fetch_request(queue);
+
+			if (item->originatedQueue == queueDirty) {
+				REQUIRE(item->mx == first + fetched++);
+			}
+
+			request_queue_remove_request(queue, item, 0);
+			request_queue_free_item(queue, item);
+		}
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(fetched == DIRTY_LIMIT + 99);
+		REQUIRE(stats.noReqRefilled == 99);
+		REQUIRE(stats.noReqSpooled == 0);
+
+		// A spooled metatile that is queued already is dropped on refill, not counted as refilled
+		item = init_render_request(cmdDirty);
+		REQUIRE(request_queue_add_request(queue, item) == cmdNotDone);
+		struct item *spooled = init_render_request(cmdDirty);
+		spooled->mx = item->mx;
+		REQUIRE(request_queue_spool_push(spool, spooled, 42) == 1);
+		free(spooled);
+
+		item = request_queue_fetch_request(queue);
+		request_queue_remove_request(queue, item, 0);
+		request_queue_free_item(queue, item);
+
+		request_queue_copy_stats(queue, &stats);
+		REQUIRE(request_queue_no_requests_queued(queue, cmdDirty) == 0);
+		REQUIRE(stats.noReqRefilled == 99);
+		REQUIRE(stats.noReqSpooled == 0);
+
+		// Different metatiles with colliding keys are spooled and removed separately
+		struct item *colliding[2], popped;
+
+		for (int i = 0; i < 2; i++) {
+			colliding[i] = init_render_request(cmdDirty);
+			REQUIRE(request_queue_spool_push(spool, colliding[i], 42) == 1);
+		}
+
+		REQUIRE(request_queue_spool_push(spool, colliding[1], 42) == 2);
+		REQUIRE(request_queue_spool_depth(spool) == 2);
+		request_queue_spool_remove(spool, colliding[0], 42);
+		REQUIRE(request_queue_spool_depth(spool) == 1);
+
+		memset(&popped, 0, sizeof(popped));
+		REQUIRE(request_queue_spool_pop(spool, &popped) == 1);
+		REQUIRE(popped.mx == colliding[1]->mx);
+		REQUIRE(request_queue_spool_pop(spool, &popped) == 0);
+		free(colliding[0]);
+		free(colliding[1]);
+
+		request_queue_close(queue);
+		request_queue_spool_close(spool);
+		REQUIRE(rmdir(spool_dir) == 0);
+	}
+}
+
+TEST_CASE("renderd/queueing/benchmark", "[.][benchmark]")
+{
+	SECTION("renderd/queueing/benchmark/add and fetch", "throughput of concurrent producers and render threads") {
+		for (int no_threads : {1, 2, 4, 8, 16, 32}) {
+			REQUIRE((no_threads * NO_BENCHMARK_REQUESTS) < DIRTY_LIMIT);
+
+			BENCHMARK("add and fetch " + std::to_string(no_threads * NO_BENCHMARK_REQUESTS) + " requests with " + std::to_string(no_threads) + " thread(s) each") {
+				std::vector<pthread_t> addition_threads(no_threads), fetch_threads(no_threads);
+				request_queue *queue = request_queue_init();
+
+				for (int i = 0; i < no_threads; i++) {
+					pthread_create(&fetch_threads[i], NULL, fetch_remove_thread, (void *)queue);
+					pthread_create(&addition_threads[i], NULL, benchmark_addition_thread, (void *)queue);
+				}
+
+				for (int i = 0; i < no_threads; i++) {
+					pthread_join(addition_threads[i], NULL);
+					pthread_join(fetch_threads[i], NULL);
+				}
+
+				request_queue_close(queue);
+			};
+		}
+	}
+
+	SECTION("renderd/queueing/benchmark/connection churn", "cost of connections coming and going with full request queues") {
+		request_queue *queue = request_queue_init();
+		std::vector<int> queued;
+		int fd = 0;
+
+		// Every request is waited for by one connection and one duplicate
+		for (enum protoCmd cmd : {cmdRenderPrio, cmdRender, cmdRenderLow}) {
+			for (int i = 0; i < REQ_LIMIT; i++) {
+				struct item *item = init_render_request(cmd);
+				struct item *duplicate = init_render_request(cmd);
+				item->fd = fd++;
+				duplicate->mx = item->mx;
+				duplicate->fd = fd++;
+				REQUIRE(request_queue_add_request(queue, item) == cmdIgnore);
+				REQUIRE(request_queue_add_request(queue, duplicate) == cmdIgnore);
+				queued.push_back(item->mx);
+			}
+		}
+
+		for (int i = 0; i < DIRTY_LIMIT; i++) {
+			REQUIRE(request_queue_add_request(queue, init_render_request(cmdDirty)) == cmdNotDone);
+		}
+
+		// Like mod_tile, which opens a connection per tile and closes it once it is done waiting
+		BENCHMARK_ADVANCED("request a queued metatile and close the connection")(Catch::Benchmark::Chronometer meter) {
+			std::vector<struct item *> items(meter.runs());
+
+			for (int i = 0; i < meter.runs(); i++) {
+				items[i] = init_render_request(cmdRender);
+				items[i]->mx = queued[i % queued.size()];
+			}
+
+			meter.measure([&](int i) {
+				items[i]->fd = fd + i;
+				request_queue_add_request(queue, items[i]);
+				request_queue_clear_requests_by_fd(queue, fd + i);
+			});
+
+			fd += meter.runs();
+		};
+
+		request_queue_close(queue);
+	}
+
+	SECTION("renderd/queueing/benchmark/lookup", "cost of the duplicate lookup with a full dirty queue") {
+		request_queue *queue = request_queue_init();
+
+		// Use the metatile coordinates of a square area, as produced by an expiry run
+		auto set_metatile = [](struct item * item, int i) {
+			item->req.z = 14;
+			item->mx = (i % 128) * METATILE;
+			item->my = (i / 128) * METATILE;
+		};
+
+		for (int i = 0; i < DIRTY_LIMIT; i++) {
+			struct item *item = init_render_request(cmdDirty);
+			set_metatile(item, i);
+			REQUIRE(request_queue_add_request(queue, item) == cmdNotDone);
+		}
+
+		REQUIRE(request_queue_no_requests_queued(queue, cmdDirty) == DIRTY_LIMIT);
+
+		BENCHMARK_ADVANCED("lookup of a request already in the dirty queue")(Catch::Benchmark::Chronometer meter) {
+			std::vector<struct item *> items(meter.runs());
+
+			for (int i = 0; i < meter.runs(); i++) {
+				items[i] = init_render_request(cmdDirty);
+				set_metatile(items[i], i % DIRTY_LIMIT);
+			}
+
+			meter.measure([&](int i) {
+				return request_queue_add_request(queue, items[i]);
+			});
+		};
+
+		BENCHMARK_ADVANCED("lookup of a request not in the dirty queue")(Catch::Benchmark::Chronometer meter) {
+			std::vector<struct item *> items(meter.runs());
+
+			for (int i = 0; i < meter.runs(); i++) {
+				items[i] = init_render_request(cmdDirty);
+				set_metatile(items[i], DIRTY_LIMIT + i);
+			}
+
+			meter.measure([&](int i) {
+				return request_queue_add_request(queue, items[i]);
+			});
+		};
+
+		request_queue_close(queue);
+	}
+
+	SECTION("renderd/queueing/benchmark/queue order", "database pages read while rendering an expiry run in each queue order") {
+		// Database pages are modelled as squares of 8x8 metatiles, the page cache holds the
+		// NO_CACHED_PAGES most recently used ones
+		for (enum queueOrder order : {queueOrderFifo, queueOrderMorton, queueOrderHilbert}) {
+			request_queue *queue = request_queue_init();
+			std::vector<uint64_t> cache;
+			int misses = 0;
+
+			request_queue_set_order(queue, order);
+
+			// Distinct metatiles scattered over an area of 256x256 metatiles
+			for (int i = 0; i < DIRTY_LIMIT; i++) {
+				struct item *item = init_render_request(cmdDirty);
+				int metatile = (i * 40503) % (256 * 256);
+				item->req.z = 14;
+				item->mx = (metatile % 256) * METATILE;
+				item->my = (metatile / 256) * METATILE;
+				REQUIRE(request_queue_add_request(queue, item) == cmdNotDone);
+			}
+
+			for (int i = 0; i < DIRTY_LIMIT; i++) {
+				struct item *item = request_queue_fetch_request(queue);
+				uint64_t page = ((uint64_t)(item->mx / METATILE / 8) << 32) | (item->my / METATILE / 8);
+				auto cached = std::find(cache.begin(), cache.end(), page);
+
+				if (cached != cache.end()) {
+					cache.erase(cached);
+				} else {
+					misses++;
+
+					if (cache.size() == NO_CACHED_PAGES) {
+						cache.pop_back();
+					}
+				}
+
+				cache.insert(cache.begin(), page);
+				request_queue_remove_request(queue, item, 0);
+				free(item);
+			}
+
+			WARN(DIRTY_LIMIT << " metatiles rendered in " << (order == queueOrderFifo ? "fifo" : order == queueOrderMorton ? "morton" : "hilbert") << " order, " << misses << " database pages read");
+			request_queue_close(queue);
+		}
+	}
+}
+
+TEST_CASE("renderd/process_loop/benchmark", "[.][benchmark]")
+{
+	std::string socket_name = std::tmpnam(nullptr);
+	int listen_fd = listen_socket(socket_name);
+	struct rlimit limit;
+	pthread_t loop;
+	int x = 0;
+
+	REQUIRE(listen_fd >= 0);
+	render_request_queue = request_queue_init();
+	pthread_create(&loop, NULL, process_loop_thread, &listen_fd);
+
+	// Both ends of the connections are in this process
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	SECTION("renderd/process_loop/benchmark/pipelined", "requests accepted per second over many connections") {
+		for (int no_conns : {1, 16, 256, 4096}) {
+			std::vector<struct protocol> cmds(NO_PIPELINED_REQUESTS), rsps(NO_PIPELINED_REQUESTS);
+			std::vector<int> fds;
+			ssize_t size = cmds.size() * sizeof(struct protocol);
+			int rounds = std::max(1, NO_LOAD_REQUESTS / (no_conns * NO_PIPELINED_REQUESTS));
+
+			if ((rlim_t)(2 * no_conns + 64) > limit.rlim_cur) {
+				WARN("Skipping " << no_conns << " connections, not enough open files allowed");
+				continue;
+			}
+
+			for (int i = 0; i < no_conns; i++) {
+				fds.push_back(connect_socket(socket_name));
+				REQUIRE(fds.back() >= 0);
+			}
+
+			auto start = std::chrono::steady_clock::now();
+
+			for (int round = 0; round < rounds; round++) {
+				for (int fd : fds) {
+					for (struct protocol &cmd : cmds) {
+						cmd = init_dirty_cmd(x++);
+					}
+
+					REQUIRE(send(fd, cmds.data(), size, 0) == size);
+				}
+
+				for (int fd : fds) {
+					REQUIRE(recv(fd, rsps.data(), size, MSG_WAITALL) == size);
+				}
+			}
+
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			WARN(no_conns << " connection(s): " << (long)(rounds * no_conns * NO_PIPELINED_REQUESTS / elapsed.count()) << " requests/s accepted");
+
+			for (int fd : fds) {
+				close(fd);
+			}
+		}
+	}
+
+	SECTION("renderd/process_loop/benchmark/connection churn", "connections per second with a request each") {
+		struct protocol cmd, rsp;
+		int no_conns = NO_LOAD_REQUESTS / 10;
+
+		auto start = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < no_conns; i++) {
+			int fd = connect_socket(socket_name);
+			REQUIRE(fd >= 0);
+			cmd = init_dirty_cmd(x++);
+			REQUIRE(send(fd, &cmd, sizeof(cmd), 0) == sizeof(cmd));
+			REQUIRE(recv(fd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+			close(fd);
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		WARN((long)(no_conns / elapsed.count()) << " connections/s accepted");
+	}
+
+	request_exit();
+	pthread_join(loop, NULL);
+	close(listen_fd);
+	unlink(socket_name.c_str());
+	request_queue_close(render_request_queue);
+}
+
+static long resident_bytes(void)
+{
+	long size, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if (statm) {
+		if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+			resident = 0;
+		}
+
+		fclose(statm);
+	}
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Counts the allocations made by the benchmarks
+static std::atomic<long> allocations(0);
+
+void *operator new (std::size_t size)
+{
+	void *ptr = malloc(size ? size : 1);
+
+	if (ptr == NULL) {
+		throw std::bad_alloc();
+	}
+
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return ptr;
+}
+
+void operator delete (void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete (void *ptr, std::size_t size) noexcept
+{
+	free(ptr);
+}
+
+static long minor_faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+TEST_CASE("renderd/map_templates/benchmark", "[.][benchmark]")
+{
+	std::string file = __FILE__;
+	std::string xmlfile = file.substr(0, file.find_last_of('/')) + "/../utils/example-map/mapnik.xml";
+
+	render_init(MAPNIK_PLUGINS_DIR, MAPNIK_FONTS_DIR, 0);
+
+	SECTION("renderd/map_templates/benchmark/load", "every render thread loading the style itself") {
+		std::vector<mapnik::Map> maps(NO_BENCHMARK_MAPS, mapnik::Map(256, 256));
+		long resident = resident_bytes();
+		auto start = std::chrono::steady_clock::now();
+
+		for (mapnik::Map &map : maps) {
+			mapnik::load_map(map, xmlfile);
+			map.load_fonts();
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		WARN(NO_BENCHMARK_MAPS << " maps loaded in " << elapsed.count() << " s, " << (resident_bytes() - resident) / 1024 << " KiB resident");
+	}
+
+	SECTION("renderd/map_templates/benchmark/copy", "render threads copying a style loaded once") {
+		std::vector<mapnik::Map> maps(NO_BENCHMARK_MAPS, mapnik::Map(256, 256));
+		long resident = resident_bytes();
+		auto start = std::chrono::steady_clock::now();
+		mapnik::Map map(256, 256);
+
+		mapnik::load_map(map, xmlfile);
+
+		for (mapnik::Map &copy : maps) {
+			copy = map;
+
+			// The datasource of the example map is not pooled, render threads get their own
+			for (mapnik::layer &l : copy.layers()) {
+				l.set_datasource(mapnik::datasource_cache::instance().create(l.datasource()->params()));
+			}
+
+			copy.load_fonts();
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		WARN(NO_BENCHMARK_MAPS << " maps copied in " << elapsed.count() << " s, " << (resident_bytes() - resident) / 1024 << " KiB resident");
+	}
+}
+
+TEST_CASE("renderd", "tile generation")
+{
+	int found, ret;
+	std::string err_log_lines, out_log_lines;
+
+	SECTION("render_init", "should throw nice error if paths are invalid") {
+		start_capture();
+		render_init("doesnotexist", "doesnotexist", 1);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		found = err_log_lines.find("Unable to open font directory: doesnotexist");
+		REQUIRE(found > -1);
+	}
+
+	SECTION("render_reload", "should only switch to map styles that load") {
+		std::string file = __FILE__;
+		std::string xmlfile = file.substr(0, file.find_last_of('/')) + "/../utils/example-map/mapnik.xml";
+		xmlconfigitem *styles = (xmlconfigitem *)calloc(XMLCONFIGS_MAX, sizeof(xmlconfigitem));
+
+		render_init(MAPNIK_PLUGINS_DIR, MAPNIK_FONTS_DIR, 0);
+
+		styles[0].host = styles[0].htcpip = styles[0].parameterization = styles[0].xmluri = "";
+		styles[0].output_format = "png256";
+		styles[0].tile_dir = "/tmp";
+		styles[0].xmlname = "default";
+		styles[0].xmlfile = xmlfile.c_str();
+		styles[0].num_threads = 1;
+		REQUIRE(render_reload(styles) == 0);
+
+		styles[0].xmlfile = "doesnotexist.xml";
+		start_capture();
+		REQUIRE(render_reload(styles) == -1);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		found = err_log_lines.find("Failed to reload map style 'default', keeping the current map styles");
+		REQUIRE(found > -1);
+
+		// Styles loaded on demand are not loaded by a reload
+		styles[0].lazy_load = 1;
+		REQUIRE(render_reload(styles) == 0);
+
+		free(styles);
+	}
+
+	SECTION("render_thread/lazy_unload", "should unload styles loaded on demand while waiting for requests") {
+		std::string file = __FILE__;
+		std::string xmlfile = file.substr(0, file.find_last_of('/')) + "/../utils/example-map/mapnik.xml";
+		std::string tile_dir = create_tile_dir("mod_tile_lazy_test");
+		xmlconfigitem *styles = (xmlconfigitem *)calloc(XMLCONFIGS_MAX, sizeof(xmlconfigitem));
+		struct item *item;
+		stats_struct stats;
+		pthread_t thread;
+
+		render_init(MAPNIK_PLUGINS_DIR, MAPNIK_FONTS_DIR, 0);
+		render_request_queue = request_queue_init();
+
+		styles[0].host = styles[0].htcpip = styles[0].parameterization = styles[0].xmluri = "";
+		styles[0].output_format = "png256";
+		styles[0].tile_dir = tile_dir.c_str();
+		styles[0].xmlname = "default";
+		styles[0].xmlfile = xmlfile.c_str();
+		styles[0].num_threads = 1;
+		styles[0].lazy_load = 1;
+		styles[0].lazy_unload = 1;
+		REQUIRE(render_reload(styles) == 0);
+
+		start_capture(1);
+		pthread_create(&thread, NULL, render_thread, styles);
+
+		// A request outside of the world loads the style, but renders nothing
+		item = init_render_request(cmdRender);
+		item->fd = FD_INVALID;
+		item->req.x = item->mx = 5;
+		item->req.y = item->my = 0;
+		item->req.z = 0;
+		request_queue_add_request(render_request_queue, item);
+
+		for (int i = 0; i < 3000 && (request_queue_copy_stats(render_request_queue, &stats), stats.noStyleLoad[0] == 0); i++) {
+			usleep(10000);
+		}
+
+		// No further request comes in to make the render thread look at the style again
+		sleep(3);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		REQUIRE(stats.noStyleLoad[0] == 1);
+		found = (err_log_lines + out_log_lines).find("Unloading map style 'default', it was not used for 1 seconds");
+		REQUIRE(found > -1);
+
+		render_exit();
+		pthread_join(thread, NULL);
+
+		request_queue_close(render_request_queue);
+		free(styles);
+		delete_tile_dir(tile_dir);
+	}
+
+	SECTION("encode_metatile", "should encode the same tiles on the encoder threads") {
+		const int tilesize = 256;
+		mapnik::image_rgba8 buf(METATILE * tilesize, METATILE * tilesize);
+		metaTile single("default", "", 0, 0, 10), pooled("default", "", 0, 0, 10), failed("default", "", 0, 0, 10);
+
+		// Solid tiles on the diagonal, a gradient everywhere else
+		for (int y = 0; y < METATILE * tilesize; y++) {
+			for (int x = 0; x < METATILE * tilesize; x++) {
+				buf(x, y) = (x / tilesize == y / tilesize) ? 0xff00ff00 : 0xff000000 | (x * 31 + y * 17);
+			}
+		}
+
+		REQUIRE(encode_metatile(buf, "png256", tilesize, METATILE, METATILE, single) == cmdDone);
+		REQUIRE(render_init_encoders(4) == 0);
+		REQUIRE(encode_metatile(buf, "png256", tilesize, METATILE, METATILE, pooled) == cmdDone);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				REQUIRE(single.get(xx, yy).size() > 0);
+				REQUIRE(pooled.get(xx, yy) == single.get(xx, yy));
+			}
+		}
+
+		start_capture();
+		REQUIRE(encode_metatile(buf, "doesnotexist", tilesize, METATILE, METATILE, failed) == cmdNotDone);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		found = err_log_lines.find("failed to encode tile");
+		REQUIRE(found > -1);
+	}
+
+	SECTION("rx_request/bad", "should return cmdNotDone") {
+		int pipefd[2];
+		pipe(pipefd);
+		struct protocol *req = (struct protocol *)malloc(sizeof(struct protocol));
+		std::string expected_mimetype = "image/png", expected_options = "", expected_xmlname = "default";
+
+		req->x = 1024;
+		req->y = 1024;
+		req->z = 10;
+		strcpy(req->mimetype, "mimetype");
+		strcpy(req->options, "options");
+		strcpy(req->xmlname, "xmlname");
+
+		// Unknown command
+		req->cmd = (enum protoCmd)4096;
+
+		// Invalid version
+		req->ver = 5;
+
+		start_capture();
+		ret = rx_request(req, pipefd[1]);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		REQUIRE(ret == cmdNotDone);
+		found = err_log_lines.find("Bad protocol version " + std::to_string(req->ver));
+		REQUIRE(found > -1);
+
+		// Valid version
+		req->ver = 1;
+
+		REQUIRE((std::string)req->mimetype != expected_mimetype);
+		REQUIRE((std::string)req->options != expected_options);
+		REQUIRE((std::string)req->xmlname != expected_xmlname);
+
+		start_capture();
+		ret = rx_request(req, pipefd[1]);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		REQUIRE((std::string)req->mimetype == expected_mimetype);
+		REQUIRE((std::string)req->options == expected_options);
+		REQUIRE((std::string)req->xmlname == expected_xmlname);
+
+		REQUIRE(ret == cmdNotDone);
+		found = err_log_lines.find("Ignoring invalid command Unknown fd(" + std::to_string(pipefd[1]));
+		REQUIRE(found > -1);
+
+		// Valid command
+		req->cmd = cmdNotDone;
+
+		start_capture();
+		ret = rx_request(req, pipefd[1]);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		REQUIRE(ret == cmdNotDone);
+		found = err_log_lines.find("Ignoring invalid command NotDone fd(" + std::to_string(pipefd[1]));
+		REQUIRE(found > -1);
+
+		free(req);
+	}
+
+	SECTION("process_loop", "should answer pipelined and partially received commands") {
+		std::string socket_name = std::tmpnam(nullptr);
+		int listen_fd = listen_socket(socket_name);
+		struct protocol cmds[3], rsp;
+		ssize_t split = 2 * sizeof(struct protocol) + sizeof(struct protocol) / 2;
+		pthread_t loop;
+		int fd;
+
+		REQUIRE(listen_fd >= 0);
+		render_request_queue = request_queue_init();
+		pthread_create(&loop, NULL, process_loop_thread, &listen_fd);
+		fd = connect_socket(socket_name);
+		REQUIRE(fd >= 0);
+
+		for (int i = 0; i < 3; i++) {
+			cmds[i] = init_dirty_cmd(i);
+		}
+
+		// Two commands and the start of a third one in one go, the rest of it later
+		REQUIRE(send(fd, cmds, split, 0) == split);
+
+		for (int i = 0; i < 2; i++) {
+			REQUIRE(recv(fd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+			REQUIRE(rsp.cmd == cmdNotDone);
+			REQUIRE(rsp.x == cmds[i].x);
+		}
+
+		REQUIRE(send(fd, (char *)cmds + split, sizeof(cmds) - split, 0) == (ssize_t)sizeof(cmds) - split);
+		REQUIRE(recv(fd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+		REQUIRE(rsp.x == cmds[2].x);
+		REQUIRE(request_queue_no_requests_queued(render_request_queue, cmdDirty) == 3);
+
+		// The connection is closed on an unknown protocol version
+		cmds[0].ver = 6;
+		start_capture();
+		REQUIRE(send(fd, cmds, sizeof(struct protocol), 0) == sizeof(struct protocol));
+		REQUIRE(recv(fd, &rsp, sizeof(rsp), 0) == 0);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		found = err_log_lines.find("unknown protocol version 6");
+		REQUIRE(found > -1);
+
+		close(fd);
+		request_exit();
+		pthread_join(loop, NULL);
+		close(listen_fd);
+		unlink(socket_name.c_str());
+		request_queue_close(render_request_queue);
+	}
+
+	SECTION("process_loop/send_response", "should send responses of render threads through process_loop") {
+		std::string socket_name = std::tmpnam(nullptr);
+		int listen_fd = listen_socket(socket_name);
+		struct protocol cmd = init_dirty_cmd(0), rsp;
+		struct item *item;
+		pthread_t loop;
+		int fd, open_fds;
+
+		REQUIRE(listen_fd >= 0);
+		render_request_queue = request_queue_init();
+		open_fds = count_open_fds();
+		pthread_create(&loop, NULL, process_loop_thread, &listen_fd);
+		fd = connect_socket(socket_name);
+		REQUIRE(fd >= 0);
+
+		cmd.cmd = cmdRender;
+		REQUIRE(send(fd, &cmd, sizeof(cmd), 0) == sizeof(cmd));
+
+		while (request_queue_no_requests_queued(render_request_queue, cmdRender) == 0) {
+			usleep(1000);
+		}
+
+		// Like a render thread
+		item = request_queue_fetch_request(render_request_queue);
+		REQUIRE(item->fd != FD_INVALID);
+		send_response(item, cmdDone, 10);
+
+		REQUIRE(recv(fd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+		REQUIRE(rsp.cmd == cmdDone);
+		REQUIRE(rsp.x == cmd.x);
+
+		close(fd);
+		request_exit();
+		pthread_join(loop, NULL);
+
+		// Only the exit pipe is left open, for render threads that still call request_exit
+		REQUIRE(count_open_fds() == open_fds + 2);
+		close(listen_fd);
+		unlink(socket_name.c_str());
+		request_queue_close(render_request_queue);
+	}
+
+	SECTION("process_loop/frames", "should answer batched requests of protocol version 5 by id and out of order") {
+		std::string socket_name = std::tmpnam(nullptr);
+		int listen_fd = listen_socket(socket_name);
+		struct protocol_v5 reqs[5], rsps[PROTO_FRAME_MAX];
+		struct item *items[2];
+		pthread_t loop;
+		int fd;
+
+		REQUIRE(listen_fd >= 0);
+		render_request_queue = request_queue_init();
+		pthread_create(&loop, NULL, process_loop_thread, &listen_fd);
+		fd = connect_socket(socket_name);
+		REQUIRE(fd >= 0);
+
+		// Three dirty requests and two renders of different metatiles in one frame
+		for (int i = 0; i < 5; i++) {
+			struct protocol cmd = init_dirty_cmd(i);
+
+			memset(&reqs[i], 0, sizeof(struct protocol_v5));
+			reqs[i].id = 100 + i;
+			reqs[i].cmd = (i < 3) ? cmdDirty : cmdRender;
+			reqs[i].x = cmd.x;
+			reqs[i].y = cmd.y;
+			reqs[i].z = cmd.z;
+			strcpy(reqs[i].xmlname, cmd.xmlname);
+			strcpy(reqs[i].mimetype, cmd.mimetype);
+		}
+
+		REQUIRE(send_frame(reqs, 5, fd) == (int)(sizeof(struct protocol_frame) + sizeof(reqs)));
+
+		// The dirty requests are answered right away, in one frame
+		REQUIRE(recv_frame(rsps, PROTO_FRAME_MAX, fd) == 3);
+
+		for (int i = 0; i < 3; i++) {
+			REQUIRE(rsps[i].id == reqs[i].id);
+			REQUIRE(rsps[i].cmd == cmdNotDone);
+			REQUIRE(rsps[i].x == reqs[i].x);
+		}
+
+		while (request_queue_no_requests_queued(render_request_queue, cmdRender) < 2) {
+			usleep(1000);
+		}
+
+		items[0] = request_queue_fetch_request(render_request_queue);
+		items[1] = request_queue_fetch_request(render_request_queue);
+		REQUIRE(items[0]->id == reqs[3].id);
+		REQUIRE(items[1]->id == reqs[4].id);
+
+		// The later request is answered first, as it is rendered first
+		send_response(items[1], cmdDone, 10);
+		REQUIRE(recv_frame(rsps, PROTO_FRAME_MAX, fd) == 1);
+		REQUIRE(rsps[0].id == reqs[4].id);
+		REQUIRE(rsps[0].cmd == cmdDone);
+
+		send_response(items[0], cmdNotDone, 10);
+		REQUIRE(recv_frame(rsps, PROTO_FRAME_MAX, fd) == 1);
+		REQUIRE(rsps[0].id == reqs[3].id);
+		REQUIRE(rsps[0].cmd == cmdNotDone);
+
+		close(fd);
+		request_exit();
+		pthread_join(loop, NULL);
+		close(listen_fd);
+		unlink(socket_name.c_str());
+		request_queue_close(render_request_queue);
+	}
+
+	SECTION("slave_dispatch", "should keep several requests in flight on a slave") {
+		std::string socket_name = std::tmpnam(nullptr);
+		struct fake_slave fake = {listen_socket(socket_name), 3, 2, 0, 0, 0};
+		struct slave_dispatcher slave;
+		renderd_config config;
+		pthread_t fake_thread;
+
+		// Like renderd, so that writing to the slave after it went away does not kill the test
+		signal(SIGPIPE, SIG_IGN);
+		REQUIRE(fake.listen_fd >= 0);
+		bzero(&config, sizeof(config));
+		config.name = "renderd1";
+		config.socketname = socket_name.c_str();
+		config.num_threads = 2;
+		REQUIRE(slave_dispatcher_init(&slave, &config) == 0);
+
+		render_request_queue = request_queue_init();
+
+		for (int i = 0; i < 8; i++) {
+			struct item *item = init_render_request(cmdRender);
+			item->fd = FD_INVALID;
+			REQUIRE(request_queue_add_request(render_request_queue, item) == cmdIgnore);
+		}
+
+		pthread_create(&fake_thread, NULL, fake_slave_thread, &fake);
+
+		// Returns once the fake slave has gone away, the requests it left are not done
+		start_capture();
+		ret = slave_dispatch(&slave);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+		pthread_join(fake_thread, NULL);
+
+		REQUIRE(ret == 6);
+		REQUIRE(fake.answered == 6);
+		REQUIRE(fake.max_inflight == 2);
+		REQUIRE(slave.noCompleted == 6);
+		REQUIRE(slave.noDispatched == 6 + slave.noFailed);
+		REQUIRE(slave.num == 0);
+		REQUIRE(slave.fd == FD_INVALID);
+
+		REQUIRE(request_queue_no_requests_queued(render_request_queue, cmdRender) == 8 - slave.noDispatched);
+
+		free(slave.inflight);
+		unlink(socket_name.c_str());
+		request_queue_close(render_request_queue);
+	}
+
+	SECTION("slave_dispatch/wakeup", "should take responses while waiting for requests") {
+		std::string socket_name = std::tmpnam(nullptr);
+		struct fake_slave fake = {listen_socket(socket_name), 1, 1, 100, 0, 0};
+		struct slave_dispatcher slave;
+		renderd_config config;
+		pthread_t fake_thread, dispatch_thread;
+		struct item *item;
+
+		signal(SIGPIPE, SIG_IGN);
+		REQUIRE(fake.listen_fd >= 0);
+		bzero(&config, sizeof(config));
+		config.name = "renderd1";
+		config.socketname = socket_name.c_str();
+		config.num_threads = 2;
+		REQUIRE(slave_dispatcher_init(&slave, &config) == 0);
+
+		render_request_queue = request_queue_init();
+		item = init_render_request(cmdRender);
+		item->fd = FD_INVALID;
+		REQUIRE(request_queue_add_request(render_request_queue, item) == cmdIgnore);
+
+		pthread_create(&fake_thread, NULL, fake_slave_thread, &fake);
+		pthread_create(&dispatch_thread, NULL, slave_dispatch_thread, &slave);
+
+		// The request queue stays empty while the request is in flight
+		for (int i = 0; i < 500 && __atomic_load_n(&(slave.noCompleted), __ATOMIC_RELAXED) == 0; i++) {
+			usleep(10000);
+		}
+
+		REQUIRE(__atomic_load_n(&(slave.noCompleted), __ATOMIC_RELAXED) == 1);
+		pthread_join(fake_thread, NULL);
+
+		// The next request finds the slave gone
+		item = init_render_request(cmdRender);
+		item->fd = FD_INVALID;
+		start_capture();
+		REQUIRE(request_queue_add_request(render_request_queue, item) == cmdIgnore);
+		pthread_join(dispatch_thread, NULL);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		REQUIRE(fake.answered == 1);
+		REQUIRE(slave.noFailed == 1);
+		REQUIRE(slave.fd == FD_INVALID);
+
+		free(slave.inflight);
+		free(slave.routed);
+		unlink(socket_name.c_str());
+		request_queue_close(render_request_queue);
+	}
+
+	SECTION("slave_route", "should route metatiles of a region to the same slave within its share") {
+		struct slave_dispatcher slaves[2];
+		renderd_config configs[2];
+		struct item *items[4];
+		int owned[2] = {0, 0};
+
+		render_request_queue = request_queue_init();
+
+		for (int i = 0; i < 2; i++) {
+			bzero(&configs[i], sizeof(renderd_config));
+			configs[i].name = (i == 0) ? "renderd1" : "renderd2";
+			configs[i].num_threads = 2;
+			REQUIRE(slave_dispatcher_init(&slaves[i], &configs[i]) == 0);
+		}
+
+		REQUIRE(slave_routing_init(slaves, 2) == 0);
+
+		// Slaves that are not connected get nothing routed to them
+		items[0] = init_render_request(cmdRender);
+		items[0]->req.z = 18;
+		REQUIRE(slave_route(&slaves[0], items[0], 0) == &slaves[0]);
+		REQUIRE(slave_route(&slaves[1], items[0], 0) == &slaves[1]);
+
+		slaves[0].connected = 1;
+		slaves[1].connected = 1;
+
+		// Regions are spread over both slaves, and the same from either one
+		for (int i = 0; i < 64; i++) {
+			struct slave_dispatcher *owner;
+
+			items[0]->mx = i * 64 * METATILE;
+			owner = slave_route(&slaves[0], items[0], 0);
+			slaves[0].numRouted = slaves[1].numRouted = 0;
+			REQUIRE(slave_route(&slaves[1], items[0], 0) == owner);
+			slaves[0].numRouted = slaves[1].numRouted = 0;
+			owned[owner - slaves]++;
+		}
+
+		REQUIRE(owned[0] > 0);
+		REQUIRE(owned[1] > 0);
+
+		// Neighbouring metatiles follow the first one, until its slave has its share
+		for (int i = 0; i < 4; i++) {
+			items[i] = init_render_request(cmdRender);
+			items[i]->req.z = 18;
+			items[i]->mx = i * METATILE;
+			items[i]->my = 0;
+		}
+
+		struct slave_dispatcher *owner = slave_route(&slaves[0], items[0], 0);
+		struct slave_dispatcher *other = (owner == &slaves[0]) ? &slaves[1] : &slaves[0];
+
+		// The owner keeps what it fetched itself, other hands it over
+		owner->num = 1;
+		REQUIRE(slave_route(owner, items[1], 0) == owner);
+		REQUIRE(slave_route(other, items[2], 0) == owner);
+		REQUIRE(owner->numRouted == 1);
+		REQUIRE(owner->routed[0] == items[2]);
+		REQUIRE(slave_route(other, items[3], 0) == other);
+
+		slaves[0].num = slaves[1].num = 0;
+		REQUIRE(slave_routing_init(NULL, 0) == 0);
+
+		for (int i = 0; i < 4; i++) {
+			free(items[i]);
+		}
+
+		for (int i = 0; i < 2; i++) {
+			free(slaves[i].inflight);
+			free(slaves[i].routed);
+		}
+
+		request_queue_close(render_request_queue);
+	}
+
+	SECTION("send_response", "should complete") {
+		auto rsp = GENERATE(cmdRender, cmdRenderPrio, cmdRenderLow, cmdRenderBulk);
+
+		render_request_queue = request_queue_init();
+		struct item *item = init_render_request(rsp);
+		request_queue_add_request(render_request_queue, item);
+
+		start_capture(1);
+		send_response(item, rsp, -1);
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		found = out_log_lines.find("Sending message Render");
+		REQUIRE(found > -1);
+
+		request_queue_close(render_request_queue);
+		SUCCEED();
+	}
+}
+
+TEST_CASE("storage-backend", "Tile storage backend router")
+{
+	int found;
+	std::string err_log_lines, out_log_lines, tile_dir = create_tile_dir();
+
+	SECTION("storage/initialise", "should return NULL") {
+		start_capture();
+
+		// empty string
+		std::string empty;
+		REQUIRE(init_storage_backend(empty.c_str()) == NULL);
+
+		// invalid path
+		std::string tile_dir_invalid;
+		tile_dir_invalid = tile_dir + "/" + "invalid";
+		REQUIRE(init_storage_backend(tile_dir_invalid.c_str()) == NULL);
+
+		// file
+		std::string file_name;
+		file_name = tile_dir + "/" + "file";
+		std::ofstream file{file_name};
+		REQUIRE(init_storage_backend(file_name.c_str()) == NULL);
+		std::remove(file_name.c_str());
+
+		// non-existent backend
+		char non_existent_backend[] = "non-existent backend";
+		REQUIRE(init_storage_backend(non_existent_backend) == NULL);
+
+		// Check log output
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		// empty string
+		found = err_log_lines.find("init_storage_backend: Options string was empty");
+		REQUIRE(found > -1);
+
+		// invalid path
+		found = err_log_lines.find("init_storage_backend: Failed to stat");
+		REQUIRE(found > -1);
+		found = err_log_lines.find("No such file or directory");
+		REQUIRE(found > -1);
+
+		// file
+		found = err_log_lines.find("is not a directory");
+		REQUIRE(found > -1);
+
+		// non-existent backend
+		found = err_log_lines.find("init_storage_backend: No valid storage backend found for options: non-existent backend");
+		REQUIRE(found > -1);
+	}
+
+	delete_tile_dir(tile_dir);
+}
+
+TEST_CASE("file storage-backend", "File Tile storage backend")
+{
+	std::string tile_dir = create_tile_dir();
+	std::string xmlconfig("default");
+
+	SECTION("storage/initialise", "should return tile_dir storage_ctx") {
+		struct storage_backend *store = NULL;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+		REQUIRE((char *)store->storage_ctx == tile_dir);
+
+		store->close_storage(store);
+	}
+
+	SECTION("storage/stat/non existent", "should return 0 size") {
+		struct storage_backend *store = NULL;
+		struct stat_info sinfo;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 0, 0, 0);
+		REQUIRE(sinfo.size < 0);
+
+		store->close_storage(store);
+	}
+
+	SECTION("storage/read/non existent", "should return 0 size") {
+		struct storage_backend *store = NULL;
+		int size;
+		char *buf = (char *)malloc(10000);
+		int compressed;
+		char *err_msg = (char *)malloc(10000);
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		size = store->tile_read(store, xmlconfig.c_str(), "", 0, 0, 0, buf, 10000, &compressed, err_msg);
+		REQUIRE(size < 0);
+
+		store->close_storage(store);
+		free(buf);
+		free(err_msg);
+	}
+
+	SECTION("storage/write/full metatile", "should complete") {
+		struct storage_backend *store = NULL;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		metaTile tiles(xmlconfig.c_str(), "", 1024, 1024, 10);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
+				tiles.set(xx, yy, tile_data);
+			}
+		}
+
+		tiles.save(store);
+
+		// Ensure metatile is deleted
+		store->metatile_delete(store, xmlconfig.c_str(), 1024, 1024, 10);
+
+		store->close_storage(store);
+		SUCCEED();
+	}
+
+	SECTION("storage/stat/full metatile", "should complete") {
+		struct storage_backend *store = NULL;
+		struct stat_info sinfo;
+
+		time_t before_write, after_write;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		metaTile tiles(xmlconfig.c_str(), "", 1024 + METATILE, 1024, 10);
+		time(&before_write);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
+				tiles.set(xx, yy, tile_data);
+			}
+		}
+
+		tiles.save(store);
+		time(&after_write);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + METATILE + yy, 1024 + xx, 10);
+				REQUIRE(sinfo.size > 0);
+				REQUIRE(sinfo.expired == 0);
+				REQUIRE(sinfo.atime > 0);
+				REQUIRE(sinfo.mtime >= before_write);
+				REQUIRE(sinfo.mtime <= before_write);
+			}
+		}
+
+		// Ensure metatile is deleted
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + METATILE, 1024, 10);
+
+		store->close_storage(store);
+		SUCCEED();
+	}
+
+	SECTION("storage/read/full metatile", "should complete") {
+		struct storage_backend *store = NULL;
+		char *buf;
+		char *buf_tmp;
+		char msg[4096];
+		int compressed;
+		int tile_size;
+
+		buf = (char *)malloc(8196);
+		buf_tmp = (char *)malloc(8196);
+
+		time_t before_write, after_write;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		metaTile tiles(xmlconfig.c_str(), "", 1024 + METATILE, 1024, 10);
+		time(&before_write);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
+				tiles.set(xx, yy, tile_data);
+			}
+		}
+
+		tiles.save(store);
+		time(&after_write);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				tile_size = store->tile_read(store, xmlconfig.c_str(), "", 1024 + METATILE + xx, 1024 + yy, 10, buf, 8195, &compressed, msg);
+				REQUIRE(tile_size == 12);
+				snprintf(buf_tmp, 8196, "DEADBEAF %i %i", xx, yy);
+				REQUIRE(memcmp(buf_tmp, buf, 11) == 0);
+			}
+		}
+
+		// Ensure metatile is deleted
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + METATILE, 1024, 10);
+
+		store->close_storage(store);
+		free(buf);
+		free(buf_tmp);
+		SUCCEED();
+	}
+
+	SECTION("storage/read/partial metatile", "should return correct data") {
+		struct storage_backend *store = NULL;
+		char *buf;
+		char *buf_tmp;
+		char msg[4096];
+		int compressed;
+		int tile_size;
+
+		buf = (char *)malloc(8196);
+		buf_tmp = (char *)malloc(8196);
+
+		time_t before_write, after_write;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		metaTile tiles(xmlconfig.c_str(), "", 1024 + 2 * METATILE, 1024, 10);
+		time(&before_write);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < (METATILE >> 1); xx++) {
+				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
+				tiles.set(xx, yy, tile_data);
+			}
+		}
+
+		tiles.save(store);
+		time(&after_write);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				tile_size = store->tile_read(store, xmlconfig.c_str(), "", 1024 + 2 * METATILE + xx, 1024 + yy, 10, buf, 8195, &compressed, msg);
+
+				if (xx >= (METATILE >> 1)) {
+					REQUIRE(tile_size == 0);
+				} else {
+					REQUIRE(tile_size == 12);
+					snprintf(buf_tmp, 8196, "DEADBEAF %i %i", xx, yy);
+					REQUIRE(memcmp(buf_tmp, buf, 11) == 0);
+				}
+			}
+		}
+
+		// Ensure metatile is deleted
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 2 * METATILE, 1024, 10);
+
+		store->close_storage(store);
+		free(buf);
+		free(buf_tmp);
+	}
+
+	SECTION("storage/expire metatile", "should expire the tile") {
+		struct storage_backend *store = NULL;
+		struct stat_info sinfo;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		metaTile tiles(xmlconfig.c_str(), "", 1024 + 3 * METATILE, 1024, 10);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
+				tiles.set(xx, yy, tile_data);
+			}
+		}
+
+		tiles.save(store);
+
+		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 3 * METATILE, 1024, 10);
+		REQUIRE(sinfo.size > 0);
+
+		store->metatile_expire(store, xmlconfig.c_str(), 1024 + 3 * METATILE, 1024, 10);
+
+		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 3 * METATILE, 1024, 10);
+		REQUIRE(sinfo.size > 0);
+		REQUIRE(sinfo.expired > 0);
+
+		// Ensure metatile is deleted
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 3 * METATILE, 1024, 10);
+
+		store->close_storage(store);
+	}
+
+	SECTION("storage/write/unchanged metatile", "should only refresh the modification time") {
+		struct storage_backend *store = NULL;
+		struct stat_info sinfo;
+		struct stat st;
+		char buf[8196];
+		char path[PATH_MAX];
+		char msg[4096];
+		int compressed;
+		int tile_size;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+		REQUIRE(store->metatile_touch != NULL);
+
+		store->tile_storage_id(store, xmlconfig.c_str(), "", 1024 + 6 * METATILE, 1024, 10, path);
+
+		for (int i = 0; i < 3; i++) {
+			metaTile tiles(xmlconfig.c_str(), "", 1024 + 6 * METATILE, 1024, 10);
+
+			for (int yy = 0; yy < METATILE; yy++) {
+				for (int xx = 0; xx < METATILE; xx++) {
+					tiles.set(xx, yy, (i == 2 && xx == 1 && yy == 1) ? "CHANGED" : "DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
+				}
+			}
+
+			if (i == 1) {
+				// An unchanged metatile is not written again, but no longer expired
+				store->metatile_expire(store, xmlconfig.c_str(), 1024 + 6 * METATILE, 1024, 10);
+				REQUIRE(stat(path + strlen("file://"), &st) == 0);
+				REQUIRE(chmod(path + strlen("file://"), 0444) == 0);
+			}
+
+			tiles.save(store);
+
+			sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 6 * METATILE, 1024, 10);
+			REQUIRE(sinfo.size > 0);
+			REQUIRE(sinfo.expired == 0);
+
+			if (i == 1) {
+				REQUIRE(stat(path + strlen("file://"), &st) == 0);
+				REQUIRE((st.st_mode & 0777) == 0444);
+				REQUIRE(chmod(path + strlen("file://"), 0644) == 0);
+			}
+		}
+
+		tile_size = store->tile_read(store, xmlconfig.c_str(), "", 1024 + 6 * METATILE + 1, 1024 + 1, 10, buf, 8195, &compressed, msg);
+		REQUIRE(tile_size > 0);
+		REQUIRE(std::string(buf, tile_size) == "CHANGED");
+
+		// Ensure metatile is deleted
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 6 * METATILE, 1024, 10);
+
+		store->close_storage(store);
+	}
+
+	SECTION("storage/delete metatile", "should delete the tile") {
+		struct storage_backend *store = NULL;
+		struct stat_info sinfo;
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		metaTile tiles(xmlconfig.c_str(), "", 1024 + 4 * METATILE, 1024, 10);
+
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
+				tiles.set(xx, yy, tile_data);
+			}
+		}
+
+		tiles.save(store);
+
+		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 4 * METATILE, 1024, 10);
+		REQUIRE(sinfo.size > 0);
+
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 4 * METATILE, 1024, 10);
 
-		size = store->tile_read(store, xmlconfig.c_str(), "", 0, 0, 0, buf, 10000, &compressed, err_msg);
-		REQUIRE(size < 0);
+		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 4 * METATILE, 1024, 10);
+		REQUIRE(sinfo.size < 0);
 
 		store->close_storage(store);
-		free(buf);
-		free(err_msg);
 	}
 
-	SECTION("storage/write/full metatile", "should complete") {
+	SECTION("storage/read/shared tiles", "identical tiles should be stored once") {
 		struct storage_backend *store = NULL;
+		struct stat st;
+		char buf[8196];
+		char path[PATH_MAX];
+		char msg[4096];
+		int compressed;
+		int tile_size;
 
 		store = init_storage_backend(tile_dir.c_str());
 		REQUIRE(store != NULL);
 
-		metaTile tiles(xmlconfig.c_str(), "", 1024, 1024, 10);
+		metaTile tiles(xmlconfig.c_str(), "", 1024 + 5 * METATILE, 1024, 10);
 
 		for (int yy = 0; yy < METATILE; yy++) {
 			for (int xx = 0; xx < METATILE; xx++) {
-				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
-				tiles.set(xx, yy, tile_data);
+				tiles.set(xx, yy, (xx == 0 && yy == 0) ? "DEADBEAF" : "SOLID");
 			}
 		}
 
 		tiles.save(store);
 
+		for (int yy = 0; yy < METATILE; yy++) {
+			for (int xx = 0; xx < METATILE; xx++) {
+				tile_size = store->tile_read(store, xmlconfig.c_str(), "", 1024 + 5 * METATILE + xx, 1024 + yy, 10, buf, 8195, &compressed, msg);
+				REQUIRE(tile_size > 0);
+				REQUIRE(std::string(buf, tile_size) == ((xx == 0 && yy == 0) ? "DEADBEAF" : "SOLID"));
+			}
+		}
+
+		store->tile_storage_id(store, xmlconfig.c_str(), "", 1024 + 5 * METATILE, 1024, 10, path);
+		REQUIRE(stat(path + strlen("file://"), &st) == 0);
+		REQUIRE((size_t)st.st_size == sizeof(struct meta_layout) + sizeof(struct entry) * METATILE * METATILE + strlen("DEADBEAF") + strlen("SOLID"));
+
 		// Ensure metatile is deleted
-		store->metatile_delete(store, xmlconfig.c_str(), 1024, 1024, 10);
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 5 * METATILE, 1024, 10);
 
 		store->close_storage(store);
-		SUCCEED();
 	}
 
-	SECTION("storage/stat/full metatile", "should complete") {
+	SECTION("storage/read/repeated tiles", "each distinct tile should be stored once") {
 		struct storage_backend *store = NULL;
-		struct stat_info sinfo;
-
-		time_t before_write, after_write;
+		struct stat st;
+		char buf[8196];
+		char path[PATH_MAX];
+		char msg[4096];
+		int compressed;
+		int tile_size;
+		size_t size = sizeof(struct meta_layout) + sizeof(struct entry) * METATILE * METATILE + 3 * strlen("STRIPE 0");
 
 		store = init_storage_backend(tile_dir.c_str());
 		REQUIRE(store != NULL);
 
-		metaTile tiles(xmlconfig.c_str(), "", 1024 + METATILE, 1024, 10);
-		time(&before_write);
+		metaTile tiles(xmlconfig.c_str(), "", 1024 + 6 * METATILE, 1024, 10);
 
+		// Stripes of three distinct tiles of the same size
 		for (int yy = 0; yy < METATILE; yy++) {
 			for (int xx = 0; xx < METATILE; xx++) {
-				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
-				tiles.set(xx, yy, tile_data);
+				tiles.set(xx, yy, "STRIPE " + std::to_string((xx + yy) % 3));
 			}
 		}
 
 		tiles.save(store);
-		time(&after_write);
 
 		for (int yy = 0; yy < METATILE; yy++) {
 			for (int xx = 0; xx < METATILE; xx++) {
-				sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + METATILE + yy, 1024 + xx, 10);
-				REQUIRE(sinfo.size > 0);
-				REQUIRE(sinfo.expired == 0);
-				REQUIRE(sinfo.atime > 0);
-				REQUIRE(sinfo.mtime >= before_write);
-				REQUIRE(sinfo.mtime <= before_write);
+				tile_size = store->tile_read(store, xmlconfig.c_str(), "", 1024 + 6 * METATILE + xx, 1024 + yy, 10, buf, 8195, &compressed, msg);
+				REQUIRE(tile_size > 0);
+				REQUIRE(std::string(buf, tile_size) == "STRIPE " + std::to_string((xx + yy) % 3));
 			}
 		}
 
+		store->tile_storage_id(store, xmlconfig.c_str(), "", 1024 + 6 * METATILE, 1024, 10, path);
+		REQUIRE(stat(path + strlen("file://"), &st) == 0);
+		REQUIRE((size_t)st.st_size == size);
+
 		// Ensure metatile is deleted
-		store->metatile_delete(store, xmlconfig.c_str(), 1024 + METATILE, 1024, 10);
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 6 * METATILE, 1024, 10);
 
 		store->close_storage(store);
-		SUCCEED();
 	}
 
-	SECTION("storage/read/full metatile", "should complete") {
+	SECTION("storage/read/metatile sizes", "metatiles of any size should be read back") {
 		struct storage_backend *store = NULL;
-		char *buf;
-		char *buf_tmp;
+		std::string sized_xmlconfig = "sized";
+		int sizes[MAX_ZOOM + 1];
+		char buf[8196];
 		char msg[4096];
 		int compressed;
 		int tile_size;
 
-		buf = (char *)malloc(8196);
-		buf_tmp = (char *)malloc(8196);
-
-		time_t before_write, after_write;
-
 		store = init_storage_backend(tile_dir.c_str());
 		REQUIRE(store != NULL);
 
-		metaTile tiles(xmlconfig.c_str(), "", 1024 + METATILE, 1024, 10);
-		time(&before_write);
+		// Large metatiles, with small ones at zoom 12
+		for (int z = 0; z <= MAX_ZOOM; z++) {
+			sizes[z] = (z == 12) ? 4 : 16;
+		}
 
-		for (int yy = 0; yy < METATILE; yy++) {
-			for (int xx = 0; xx < METATILE; xx++) {
-				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
-				tiles.set(xx, yy, tile_data);
+		metatile_size_set(sized_xmlconfig.c_str(), sizes);
+		REQUIRE(metatile_size(sized_xmlconfig.c_str(), 10) == 16);
+		REQUIRE(metatile_size(sized_xmlconfig.c_str(), 12) == 4);
+		REQUIRE(metatile_size(xmlconfig.c_str(), 10) == METATILE);
+
+		for (int z = 10; z <= 12; z += 2) {
+			int size = metatile_size(sized_xmlconfig.c_str(), z);
+			metaTile tiles(sized_xmlconfig.c_str(), "", 1024, 1024, z, size);
+
+			for (int yy = 0; yy < size; yy++) {
+				for (int xx = 0; xx < size; xx++) {
+					tiles.set(xx, yy, "TILE " + std::to_string(xx) + " " + std::to_string(yy));
+				}
 			}
-		}
 
-		tiles.save(store);
-		time(&after_write);
+			tiles.save(store);
 
-		for (int yy = 0; yy < METATILE; yy++) {
-			for (int xx = 0; xx < METATILE; xx++) {
-				tile_size = store->tile_read(store, xmlconfig.c_str(), "", 1024 + METATILE + xx, 1024 + yy, 10, buf, 8195, &compressed, msg);
-				REQUIRE(tile_size == 12);
-				snprintf(buf_tmp, 8196, "DEADBEAF %i %i", xx, yy);
-				REQUIRE(memcmp(buf_tmp, buf, 11) == 0);
+			for (int yy = 0; yy < size; yy++) {
+				for (int xx = 0; xx < size; xx++) {
+					tile_size = store->tile_read(store, sized_xmlconfig.c_str(), "", 1024 + xx, 1024 + yy, z, buf, 8195, &compressed, msg);
+					REQUIRE(tile_size > 0);
+					REQUIRE(std::string(buf, tile_size) == "TILE " + std::to_string(xx) + " " + std::to_string(yy));
+				}
 			}
 		}
 
+		store->metatile_delete(store, sized_xmlconfig.c_str(), 1024, 1024, 12);
+
+		// Metatiles written before the size was changed are still read with their own size
+		for (int z = 0; z <= MAX_ZOOM; z++) {
+			sizes[z] = METATILE;
+		}
+
+		metatile_size_set(sized_xmlconfig.c_str(), sizes);
+
+		tile_size = store->tile_read(store, sized_xmlconfig.c_str(), "", 1024 + METATILE - 1, 1024 + 1, 10, buf, 8195, &compressed, msg);
+		REQUIRE(tile_size > 0);
+		REQUIRE(std::string(buf, tile_size) == "TILE " + std::to_string(METATILE - 1) + " 1");
+
+		tile_size = store->tile_read(store, sized_xmlconfig.c_str(), "", 1024 + METATILE, 1024, 10, buf, 8195, &compressed, msg);
+		REQUIRE(tile_size < 0);
+
 		// Ensure metatile is deleted
-		store->metatile_delete(store, xmlconfig.c_str(), 1024 + METATILE, 1024, 10);
+		store->metatile_delete(store, sized_xmlconfig.c_str(), 1024, 1024, 10);
 
 		store->close_storage(store);
-		free(buf);
-		free(buf_tmp);
-		SUCCEED();
 	}
 
-	SECTION("storage/read/partial metatile", "should return correct data") {
+	SECTION("storage/tile_storage_id", "should return -1") {
 		struct storage_backend *store = NULL;
-		char *buf;
-		char *buf_tmp;
+		char *string = (char *)malloc(PATH_MAX - 1);
+
+		store = init_storage_backend(tile_dir.c_str());
+		REQUIRE(store != NULL);
+
+		string = store->tile_storage_id(store, xmlconfig.c_str(), "", 0, 0, 0, string);
+		REQUIRE((std::string)string == "file://" + tile_dir + "/" + xmlconfig + "/0/0/0/0/0/0.meta");
+
+		store->close_storage(store);
+	}
+
+	delete_tile_dir(tile_dir);
+}
+
+// Counts the blobs in the blob store of a dedup storage backend
+static int count_blobs(const std::string &dir)
+{
+	DIR *blob_dir = opendir(dir.c_str());
+	struct dirent *entry;
+	int count = 0;
+
+	if (blob_dir == NULL) {
+		return 0;
+	}
+
+	while ((entry = readdir(blob_dir)) != NULL) {
+		if (entry->d_name[0] == '.' || !strcmp(entry->d_name, "lock")) {
+			continue;
+		} else if (entry->d_type == DT_DIR) {
+			count += count_blobs(dir + "/" + entry->d_name);
+		} else {
+			count++;
+		}
+	}
+
+	closedir(blob_dir);
+	return count;
+}
+
+TEST_CASE("dedup storage-backend", "Content addressed Tile storage backend")
+{
+	std::string tile_dir = create_tile_dir("mod_tile_dedup_test");
+	std::string blob_dir = tile_dir + "/" + DEDUP_BLOB_DIR;
+	std::string store_name = "dedup://" + tile_dir;
+	std::string xmlconfig("default");
+	size_t header_len = sizeof(struct meta_layout) + sizeof(struct entry) * METATILE * METATILE;
+
+	SECTION("dedup storage/initialise", "should return a storage backend for directories only") {
+		struct storage_backend *store = NULL;
+
+		REQUIRE(init_storage_backend("dedup:///non-existent") == NULL);
+
+		store = init_storage_backend(store_name.c_str());
+		REQUIRE(store != NULL);
+
+		store->close_storage(store);
+	}
+
+	SECTION("dedup storage/read/repeated tiles", "tiles repeated across metatiles should be stored once") {
+		struct storage_backend *store = NULL;
+		struct stat st;
+		char buf[8196];
+		char path[PATH_MAX];
 		char msg[4096];
 		int compressed;
 		int tile_size;
 
-		buf = (char *)malloc(8196);
-		buf_tmp = (char *)malloc(8196);
+		store = init_storage_backend(store_name.c_str());
+		REQUIRE(store != NULL);
 
-		time_t before_write, after_write;
+		for (int mx = 1024; mx < 1024 + 3 * METATILE; mx += METATILE) {
+			metaTile tiles(xmlconfig.c_str(), "", mx, 1024, 10);
 
-		store = init_storage_backend(tile_dir.c_str());
-		REQUIRE(store != NULL);
+			for (int yy = 0; yy < METATILE; yy++) {
+				for (int xx = 0; xx < METATILE; xx++) {
+					tiles.set(xx, yy, (xx == 0 && yy == 0) ? "DEADBEAF " + std::to_string(mx) : "SOLID");
+				}
+			}
 
-		metaTile tiles(xmlconfig.c_str(), "", 1024 + 2 * METATILE, 1024, 10);
-		time(&before_write);
+			tiles.save(store);
+		}
 
-		for (int yy = 0; yy < METATILE; yy++) {
-			for (int xx = 0; xx < (METATILE >> 1); xx++) {
-				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
-				tiles.set(xx, yy, tile_data);
+		for (int mx = 1024; mx < 1024 + 3 * METATILE; mx += METATILE) {
+			for (int yy = 0; yy < METATILE; yy++) {
+				for (int xx = 0; xx < METATILE; xx++) {
+					tile_size = store->tile_read(store, xmlconfig.c_str(), "", mx + xx, 1024 + yy, 10, buf, 8195, &compressed, msg);
+					REQUIRE(tile_size > 0);
+					REQUIRE(std::string(buf, tile_size) == ((xx == 0 && yy == 0) ? "DEADBEAF " + std::to_string(mx) : "SOLID"));
+				}
 			}
 		}
 
-		tiles.save(store);
-		time(&after_write);
+		// The first metatile holds the repeated tile, the others reference its blob
+		REQUIRE(count_blobs(blob_dir) == 1);
 
-		for (int yy = 0; yy < METATILE; yy++) {
-			for (int xx = 0; xx < METATILE; xx++) {
-				tile_size = store->tile_read(store, xmlconfig.c_str(), "", 1024 + 2 * METATILE + xx, 1024 + yy, 10, buf, 8195, &compressed, msg);
+		store->tile_storage_id(store, xmlconfig.c_str(), "", 1024 + 2 * METATILE, 1024, 10, path);
+		REQUIRE(stat(path + strlen("dedup://"), &st) == 0);
+		REQUIRE((size_t)st.st_size == header_len + ("DEADBEAF " + std::to_string(1024 + 2 * METATILE)).size() + sizeof(uint64_t));
 
-				if (xx >= (METATILE >> 1)) {
-					REQUIRE(tile_size == 0);
-				} else {
-					REQUIRE(tile_size == 12);
-					snprintf(buf_tmp, 8196, "DEADBEAF %i %i", xx, yy);
-					REQUIRE(memcmp(buf_tmp, buf, 11) == 0);
+		// Read back with the blob in place, so rendering it again unchanged does not write it
+		REQUIRE(store->metatile_read(store, xmlconfig.c_str(), "", 1024 + 2 * METATILE, 1024, 10, NULL, 0) == (int)(header_len + ("DEADBEAF " + std::to_string(1024 + 2 * METATILE)).size() + strlen("SOLID")));
+
+		{
+			struct stat st_again;
+			metaTile tiles(xmlconfig.c_str(), "", 1024 + 2 * METATILE, 1024, 10);
+
+			for (int yy = 0; yy < METATILE; yy++) {
+				for (int xx = 0; xx < METATILE; xx++) {
+					tiles.set(xx, yy, (xx == 0 && yy == 0) ? "DEADBEAF " + std::to_string(1024 + 2 * METATILE) : "SOLID");
 				}
 			}
+
+			tiles.save(store);
+			REQUIRE(stat(path + strlen("dedup://"), &st_again) == 0);
+			REQUIRE(st_again.st_ino == st.st_ino);
+			REQUIRE(count_blobs(blob_dir) == 1);
 		}
 
-		// Ensure metatile is deleted
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + METATILE, 1024, 10);
+		REQUIRE(count_blobs(blob_dir) == 1);
+
+		// The blob is gone with the last metatile referencing it
 		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 2 * METATILE, 1024, 10);
+		REQUIRE(count_blobs(blob_dir) == 0);
+
+		store->metatile_delete(store, xmlconfig.c_str(), 1024, 1024, 10);
 
 		store->close_storage(store);
-		free(buf);
-		free(buf_tmp);
 	}
 
-	SECTION("storage/expire metatile", "should expire the tile") {
+	SECTION("dedup storage/write/repeated at another offset", "tiles repeating a blob within a metatile should reference it once") {
 		struct storage_backend *store = NULL;
-		struct stat_info sinfo;
+		std::string repeated("DEADBEAF repeated");
+		std::string buf(header_len, '\0');
+		struct meta_layout *m;
+		char tile[8196];
+		char msg[4096];
+		int compressed;
+		int tile_size;
 
-		store = init_storage_backend(tile_dir.c_str());
+		store = init_storage_backend(store_name.c_str());
 		REQUIRE(store != NULL);
 
-		metaTile tiles(xmlconfig.c_str(), "", 1024 + 3 * METATILE, 1024, 10);
+		// Two metatiles repeating the tile make it a blob
+		for (int mx = 1024 + 4 * METATILE; mx < 1024 + 6 * METATILE; mx += METATILE) {
+			metaTile tiles(xmlconfig.c_str(), "", mx, 1024, 10);
 
-		for (int yy = 0; yy < METATILE; yy++) {
-			for (int xx = 0; xx < METATILE; xx++) {
-				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
-				tiles.set(xx, yy, tile_data);
+			for (int yy = 0; yy < METATILE; yy++) {
+				for (int xx = 0; xx < METATILE; xx++) {
+					tiles.set(xx, yy, (xx == 0 && yy == 0) ? repeated : "TILE " + std::to_string(mx));
+				}
 			}
+
+			tiles.save(store);
 		}
 
-		tiles.save(store);
+		REQUIRE(count_blobs(blob_dir) == 1);
 
-		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 3 * METATILE, 1024, 10);
-		REQUIRE(sinfo.size > 0);
+		// Written as it is, the first two tiles hold the same content at different offsets
+		m = (struct meta_layout *)&buf[0];
+		memcpy(m->magic, META_MAGIC, strlen(META_MAGIC));
+		m->count = METATILE * METATILE;
+		m->x = 1024 + 6 * METATILE;
+		m->y = 1024;
+		m->z = 10;
 
-		store->metatile_expire(store, xmlconfig.c_str(), 1024 + 3 * METATILE, 1024, 10);
+		for (int i = 0; i < METATILE * METATILE; i++) {
+			std::string content = (i < 2) ? repeated : "TILE " + std::to_string(i);
 
-		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 3 * METATILE, 1024, 10);
-		REQUIRE(sinfo.size > 0);
-		REQUIRE(sinfo.expired > 0);
+			m = (struct meta_layout *)&buf[0];
+			m->index[i].offset = buf.size();
+			m->index[i].size = content.size();
+			buf += content;
+		}
 
-		// Ensure metatile is deleted
-		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 3 * METATILE, 1024, 10);
+		REQUIRE(store->metatile_write(store, xmlconfig.c_str(), "", 1024 + 6 * METATILE, 1024, 10, buf.data(), buf.size()) == (int)buf.size());
+
+		for (int yy = 0; yy < 2; yy++) {
+			tile_size = store->tile_read(store, xmlconfig.c_str(), "", 1024 + 6 * METATILE, 1024 + yy, 10, tile, sizeof(tile) - 1, &compressed, msg);
+			REQUIRE(std::string(tile, tile_size) == repeated);
+		}
+
+		// The blob is gone with the last metatile referencing it
+		for (int mx = 1024 + 4 * METATILE; mx < 1024 + 7 * METATILE; mx += METATILE) {
+			REQUIRE(count_blobs(blob_dir) == 1);
+			store->metatile_delete(store, xmlconfig.c_str(), mx, 1024, 10);
+		}
+
+		REQUIRE(count_blobs(blob_dir) == 0);
 
 		store->close_storage(store);
 	}
 
-	SECTION("storage/delete metatile", "should delete the tile") {
+	SECTION("dedup storage/write/rendered again", "tiles of a metatile rendered again should not become blobs") {
 		struct storage_backend *store = NULL;
 		struct stat_info sinfo;
 
-		store = init_storage_backend(tile_dir.c_str());
+		store = init_storage_backend(store_name.c_str());
 		REQUIRE(store != NULL);
 
-		metaTile tiles(xmlconfig.c_str(), "", 1024 + 4 * METATILE, 1024, 10);
+		for (int i = 0; i < 2; i++) {
+			metaTile tiles(xmlconfig.c_str(), "", 1024 + 3 * METATILE, 1024, 10);
 
-		for (int yy = 0; yy < METATILE; yy++) {
-			for (int xx = 0; xx < METATILE; xx++) {
-				std::string tile_data("DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
-				tiles.set(xx, yy, tile_data);
+			for (int yy = 0; yy < METATILE; yy++) {
+				for (int xx = 0; xx < METATILE; xx++) {
+					tiles.set(xx, yy, "DEADBEAF " + std::to_string(xx) + " " + std::to_string(yy));
+				}
 			}
-		}
 
-		tiles.save(store);
+			tiles.save(store);
+		}
 
-		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 4 * METATILE, 1024, 10);
-		REQUIRE(sinfo.size > 0);
+		REQUIRE(count_blobs(blob_dir) == 0);
 
-		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 4 * METATILE, 1024, 10);
+		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 3 * METATILE, 1024, 10);
+		REQUIRE((size_t)sinfo.size == header_len + METATILE * METATILE * strlen("DEADBEAF 0 0"));
 
-		sinfo = store->tile_stat(store, xmlconfig.c_str(), "", 1024 + 4 * METATILE, 1024, 10);
-		REQUIRE(sinfo.size < 0);
+		store->metatile_delete(store, xmlconfig.c_str(), 1024 + 3 * METATILE, 1024, 10);
 
 		store->close_storage(store);
 	}
 
-	SECTION("storage/tile_storage_id", "should return -1") {
+	SECTION("dedup storage/tile_storage_id", "should return the metatile path") {
 		struct storage_backend *store = NULL;
 		char *string = (char *)malloc(PATH_MAX - 1);
 
-		store = init_storage_backend(tile_dir.c_str());
+		store = init_storage_backend(store_name.c_str());
 		REQUIRE(store != NULL);
 
 		string = store->tile_storage_id(store, xmlconfig.c_str(), "", 0, 0, 0, string);
-		REQUIRE((std::string)string == "file://" + tile_dir + "/" + xmlconfig + "/0/0/0/0/0/0.meta");
+		REQUIRE((std::string)string == "dedup://" + tile_dir + "/" + xmlconfig + "/0/0/0/0/0/0.meta");
 
 		store->close_storage(store);
+		free(string);
 	}
 
 	delete_tile_dir(tile_dir);
@@ -1290,19 +3341,26 @@ TEST_CASE("projections", "Test projections")
 
 		struct projectionconfig *prj = get_projection(projection_srs);
 
-		bbox = tile2prjbounds(prj, 0, 0, 0);
+		bbox = tile2prjbounds(prj, 0, 0, 0, METATILE);
 		REQUIRE(bbox.minx() == expected_minx);
 		REQUIRE(bbox.miny() == expected_miny);
 		REQUIRE(bbox.maxx() == expected_maxx);
 		REQUIRE(bbox.maxy() == expected_maxy);
 
-		bbox = tile2prjbounds(prj, 0, 0, 10);
+		bbox = tile2prjbounds(prj, 0, 0, 10, METATILE);
 		REQUIRE(bbox.minx() == expected_minx);
 		REQUIRE(round(bbox.miny()) == expected_rounded_miny);
 		REQUIRE(round(bbox.maxx()) == expected_rounded_maxx);
 		REQUIRE(bbox.maxy() == expected_maxy);
 
-		bbox = tile2prjbounds(prj, (x_multiplier * (1 << 10) - METATILE), (y_multiplier * (1 << 10) - METATILE), 10);
+		// Styles may use larger meta-tiles at some zoom levels
+		mapnik::box2d<double> bbox_large = tile2prjbounds(prj, 0, 0, 10, 2 * METATILE);
+		REQUIRE(bbox_large.minx() == expected_minx);
+		REQUIRE(bbox_large.maxy() == expected_maxy);
+		REQUIRE(bbox_large.width() == Approx(2 * bbox.width()));
+		REQUIRE(bbox_large.height() == Approx(2 * bbox.height()));
+
+		bbox = tile2prjbounds(prj, (x_multiplier * (1 << 10) - METATILE), (y_multiplier * (1 << 10) - METATILE), 10, METATILE);
 		REQUIRE(round(bbox.minx()) == expected_rounded_minx);
 		REQUIRE(bbox.miny() == expected_miny);
 		REQUIRE(bbox.maxx() == expected_maxx);
@@ -1444,6 +3502,79 @@ TEST_CASE("metatile", "Test metatile.cpp")
 			}
 		}
 	}
+
+	SECTION("metatile/tile_solid", "should only find tiles of a single colour") {
+		const int tilesize = 256;
+		mapnik::image_rgba8 buf(2 * tilesize, tilesize);
+		uint32_t colour = 0;
+
+		buf.set(0xff336699);
+		REQUIRE(tile_solid(buf, 0, 0, tilesize, &colour));
+		REQUIRE(colour == 0xff336699);
+		REQUIRE(tile_solid(buf, 1, 0, tilesize, &colour));
+
+		// One pixel differs, in the first row of the second tile and in the last row of the first
+		buf(tilesize + 7, 0) = 0xff336698;
+		REQUIRE_FALSE(tile_solid(buf, 1, 0, tilesize, &colour));
+		REQUIRE(tile_solid(buf, 0, 0, tilesize, &colour));
+		buf(tilesize - 1, tilesize - 1) = 0xff336698;
+		REQUIRE_FALSE(tile_solid(buf, 0, 0, tilesize, &colour));
+	}
+}
+
+TEST_CASE("metatile/benchmark", "[.][benchmark]")
+{
+	const unsigned int size = METATILE * 256;
+
+	SECTION("metatile/benchmark/raster/fresh", "a new raster for every metatile") {
+		long allocated = allocations.load(), faults = minor_faults();
+		auto start = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < NO_BENCHMARK_RENDERS; i++) {
+			mapnik::image_rgba8 buf(size, size);
+			buf.set(i);
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		WARN(NO_BENCHMARK_RENDERS << " rasters in " << elapsed.count() << " s, " << allocations.load() - allocated << " allocations, " << minor_faults() - faults << " minor faults");
+	}
+
+	SECTION("metatile/benchmark/raster/reused", "the raster of the render thread cleared for every metatile") {
+		long allocated = allocations.load(), faults = minor_faults();
+		auto start = std::chrono::steady_clock::now();
+		mapnik::image_rgba8 buf(size, size);
+
+		for (int i = 0; i < NO_BENCHMARK_RENDERS; i++) {
+			buf.set(0);
+			buf.set(i);
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		WARN(NO_BENCHMARK_RENDERS << " rasters in " << elapsed.count() << " s, " << allocations.load() - allocated << " allocations, " << minor_faults() - faults << " minor faults");
+	}
+
+	SECTION("metatile/benchmark/save", "assembling metatiles of encoded tiles and saving them") {
+		struct storage_backend *store = init_storage_backend("null://");
+		std::string tile_data(20000, 'x');
+		long allocated = allocations.load(), faults = minor_faults();
+		auto start = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < NO_BENCHMARK_RENDERS; i++) {
+			metaTile tiles("default", "", 0, 0, 10);
+
+			for (int yy = 0; yy < METATILE; yy++) {
+				for (int xx = 0; xx < METATILE; xx++) {
+					tiles.set(xx, yy, std::string(tile_data));
+				}
+			}
+
+			tiles.save(store);
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		WARN(NO_BENCHMARK_RENDERS << " metatiles saved in " << elapsed.count() << " s, " << allocations.load() - allocated << " allocations, " << minor_faults() - faults << " minor faults");
+		store->close_storage(store);
+	}
 }
 
 TEST_CASE("protocol_helper", "Test protocol_helper.c")
@@ -1457,7 +3588,7 @@ TEST_CASE("protocol_helper", "Test protocol_helper.c")
 	cmd->z = 10;
 
 	SECTION("send_cmd/ver invalid version", "should return -1") {
-		// Version must be 1, 2 or 3
+		// Version must be 1, 2, 3 or 4
 		cmd->ver = 0;
 
 		start_capture();
@@ -1468,15 +3599,15 @@ TEST_CASE("protocol_helper", "Test protocol_helper.c")
 		found = err_log_lines.find("Failed to send render cmd with unknown protocol version 0");
 		REQUIRE(found > -1);
 
-		// Version must be 1, 2 or 3
-		cmd->ver = 4;
+		// Version must be 1, 2, 3 or 4
+		cmd->ver = 5;
 
 		start_capture();
 		ret = send_cmd(cmd, fd);
 		std::tie(err_log_lines, out_log_lines) = end_capture();
 
 		REQUIRE(ret == -1);
-		found = err_log_lines.find("Failed to send render cmd with unknown protocol version 4");
+		found = err_log_lines.find("Failed to send render cmd with unknown protocol version 5");
 		REQUIRE(found > -1);
 	}
 
@@ -1492,6 +3623,72 @@ TEST_CASE("protocol_helper", "Test protocol_helper.c")
 		REQUIRE(found > -1);
 	}
 
+	SECTION("parse_cmd", "should take complete commands off the buffer") {
+		char buf[2 * sizeof(struct protocol)];
+		struct protocol parsed;
+
+		cmd->ver = 4;
+		cmd->cmd = cmdRender;
+		strcpy(cmd->xmlname, "default");
+		cmd->timeout = 10;
+		memcpy(buf, cmd, sizeof(struct protocol));
+		memcpy(buf + sizeof(struct protocol), cmd, sizeof(struct protocol_v1));
+		((struct protocol_v1 *)(buf + sizeof(struct protocol)))->ver = 1;
+
+		REQUIRE(parse_cmd(&parsed, buf, sizeof(struct protocol_v1)) == 0);
+		REQUIRE(parse_cmd(&parsed, buf, sizeof(struct protocol) - 1) == 0);
+		REQUIRE(parse_cmd(&parsed, buf, sizeof(buf)) == sizeof(struct protocol));
+		REQUIRE(parsed.timeout == 10);
+		REQUIRE(std::string(parsed.xmlname) == "default");
+
+		REQUIRE(parse_cmd(&parsed, buf + sizeof(struct protocol), sizeof(struct protocol_v1)) == sizeof(struct protocol_v1));
+		REQUIRE(parsed.ver == 1);
+		REQUIRE(parsed.x == 1024);
+		REQUIRE(parsed.xmlname[0] == '\0');
+
+		// Version must be 1, 2, 3 or 4
+		cmd->ver = 5;
+		memcpy(buf, cmd, sizeof(struct protocol));
+
+		start_capture();
+		ret = parse_cmd(&parsed, buf, sizeof(buf));
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		REQUIRE(ret == -1);
+		found = err_log_lines.find("Failed to receive render cmd with unknown protocol version 5");
+		REQUIRE(found > -1);
+	}
+
+	SECTION("parse_frame", "should take frame headers of protocol version 5 off the buffer") {
+		struct protocol_frame frame = {PROTO_VER_FRAMED, 2 * sizeof(struct protocol_v5)}, parsed;
+		char buf[sizeof(struct protocol_frame)];
+
+		memcpy(buf, &frame, sizeof(frame));
+
+		REQUIRE(parse_frame(&parsed, buf, sizeof(frame) - 1) == 0);
+		REQUIRE(parse_frame(&parsed, buf, sizeof(frame)) == sizeof(frame));
+		REQUIRE(parsed.length == 2 * sizeof(struct protocol_v5));
+
+		// Frames must hold whole requests and not more than PROTO_FRAME_MAX of them
+		frame.length = (PROTO_FRAME_MAX + 1) * sizeof(struct protocol_v5);
+		memcpy(buf, &frame, sizeof(frame));
+
+		start_capture();
+		ret = parse_frame(&parsed, buf, sizeof(frame));
+		std::tie(err_log_lines, out_log_lines) = end_capture();
+
+		REQUIRE(ret == -1);
+		found = err_log_lines.find("Failed to receive frame of");
+		REQUIRE(found > -1);
+
+		frame.length = sizeof(struct protocol_v5) + 1;
+		memcpy(buf, &frame, sizeof(frame));
+
+		start_capture();
+		REQUIRE(parse_frame(&parsed, buf, sizeof(frame)) == -1);
+		end_capture();
+	}
+
 	SECTION("recv_cmd/fd invalid debug", "should return -1") {
 		cmd->ver = 1;
 
@@ -382,6 +382,110 @@ TEST_CASE("renderd_config config parser", "specific testing")
 		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified min zoom (" + std::to_string(MAX_ZOOM + 1) + ") is larger than max zoom (" + std::to_string(MAX_ZOOM) + ")."));
 	}
 
+	SECTION("renderd.conf map section weight too small", "should return 7") {
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[renderd]\n";
+		renderd_conf_file << "[map]\nweight=0\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified weight (0) is too small, must be greater than or equal to 1."));
+	}
+
+	SECTION("renderd.conf map section lazy unload too small", "should return 7") {
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[renderd]\n";
+		renderd_conf_file << "[map]\nlazy_load=true\nlazy_unload=-1\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified lazy unload (-1) is too small, must be greater than or equal to 0."));
+	}
+
+	SECTION("renderd.conf map section metatile size is invalid", "should return 7") {
+		std::string renderd_conf_map_metatile_size = "16:4";
+
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[renderd]\n";
+		renderd_conf_file << "[map]\nmetatile_size=" + renderd_conf_map_metatile_size + "\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified metatile size (16:4) is invalid, it must be SIZE or SIZE:MINZOOM-MAXZOOM, e.g., '8 16:0-6'."));
+	}
+
+	SECTION("renderd.conf map section metatile size is not a power of 2", "should return 7") {
+		std::string renderd_conf_map_metatile_size = "8 12:0-6";
+
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[renderd]\n";
+		renderd_conf_file << "[map]\nmetatile_size=" + renderd_conf_map_metatile_size + "\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified metatile size (12) must be a power of 2 between 1 and 16."));
+	}
+
+	SECTION("renderd.conf map section metatile size is too large", "should return 7") {
+		std::string renderd_conf_map_metatile_size = "32";
+
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[renderd]\n";
+		renderd_conf_file << "[map]\nmetatile_size=" + renderd_conf_map_metatile_size + "\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified metatile size (32) must be a power of 2 between 1 and 16."));
+	}
+
+	SECTION("renderd.conf map section metatile size zoom levels are out of range", "should return 7") {
+		std::string renderd_conf_map_metatile_size = "16:6-25";
+
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[renderd]\n";
+		renderd_conf_file << "[map]\nmetatile_size=" + renderd_conf_map_metatile_size + "\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified metatile size zoom levels (6-25) must be within 0-20."));
+	}
+
 	SECTION("renderd.conf map section type has too few parts", "should return 7") {
 		std::string renderd_conf_map_type = "a";
 
@@ -437,6 +541,54 @@ TEST_CASE("renderd_config config parser", "specific testing")
 		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified socketname (" + renderd_socketname + ") exceeds maximum allowed length of " + std::to_string(renderd_socketname_maxlen) + "."));
 	}
 
+	SECTION("renderd.conf renderd section queue_order is invalid", "should return 7") {
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[map]\n";
+		renderd_conf_file << "[renderd]\nqueue_order=zorder\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified queue_order (zorder) is not supported, it must be one of 'fifo', 'morton' or 'hilbert'."));
+	}
+
+	SECTION("renderd.conf renderd section slave_routing is invalid", "should return 7") {
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[map]\n";
+		renderd_conf_file << "[renderd]\nslave_routing=random\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified slave_routing (random) is not supported, it must be one of 'any' or 'locality'."));
+	}
+
+	SECTION("renderd.conf renderd section encode_threads too small", "should return 7") {
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[map]\n";
+		renderd_conf_file << "[renderd]\nencode_threads=-2\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {"--config", renderd_conf};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 7);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified encode_threads (-2) is too small, must be greater than or equal to -1."));
+	}
+
 	SECTION("renderd.conf duplicate renderd section names", "should return 7") {
 		std::string renderd_conf = std::tmpnam(nullptr);
 		std::ofstream renderd_conf_file;
@@ -534,4 +686,29 @@ TEST_CASE("renderd_config_test_helper", "specific testing")
 		REQUIRE(WEXITSTATUS(status) == 1);
 		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Failed to load config file (process_map_sections): 'doesnotexist'"));
 	}
+
+	SECTION("nonexistent renderd.conf file with valid active renderd section (load_map_sections)", "should return 0") {
+		std::vector<std::string> argv = {"doesnotexist", std::to_string(0), "load_map_sections"};
+
+		int status = run_command(test_binary, argv);
+		REQUIRE(WEXITSTATUS(status) == 0);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("load_map_sections returned 1"));
+	}
+
+	SECTION("renderd.conf file with invalid map section (load_map_sections)", "should return 0") {
+		std::string renderd_conf = std::tmpnam(nullptr);
+		std::ofstream renderd_conf_file;
+		renderd_conf_file.open(renderd_conf);
+		renderd_conf_file << "[mapnik]\n[renderd]\n";
+		renderd_conf_file << "[map]\nmetatile_size=12\n";
+		renderd_conf_file.close();
+
+		std::vector<std::string> argv = {renderd_conf, std::to_string(0), "load_map_sections"};
+
+		int status = run_command(test_binary, argv);
+		std::remove(renderd_conf.c_str());
+		REQUIRE(WEXITSTATUS(status) == 0);
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("Specified metatile size (12) must be a power of 2 between 1 and 16."));
+		REQUIRE_THAT(err_log_lines, Catch::Matchers::Contains("load_map_sections returned 7"));
+	}
 }
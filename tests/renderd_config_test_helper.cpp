@@ -40,6 +40,10 @@ int main(int argc, char **argv)
 		process_map_sections(NULL, config_file_name, maps, "", 0);
 	}
 
+	if (strcmp(process_function, "load_map_sections") == 0) {
+		g_logger(G_LOG_LEVEL_WARNING, "load_map_sections returned %i", load_map_sections(NULL, config_file_name, maps, "", 0));
+	}
+
 	free_map_sections(maps);
 	free_renderd_sections(config_slaves);
 